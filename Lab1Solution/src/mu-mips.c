@@ -3,6 +3,11 @@
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stddef.h>
+#include <sys/mman.h>
 
 #include "mu-mips.h"
 
@@ -21,46 +26,454 @@ void help() {
 	printf("high <val>\t-- set the HI register to <val>\n");
 	printf("low <val>\t-- set the LO register to <val>\n");
 	printf("print\t-- print the program loaded into memory\n");
+	printf("jit <0/1/2>\t-- JIT off, on, or on and checked against the interpreter (not while recording)\n");
+	printf("d <0/1>\t-- run the instruction after each branch and jump (delay slots)\n");
+	printf("trace <0-2>\t-- trace off, a summary per run, every instruction and loaded word\n");
 	printf("?\t-- display help menu\n");
 	printf("quit\t-- exit the simulator\n\n");
 	printf("------------------------------------------------------------------\n\n");
 }
 
 /***************************************************************/
-/* Read a 32-bit word from memory                                                                            */
+/* Send trace output to path (stdout when NULL) through a large buffer */
 /***************************************************************/
-uint32_t mem_read_32(uint32_t address)
+void trace_open(const char *path)
+{
+	TRACE_SINK = path == NULL ? stdout : fopen(path, "w");
+	if (TRACE_SINK == NULL) {
+		printf("Error: Can't open trace file %s\n", path);
+		exit(1);
+	}
+	setvbuf(TRACE_SINK, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+}
+
+/***************************************************************/
+/* Start recording every executed instruction to path                        */
+/***************************************************************/
+void itrace_open(const char *path)
 {
+	itrace_writer_t *w = &ITRACE_WRITER;
+	itrace_header_t header;
 	int i;
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		if ( (address >= MEM_REGIONS[i].begin) &&  ( address <= MEM_REGIONS[i].end) ) {
-			uint32_t offset = address - MEM_REGIONS[i].begin;
-			return (MEM_REGIONS[i].mem[offset+3] << 24) |
-					(MEM_REGIONS[i].mem[offset+2] << 16) |
-					(MEM_REGIONS[i].mem[offset+1] <<  8) |
-					(MEM_REGIONS[i].mem[offset+0] <<  0);
+
+	w->file = fopen(path, "wb");
+	if (w->file == NULL) {
+		printf("Error: Can't open instruction trace file %s\n", path);
+		exit(1);
+	}
+	w->path = path;
+	memcpy(header.magic, ITRACE_MAGIC, 4);
+	header.version = ITRACE_VERSION;
+	fwrite(&header, sizeof(header), 1, w->file);
+	w->file_bytes = sizeof(header);
+
+	for (i = 0; i < ITRACE_RING_SLOTS; i++) {
+		w->ring[i].held = malloc(ITRACE_SLOT_RECORDS * sizeof(itrace_held_t));
+		assert(w->ring[i].held != NULL);
+	}
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->filled, NULL);
+	pthread_cond_init(&w->drained, NULL);
+	w->num_threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	if (w->num_threads < 1) {
+		w->num_threads = 1;
+	} else if (w->num_threads > ITRACE_MAX_WRITERS) {
+		w->num_threads = ITRACE_MAX_WRITERS;
+	}
+	for (i = 0; i < w->num_threads; i++) {
+		if (pthread_create(&w->threads[i], NULL, itrace_writer_main, w) != 0) {
+			printf("Error: Can't start the trace writer threads\n");
+			exit(1);
 		}
 	}
-	return 0;
+	atexit(itrace_close);
 }
 
 /***************************************************************/
-/* Write a 32-bit word to memory                                                                                */
+/* Hand the first records of the head slot to the writer; the rest (at most  */
+/* one, not executed yet) moves to the next free slot, which is returned     */
 /***************************************************************/
-void mem_write_32(uint32_t address, uint32_t value)
+itrace_held_t *itrace_submit(uint32_t records, uint32_t next_pc)
+{
+	itrace_writer_t *w = &ITRACE_WRITER;
+	itrace_slot_t *slot = &w->ring[w->head % ITRACE_RING_SLOTS];
+	itrace_held_t carry = slot->held[records];
+
+	slot->records = records;
+	slot->next_pc = next_pc;
+	w->total_records += records;
+
+	pthread_mutex_lock(&w->lock);
+	w->head++;
+	pthread_cond_broadcast(&w->filled);
+	while (w->head - w->tail == ITRACE_RING_SLOTS) {
+		pthread_cond_wait(&w->drained, &w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	slot = &w->ring[w->head % ITRACE_RING_SLOTS];
+	slot->held[0] = carry;
+	return slot->held;
+}
+
+/***************************************************************/
+/* Writer thread: encode and compress the oldest unclaimed slot, then wait   */
+/* for its turn to append the chunk                                          */
+/***************************************************************/
+void *itrace_writer_main(void *arg)
+{
+	static const uint8_t kinds[NUM_OPS] = {
+		[OP_JR] = ITRACE_BRANCH, [OP_JALR] = ITRACE_BRANCH,
+		[OP_BLTZ] = ITRACE_BRANCH, [OP_BGEZ] = ITRACE_BRANCH, [OP_J] = ITRACE_BRANCH, [OP_JAL] = ITRACE_BRANCH,
+		[OP_BEQ] = ITRACE_BRANCH, [OP_BNE] = ITRACE_BRANCH, [OP_BLEZ] = ITRACE_BRANCH, [OP_BGTZ] = ITRACE_BRANCH,
+		[OP_LB] = ITRACE_LOAD, [OP_LH] = ITRACE_LOAD, [OP_LW] = ITRACE_LOAD,
+		[OP_SB] = ITRACE_STORE, [OP_SH] = ITRACE_STORE, [OP_SW] = ITRACE_STORE
+	};
+	itrace_writer_t *w = arg;
+	itrace_codec_t *codec = malloc(sizeof(itrace_codec_t));
+	uint8_t *raw = malloc(ITRACE_CHUNK_SIZE);
+	uint8_t *compressed = malloc(ITRACE_COMPRESS_BOUND(ITRACE_CHUNK_SIZE));
+	uint8_t *pos;
+	itrace_slot_t *slot;
+	itrace_chunk_t chunk;
+	itrace_record_t r;
+	uint32_t i, next, turn;
+
+	assert(codec != NULL && raw != NULL && compressed != NULL);
+	while (1) {
+		pthread_mutex_lock(&w->lock);
+		while (w->claimed == w->head && !w->closing) {
+			pthread_cond_wait(&w->filled, &w->lock);
+		}
+		if (w->claimed == w->head) {
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		turn = w->claimed++;
+		slot = &w->ring[turn % ITRACE_RING_SLOTS];
+		pthread_mutex_unlock(&w->lock);
+
+		itrace_codec_init(codec);
+		pos = raw;
+		for (i = 0; i < slot->records; i++) {
+			next = i + 1 < slot->records ? slot->held[i + 1].pc : slot->next_pc;
+			r.pc = slot->held[i].pc;
+			r.instruction = slot->held[i].instruction;
+			r.flags = kinds[slot->held[i].op];
+			r.address = r.flags & (ITRACE_LOAD | ITRACE_STORE) ? slot->held[i].address : 0;
+			if ((r.flags & ITRACE_BRANCH) && next != r.pc + 4) {
+				r.flags |= ITRACE_TAKEN;
+			}
+			pos = itrace_encode(codec, &r, pos);
+		}
+		chunk.raw_size = pos - raw;
+		chunk.records = slot->records;
+		chunk.compressed_size = itrace_compress(raw, chunk.raw_size, compressed);
+
+		pthread_mutex_lock(&w->lock);
+		while (w->tail != turn) {
+			pthread_cond_wait(&w->drained, &w->lock);
+		}
+		pthread_mutex_unlock(&w->lock);
+		if (fwrite(&chunk, sizeof(chunk), 1, w->file) != 1 ||
+			fwrite(compressed, 1, chunk.compressed_size, w->file) != chunk.compressed_size) {
+			w->failed = TRUE;
+		}
+		w->raw_bytes += chunk.raw_size;
+		w->file_bytes += sizeof(chunk) + chunk.compressed_size;
+
+		pthread_mutex_lock(&w->lock);
+		w->tail++;
+		pthread_cond_broadcast(&w->drained);
+		pthread_mutex_unlock(&w->lock);
+	}
+	free(codec);
+	free(raw);
+	free(compressed);
+	return NULL;
+}
+
+/***************************************************************/
+/* Stop the writers once they have drained the ring and close the file (at exit) */
+/***************************************************************/
+void itrace_close()
+{
+	itrace_writer_t *w = &ITRACE_WRITER;
+	int i;
+
+	if (w->file == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&w->lock);
+	w->closing = TRUE;
+	pthread_cond_broadcast(&w->filled);
+	pthread_mutex_unlock(&w->lock);
+	for (i = 0; i < w->num_threads; i++) {
+		pthread_join(w->threads[i], NULL);
+	}
+
+	if (fclose(w->file) != 0 || w->failed) {
+		printf("Error: Writing instruction trace %s failed\n", w->path);
+	} else {
+		printf("Instruction trace %s: %llu instructions, %llu bytes encoded, %llu bytes written\n", w->path,
+			(unsigned long long)w->total_records, (unsigned long long)w->raw_bytes, (unsigned long long)w->file_bytes);
+	}
+	for (i = 0; i < ITRACE_RING_SLOTS; i++) {
+		free(w->ring[i].held);
+	}
+	w->file = NULL;
+}
+
+/***************************************************************/
+/* Return the host page backing address for reading (never NULL)             */
+/***************************************************************/
+const uint8_t *mem_page_read(uint32_t address)
+{
+	mem_page_table_t *table = MEM_PAGE_TABLE[MEM_L1_INDEX(address)];
+	if (table == NULL || table->pages[MEM_L2_INDEX(address)] == NULL) {
+		return MEM_ZERO_PAGE;
+	}
+	return table->pages[MEM_L2_INDEX(address)];
+}
+
+/***************************************************************/
+/* Return the host page backing address for writing, allocating it on      */
+/* first touch. Returns NULL for addresses outside every memory region.     */
+/***************************************************************/
+uint8_t *mem_page_write(uint32_t address)
 {
 	int i;
-	uint32_t offset;
+	mem_page_table_t *table = MEM_PAGE_TABLE[MEM_L1_INDEX(address)];
+	uint8_t **page;
+
+	if (table != NULL && table->pages[MEM_L2_INDEX(address)] != NULL) {
+		return table->pages[MEM_L2_INDEX(address)];
+	}
 	for (i = 0; i < NUM_MEM_REGION; i++) {
 		if ( (address >= MEM_REGIONS[i].begin) && (address <= MEM_REGIONS[i].end) ) {
-			offset = address - MEM_REGIONS[i].begin;
+			break;
+		}
+	}
+	if (i == NUM_MEM_REGION) {
+		return NULL;
+	}
+	if (table == NULL) {
+		table = calloc(1, sizeof(mem_page_table_t));
+		assert(table != NULL);
+		MEM_PAGE_TABLE[MEM_L1_INDEX(address)] = table;
+	}
+	page = &table->pages[MEM_L2_INDEX(address)];
+	*page = calloc(1, MEM_PAGE_SIZE);
+	assert(*page != NULL);
+	/* the read TLB may still map this page to the zero page */
+	MEM_READ_TLB[MEM_TLB_INDEX(address)].tag = MEM_TLB_INVALID;
+	if (MEM_PAGES_ALLOCATED == MEM_PAGE_LIST_SIZE) {
+		MEM_PAGE_LIST_SIZE = MEM_PAGE_LIST_SIZE ? 2 * MEM_PAGE_LIST_SIZE : 64;
+		MEM_PAGE_LIST = realloc(MEM_PAGE_LIST, MEM_PAGE_LIST_SIZE * sizeof(uint32_t));
+		assert(MEM_PAGE_LIST != NULL);
+	}
+	MEM_PAGE_LIST[MEM_PAGES_ALLOCATED++] = address & ~MEM_PAGE_MASK;
+	return *page;
+}
+
+/***************************************************************/
+/* Invalidate every software TLB entry                                       */
+/***************************************************************/
+void mem_tlb_flush()
+{
+	int i;
+	for (i = 0; i < MEM_TLB_SIZE; i++) {
+		MEM_READ_TLB[i].tag = MEM_TLB_INVALID;
+		MEM_WRITE_TLB[i].tag = MEM_TLB_INVALID;
+	}
+}
+
+/***************************************************************/
+/* Translate address to a host page through the TLBs                         */
+/***************************************************************/
+static inline const uint8_t *mem_tlb_read(uint32_t address)
+{
+	mem_read_tlb_t *entry = &MEM_READ_TLB[MEM_TLB_INDEX(address)];
+	if (entry->tag != (address & ~MEM_PAGE_MASK)) {
+		entry->tag = address & ~MEM_PAGE_MASK;
+		entry->page = mem_page_read(address);
+	}
+	return entry->page;
+}
+
+static inline uint8_t *mem_tlb_write(uint32_t address)
+{
+	mem_write_tlb_t *entry = &MEM_WRITE_TLB[MEM_TLB_INDEX(address)];
+	if (entry->tag != (address & ~MEM_PAGE_MASK)) {
+		uint8_t *page = mem_page_write(address);
+		if (page == NULL) {
+			return NULL;
+		}
+		entry->tag = address & ~MEM_PAGE_MASK;
+		entry->page = page;
+	}
+	return entry->page;
+}
+
+/***************************************************************/
+/* Read a byte from memory                                                   */
+/***************************************************************/
+uint8_t mem_read_8(uint32_t address)
+{
+	return mem_tlb_read(address)[address & MEM_PAGE_MASK];
+}
+
+/***************************************************************/
+/* Read a 16-bit halfword from memory                                        */
+/***************************************************************/
+uint16_t mem_read_16(uint32_t address)
+{
+	uint16_t value;
+	if ((address & MEM_PAGE_MASK) > MEM_PAGE_SIZE - 2) {
+		/* halfword straddles two pages */
+		return mem_read_8(address) | (mem_read_8(address + 1) << 8);
+	}
+	memcpy(&value, mem_tlb_read(address) + (address & MEM_PAGE_MASK), 2);
+	return MEM_LE16(value);
+}
+
+/***************************************************************/
+/* Read a 32-bit word from memory                                                                            */
+/***************************************************************/
+uint32_t mem_read_32(uint32_t address)
+{
+	uint32_t value;
+	if ((address & MEM_PAGE_MASK) > MEM_PAGE_SIZE - 4) {
+		/* word straddles two pages */
+		return mem_read_16(address) | (mem_read_16(address + 2) << 16);
+	}
+	memcpy(&value, mem_tlb_read(address) + (address & MEM_PAGE_MASK), 4);
+	return MEM_LE32(value);
+}
+
+/***************************************************************/
+/* Write a byte to memory                                                    */
+/***************************************************************/
+void mem_write_8(uint32_t address, uint8_t value)
+{
+	uint8_t *page;
+	if (MEM_JOURNAL_ACTIVE) {
+		mem_journal_record(address, 1);
+	}
+	page = mem_tlb_write(address);
+	if (page != NULL) {
+		page[address & MEM_PAGE_MASK] = value;
+	}
+	if (address - MEM_TEXT_BEGIN < CODE_WATCH_BYTES) {
+		decode_invalidate(address, 1);
+	}
+}
+
+/***************************************************************/
+/* Write a 16-bit halfword to memory                                         */
+/***************************************************************/
+void mem_write_16(uint32_t address, uint16_t value)
+{
+	uint8_t *page;
+	if ((address & MEM_PAGE_MASK) > MEM_PAGE_SIZE - 2) {
+		/* halfword straddles two pages */
+		mem_write_8(address, value & 0xFF);
+		mem_write_8(address + 1, value >> 8);
+		return;
+	}
+	if (MEM_JOURNAL_ACTIVE) {
+		mem_journal_record(address, 2);
+	}
+	page = mem_tlb_write(address);
+	if (page != NULL) {
+		value = MEM_LE16(value);
+		memcpy(page + (address & MEM_PAGE_MASK), &value, 2);
+	}
+	if (address - MEM_TEXT_BEGIN < CODE_WATCH_BYTES) {
+		decode_invalidate(address, 2);
+	}
+}
 
-			MEM_REGIONS[i].mem[offset+3] = (value >> 24) & 0xFF;
-			MEM_REGIONS[i].mem[offset+2] = (value >> 16) & 0xFF;
-			MEM_REGIONS[i].mem[offset+1] = (value >>  8) & 0xFF;
-			MEM_REGIONS[i].mem[offset+0] = (value >>  0) & 0xFF;
+/***************************************************************/
+/* Write a 32-bit word to memory                                                                                */
+/***************************************************************/
+void mem_write_32(uint32_t address, uint32_t value)
+{
+	uint8_t *page;
+	if ((address & MEM_PAGE_MASK) > MEM_PAGE_SIZE - 4) {
+		/* word straddles two pages */
+		mem_write_16(address, value & 0xFFFF);
+		mem_write_16(address + 2, value >> 16);
+		return;
+	}
+	if (MEM_JOURNAL_ACTIVE) {
+		mem_journal_record(address, 4);
+	}
+	page = mem_tlb_write(address);
+	if (page != NULL) {
+		value = MEM_LE32(value);
+		memcpy(page + (address & MEM_PAGE_MASK), &value, 4);
+	}
+	if (address - MEM_TEXT_BEGIN < CODE_WATCH_BYTES) {
+		decode_invalidate(address, 4);
+	}
+}
+
+/***************************************************************/
+/* Remember the bytes a store is about to overwrite                          */
+/***************************************************************/
+void mem_journal_record(uint32_t address, uint32_t size)
+{
+	mem_journal_t *e;
+	if (MEM_JOURNAL_COUNT == MEM_JOURNAL_SIZE) {
+		MEM_JOURNAL_SIZE = MEM_JOURNAL_SIZE ? MEM_JOURNAL_SIZE * 2 : 64;
+		MEM_JOURNAL = realloc(MEM_JOURNAL, MEM_JOURNAL_SIZE * sizeof(mem_journal_t));
+		assert(MEM_JOURNAL != NULL);
+	}
+	e = &MEM_JOURNAL[MEM_JOURNAL_COUNT++];
+	e->address = address;
+	e->size = size;
+	e->old = size == 1 ? mem_read_8(address) : size == 2 ? mem_read_16(address) : mem_read_32(address);
+}
+
+/***************************************************************/
+/* Undo every journaled store, newest first, and empty the journal          */
+/***************************************************************/
+void mem_journal_rollback()
+{
+	mem_journal_t *e;
+	int active = MEM_JOURNAL_ACTIVE;
+
+	MEM_JOURNAL_ACTIVE = FALSE;
+	while (MEM_JOURNAL_COUNT > 0) {
+		e = &MEM_JOURNAL[--MEM_JOURNAL_COUNT];
+		if (e->size == 1) {
+			mem_write_8(e->address, e->old);
+		} else if (e->size == 2) {
+			mem_write_16(e->address, e->old);
+		} else {
+			mem_write_32(e->address, e->old);
 		}
 	}
+	MEM_JOURNAL_ACTIVE = active;
+}
+
+/***************************************************************/
+/* Release every allocated page; cost is proportional to the pages the      */
+/* program actually wrote, not to the size of the address space.            */
+/***************************************************************/
+void mem_clear()
+{
+	uint32_t i, address;
+	mem_page_table_t *table;
+	for (i = 0; i < MEM_PAGES_ALLOCATED; i++) {
+		address = MEM_PAGE_LIST[i];
+		table = MEM_PAGE_TABLE[MEM_L1_INDEX(address)];
+		free(table->pages[MEM_L2_INDEX(address)]);
+		table->pages[MEM_L2_INDEX(address)] = NULL;
+	}
+	MEM_PAGES_ALLOCATED = 0;
+	mem_tlb_flush();
 }
 
 /***************************************************************/
@@ -83,14 +496,22 @@ void run(int num_cycles) {
 	}
 
 	printf("Running simulator for %d cycles...\n\n", num_cycles);
-	int i;
-	for (i = 0; i < num_cycles; i++) {
-		if (RUN_FLAG == FALSE) {
+	uint32_t start = INSTRUCTION_COUNT;
+	if (ENGINE != ENGINE_SWITCH) {
+		if (run_engine(num_cycles) < num_cycles && RUN_FLAG == FALSE) {
 			printf("Simulation Stopped.\n\n");
-			break;
 		}
-		cycle();
+	} else {
+		int i;
+		for (i = 0; i < num_cycles; i++) {
+			if (RUN_FLAG == FALSE) {
+				printf("Simulation Stopped.\n\n");
+				break;
+			}
+			cycle();
+		}
 	}
+	TRACE(TRACE_SUMMARY, "%u instructions executed, PC 0x%08x\n", INSTRUCTION_COUNT - start, CURRENT_STATE.PC);
 }
 
 /***************************************************************/
@@ -103,10 +524,16 @@ void runAll() {
 	}
 
 	printf("Simulation Started...\n\n");
+	uint32_t start = INSTRUCTION_COUNT;
 	while (RUN_FLAG){
-		cycle();
+		if (ENGINE != ENGINE_SWITCH) {
+			run_engine(UINT32_MAX);
+		} else {
+			cycle();
+		}
 	}
 	printf("Simulation Finished.\n\n");
+	TRACE(TRACE_SUMMARY, "%u instructions executed, PC 0x%08x\n", INSTRUCTION_COUNT - start, CURRENT_STATE.PC);
 }
 
 /***************************************************************/ 
@@ -156,8 +583,10 @@ void handle_command() {
 	uint32_t register_no;
 	int register_value;
 	int hi_reg_value, lo_reg_value;
+	int jit_mode, trace_level, delay_slots;
 
 	printf("MU-MIPS SIM:> ");
+	fflush(stdout);
 
 	if (scanf("%s", buffer) == EOF){
 		exit(0);
@@ -226,6 +655,37 @@ void handle_command() {
 		case 'p':
 			print_program(); 
 			break;
+		case 'T':
+		case 't':
+			if (scanf("%d", &trace_level) != 1){
+				break;
+			}
+			TRACE_LEVEL = trace_level > TRACE_MAX ? TRACE_MAX : trace_level;
+			printf("Trace level %d\n", TRACE_LEVEL);
+			break;
+		case 'J':
+		case 'j':
+			if (scanf("%d", &jit_mode) != 1){
+				break;
+			}
+			JIT_ENABLED = jit_mode != 0 && ITRACE_WRITER.file == NULL;
+			JIT_VERIFY = jit_mode == 2;
+			if (JIT_ENABLED) {
+				ENGINE = ENGINE_BLOCK;	/* translations hang off cached blocks */
+			}
+			printf("JIT %s%s: %u blocks translated, %u verify failures\n", JIT_ENABLED ? "on" : "off",
+				JIT_VERIFY ? " (verifying)" : "", JIT_BLOCKS_COMPILED, JIT_VERIFY_FAILURES);
+			break;
+		case 'D':
+		case 'd':
+			if (scanf("%d", &delay_slots) != 1){
+				break;
+			}
+			DELAY_SLOTS = delay_slots != 0;
+			DELAY_TARGET = 0;
+			block_cache_flush();	/* translations hold the JAL link */
+			printf("Delay slots %s\n", DELAY_SLOTS ? "ON" : "OFF");
+			break;
 		default:
 			printf("Invalid Command.\n");
 			break;
@@ -244,10 +704,7 @@ void reset() {
 	CURRENT_STATE.HI = 0;
 	CURRENT_STATE.LO = 0;
 	
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-		memset(MEM_REGIONS[i].mem, 0, region_size);
-	}
+	mem_clear();
 	
 	/*load program*/
 	load_program();
@@ -256,352 +713,1448 @@ void reset() {
 	INSTRUCTION_COUNT = 0;
 	CURRENT_STATE.PC =  MEM_TEXT_BEGIN;
 	NEXT_STATE = CURRENT_STATE;
+	DELAY_TARGET = 0;
 	RUN_FLAG = TRUE;
 }
 
 /***************************************************************/
-/* Allocate and set memory to zero                                                                            */
+/* Start with an empty page table; pages are allocated on first write        */
 /***************************************************************/
 void init_memory() {                                           
-	int i;
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-		MEM_REGIONS[i].mem = malloc(region_size);
-		memset(MEM_REGIONS[i].mem, 0, region_size);
+	memset(MEM_PAGE_TABLE, 0, sizeof(MEM_PAGE_TABLE));
+	MEM_PAGES_ALLOCATED = 0;
+	mem_tlb_flush();
+}
+
+/**************************************************************/
+/* Copy size bytes into guest memory at address, a page at a time                          */
+/**************************************************************/
+void mem_load(uint32_t address, const uint8_t *src, uint32_t size)
+{
+	uint32_t chunk;
+	uint8_t *page;
+	while (size > 0) {
+		chunk = MEM_PAGE_SIZE - (address & MEM_PAGE_MASK);
+		if (chunk > size) {
+			chunk = size;
+		}
+		page = mem_page_write(address);
+		if (page != NULL) {
+			memcpy(page + (address & MEM_PAGE_MASK), src, chunk);
+		}
+		address += chunk;
+		src += chunk;
+		size -= chunk;
+	}
+}
+
+/**************************************************************/
+/* Load a binary program image; returns the number of text words                          */
+/**************************************************************/
+uint32_t load_image(const uint8_t *file, size_t size)
+{
+	image_header_t header;
+
+	memcpy(&header, file, sizeof(header));
+	if (header.version != IMAGE_VERSION || header.text_base != MEM_TEXT_BEGIN || (header.text_size & 0x3) != 0
+			|| (uint64_t)header.text_size + header.data_size > size - sizeof(header)) {
+		printf("Error: Bad program image %s\n", prog_file);
+		exit(-1);
+	}
+	mem_load(header.text_base, file + sizeof(header), header.text_size);
+	mem_load(header.data_base, file + sizeof(header) + header.text_size, header.data_size);
+	return header.text_size >> 2;
+}
+
+/**************************************************************/
+/* Load hex text, one word per whitespace-separated token with an optional 0x prefix.       */
+/* Stops at the first token that is not a hex number. Returns the number of words.         */
+/**************************************************************/
+uint32_t load_hex(const char *text, size_t size)
+{
+	const char *p = text, *end = text + size;
+	uint32_t address = MEM_TEXT_BEGIN;
+	uint32_t word;
+	int digits, value;
+
+	for (;;) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+			p++;
+		}
+		if (end - p > 1 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+			p += 2;
+		}
+		word = 0;
+		for (digits = 0; p < end; digits++, p++) {
+			if (*p >= '0' && *p <= '9') {
+				value = *p - '0';
+			} else if ((*p | 0x20) >= 'a' && (*p | 0x20) <= 'f') {
+				value = (*p | 0x20) - 'a' + 10;
+			} else {
+				break;
+			}
+			word = (word << 4) | value;
+		}
+		if (digits == 0) {
+			break;
+		}
+		mem_write_32(address, word);
+		TRACE(TRACE_INSTR, "writing 0x%08x into address 0x%08x (%d)\n", word, address, address);
+		address += 4;
 	}
+	return (address - MEM_TEXT_BEGIN) >> 2;
 }
 
 /**************************************************************/
 /* load program into memory                                                                                      */
 /**************************************************************/
 void load_program() {                   
-	FILE * fp;
-	int i, word;
-	uint32_t address;
+	struct stat st;
+	const uint8_t *file = NULL;
+	int fd;
 
-	printf("\nbefore write\n");
+	TRACE(TRACE_INSTR, "\nbefore write\n");
 
 	/* Open program file. */
-	fp = fopen(prog_file, "r");
-	if (fp == NULL) {
+	fd = open(prog_file, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0) {
 		printf("Error: Can't open program file %s\n", prog_file);
 		exit(-1);
 	}
+	if (st.st_size > 0) {
+		file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (file == MAP_FAILED) {
+			printf("Error: Can't map program file %s\n", prog_file);
+			exit(-1);
+		}
+	}
+	close(fd);
 
 	/* Read in the program. */
-
-	i = 0;
-	while( fscanf(fp, "%x\n", &word) != EOF ) {
-		address = MEM_TEXT_BEGIN + i;
-		mem_write_32(address, word);
-		printf("writing 0x%08x into address 0x%08x (%d)\n", word, address, address);
-		i += 4;
+	if ((size_t)st.st_size >= sizeof(image_header_t) && memcmp(file, IMAGE_MAGIC, 4) == 0) {
+		PROGRAM_SIZE = load_image(file, st.st_size);
+	} else {
+		PROGRAM_SIZE = load_hex((const char *)file, st.st_size);
+	}
+	if (file != NULL) {
+		munmap((void *)file, st.st_size);
 	}
-	PROGRAM_SIZE = i/4;
-	printf("Program loaded into memory.\n%d words written into memory.\n\n", PROGRAM_SIZE);
-	fclose(fp);
+	TRACE(TRACE_SUMMARY, "Program loaded into memory.\n%d words written into memory.\n\n", PROGRAM_SIZE);
+	predecode_program();
 }
 
-/************************************************************/
-/* decode and execute instruction                                                                     */ 
-/************************************************************/
-void handle_instruction()
-{
-	/*IMPLEMENT THIS*/
-	/* execute one instruction at a time. Use/update CURRENT_STATE and and NEXT_STATE, as necessary.*/
-	
-	
-	uint32_t instruction, opcode, function, rs, rt, rd, sa, immediate, target;
-	uint64_t product, p1, p2;
-	
-	uint32_t addr, data;
-	
-	int branch_jump = FALSE;
-	
-	printf("[0x%x]\t", CURRENT_STATE.PC);
-	
-	instruction = mem_read_32(CURRENT_STATE.PC);
-	
+/**************************************************************/
+/* Decode an instruction word fetched from addr                                                             */
+/**************************************************************/
+void decode_instruction(uint32_t addr, uint32_t instruction, decoded_inst_t *d) {
+	uint32_t opcode, function;
+
 	opcode = (instruction & 0xFC000000) >> 26;
 	function = instruction & 0x0000003F;
-	rs = (instruction & 0x03E00000) >> 21;
-	rt = (instruction & 0x001F0000) >> 16;
-	rd = (instruction & 0x0000F800) >> 11;
-	sa = (instruction & 0x000007C0) >> 6;
-	immediate = instruction & 0x0000FFFF;
-	target = instruction & 0x03FFFFFF;
-	
+	d->instruction = instruction;
+	d->rs = (instruction & 0x03E00000) >> 21;
+	d->rt = (instruction & 0x001F0000) >> 16;
+	d->rd = (instruction & 0x0000F800) >> 11;
+	d->sa = (instruction & 0x000007C0) >> 6;
+	d->uimm = instruction & 0x0000FFFF;
+	d->imm = (d->uimm & 0x8000) > 0 ? (d->uimm | 0xFFFF0000) : d->uimm;
+	d->target = addr + (d->imm << 2);
+
 	if(opcode == 0x00){
 		switch(function){
-			case 0x00: //SLL
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rt] << sa;
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x02: //SRL
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rt] >> sa;
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x03: //SRA 
-				if ((CURRENT_STATE.REGS[rt] & 0x80000000) == 1)
-				{
-					NEXT_STATE.REGS[rd] =  ~(~CURRENT_STATE.REGS[rt] >> sa );
-				}
-				else{
-					NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rt] >> sa;
-				}
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x08: //JR
-				NEXT_STATE.PC = CURRENT_STATE.REGS[rs];
-				branch_jump = TRUE;
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x09: //JALR
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.PC + 4;
-				NEXT_STATE.PC = CURRENT_STATE.REGS[rs];
-				branch_jump = TRUE;
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x0C: //SYSCALL
-				if(CURRENT_STATE.REGS[2] == 0xa){
-					RUN_FLAG = FALSE;
-					print_instruction(CURRENT_STATE.PC);
+			case 0x00: d->op = OP_SLL; break;
+			case 0x02: d->op = OP_SRL; break;
+			case 0x03: d->op = OP_SRA; break;
+			case 0x08: d->op = OP_JR; break;
+			case 0x09: d->op = OP_JALR; break;
+			case 0x0C: d->op = OP_SYSCALL; break;
+			case 0x10: d->op = OP_MFHI; break;
+			case 0x11: d->op = OP_MTHI; break;
+			case 0x12: d->op = OP_MFLO; break;
+			case 0x13: d->op = OP_MTLO; break;
+			case 0x18: d->op = OP_MULT; break;
+			case 0x19: d->op = OP_MULTU; break;
+			case 0x1A: d->op = OP_DIV; break;
+			case 0x1B: d->op = OP_DIVU; break;
+			case 0x20: d->op = OP_ADD; break;
+			case 0x21: d->op = OP_ADDU; break;
+			case 0x22: d->op = OP_SUB; break;
+			case 0x23: d->op = OP_SUBU; break;
+			case 0x24: d->op = OP_AND; break;
+			case 0x25: d->op = OP_OR; break;
+			case 0x26: d->op = OP_XOR; break;
+			case 0x27: d->op = OP_NOR; break;
+			case 0x2A: d->op = OP_SLT; break;
+			default: d->op = OP_UNKNOWN; break;
+		}
+	}
+	else{
+		switch(opcode){
+			case 0x01:
+				if(d->rt == 0){
+					d->op = OP_BLTZ;
 				}
-				break;
-			case 0x10: //MFHI
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.HI;
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x11: //MTHI
-				NEXT_STATE.HI = CURRENT_STATE.REGS[rs];
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x12: //MFLO
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.LO;
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x13: //MTLO
-				NEXT_STATE.LO = CURRENT_STATE.REGS[rs];
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x18: //MULT
-				if ((CURRENT_STATE.REGS[rs] & 0x80000000) == 0x80000000){
-					p1 = 0xFFFFFFFF00000000 | CURRENT_STATE.REGS[rs];
-				}else{
-					p1 = 0x00000000FFFFFFFF & CURRENT_STATE.REGS[rs];
+				else if(d->rt == 1){
+					d->op = OP_BGEZ;
 				}
-				if ((CURRENT_STATE.REGS[rt] & 0x80000000) == 0x80000000){
-					p2 = 0xFFFFFFFF00000000 | CURRENT_STATE.REGS[rt];
-				}else{
-					p2 = 0x00000000FFFFFFFF & CURRENT_STATE.REGS[rt];
+				else{
+					d->op = OP_NOP;
 				}
-				product = p1 * p2;
-				NEXT_STATE.LO = (product & 0X00000000FFFFFFFF);
-				NEXT_STATE.HI = (product & 0XFFFFFFFF00000000)>>32;
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x19: //MULTU
-				product = (uint64_t)CURRENT_STATE.REGS[rs] * (uint64_t)CURRENT_STATE.REGS[rt];
-				NEXT_STATE.LO = (product & 0X00000000FFFFFFFF);
-				NEXT_STATE.HI = (product & 0XFFFFFFFF00000000)>>32;
-				print_instruction(CURRENT_STATE.PC);
 				break;
-			case 0x1A: //DIV 
-				if(CURRENT_STATE.REGS[rt] != 0)
-				{
-					NEXT_STATE.LO = (int32_t)CURRENT_STATE.REGS[rs] / (int32_t)CURRENT_STATE.REGS[rt];
-					NEXT_STATE.HI = (int32_t)CURRENT_STATE.REGS[rs] % (int32_t)CURRENT_STATE.REGS[rt];
-				}
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x1B: //DIVU
-				if(CURRENT_STATE.REGS[rt] != 0)
-				{
-					NEXT_STATE.LO = CURRENT_STATE.REGS[rs] / CURRENT_STATE.REGS[rt];
-					NEXT_STATE.HI = CURRENT_STATE.REGS[rs] % CURRENT_STATE.REGS[rt];
-				}
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x20: //ADD
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs] + CURRENT_STATE.REGS[rt];
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x21: //ADDU 
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rt] + CURRENT_STATE.REGS[rs];
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x22: //SUB
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs] - CURRENT_STATE.REGS[rt];
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x23: //SUBU
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs] - CURRENT_STATE.REGS[rt];
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x24: //AND
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs] & CURRENT_STATE.REGS[rt];
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x25: //OR
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs] | CURRENT_STATE.REGS[rt];
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x26: //XOR
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs] ^ CURRENT_STATE.REGS[rt];
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x27: //NOR
-				NEXT_STATE.REGS[rd] = ~(CURRENT_STATE.REGS[rs] | CURRENT_STATE.REGS[rt]);
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x2A: //SLT
-				if(CURRENT_STATE.REGS[rs] < CURRENT_STATE.REGS[rt]){
-					NEXT_STATE.REGS[rd] = 0x1;
-				}
-				else{
-					NEXT_STATE.REGS[rd] = 0x0;
-				}
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			default:
-				printf("Instruction at 0x%x is not implemented!\n", CURRENT_STATE.PC);
+			case 0x02:
+				d->op = OP_J;
+				d->target = (addr & 0xF0000000) | ((instruction & 0x03FFFFFF) << 2);
 				break;
+			case 0x03:
+				d->op = OP_JAL;
+				d->target = (addr & 0xF0000000) | ((instruction & 0x03FFFFFF) << 2);
+				break;
+			case 0x04: d->op = OP_BEQ; break;
+			case 0x05: d->op = OP_BNE; break;
+			case 0x06: d->op = OP_BLEZ; break;
+			case 0x07: d->op = OP_BGTZ; break;
+			case 0x08: d->op = OP_ADDI; break;
+			case 0x09: d->op = OP_ADDIU; break;
+			case 0x0A: d->op = OP_SLTI; break;
+			case 0x0C: d->op = OP_ANDI; break;
+			case 0x0D: d->op = OP_ORI; break;
+			case 0x0E: d->op = OP_XORI; break;
+			case 0x0F: d->op = OP_LUI; break;
+			case 0x20: d->op = OP_LB; break;
+			case 0x21: d->op = OP_LH; break;
+			case 0x23: d->op = OP_LW; break;
+			case 0x28: d->op = OP_SB; break;
+			case 0x29: d->op = OP_SH; break;
+			case 0x2B: d->op = OP_SW; break;
+			default: d->op = OP_UNKNOWN; break;
 		}
 	}
-	else{
-		switch(opcode){
-			case 0x01:
-				if(rt == 0x00000){ //BLTZ
-					if((CURRENT_STATE.REGS[rs] & 0x80000000) > 0){
-						NEXT_STATE.PC = CURRENT_STATE.PC + ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000)<<2 : (immediate & 0x0000FFFF)<<2);
-						branch_jump = TRUE;
-					}
-					print_instruction(CURRENT_STATE.PC);
-				}
-				else if(rt == 0x00001){ //BGEZ
-					if((CURRENT_STATE.REGS[rs] & 0x80000000) == 0x0){
-						NEXT_STATE.PC = CURRENT_STATE.PC + ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000)<<2 : (immediate & 0x0000FFFF)<<2);
-						branch_jump = TRUE;
-					}
-					print_instruction(CURRENT_STATE.PC);
-				}
-				break;
-			case 0x02: //J
-				NEXT_STATE.PC = (CURRENT_STATE.PC & 0xF0000000) | (target << 2);
+	d->handler = THREADED_HANDLERS ? THREADED_HANDLERS[d->op] : NULL;
+}
+
+/**************************************************************/
+/* Return the decoded instruction at addr, decoding it on first use                                   */
+/**************************************************************/
+decoded_inst_t *decode_lookup(uint32_t addr) {
+	static decoded_inst_t scratch;
+	uint32_t index = (addr - MEM_TEXT_BEGIN) >> 2;
+	decoded_inst_t *d;
+
+	if ((addr & 0x3) != 0 || index >= DECODED_SIZE) {
+		/* outside the loaded program: decode without caching */
+		decode_instruction(addr, mem_read_32(addr), &scratch);
+		return &scratch;
+	}
+	d = &DECODED[index];
+	if (d->op == OP_INVALID) {
+		decode_instruction(addr, mem_read_32(addr), d);
+	}
+	return d;
+}
+
+/**************************************************************/
+/* Drop decoded entries and cached blocks overlapping a store of size bytes at address          */
+/**************************************************************/
+void decode_invalidate(uint32_t address, uint32_t size) {
+	uint32_t first = (address - MEM_TEXT_BEGIN) >> 2;
+	uint32_t last = (address + size - 1 - MEM_TEXT_BEGIN) >> 2;
+	uint32_t i;
+
+	for (i = first; i <= last && i < DECODED_SIZE; i++) {
+		DECODED[i].op = OP_INVALID;
+		DECODED[i].handler = THREADED_HANDLERS ? THREADED_HANDLERS[OP_INVALID] : NULL;
+	}
+	if (BLOCK_LIST != NULL) {
+		BLOCK_CACHE_STALE = TRUE;
+	}
+}
+
+/**************************************************************/
+/* Decode the whole text segment once, right after loading                                               */
+/**************************************************************/
+void predecode_program() {
+	uint32_t i;
+
+	free(DECODED);
+	DECODED = malloc((PROGRAM_SIZE + 1) * sizeof(decoded_inst_t));
+	assert(DECODED != NULL);
+	DECODED_SIZE = PROGRAM_SIZE;
+	for (i = 0; i < DECODED_SIZE; i++) {
+		decode_instruction(MEM_TEXT_BEGIN + (i << 2), mem_read_32(MEM_TEXT_BEGIN + (i << 2)), &DECODED[i]);
+	}
+	/* entry past the end is never valid */
+	DECODED[DECODED_SIZE].op = OP_INVALID;
+	DECODED[DECODED_SIZE].handler = THREADED_HANDLERS ? THREADED_HANDLERS[OP_INVALID] : NULL;
+	CODE_WATCH_BYTES = DECODED_SIZE << 2;
+	block_cache_flush();
+}
+
+/************************************************************/
+/* decode and execute instruction                                                                     */ 
+/************************************************************/
+void handle_instruction()
+{
+	/* execute one instruction at a time. Use/update CURRENT_STATE and and NEXT_STATE, as necessary.*/
+	decoded_inst_t *d;
+	uint64_t product, p1, p2;
+	
+	uint32_t addr, data, target;
+	uint32_t link = CURRENT_STATE.PC + (DELAY_SLOTS ? 8 : 4);
+	
+	int branch_jump = FALSE;
+	
+	TRACE(TRACE_INSTR, "[0x%x]\t", CURRENT_STATE.PC);
+	
+	d = decode_lookup(CURRENT_STATE.PC);
+	
+	switch(d->op){
+		case OP_SLL:
+			NEXT_STATE.REGS[d->rd] = CURRENT_STATE.REGS[d->rt] << d->sa;
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_SRL:
+			NEXT_STATE.REGS[d->rd] = CURRENT_STATE.REGS[d->rt] >> d->sa;
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_SRA: 
+			if ((CURRENT_STATE.REGS[d->rt] & 0x80000000) == 1)
+			{
+				NEXT_STATE.REGS[d->rd] =  ~(~CURRENT_STATE.REGS[d->rt] >> d->sa );
+			}
+			else{
+				NEXT_STATE.REGS[d->rd] = CURRENT_STATE.REGS[d->rt] >> d->sa;
+			}
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_JR:
+			NEXT_STATE.PC = CURRENT_STATE.REGS[d->rs];
+			branch_jump = TRUE;
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_JALR:
+			NEXT_STATE.REGS[d->rd] = link;
+			NEXT_STATE.PC = CURRENT_STATE.REGS[d->rs];
+			branch_jump = TRUE;
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_SYSCALL:
+			if(CURRENT_STATE.REGS[2] == 0xa){
+				RUN_FLAG = FALSE;
+				TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			}
+			break;
+		case OP_MFHI:
+			NEXT_STATE.REGS[d->rd] = CURRENT_STATE.HI;
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_MTHI:
+			NEXT_STATE.HI = CURRENT_STATE.REGS[d->rs];
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_MFLO:
+			NEXT_STATE.REGS[d->rd] = CURRENT_STATE.LO;
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_MTLO:
+			NEXT_STATE.LO = CURRENT_STATE.REGS[d->rs];
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_MULT:
+			if ((CURRENT_STATE.REGS[d->rs] & 0x80000000) == 0x80000000){
+				p1 = 0xFFFFFFFF00000000 | CURRENT_STATE.REGS[d->rs];
+			}else{
+				p1 = 0x00000000FFFFFFFF & CURRENT_STATE.REGS[d->rs];
+			}
+			if ((CURRENT_STATE.REGS[d->rt] & 0x80000000) == 0x80000000){
+				p2 = 0xFFFFFFFF00000000 | CURRENT_STATE.REGS[d->rt];
+			}else{
+				p2 = 0x00000000FFFFFFFF & CURRENT_STATE.REGS[d->rt];
+			}
+			product = p1 * p2;
+			NEXT_STATE.LO = (product & 0X00000000FFFFFFFF);
+			NEXT_STATE.HI = (product & 0XFFFFFFFF00000000)>>32;
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_MULTU:
+			product = (uint64_t)CURRENT_STATE.REGS[d->rs] * (uint64_t)CURRENT_STATE.REGS[d->rt];
+			NEXT_STATE.LO = (product & 0X00000000FFFFFFFF);
+			NEXT_STATE.HI = (product & 0XFFFFFFFF00000000)>>32;
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_DIV: 
+			if(CURRENT_STATE.REGS[d->rt] != 0)
+			{
+				NEXT_STATE.LO = (int32_t)CURRENT_STATE.REGS[d->rs] / (int32_t)CURRENT_STATE.REGS[d->rt];
+				NEXT_STATE.HI = (int32_t)CURRENT_STATE.REGS[d->rs] % (int32_t)CURRENT_STATE.REGS[d->rt];
+			}
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_DIVU:
+			if(CURRENT_STATE.REGS[d->rt] != 0)
+			{
+				NEXT_STATE.LO = CURRENT_STATE.REGS[d->rs] / CURRENT_STATE.REGS[d->rt];
+				NEXT_STATE.HI = CURRENT_STATE.REGS[d->rs] % CURRENT_STATE.REGS[d->rt];
+			}
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_ADD:
+			NEXT_STATE.REGS[d->rd] = CURRENT_STATE.REGS[d->rs] + CURRENT_STATE.REGS[d->rt];
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_ADDU: 
+			NEXT_STATE.REGS[d->rd] = CURRENT_STATE.REGS[d->rt] + CURRENT_STATE.REGS[d->rs];
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_SUB:
+			NEXT_STATE.REGS[d->rd] = CURRENT_STATE.REGS[d->rs] - CURRENT_STATE.REGS[d->rt];
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_SUBU:
+			NEXT_STATE.REGS[d->rd] = CURRENT_STATE.REGS[d->rs] - CURRENT_STATE.REGS[d->rt];
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_AND:
+			NEXT_STATE.REGS[d->rd] = CURRENT_STATE.REGS[d->rs] & CURRENT_STATE.REGS[d->rt];
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_OR:
+			NEXT_STATE.REGS[d->rd] = CURRENT_STATE.REGS[d->rs] | CURRENT_STATE.REGS[d->rt];
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_XOR:
+			NEXT_STATE.REGS[d->rd] = CURRENT_STATE.REGS[d->rs] ^ CURRENT_STATE.REGS[d->rt];
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_NOR:
+			NEXT_STATE.REGS[d->rd] = ~(CURRENT_STATE.REGS[d->rs] | CURRENT_STATE.REGS[d->rt]);
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_SLT:
+			if(CURRENT_STATE.REGS[d->rs] < CURRENT_STATE.REGS[d->rt]){
+				NEXT_STATE.REGS[d->rd] = 0x1;
+			}
+			else{
+				NEXT_STATE.REGS[d->rd] = 0x0;
+			}
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_BLTZ:
+			if((CURRENT_STATE.REGS[d->rs] & 0x80000000) > 0){
+				NEXT_STATE.PC = d->target;
 				branch_jump = TRUE;
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x03: //JAL
-				NEXT_STATE.PC = (CURRENT_STATE.PC & 0xF0000000) | (target << 2);
-				NEXT_STATE.REGS[31] = CURRENT_STATE.PC + 4;
+			}
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_BGEZ:
+			if((CURRENT_STATE.REGS[d->rs] & 0x80000000) == 0x0){
+				NEXT_STATE.PC = d->target;
 				branch_jump = TRUE;
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x04: //BEQ
-				if(CURRENT_STATE.REGS[rs] == CURRENT_STATE.REGS[rt]){
-					NEXT_STATE.PC = CURRENT_STATE.PC + ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000)<<2 : (immediate & 0x0000FFFF)<<2);
-					branch_jump = TRUE;
-				}
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x05: //BNE
-				if(CURRENT_STATE.REGS[rs] != CURRENT_STATE.REGS[rt]){
-					NEXT_STATE.PC = CURRENT_STATE.PC + ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000)<<2 : (immediate & 0x0000FFFF)<<2);
-					branch_jump = TRUE;
-				}
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x06: //BLEZ
-				if((CURRENT_STATE.REGS[rs] & 0x80000000) > 0 || CURRENT_STATE.REGS[rs] == 0){
-					NEXT_STATE.PC = CURRENT_STATE.PC +  ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000)<<2 : (immediate & 0x0000FFFF)<<2);
-					branch_jump = TRUE;
-				}
-				print_instruction(CURRENT_STATE.PC);
+			}
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_J:
+			NEXT_STATE.PC = d->target;
+			branch_jump = TRUE;
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_JAL:
+			NEXT_STATE.PC = d->target;
+			NEXT_STATE.REGS[31] = link;
+			branch_jump = TRUE;
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_BEQ:
+			if(CURRENT_STATE.REGS[d->rs] == CURRENT_STATE.REGS[d->rt]){
+				NEXT_STATE.PC = d->target;
+				branch_jump = TRUE;
+			}
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_BNE:
+			if(CURRENT_STATE.REGS[d->rs] != CURRENT_STATE.REGS[d->rt]){
+				NEXT_STATE.PC = d->target;
+				branch_jump = TRUE;
+			}
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_BLEZ:
+			if((CURRENT_STATE.REGS[d->rs] & 0x80000000) > 0 || CURRENT_STATE.REGS[d->rs] == 0){
+				NEXT_STATE.PC = d->target;
+				branch_jump = TRUE;
+			}
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_BGTZ:
+			if((CURRENT_STATE.REGS[d->rs] & 0x80000000) == 0x0 || CURRENT_STATE.REGS[d->rs] != 0){
+				NEXT_STATE.PC = d->target;
+				branch_jump = TRUE;
+			}
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_ADDI:
+			NEXT_STATE.REGS[d->rt] = CURRENT_STATE.REGS[d->rs] + d->imm;
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_ADDIU:
+			NEXT_STATE.REGS[d->rt] = CURRENT_STATE.REGS[d->rs] + d->imm;
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_SLTI:
+			if ( ( (int32_t)CURRENT_STATE.REGS[d->rs] - (int32_t)d->imm) < 0){
+				NEXT_STATE.REGS[d->rt] = 0x1;
+			}else{
+				NEXT_STATE.REGS[d->rt] = 0x0;
+			}
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_ANDI:
+			NEXT_STATE.REGS[d->rt] = CURRENT_STATE.REGS[d->rs] & d->uimm;
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_ORI:
+			NEXT_STATE.REGS[d->rt] = CURRENT_STATE.REGS[d->rs] | d->uimm;
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_XORI:
+			NEXT_STATE.REGS[d->rt] = CURRENT_STATE.REGS[d->rs] ^ d->uimm;
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_LUI:
+			NEXT_STATE.REGS[d->rt] = d->uimm << 16;
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_LB:
+			data = mem_read_8(CURRENT_STATE.REGS[d->rs] + d->imm);
+			NEXT_STATE.REGS[d->rt] = (data & 0x80) > 0 ? (data | 0xFFFFFF00) : data;
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_LH:
+			data = mem_read_16(CURRENT_STATE.REGS[d->rs] + d->imm);
+			NEXT_STATE.REGS[d->rt] = (data & 0x8000) > 0 ? (data | 0xFFFF0000) : data;
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_LW:
+			NEXT_STATE.REGS[d->rt] = mem_read_32(CURRENT_STATE.REGS[d->rs] + d->imm);
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_SB:
+			addr = CURRENT_STATE.REGS[d->rs] + d->imm;
+			mem_write_8(addr, CURRENT_STATE.REGS[d->rt] & 0x000000FF);
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);				
+			break;
+		case OP_SH:
+			addr = CURRENT_STATE.REGS[d->rs] + d->imm;
+			mem_write_16(addr, CURRENT_STATE.REGS[d->rt] & 0x0000FFFF);
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_SW:
+			addr = CURRENT_STATE.REGS[d->rs] + d->imm;
+			mem_write_32(addr, CURRENT_STATE.REGS[d->rt]);
+			TRACE_INSTRUCTION(CURRENT_STATE.PC);
+			break;
+		case OP_NOP:
+			break;
+		default:
+			printf("Instruction at 0x%x is not implemented!\n", CURRENT_STATE.PC);
+			break;
+	}
+	
+	if(DELAY_SLOTS){
+		/* run the slot first; a taken branch waits in DELAY_TARGET */
+		target = DELAY_TARGET;
+		DELAY_TARGET = branch_jump ? NEXT_STATE.PC : 0;
+		NEXT_STATE.PC = target ? target : CURRENT_STATE.PC + 4;
+	}
+	else if(!branch_jump){
+		NEXT_STATE.PC = CURRENT_STATE.PC + 4;
+	}
+}
+
+
+/************************************************************/
+/* Run up to max_instructions with the selected fast engine; returns the number executed */
+/************************************************************/
+uint32_t run_engine(uint32_t max_instructions)
+{
+	uint32_t count = 0;
+
+	switch(ENGINE){
+		case ENGINE_THREADED:
+			count = run_threaded(max_instructions);
+			break;
+		case ENGINE_BLOCK:
+			count = run_blocks(max_instructions);
+			break;
+		default:
+			while (count < max_instructions && RUN_FLAG) {
+				cycle();
+				count++;
+			}
+			return count;
+	}
+	NEXT_STATE = CURRENT_STATE;
+	return count;
+}
+
+/************************************************************/
+/* Direct-threaded interpreter: every decoded instruction carries the label of its handler and   */
+/* each handler jumps straight to the next one. Works in place on CURRENT_STATE and produces the */
+/* same architectural state as handle_instruction(), without the per-instruction printing.       */
+/* While recording, each dispatch also stores the instruction into the trace ring; the handlers  */
+/* keep their own indirect jumps, so dispatch prediction is unaffected.                          */
+/************************************************************/
+uint32_t run_threaded(uint32_t max_instructions)
+{
+	static const void *labels[NUM_OPS] = {
+		[OP_INVALID] = &&do_decode,
+		[OP_SLL] = &&do_sll, [OP_SRL] = &&do_srl, [OP_SRA] = &&do_sra,
+		[OP_JR] = &&do_jr, [OP_JALR] = &&do_jalr, [OP_SYSCALL] = &&do_syscall,
+		[OP_MFHI] = &&do_mfhi, [OP_MTHI] = &&do_mthi, [OP_MFLO] = &&do_mflo, [OP_MTLO] = &&do_mtlo,
+		[OP_MULT] = &&do_mult, [OP_MULTU] = &&do_multu, [OP_DIV] = &&do_div, [OP_DIVU] = &&do_divu,
+		[OP_ADD] = &&do_add, [OP_ADDU] = &&do_addu, [OP_SUB] = &&do_sub, [OP_SUBU] = &&do_subu,
+		[OP_AND] = &&do_and, [OP_OR] = &&do_or, [OP_XOR] = &&do_xor, [OP_NOR] = &&do_nor,
+		[OP_SLT] = &&do_slt,
+		[OP_BLTZ] = &&do_bltz, [OP_BGEZ] = &&do_bgez, [OP_J] = &&do_j, [OP_JAL] = &&do_jal,
+		[OP_BEQ] = &&do_beq, [OP_BNE] = &&do_bne, [OP_BLEZ] = &&do_blez, [OP_BGTZ] = &&do_bgtz,
+		[OP_ADDI] = &&do_addi, [OP_ADDIU] = &&do_addiu, [OP_SLTI] = &&do_slti,
+		[OP_ANDI] = &&do_andi, [OP_ORI] = &&do_ori, [OP_XORI] = &&do_xori, [OP_LUI] = &&do_lui,
+		[OP_LB] = &&do_lb, [OP_LH] = &&do_lh, [OP_LW] = &&do_lw,
+		[OP_SB] = &&do_sb, [OP_SH] = &&do_sh, [OP_SW] = &&do_sw,
+		[OP_NOP] = &&do_nop, [OP_UNKNOWN] = &&do_unknown
+	};
+	/* PCs outside the table are decoded here; scratch[1] sends sequential flow back to lookup */
+	static decoded_inst_t scratch[2];
+	const int recording = ITRACE_WRITER.file != NULL;
+	itrace_held_t *held = recording ? ITRACE_WRITER.ring[ITRACE_WRITER.head % ITRACE_RING_SLOTS].held : NULL;
+	uint32_t num_held = 0;
+	uint32_t *R = CURRENT_STATE.REGS;
+	uint32_t pc = CURRENT_STATE.PC;
+	const int delay = DELAY_SLOTS;
+	const uint32_t link = delay ? 8 : 4;
+	uint32_t count = 0;
+	uint32_t index, target, data;
+	uint64_t product;
+	decoded_inst_t *d;
+
+	if (THREADED_HANDLERS == NULL) {
+		/* first run: link the already decoded program to the handlers */
+		THREADED_HANDLERS = labels;
+		for (index = 0; index <= DECODED_SIZE && DECODED != NULL; index++) {
+			DECODED[index].handler = labels[DECODED[index].op];
+		}
+		scratch[1].op = OP_INVALID;
+		scratch[1].handler = labels[OP_INVALID];
+	}
+
+#define DISPATCH()	do { if (count == max_instructions) goto done; count++; if (recording) HOLD(); goto *d->handler; } while (0)
+#define HOLD()		do {																\
+		held[num_held].pc = pc;															\
+		held[num_held].instruction = d->instruction;									\
+		held[num_held].address = R[d->rs] + d->imm;										\
+		held[num_held].op = d->op;														\
+		if (++num_held == ITRACE_SLOT_RECORDS) {										\
+			/* the instruction being dispatched has no outcome yet */					\
+			held = itrace_submit(ITRACE_SLOT_RECORDS - 1, pc);							\
+			num_held = 1;																\
+		}																				\
+	} while (0)
+#define NEXT()		do { pc += 4; d++; DISPATCH(); } while (0)
+#define JUMP(addr)	do { target = (addr); if (delay) goto delay_slot; pc = target; goto lookup; } while (0)
+#define BRANCH(cond)	do { if (cond) JUMP(d->target); NEXT(); } while (0)
+
+	if (DELAY_TARGET != 0) {
+		/* the last run stopped between a branch and its slot */
+		goto slot;
+	}
+
+lookup:
+	index = (pc - MEM_TEXT_BEGIN) >> 2;
+	if ((pc & 0x3) == 0 && index < DECODED_SIZE) {
+		d = &DECODED[index];
+	} else {
+		d = &scratch[0];
+		decode_instruction(pc, mem_read_32(pc), d);
+	}
+	DISPATCH();
+
+do_decode:
+	/* invalidated entry, table sentinel or scratch[1]: decode at pc and retry */
+	count--;
+	if (recording) {
+		num_held--;	/* held again when dispatched */
+	}
+	if (d < DECODED || d >= DECODED + DECODED_SIZE) {
+		goto lookup;
+	}
+	decode_instruction(pc, mem_read_32(pc), d);
+	DISPATCH();
+
+do_sll:		R[d->rd] = R[d->rt] << d->sa; NEXT();
+do_srl:		R[d->rd] = R[d->rt] >> d->sa; NEXT();
+do_sra:		R[d->rd] = R[d->rt] >> d->sa; NEXT(); /* same result as handle_instruction() */
+do_jr:		JUMP(R[d->rs]);
+do_jalr:	target = R[d->rs]; R[d->rd] = pc + link; JUMP(target);
+do_syscall:
+	if (R[2] == 0xa) {
+		RUN_FLAG = FALSE;
+		pc += 4;
+		goto done;
+	}
+	NEXT();
+do_mfhi:	R[d->rd] = CURRENT_STATE.HI; NEXT();
+do_mthi:	CURRENT_STATE.HI = R[d->rs]; NEXT();
+do_mflo:	R[d->rd] = CURRENT_STATE.LO; NEXT();
+do_mtlo:	CURRENT_STATE.LO = R[d->rs]; NEXT();
+do_mult:
+	product = (uint64_t)(int64_t)(int32_t)R[d->rs] * (uint64_t)(int64_t)(int32_t)R[d->rt];
+	CURRENT_STATE.LO = product & 0xFFFFFFFF;
+	CURRENT_STATE.HI = product >> 32;
+	NEXT();
+do_multu:
+	product = (uint64_t)R[d->rs] * (uint64_t)R[d->rt];
+	CURRENT_STATE.LO = product & 0xFFFFFFFF;
+	CURRENT_STATE.HI = product >> 32;
+	NEXT();
+do_div:
+	if (R[d->rt] != 0) {
+		data = (int32_t)R[d->rs] / (int32_t)R[d->rt];
+		CURRENT_STATE.HI = (int32_t)R[d->rs] % (int32_t)R[d->rt];
+		CURRENT_STATE.LO = data;
+	}
+	NEXT();
+do_divu:
+	if (R[d->rt] != 0) {
+		data = R[d->rs] / R[d->rt];
+		CURRENT_STATE.HI = R[d->rs] % R[d->rt];
+		CURRENT_STATE.LO = data;
+	}
+	NEXT();
+do_add:		R[d->rd] = R[d->rs] + R[d->rt]; NEXT();
+do_addu:	R[d->rd] = R[d->rs] + R[d->rt]; NEXT();
+do_sub:		R[d->rd] = R[d->rs] - R[d->rt]; NEXT();
+do_subu:	R[d->rd] = R[d->rs] - R[d->rt]; NEXT();
+do_and:		R[d->rd] = R[d->rs] & R[d->rt]; NEXT();
+do_or:		R[d->rd] = R[d->rs] | R[d->rt]; NEXT();
+do_xor:		R[d->rd] = R[d->rs] ^ R[d->rt]; NEXT();
+do_nor:		R[d->rd] = ~(R[d->rs] | R[d->rt]); NEXT();
+do_slt:		R[d->rd] = R[d->rs] < R[d->rt] ? 1 : 0; NEXT();
+do_bltz:	BRANCH((R[d->rs] & 0x80000000) > 0);
+do_bgez:	BRANCH((R[d->rs] & 0x80000000) == 0);
+do_j:		JUMP(d->target);
+do_jal:		R[31] = pc + link; JUMP(d->target);
+do_beq:		BRANCH(R[d->rs] == R[d->rt]);
+do_bne:		BRANCH(R[d->rs] != R[d->rt]);
+do_blez:	BRANCH((R[d->rs] & 0x80000000) > 0 || R[d->rs] == 0);
+do_bgtz:	BRANCH((R[d->rs] & 0x80000000) == 0 || R[d->rs] != 0);
+do_addi:	R[d->rt] = R[d->rs] + d->imm; NEXT();
+do_addiu:	R[d->rt] = R[d->rs] + d->imm; NEXT();
+do_slti:	R[d->rt] = ((int32_t)R[d->rs] - (int32_t)d->imm) < 0 ? 1 : 0; NEXT();
+do_andi:	R[d->rt] = R[d->rs] & d->uimm; NEXT();
+do_ori:		R[d->rt] = R[d->rs] | d->uimm; NEXT();
+do_xori:	R[d->rt] = R[d->rs] ^ d->uimm; NEXT();
+do_lui:		R[d->rt] = d->uimm << 16; NEXT();
+do_lb:
+	data = mem_read_8(R[d->rs] + d->imm);
+	R[d->rt] = (data & 0x80) > 0 ? (data | 0xFFFFFF00) : data;
+	NEXT();
+do_lh:
+	data = mem_read_16(R[d->rs] + d->imm);
+	R[d->rt] = (data & 0x8000) > 0 ? (data | 0xFFFF0000) : data;
+	NEXT();
+do_lw:		R[d->rt] = mem_read_32(R[d->rs] + d->imm); NEXT();
+do_sb:		mem_write_8(R[d->rs] + d->imm, R[d->rt] & 0xFF); NEXT();
+do_sh:		mem_write_16(R[d->rs] + d->imm, R[d->rt] & 0xFFFF); NEXT();
+do_sw:		mem_write_32(R[d->rs] + d->imm, R[d->rt]); NEXT();
+do_nop:		NEXT();
+do_unknown:
+	printf("Instruction at 0x%x is not implemented!\n", pc);
+	NEXT();
+
+delay_slot:
+	/* taken with delay slots: run the instruction after it, then go to target */
+	DELAY_TARGET = target;
+	pc += 4;
+slot:
+	if (count == max_instructions) {
+		goto done;
+	}
+	count++;
+	d = decode_lookup(pc);
+	if (recording) {
+		HOLD();
+	}
+	pc = delay_step(d, pc);
+	if (!RUN_FLAG) {
+		goto done;
+	}
+	if (DELAY_TARGET != 0) {
+		/* the slot was a taken branch itself: pc is its slot */
+		goto slot;
+	}
+	goto lookup;
+
+#undef DISPATCH
+#undef HOLD
+#undef NEXT
+#undef JUMP
+#undef BRANCH
+
+done:
+	if (num_held > 0) {
+		itrace_submit(num_held, pc);
+	}
+	CURRENT_STATE.PC = pc;
+	INSTRUCTION_COUNT += count;
+	return count;
+}
+
+/************************************************************/
+/* Execute one decoded instruction in place on CURRENT_STATE; returns the next PC             */
+/************************************************************/
+uint32_t execute_decoded(const decoded_inst_t *d, uint32_t pc)
+{
+	uint32_t *R = CURRENT_STATE.REGS;
+	uint32_t link = pc + (DELAY_SLOTS ? 8 : 4);
+	uint32_t target, data;
+	uint64_t product;
+
+	switch(d->op){
+		case OP_SLL:	R[d->rd] = R[d->rt] << d->sa; break;
+		case OP_SRL:	R[d->rd] = R[d->rt] >> d->sa; break;
+		case OP_SRA:	R[d->rd] = R[d->rt] >> d->sa; break; /* same result as handle_instruction() */
+		case OP_JR:		return R[d->rs];
+		case OP_JALR:
+			target = R[d->rs];
+			R[d->rd] = link;
+			return target;
+		case OP_SYSCALL:
+			if (R[2] == 0xa) {
+				RUN_FLAG = FALSE;
+			}
+			break;
+		case OP_MFHI:	R[d->rd] = CURRENT_STATE.HI; break;
+		case OP_MTHI:	CURRENT_STATE.HI = R[d->rs]; break;
+		case OP_MFLO:	R[d->rd] = CURRENT_STATE.LO; break;
+		case OP_MTLO:	CURRENT_STATE.LO = R[d->rs]; break;
+		case OP_MULT:
+			product = (uint64_t)(int64_t)(int32_t)R[d->rs] * (uint64_t)(int64_t)(int32_t)R[d->rt];
+			CURRENT_STATE.LO = product & 0xFFFFFFFF;
+			CURRENT_STATE.HI = product >> 32;
+			break;
+		case OP_MULTU:
+			product = (uint64_t)R[d->rs] * (uint64_t)R[d->rt];
+			CURRENT_STATE.LO = product & 0xFFFFFFFF;
+			CURRENT_STATE.HI = product >> 32;
+			break;
+		case OP_DIV:
+			if (R[d->rt] != 0) {
+				data = (int32_t)R[d->rs] / (int32_t)R[d->rt];
+				CURRENT_STATE.HI = (int32_t)R[d->rs] % (int32_t)R[d->rt];
+				CURRENT_STATE.LO = data;
+			}
+			break;
+		case OP_DIVU:
+			if (R[d->rt] != 0) {
+				data = R[d->rs] / R[d->rt];
+				CURRENT_STATE.HI = R[d->rs] % R[d->rt];
+				CURRENT_STATE.LO = data;
+			}
+			break;
+		case OP_ADD:	R[d->rd] = R[d->rs] + R[d->rt]; break;
+		case OP_ADDU:	R[d->rd] = R[d->rs] + R[d->rt]; break;
+		case OP_SUB:	R[d->rd] = R[d->rs] - R[d->rt]; break;
+		case OP_SUBU:	R[d->rd] = R[d->rs] - R[d->rt]; break;
+		case OP_AND:	R[d->rd] = R[d->rs] & R[d->rt]; break;
+		case OP_OR:		R[d->rd] = R[d->rs] | R[d->rt]; break;
+		case OP_XOR:	R[d->rd] = R[d->rs] ^ R[d->rt]; break;
+		case OP_NOR:	R[d->rd] = ~(R[d->rs] | R[d->rt]); break;
+		case OP_SLT:	R[d->rd] = R[d->rs] < R[d->rt] ? 1 : 0; break;
+		case OP_BLTZ:	return (R[d->rs] & 0x80000000) > 0 ? d->target : pc + 4;
+		case OP_BGEZ:	return (R[d->rs] & 0x80000000) == 0 ? d->target : pc + 4;
+		case OP_J:		return d->target;
+		case OP_JAL:
+			R[31] = link;
+			return d->target;
+		case OP_BEQ:	return R[d->rs] == R[d->rt] ? d->target : pc + 4;
+		case OP_BNE:	return R[d->rs] != R[d->rt] ? d->target : pc + 4;
+		case OP_BLEZ:	return (R[d->rs] & 0x80000000) > 0 || R[d->rs] == 0 ? d->target : pc + 4;
+		case OP_BGTZ:	return (R[d->rs] & 0x80000000) == 0 || R[d->rs] != 0 ? d->target : pc + 4;
+		case OP_ADDI:	R[d->rt] = R[d->rs] + d->imm; break;
+		case OP_ADDIU:	R[d->rt] = R[d->rs] + d->imm; break;
+		case OP_SLTI:	R[d->rt] = ((int32_t)R[d->rs] - (int32_t)d->imm) < 0 ? 1 : 0; break;
+		case OP_ANDI:	R[d->rt] = R[d->rs] & d->uimm; break;
+		case OP_ORI:	R[d->rt] = R[d->rs] | d->uimm; break;
+		case OP_XORI:	R[d->rt] = R[d->rs] ^ d->uimm; break;
+		case OP_LUI:	R[d->rt] = d->uimm << 16; break;
+		case OP_LB:
+			data = mem_read_8(R[d->rs] + d->imm);
+			R[d->rt] = (data & 0x80) > 0 ? (data | 0xFFFFFF00) : data;
+			break;
+		case OP_LH:
+			data = mem_read_16(R[d->rs] + d->imm);
+			R[d->rt] = (data & 0x8000) > 0 ? (data | 0xFFFF0000) : data;
+			break;
+		case OP_LW:		R[d->rt] = mem_read_32(R[d->rs] + d->imm); break;
+		case OP_SB:		mem_write_8(R[d->rs] + d->imm, R[d->rt] & 0xFF); break;
+		case OP_SH:		mem_write_16(R[d->rs] + d->imm, R[d->rt] & 0xFFFF); break;
+		case OP_SW:		mem_write_32(R[d->rs] + d->imm, R[d->rt]); break;
+		case OP_NOP:	break;
+		default:
+			printf("Instruction at 0x%x is not implemented!\n", pc);
+			break;
+	}
+	return pc + 4;
+}
+
+/************************************************************/
+/* Does branch or jump d go to its target? Same conditions as execute_decoded(); a branch   */
+/* writes no register it compares, so this holds before and after it runs.                  */
+/************************************************************/
+static inline int branch_taken(const decoded_inst_t *d)
+{
+	const uint32_t *R = CURRENT_STATE.REGS;
+
+	switch(d->op){
+		case OP_BLTZ:	return (R[d->rs] & 0x80000000) > 0;
+		case OP_BGEZ:	return (R[d->rs] & 0x80000000) == 0;
+		case OP_BEQ:	return R[d->rs] == R[d->rt];
+		case OP_BNE:	return R[d->rs] != R[d->rt];
+		case OP_BLEZ:	return (R[d->rs] & 0x80000000) > 0 || R[d->rs] == 0;
+		case OP_BGTZ:	return (R[d->rs] & 0x80000000) == 0 || R[d->rs] != 0;
+		case OP_J: case OP_JAL: case OP_JR: case OP_JALR:
+			return TRUE;
+		default:
+			return FALSE;
+	}
+}
+
+/************************************************************/
+/* execute_decoded() with delay slots: returns the slot after a taken branch or jump, whose */
+/* target waits in DELAY_TARGET, and DELAY_TARGET after the slot. A branch to its own slot  */
+/* runs the slot twice.                                                                      */
+/************************************************************/
+uint32_t delay_step(const decoded_inst_t *d, uint32_t pc)
+{
+	uint32_t target = DELAY_TARGET;
+	int taken = branch_taken(d);
+	uint32_t next = execute_decoded(d, pc);
+
+	DELAY_TARGET = taken ? next : 0;
+	return target ? target : pc + 4;
+}
+
+/************************************************************/
+/* Does op end a basic block?                                                                                  */
+/************************************************************/
+static inline int ends_block(uint8_t op)
+{
+	switch(op){
+		case OP_J: case OP_JAL: case OP_JR: case OP_JALR:
+		case OP_BEQ: case OP_BNE: case OP_BLEZ: case OP_BGTZ: case OP_BLTZ: case OP_BGEZ:
+		case OP_SYSCALL:
+			return TRUE;
+		default:
+			return FALSE;
+	}
+}
+
+/************************************************************/
+/* Find the cached block starting at pc, translating it on first use. Returns NULL for PCs the */
+/* cache does not cover (outside the text segment or unaligned).                               */
+/************************************************************/
+block_t *block_lookup(uint32_t pc)
+{
+	decoded_inst_t ops[BLOCK_MAX_LENGTH];
+	block_t *b;
+	uint32_t n;
+
+	if ((pc & 0x3) != 0 || pc < MEM_TEXT_BEGIN || pc > MEM_TEXT_END) {
+		return NULL;
+	}
+	for (b = BLOCK_HASH_TABLE[BLOCK_HASH(pc)]; b != NULL; b = b->hash_next) {
+		if (b->pc == pc) {
+			return b;
+		}
+	}
+
+	/* discover the block: straight-line code up to and including the first branch/jump/syscall */
+	n = 0;
+	do {
+		ops[n] = *decode_lookup(pc + (n << 2));
+		n++;
+	} while (n < BLOCK_MAX_LENGTH && !ends_block(ops[n-1].op) && pc + (n << 2) <= MEM_TEXT_END);
+
+	b = calloc(1, sizeof(block_t));
+	assert(b != NULL);
+	b->ops = malloc(n * sizeof(decoded_inst_t));
+	assert(b->ops != NULL);
+	memcpy(b->ops, ops, n * sizeof(decoded_inst_t));
+	b->pc = pc;
+	b->length = n;
+	b->hash_next = BLOCK_HASH_TABLE[BLOCK_HASH(pc)];
+	BLOCK_HASH_TABLE[BLOCK_HASH(pc)] = b;
+	b->list_next = BLOCK_LIST;
+	BLOCK_LIST = b;
+
+	/* stores into this block must now invalidate the cache */
+	if (pc + (n << 2) - MEM_TEXT_BEGIN > CODE_WATCH_BYTES) {
+		CODE_WATCH_BYTES = pc + (n << 2) - MEM_TEXT_BEGIN;
+	}
+	return b;
+}
+
+/************************************************************/
+/* Free every cached block                                                                                         */
+/************************************************************/
+void block_cache_flush()
+{
+	block_t *b, *next;
+
+	for (b = BLOCK_LIST; b != NULL; b = next) {
+		next = b->list_next;
+		free(b->ops);
+		free(b);
+	}
+	BLOCK_LIST = NULL;
+	memset(BLOCK_HASH_TABLE, 0, sizeof(BLOCK_HASH_TABLE));
+	BLOCK_CACHE_STALE = FALSE;
+	JIT_CACHE_USED = 0;
+}
+
+/************************************************************/
+/* x86-64 translation of hot blocks. Guest state stays in CURRENT_STATE, which the generated  */
+/* code addresses through rbx; every instruction loads its sources from and stores its result */
+/* to that frame, so nothing needs to be written back when the code calls out to C. Loads and */
+/* stores call the mem_* fast paths, and operations with no native sequence call              */
+/* execute_decoded(). A translation returns the next guest PC, leaving early (after the store) */
+/* if a store rewrote cached code.                                                             */
+/************************************************************/
+#if defined(__x86_64__)
+
+#define JIT_REG(r)	((uint32_t)(offsetof(CPU_State, REGS) + 4 * (r)))
+#define JIT_HI		((uint32_t)offsetof(CPU_State, HI))
+#define JIT_LO		((uint32_t)offsetof(CPU_State, LO))
+
+/* host registers used by the emitter (x86 register numbers) */
+#define X_EAX 0
+#define X_ECX 1
+#define X_ESI 6
+#define X_EDI 7
+
+static uint8_t *jit_pos;
+
+static inline void emit8(uint8_t byte) { *jit_pos++ = byte; }
+static inline void emit32(uint32_t word) { memcpy(jit_pos, &word, 4); jit_pos += 4; }
+static inline void emit64(uint64_t word) { memcpy(jit_pos, &word, 8); jit_pos += 8; }
+
+/* mov reg32, [rbx + offset] */
+static void emit_load(int reg, uint32_t offset) { emit8(0x8B); emit8(0x83 | (reg << 3)); emit32(offset); }
+/* mov [rbx + offset], reg32 */
+static void emit_store(int reg, uint32_t offset) { emit8(0x89); emit8(0x83 | (reg << 3)); emit32(offset); }
+/* mov dword [rbx + offset], imm32 */
+static void emit_store_imm(uint32_t offset, uint32_t value) { emit8(0xC7); emit8(0x83); emit32(offset); emit32(value); }
+/* mov eax, imm32; pop rbx; ret */
+static void emit_exit(uint32_t pc) { emit8(0xB8); emit32(pc); emit8(0x5B); emit8(0xC3); }
+
+/* mov rax, fn; call rax */
+static void emit_call(const void *fn)
+{
+	emit8(0x48); emit8(0xB8); emit64((uint64_t)(uintptr_t)fn);
+	emit8(0xFF); emit8(0xD0);
+}
+
+/* edi = R[rs] + imm, the effective address of a load or store */
+static void emit_address(const decoded_inst_t *d)
+{
+	emit_load(X_EDI, JIT_REG(d->rs));
+	emit8(0x81); emit8(0xC7); emit32(d->imm);
+}
+
+/* eax = R[rs] op R[rt]; R[rd] = eax. op is the "op r/m32, r32" opcode byte */
+static void emit_alu(const decoded_inst_t *d, uint8_t op)
+{
+	emit_load(X_EAX, JIT_REG(d->rs));
+	emit_load(X_ECX, JIT_REG(d->rt));
+	emit8(op); emit8(0xC8);
+	emit_store(X_EAX, JIT_REG(d->rd));
+}
+
+/* eax = R[rs] op imm; R[rt] = eax. op is the "op eax, imm32" opcode byte */
+static void emit_alu_imm(const decoded_inst_t *d, uint8_t op, uint32_t imm)
+{
+	emit_load(X_EAX, JIT_REG(d->rs));
+	emit8(op); emit32(imm);
+	emit_store(X_EAX, JIT_REG(d->rt));
+}
+
+/* eax = R[rt] shifted by sa; R[rd] = eax. ext is the ModRM byte selecting shl/shr */
+static void emit_shift(const decoded_inst_t *d, uint8_t ext)
+{
+	emit_load(X_EAX, JIT_REG(d->rt));
+	emit8(0xC1); emit8(ext); emit8(d->sa);
+	emit_store(X_EAX, JIT_REG(d->rd));
+}
+
+/* after a store: leave with the next PC if it rewrote cached code */
+static void emit_stale_check(uint32_t pc)
+{
+	emit8(0x48); emit8(0xB8); emit64((uint64_t)(uintptr_t)&BLOCK_CACHE_STALE);
+	emit8(0x83); emit8(0x38); emit8(0x00);		/* cmp dword [rax], 0 */
+	emit8(0x74); emit8(0x07);					/* je past the exit */
+	emit_exit(pc + 4);
+}
+
+/* hand the instruction to the interpreter; eax = next PC */
+static void emit_fallback(const decoded_inst_t *d, uint32_t pc)
+{
+	emit8(0x48); emit8(0xBF); emit64((uint64_t)(uintptr_t)d);	/* mov rdi, d */
+	emit8(0xBE); emit32(pc);									/* mov esi, pc */
+	emit_call(execute_decoded);
+}
+
+/* eax = taken ? target : pc + 4, with taken given by the flags and the cmovcc opcode byte */
+static void emit_branch(const decoded_inst_t *d, uint32_t pc, uint8_t cmov)
+{
+	emit8(0xB8); emit32(pc + 4);
+	emit8(0xB9); emit32(d->target);
+	emit8(0x0F); emit8(cmov); emit8(0xC1);
+	emit8(0x5B); emit8(0xC3);
+}
+
+void jit_compile(block_t *b)
+{
+	const decoded_inst_t *d;
+	uint32_t i, pc;
+
+	if (JIT_CACHE == NULL) {
+		JIT_CACHE = mmap(NULL, JIT_CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (JIT_CACHE == MAP_FAILED) {
+			printf("JIT: cannot map executable memory, staying in the interpreter\n");
+			JIT_CACHE = NULL;
+			JIT_ENABLED = FALSE;
+			return;
+		}
+	}
+	if (JIT_CACHE_USED + JIT_MAX_BLOCK_BYTES > JIT_CACHE_SIZE) {
+		jit_cache_flush();
+	}
+
+	jit_pos = JIT_CACHE + JIT_CACHE_USED;
+	emit8(0x53);								/* push rbx */
+	emit8(0x48); emit8(0x89); emit8(0xFB);		/* mov rbx, rdi */
+
+	for (i = 0, pc = b->pc; i < b->length; i++, pc += 4) {
+		d = &b->ops[i];
+		switch(d->op){
+			case OP_SLL:	emit_shift(d, 0xE0); break;
+			case OP_SRL:
+			case OP_SRA:	emit_shift(d, 0xE8); break;	/* logical, as in handle_instruction() */
+			case OP_ADD:
+			case OP_ADDU:	emit_alu(d, 0x01); break;
+			case OP_SUB:
+			case OP_SUBU:	emit_alu(d, 0x29); break;
+			case OP_AND:	emit_alu(d, 0x21); break;
+			case OP_OR:		emit_alu(d, 0x09); break;
+			case OP_XOR:	emit_alu(d, 0x31); break;
+			case OP_NOR:
+				emit_load(X_EAX, JIT_REG(d->rs));
+				emit_load(X_ECX, JIT_REG(d->rt));
+				emit8(0x09); emit8(0xC8);				/* or eax, ecx */
+				emit8(0xF7); emit8(0xD0);				/* not eax */
+				emit_store(X_EAX, JIT_REG(d->rd));
+				break;
+			case OP_SLT:	/* unsigned compare, as in handle_instruction() */
+				emit_load(X_EAX, JIT_REG(d->rs));
+				emit_load(X_ECX, JIT_REG(d->rt));
+				emit8(0x39); emit8(0xC8);				/* cmp eax, ecx */
+				emit8(0x0F); emit8(0x92); emit8(0xC0);	/* setb al */
+				emit8(0x0F); emit8(0xB6); emit8(0xC0);	/* movzx eax, al */
+				emit_store(X_EAX, JIT_REG(d->rd));
+				break;
+			case OP_ADDI:
+			case OP_ADDIU:	emit_alu_imm(d, 0x05, d->imm); break;
+			case OP_ANDI:	emit_alu_imm(d, 0x25, d->uimm); break;
+			case OP_ORI:	emit_alu_imm(d, 0x0D, d->uimm); break;
+			case OP_XORI:	emit_alu_imm(d, 0x35, d->uimm); break;
+			case OP_LUI:	emit_store_imm(JIT_REG(d->rt), d->uimm << 16); break;
+			case OP_MFHI:	emit_load(X_EAX, JIT_HI); emit_store(X_EAX, JIT_REG(d->rd)); break;
+			case OP_MFLO:	emit_load(X_EAX, JIT_LO); emit_store(X_EAX, JIT_REG(d->rd)); break;
+			case OP_MTHI:	emit_load(X_EAX, JIT_REG(d->rs)); emit_store(X_EAX, JIT_HI); break;
+			case OP_MTLO:	emit_load(X_EAX, JIT_REG(d->rs)); emit_store(X_EAX, JIT_LO); break;
+			case OP_LB:
+				emit_address(d);
+				emit_call(mem_read_8);
+				emit8(0x0F); emit8(0xBE); emit8(0xC0);	/* movsx eax, al */
+				emit_store(X_EAX, JIT_REG(d->rt));
+				break;
+			case OP_LH:
+				emit_address(d);
+				emit_call(mem_read_16);
+				emit8(0x0F); emit8(0xBF); emit8(0xC0);	/* movsx eax, ax */
+				emit_store(X_EAX, JIT_REG(d->rt));
+				break;
+			case OP_LW:
+				emit_address(d);
+				emit_call(mem_read_32);
+				emit_store(X_EAX, JIT_REG(d->rt));
+				break;
+			case OP_SB:
+			case OP_SH:
+			case OP_SW:
+				emit_address(d);
+				emit_load(X_ESI, JIT_REG(d->rt));
+				emit_call(d->op == OP_SB ? (const void *)mem_write_8 : d->op == OP_SH ? (const void *)mem_write_16 : (const void *)mem_write_32);
+				emit_stale_check(pc);
+				break;
+			case OP_NOP:	break;
+			case OP_J:		emit_exit(d->target); break;
+			case OP_JAL:
+				emit_store_imm(JIT_REG(31), pc + (DELAY_SLOTS ? 8 : 4));	/* flushed when -D changes */
+				emit_exit(d->target);
+				break;
+			case OP_JR:
+				emit_load(X_EAX, JIT_REG(d->rs));
+				emit8(0x5B); emit8(0xC3);
+				break;
+			case OP_BEQ:
+			case OP_BNE:
+				emit_load(X_EAX, JIT_REG(d->rs));
+				emit8(0x3B); emit8(0x83); emit32(JIT_REG(d->rt));	/* cmp eax, [rbx + rt] */
+				emit_branch(d, pc, d->op == OP_BEQ ? 0x44 : 0x45);
 				break;
-			case 0x07: //BGTZ
-				if((CURRENT_STATE.REGS[rs] & 0x80000000) == 0x0 || CURRENT_STATE.REGS[rs] != 0){
-					NEXT_STATE.PC = CURRENT_STATE.PC +  ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000)<<2 : (immediate & 0x0000FFFF)<<2);
-					branch_jump = TRUE;
+			default:
+				/* MULT/DIV, SLTI, the remaining branches, SYSCALL and unknown encodings */
+				emit_fallback(d, pc);
+				if (ends_block(d->op)) {
+					emit8(0x5B); emit8(0xC3);
 				}
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x08: //ADDI
-				NEXT_STATE.REGS[rt] = CURRENT_STATE.REGS[rs] + ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000) : (immediate & 0x0000FFFF));
-				print_instruction(CURRENT_STATE.PC);
 				break;
-			case 0x09: //ADDIU
-				NEXT_STATE.REGS[rt] = CURRENT_STATE.REGS[rs] + ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000) : (immediate & 0x0000FFFF));
-				print_instruction(CURRENT_STATE.PC);
+		}
+	}
+	if (!ends_block(b->ops[b->length - 1].op)) {
+		/* block cut at BLOCK_MAX_LENGTH or at the end of the text segment */
+		emit_exit(pc);
+	}
+
+	b->jit = (uint32_t (*)(CPU_State *))(JIT_CACHE + JIT_CACHE_USED);
+	JIT_CACHE_USED = jit_pos - JIT_CACHE;
+	JIT_BLOCKS_COMPILED++;
+}
+
+#undef X_EAX
+#undef X_ECX
+#undef X_ESI
+#undef X_EDI
+
+#else
+
+/* no native backend for this host: hot blocks stay in the block interpreter */
+void jit_compile(block_t *b)
+{
+	b->jit_failed = TRUE;
+}
+
+#endif
+
+/************************************************************/
+/* Drop every translation; the blocks themselves stay cached and are retranslated when hot again */
+/************************************************************/
+void jit_cache_flush()
+{
+	block_t *b;
+
+	for (b = BLOCK_LIST; b != NULL; b = b->list_next) {
+		b->jit = NULL;
+		b->exec_count = 0;
+	}
+	JIT_CACHE_USED = 0;
+}
+
+/************************************************************/
+/* Run a translated block on the JIT and then, from the same starting state, on the interpreter, */
+/* and compare registers, HI/LO, the next PC and every byte either run stored. The interpreter's  */
+/* result is kept; a block that disagrees is reported and never translated again. Returns the    */
+/* next PC.                                                                                        */
+/************************************************************/
+uint32_t jit_verify(block_t *b)
+{
+	CPU_State start = CURRENT_STATE, jitted;
+	int run_flag = RUN_FLAG, jit_run_flag;
+	mem_journal_t *jit_log;
+	uint32_t *jit_values;
+	uint32_t jit_count, jit_pc, pc, i, j, value, expected;
+	int mismatch = FALSE;
+
+	/* JIT first, journaling its stores so they can be undone */
+	MEM_JOURNAL_COUNT = 0;
+	MEM_JOURNAL_ACTIVE = TRUE;
+	jit_pc = b->jit(&CURRENT_STATE);
+	MEM_JOURNAL_ACTIVE = FALSE;
+	if (BLOCK_CACHE_STALE) {
+		/* the block rewrote itself; the replay would not see the same code */
+		MEM_JOURNAL_COUNT = 0;
+		return jit_pc;
+	}
+	jitted = CURRENT_STATE;
+	jit_run_flag = RUN_FLAG;
+	jit_count = MEM_JOURNAL_COUNT;
+	jit_log = malloc(jit_count * sizeof(mem_journal_t) + 1);
+	jit_values = malloc(jit_count * sizeof(uint32_t) + 1);
+	assert(jit_log != NULL && jit_values != NULL);
+	memcpy(jit_log, MEM_JOURNAL, jit_count * sizeof(mem_journal_t));
+	for (i = 0; i < jit_count; i++) {
+		j = jit_log[i].address;
+		jit_values[i] = jit_log[i].size == 1 ? mem_read_8(j) : jit_log[i].size == 2 ? mem_read_16(j) : mem_read_32(j);
+	}
+	mem_journal_rollback();
+	CURRENT_STATE = start;
+	RUN_FLAG = run_flag;
+
+	/* then the interpreter, journaling too so stores the JIT missed are found */
+	MEM_JOURNAL_ACTIVE = TRUE;
+	pc = b->pc;
+	for (i = 0; i < b->length; i++) {
+		pc = execute_decoded(&b->ops[i], pc);
+	}
+	MEM_JOURNAL_ACTIVE = FALSE;
+
+	if (pc != jit_pc || RUN_FLAG != jit_run_flag || memcmp(&CURRENT_STATE, &jitted, sizeof(CPU_State)) != 0) {
+		mismatch = TRUE;
+	}
+	for (i = 0; i < jit_count && !mismatch; i++) {
+		j = jit_log[i].address;
+		value = jit_log[i].size == 1 ? mem_read_8(j) : jit_log[i].size == 2 ? mem_read_16(j) : mem_read_32(j);
+		mismatch = value != jit_values[i];
+	}
+	for (i = 0; i < MEM_JOURNAL_COUNT && !mismatch; i++) {
+		/* stored only by the interpreter: the JIT left the old contents there */
+		for (j = 0; j < jit_count; j++) {
+			if (jit_log[j].address == MEM_JOURNAL[i].address && jit_log[j].size == MEM_JOURNAL[i].size) {
 				break;
-			case 0x0A: //SLTI
-				if ( (  (int32_t)CURRENT_STATE.REGS[rs] - (int32_t)( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000) : (immediate & 0x0000FFFF))) < 0){
-					NEXT_STATE.REGS[rt] = 0x1;
-				}else{
-					NEXT_STATE.REGS[rt] = 0x0;
+			}
+		}
+		if (j == jit_count) {
+			/* only the first store to an address remembers what was there before the block */
+			for (j = 0; j < i; j++) {
+				if (MEM_JOURNAL[j].address == MEM_JOURNAL[i].address && MEM_JOURNAL[j].size == MEM_JOURNAL[i].size) {
+					break;
 				}
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x0C: //ANDI
-				NEXT_STATE.REGS[rt] = CURRENT_STATE.REGS[rs] & (immediate & 0x0000FFFF);
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x0D: //ORI
-				NEXT_STATE.REGS[rt] = CURRENT_STATE.REGS[rs] | (immediate & 0x0000FFFF);
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x0E: //XORI
-				NEXT_STATE.REGS[rt] = CURRENT_STATE.REGS[rs] ^ (immediate & 0x0000FFFF);
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x0F: //LUI
-				NEXT_STATE.REGS[rt] = immediate << 16;
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x20: //LB
-				data = mem_read_32( CURRENT_STATE.REGS[rs] + ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000) : (immediate & 0x0000FFFF)) );
-				NEXT_STATE.REGS[rt] = ((data & 0x000000FF) & 0x80) > 0 ? (data | 0xFFFFFF00) : (data & 0x000000FF);
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x21: //LH
-				data = mem_read_32( CURRENT_STATE.REGS[rs] + ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000) : (immediate & 0x0000FFFF)) );
-				NEXT_STATE.REGS[rt] = ((data & 0x0000FFFF) & 0x8000) > 0 ? (data | 0xFFFF0000) : (data & 0x0000FFFF);
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x23: //LW
-				NEXT_STATE.REGS[rt] = mem_read_32( CURRENT_STATE.REGS[rs] + ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000) : (immediate & 0x0000FFFF)) );
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x28: //SB
-				addr = CURRENT_STATE.REGS[rs] + ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000) : (immediate & 0x0000FFFF));
-				data = mem_read_32( addr);
-				data = (data & 0xFFFFFF00) | (CURRENT_STATE.REGS[rt] & 0x000000FF);
-				mem_write_32(addr, data);
-				print_instruction(CURRENT_STATE.PC);				
-				break;
-			case 0x29: //SH
-				addr = CURRENT_STATE.REGS[rs] + ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000) : (immediate & 0x0000FFFF));
-				data = mem_read_32( addr);
-				data = (data & 0xFFFF0000) | (CURRENT_STATE.REGS[rt] & 0x0000FFFF);
-				mem_write_32(addr, data);
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x2B: //SW
-				addr = CURRENT_STATE.REGS[rs] + ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000) : (immediate & 0x0000FFFF));
-				mem_write_32(addr, CURRENT_STATE.REGS[rt]);
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			default:
-				// put more things here
-				printf("Instruction at 0x%x is not implemented!\n", CURRENT_STATE.PC);
-				break;
+			}
+			if (j < i) {
+				continue;
+			}
+			j = MEM_JOURNAL[i].address;
+			value = MEM_JOURNAL[i].size == 1 ? mem_read_8(j) : MEM_JOURNAL[i].size == 2 ? mem_read_16(j) : mem_read_32(j);
+			expected = MEM_JOURNAL[i].old;
+			mismatch = value != expected;
 		}
 	}
-	
-	if(!branch_jump){
-		NEXT_STATE.PC = CURRENT_STATE.PC + 4;
+	MEM_JOURNAL_COUNT = 0;
+	free(jit_log);
+	free(jit_values);
+
+	if (mismatch) {
+		printf("JIT: block at 0x%08x disagrees with the interpreter, disabling its translation\n", b->pc);
+		for (i = 0; i < 32; i++) {
+			if (jitted.REGS[i] != CURRENT_STATE.REGS[i]) {
+				printf("JIT:   $r%u = 0x%08x, expected 0x%08x\n", i, jitted.REGS[i], CURRENT_STATE.REGS[i]);
+			}
+		}
+		if (jit_pc != pc) {
+			printf("JIT:   next PC = 0x%08x, expected 0x%08x\n", jit_pc, pc);
+		}
+		b->jit = NULL;
+		b->jit_failed = TRUE;
+		JIT_VERIFY_FAILURES++;
 	}
+	return pc;
 }
 
+/************************************************************/
+/* Block engine: executes a whole cached basic block per dispatch and follows chained successor */
+/* links between blocks. Stops exactly after max_instructions, mid-block if necessary.          */
+/************************************************************/
+uint32_t run_blocks(uint32_t max_instructions)
+{
+	uint32_t pc = CURRENT_STATE.PC;
+	uint32_t count = 0;
+	uint32_t i, n;
+	block_t *b, *next;
+	decoded_inst_t single;
+
+	if (BLOCK_CACHE_STALE) {
+		block_cache_flush();
+	}
+	b = block_lookup(pc);
+
+	while (count < max_instructions && RUN_FLAG) {
+		if (b == NULL || DELAY_TARGET != 0) {
+			/* not cacheable, or the delay slot of a taken branch: step a single instruction */
+			decode_instruction(pc, mem_read_32(pc), &single);
+			pc = DELAY_SLOTS ? delay_step(&single, pc) : execute_decoded(&single, pc);
+			count++;
+			if (BLOCK_CACHE_STALE) {
+				block_cache_flush();
+			}
+			b = block_lookup(pc);
+			continue;
+		}
+
+		n = b->length;
+		if (max_instructions - count < n) {
+			n = max_instructions - count;
+		}
+		b->exec_count++;
+		if (JIT_ENABLED && b->jit == NULL && !b->jit_failed && b->exec_count >= JIT_THRESHOLD) {
+			jit_compile(b);
+		}
+		if (JIT_ENABLED && b->jit != NULL && n == b->length) {
+			pc = JIT_VERIFY ? jit_verify(b) : b->jit(&CURRENT_STATE);
+			/* a translation only leaves early right after a store into cached code */
+			i = BLOCK_CACHE_STALE ? (pc - b->pc) >> 2 : n;
+		} else {
+			for (i = 0; i < n; i++) {
+				pc = execute_decoded(&b->ops[i], pc);
+				if (BLOCK_CACHE_STALE) {
+					/* a store rewrote cached code: finish this instruction, then retranslate */
+					i++;
+					break;
+				}
+			}
+		}
+		count += i;
+
+		if (DELAY_SLOTS && i == b->length && branch_taken(&b->ops[i - 1])) {
+			/* the block ended in a taken branch or jump: its slot runs next */
+			DELAY_TARGET = pc;
+			pc = b->pc + (b->length << 2);
+		}
+		if (BLOCK_CACHE_STALE) {
+			block_cache_flush();
+			b = block_lookup(pc);
+			continue;
+		}
+
+		/* follow the chain, linking the successor on first use */
+		if (b->taken != NULL && b->taken->pc == pc) {
+			next = b->taken;
+		} else if (b->fallthrough != NULL && b->fallthrough->pc == pc) {
+			next = b->fallthrough;
+		} else {
+			next = block_lookup(pc);
+			if (pc == b->pc + (b->length << 2)) {
+				b->fallthrough = next;
+			} else {
+				b->taken = next;
+			}
+		}
+		b = next;
+	}
+
+	CURRENT_STATE.PC = pc;
+	INSTRUCTION_COUNT += count;
+	return count;
+}
 
 /************************************************************/
 /* Initialize Memory                                                                                                    */ 
@@ -623,181 +2176,159 @@ void print_program(){
 	for(i=0; i<PROGRAM_SIZE; i++){
 		addr = MEM_TEXT_BEGIN + (i*4);
 		printf("[0x%x]\t", addr);
-		print_instruction(addr);
+		print_instruction(stdout, addr);
 	}
 }
 
 /************************************************************/
 /* Print the instruction at given memory address (in MIPS assembly format)    */
 /************************************************************/
-void print_instruction(uint32_t addr){
-	uint32_t instruction, opcode, function, rs, rt, rd, sa, immediate, target;
-	
-	instruction = mem_read_32(addr);
-	
-	opcode = (instruction & 0xFC000000) >> 26;
-	function = instruction & 0x0000003F;
-	rs = (instruction & 0x03E00000) >> 21;
-	rt = (instruction & 0x001F0000) >> 16;
-	rd = (instruction & 0x0000F800) >> 11;
-	sa = (instruction & 0x000007C0) >> 6;
-	immediate = instruction & 0x0000FFFF;
-	target = instruction & 0x03FFFFFF;
+void print_instruction(FILE *out, uint32_t addr){
+	decoded_inst_t *d = decode_lookup(addr);
 	
-	if(opcode == 0x00){
-		/*R format instructions here*/
-		
-		switch(function){
-			case 0x00:
-				printf("SLL $r%u, $r%u, 0x%x\n", rd, rt, sa);
-				break;
-			case 0x02:
-				printf("SRL $r%u, $r%u, 0x%x\n", rd, rt, sa);
-				break;
-			case 0x03:
-				printf("SRA $r%u, $r%u, 0x%x\n", rd, rt, sa);
-				break;
-			case 0x08:
-				printf("JR $r%u\n", rs);
-				break;
-			case 0x09:
-				if(rd == 31){
-					printf("JALR $r%u\n", rs);
-				}
-				else{
-					printf("JALR $r%u, $r%u\n", rd, rs);
-				}
-				break;
-			case 0x0C:
-				printf("SYSCALL\n");
-				break;
-			case 0x10:
-				printf("MFHI $r%u\n", rd);
-				break;
-			case 0x11:
-				printf("MTHI $r%u\n", rs);
-				break;
-			case 0x12:
-				printf("MFLO $r%u\n", rd);
-				break;
-			case 0x13:
-				printf("MTLO $r%u\n", rs);
-				break;
-			case 0x18:
-				printf("MULT $r%u, $r%u\n", rs, rt);
-				break;
-			case 0x19:
-				printf("MULTU $r%u, $r%u\n", rs, rt);
-				break;
-			case 0x1A:
-				printf("DIV $r%u, $r%u\n", rs, rt);
-				break;
-			case 0x1B:
-				printf("DIVU $r%u, $r%u\n", rs, rt);
-				break;
-			case 0x20:
-				printf("ADD $r%u, $r%u, $r%u\n", rd, rs, rt);
-				break;
-			case 0x21:
-				printf("ADDU $r%u, $r%u, $r%u\n", rd, rs, rt);
-				break;
-			case 0x22:
-				printf("SUB $r%u, $r%u, $r%u\n", rd, rs, rt);
-				break;
-			case 0x23:
-				printf("SUBU $r%u, $r%u, $r%u\n", rd, rs, rt);
-				break;
-			case 0x24:
-				printf("AND $r%u, $r%u, $r%u\n", rd, rs, rt);
-				break;
-			case 0x25:
-				printf("OR $r%u, $r%u, $r%u\n", rd, rs, rt);
-				break;
-			case 0x26:
-				printf("XOR $r%u, $r%u, $r%u\n", rd, rs, rt);
-				break;
-			case 0x27:
-				printf("NOR $r%u, $r%u, $r%u\n", rd, rs, rt);
-				break;
-			case 0x2A:
-				printf("SLT $r%u, $r%u, $r%u\n", rd, rs, rt);
-				break;
-			default:
-				printf("Instruction is not implemented!\n");
-				break;
-		}
-	}
-	else{
-		switch(opcode){
-			case 0x01:
-				if(rt == 0){
-					printf("BLTZ $r%u, 0x%x\n", rs, immediate<<2);
-				}
-				else if(rt == 1){
-					printf("BGEZ $r%u, 0x%x\n", rs, immediate<<2);
-				}
-				break;
-			case 0x02:
-				printf("J 0x%x\n", (addr & 0xF0000000) | (target<<2));
-				break;
-			case 0x03:
-				printf("JAL 0x%x\n", (addr & 0xF0000000) | (target<<2));
-				break;
-			case 0x04:
-				printf("BEQ $r%u, $r%u, 0x%x\n", rs, rt, immediate<<2);
-				break;
-			case 0x05:
-				printf("BNE $r%u, $r%u, 0x%x\n", rs, rt, immediate<<2);
-				break;
-			case 0x06:
-				printf("BLEZ $r%u, 0x%x\n", rs, immediate<<2);
-				break;
-			case 0x07:
-				printf("BGTZ $r%u, 0x%x\n", rs, immediate<<2);
-				break;
-			case 0x08:
-				printf("ADDI $r%u, $r%u, 0x%x\n", rt, rs, immediate);
-				break;
-			case 0x09:
-				printf("ADDIU $r%u, $r%u, 0x%x\n", rt, rs, immediate);
-				break;
-			case 0x0A:
-				printf("SLTI $r%u, $r%u, 0x%x\n", rt, rs, immediate);
-				break;
-			case 0x0C:
-				printf("ANDI $r%u, $r%u, 0x%x\n", rt, rs, immediate);
-				break;
-			case 0x0D:
-				printf("ORI $r%u, $r%u, 0x%x\n", rt, rs, immediate);
-				break;
-			case 0x0E:
-				printf("XORI $r%u, $r%u, 0x%x\n", rt, rs, immediate);
-				break;
-			case 0x0F:
-				printf("LUI $r%u, 0x%x\n", rt, immediate);
-				break;
-			case 0x20:
-				printf("LB $r%u, 0x%x($r%u)\n", rt, immediate, rs);
-				break;
-			case 0x21:
-				printf("LH $r%u, 0x%x($r%u)\n", rt, immediate, rs);
-				break;
-			case 0x23:
-				printf("LW $r%u, 0x%x($r%u)\n", rt, immediate, rs);
-				break;
-			case 0x28:
-				printf("SB $r%u, 0x%x($r%u)\n", rt, immediate, rs);
-				break;
-			case 0x29:
-				printf("SH $r%u, 0x%x($r%u)\n", rt, immediate, rs);
-				break;
-			case 0x2B:
-				printf("SW $r%u, 0x%x($r%u)\n", rt, immediate, rs);
-				break;
-			default:
-				printf("Instruction is not implemented!\n");
-				break;
-		}
+	switch(d->op){
+		case OP_SLL:
+			fprintf(out, "SLL $r%u, $r%u, 0x%x\n", d->rd, d->rt, d->sa);
+			break;
+		case OP_SRL:
+			fprintf(out, "SRL $r%u, $r%u, 0x%x\n", d->rd, d->rt, d->sa);
+			break;
+		case OP_SRA:
+			fprintf(out, "SRA $r%u, $r%u, 0x%x\n", d->rd, d->rt, d->sa);
+			break;
+		case OP_JR:
+			fprintf(out, "JR $r%u\n", d->rs);
+			break;
+		case OP_JALR:
+			if(d->rd == 31){
+				fprintf(out, "JALR $r%u\n", d->rs);
+			}
+			else{
+				fprintf(out, "JALR $r%u, $r%u\n", d->rd, d->rs);
+			}
+			break;
+		case OP_SYSCALL:
+			fprintf(out, "SYSCALL\n");
+			break;
+		case OP_MFHI:
+			fprintf(out, "MFHI $r%u\n", d->rd);
+			break;
+		case OP_MTHI:
+			fprintf(out, "MTHI $r%u\n", d->rs);
+			break;
+		case OP_MFLO:
+			fprintf(out, "MFLO $r%u\n", d->rd);
+			break;
+		case OP_MTLO:
+			fprintf(out, "MTLO $r%u\n", d->rs);
+			break;
+		case OP_MULT:
+			fprintf(out, "MULT $r%u, $r%u\n", d->rs, d->rt);
+			break;
+		case OP_MULTU:
+			fprintf(out, "MULTU $r%u, $r%u\n", d->rs, d->rt);
+			break;
+		case OP_DIV:
+			fprintf(out, "DIV $r%u, $r%u\n", d->rs, d->rt);
+			break;
+		case OP_DIVU:
+			fprintf(out, "DIVU $r%u, $r%u\n", d->rs, d->rt);
+			break;
+		case OP_ADD:
+			fprintf(out, "ADD $r%u, $r%u, $r%u\n", d->rd, d->rs, d->rt);
+			break;
+		case OP_ADDU:
+			fprintf(out, "ADDU $r%u, $r%u, $r%u\n", d->rd, d->rs, d->rt);
+			break;
+		case OP_SUB:
+			fprintf(out, "SUB $r%u, $r%u, $r%u\n", d->rd, d->rs, d->rt);
+			break;
+		case OP_SUBU:
+			fprintf(out, "SUBU $r%u, $r%u, $r%u\n", d->rd, d->rs, d->rt);
+			break;
+		case OP_AND:
+			fprintf(out, "AND $r%u, $r%u, $r%u\n", d->rd, d->rs, d->rt);
+			break;
+		case OP_OR:
+			fprintf(out, "OR $r%u, $r%u, $r%u\n", d->rd, d->rs, d->rt);
+			break;
+		case OP_XOR:
+			fprintf(out, "XOR $r%u, $r%u, $r%u\n", d->rd, d->rs, d->rt);
+			break;
+		case OP_NOR:
+			fprintf(out, "NOR $r%u, $r%u, $r%u\n", d->rd, d->rs, d->rt);
+			break;
+		case OP_SLT:
+			fprintf(out, "SLT $r%u, $r%u, $r%u\n", d->rd, d->rs, d->rt);
+			break;
+		case OP_BLTZ:
+			fprintf(out, "BLTZ $r%u, 0x%x\n", d->rs, d->uimm<<2);
+			break;
+		case OP_BGEZ:
+			fprintf(out, "BGEZ $r%u, 0x%x\n", d->rs, d->uimm<<2);
+			break;
+		case OP_J:
+			fprintf(out, "J 0x%x\n", d->target);
+			break;
+		case OP_JAL:
+			fprintf(out, "JAL 0x%x\n", d->target);
+			break;
+		case OP_BEQ:
+			fprintf(out, "BEQ $r%u, $r%u, 0x%x\n", d->rs, d->rt, d->uimm<<2);
+			break;
+		case OP_BNE:
+			fprintf(out, "BNE $r%u, $r%u, 0x%x\n", d->rs, d->rt, d->uimm<<2);
+			break;
+		case OP_BLEZ:
+			fprintf(out, "BLEZ $r%u, 0x%x\n", d->rs, d->uimm<<2);
+			break;
+		case OP_BGTZ:
+			fprintf(out, "BGTZ $r%u, 0x%x\n", d->rs, d->uimm<<2);
+			break;
+		case OP_ADDI:
+			fprintf(out, "ADDI $r%u, $r%u, 0x%x\n", d->rt, d->rs, d->uimm);
+			break;
+		case OP_ADDIU:
+			fprintf(out, "ADDIU $r%u, $r%u, 0x%x\n", d->rt, d->rs, d->uimm);
+			break;
+		case OP_SLTI:
+			fprintf(out, "SLTI $r%u, $r%u, 0x%x\n", d->rt, d->rs, d->uimm);
+			break;
+		case OP_ANDI:
+			fprintf(out, "ANDI $r%u, $r%u, 0x%x\n", d->rt, d->rs, d->uimm);
+			break;
+		case OP_ORI:
+			fprintf(out, "ORI $r%u, $r%u, 0x%x\n", d->rt, d->rs, d->uimm);
+			break;
+		case OP_XORI:
+			fprintf(out, "XORI $r%u, $r%u, 0x%x\n", d->rt, d->rs, d->uimm);
+			break;
+		case OP_LUI:
+			fprintf(out, "LUI $r%u, 0x%x\n", d->rt, d->uimm);
+			break;
+		case OP_LB:
+			fprintf(out, "LB $r%u, 0x%x($r%u)\n", d->rt, d->uimm, d->rs);
+			break;
+		case OP_LH:
+			fprintf(out, "LH $r%u, 0x%x($r%u)\n", d->rt, d->uimm, d->rs);
+			break;
+		case OP_LW:
+			fprintf(out, "LW $r%u, 0x%x($r%u)\n", d->rt, d->uimm, d->rs);
+			break;
+		case OP_SB:
+			fprintf(out, "SB $r%u, 0x%x($r%u)\n", d->rt, d->uimm, d->rs);
+			break;
+		case OP_SH:
+			fprintf(out, "SH $r%u, 0x%x($r%u)\n", d->rt, d->uimm, d->rs);
+			break;
+		case OP_SW:
+			fprintf(out, "SW $r%u, 0x%x($r%u)\n", d->rt, d->uimm, d->rs);
+			break;
+		case OP_NOP:
+			break;
+		default:
+			fprintf(out, "Instruction is not implemented!\n");
+			break;
 	}
 }
 
@@ -805,16 +2336,51 @@ void print_instruction(uint32_t addr){
 /* main                                                                                                                                   */
 /***************************************************************/
 int main(int argc, char *argv[]) {                              
+	const char *trace_file = NULL;
+	const char *record_file = NULL;
+	int i;
+
+	ENGINE = ENGINE_SWITCH;
+	for (i = 2; i + 1 < argc; i += 2) {
+		if (strcmp(argv[i], "-E") == 0) {
+			if (strcmp(argv[i+1], "threaded") == 0) {
+				ENGINE = ENGINE_THREADED;
+			} else if (strcmp(argv[i+1], "block") == 0) {
+				ENGINE = ENGINE_BLOCK;
+			} else if (strcmp(argv[i+1], "jit") == 0) {
+				ENGINE = ENGINE_BLOCK;
+				JIT_ENABLED = TRUE;
+			} else if (strcmp(argv[i+1], "switch") != 0) {
+				printf("Error: Unknown engine %s\n\n", argv[i+1]);
+				exit(1);
+			}
+		} else if (strcmp(argv[i], "-t") == 0) {
+			trace_file = argv[i+1];
+		} else if (strcmp(argv[i], "-r") == 0) {
+			record_file = argv[i+1];
+		} else if (strcmp(argv[i], "-D") == 0) {
+			DELAY_SLOTS = atoi(argv[i+1]) != 0;
+		}
+	}
+	/* before any output, so stdout gets the large buffer too */
+	trace_open(trace_file);
+	TRACE_LEVEL = TRACE_MAX;
+
 	printf("\n**************************\n");
 	printf("Welcome to MU-MIPS SIM...\n");
 	printf("**************************\n\n");
 	
 	if (argc < 2) {
-		printf("Error: You should provide input file.\nUsage: %s <input program> \n\n",  argv[0]);
+		printf("Error: You should provide input file.\nUsage: %s <input program> [-E switch|threaded|block|jit] [-t <trace file>] [-r <instruction trace>] [-D 0|1]\n\n",  argv[0]);
 		exit(1);
 	}
 
 	strcpy(prog_file, argv[1]);
+	if (record_file != NULL) {
+		/* only the threaded engine records */
+		ENGINE = ENGINE_THREADED;
+		itrace_open(record_file);
+	}
 	initialize();
 	load_program();
 	help();
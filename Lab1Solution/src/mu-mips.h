@@ -1,4 +1,9 @@
+#include <stdio.h>
 #include <stdint.h>
+#include <pthread.h>
+
+#include "mu-itrace.h"
+#include "mu-image.h"
 
 #define FALSE 0
 #define TRUE  1
@@ -24,18 +29,69 @@
 
 typedef struct {
 	uint32_t begin, end;
-	uint8_t *mem;
 } mem_region_t;
 
-/* memory will be dynamically allocated at initialization */
+/* only addresses inside one of these regions are backed by memory */
 mem_region_t MEM_REGIONS[] = {
-	{ MEM_TEXT_BEGIN, MEM_TEXT_END, NULL },
-	{ MEM_DATA_BEGIN, MEM_DATA_END, NULL },
-	{ MEM_KDATA_BEGIN, MEM_KDATA_END, NULL },
-	{ MEM_KTEXT_BEGIN, MEM_KTEXT_END, NULL }
+	{ MEM_TEXT_BEGIN, MEM_TEXT_END },
+	{ MEM_DATA_BEGIN, MEM_DATA_END },
+	{ MEM_KDATA_BEGIN, MEM_KDATA_END },
+	{ MEM_KTEXT_BEGIN, MEM_KTEXT_END }
 };
 
 #define NUM_MEM_REGION 4
+
+/******************************************************************************/
+/* Sparse guest memory: two-level page table, pages allocated on first write  */
+/******************************************************************************/
+#define MEM_PAGE_BITS   12
+#define MEM_PAGE_SIZE   (1 << MEM_PAGE_BITS)
+#define MEM_PAGE_MASK   (MEM_PAGE_SIZE - 1)
+#define MEM_L2_BITS     10
+#define MEM_L1_BITS     (32 - MEM_PAGE_BITS - MEM_L2_BITS)
+
+#define MEM_L1_INDEX(addr) ((addr) >> (MEM_PAGE_BITS + MEM_L2_BITS))
+#define MEM_L2_INDEX(addr) (((addr) >> MEM_PAGE_BITS) & ((1 << MEM_L2_BITS) - 1))
+
+typedef struct {
+	uint8_t *pages[1 << MEM_L2_BITS];
+} mem_page_table_t;
+
+/* second-level tables are allocated on demand; untouched pages read as zero */
+mem_page_table_t *MEM_PAGE_TABLE[1 << MEM_L1_BITS];
+const uint8_t MEM_ZERO_PAGE[MEM_PAGE_SIZE];
+/* guest address of every allocated page, so reset only touches dirtied memory */
+uint32_t *MEM_PAGE_LIST;
+uint32_t MEM_PAGES_ALLOCATED;
+uint32_t MEM_PAGE_LIST_SIZE;
+
+/* direct-mapped software TLBs caching guest page -> host page translations */
+#define MEM_TLB_BITS    8
+#define MEM_TLB_SIZE    (1 << MEM_TLB_BITS)
+#define MEM_TLB_INDEX(addr) (((addr) >> MEM_PAGE_BITS) & (MEM_TLB_SIZE - 1))
+#define MEM_TLB_INVALID 1 /* never equal to a page-aligned tag */
+
+typedef struct {
+	uint32_t tag;
+	const uint8_t *page;
+} mem_read_tlb_t;
+
+typedef struct {
+	uint32_t tag;
+	uint8_t *page;
+} mem_write_tlb_t;
+
+mem_read_tlb_t MEM_READ_TLB[MEM_TLB_SIZE];
+mem_write_tlb_t MEM_WRITE_TLB[MEM_TLB_SIZE];
+
+/* guest memory is little-endian; swap only on big-endian hosts */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define MEM_LE16(x) __builtin_bswap16(x)
+#define MEM_LE32(x) __builtin_bswap32(x)
+#else
+#define MEM_LE16(x) (x)
+#define MEM_LE32(x) (x)
+#endif
 #define MIPS_REGS 32
 
 typedef struct CPU_State_Struct {
@@ -46,6 +102,106 @@ typedef struct CPU_State_Struct {
 } CPU_State;
 
 
+/***************************************************************/
+/* Predecoded instructions                                                                                       */
+/***************************************************************/
+enum {
+	OP_INVALID = 0,	/* not decoded yet, or invalidated by a store to text */
+	OP_SLL, OP_SRL, OP_SRA, OP_JR, OP_JALR, OP_SYSCALL,
+	OP_MFHI, OP_MTHI, OP_MFLO, OP_MTLO, OP_MULT, OP_MULTU, OP_DIV, OP_DIVU,
+	OP_ADD, OP_ADDU, OP_SUB, OP_SUBU, OP_AND, OP_OR, OP_XOR, OP_NOR, OP_SLT,
+	OP_BLTZ, OP_BGEZ, OP_J, OP_JAL, OP_BEQ, OP_BNE, OP_BLEZ, OP_BGTZ,
+	OP_ADDI, OP_ADDIU, OP_SLTI, OP_ANDI, OP_ORI, OP_XORI, OP_LUI,
+	OP_LB, OP_LH, OP_LW, OP_SB, OP_SH, OP_SW,
+	OP_NOP,		/* REGIMM encoding other than BLTZ/BGEZ */
+	OP_UNKNOWN,	/* not implemented */
+	NUM_OPS
+};
+
+typedef struct Decoded_Inst_Struct {
+	uint8_t op;				/* handler id */
+	uint8_t rs, rt, rd, sa;
+	uint32_t imm;			/* sign-extended immediate */
+	uint32_t uimm;			/* zero-extended immediate */
+	uint32_t target;		/* absolute branch/jump target */
+	uint32_t instruction;	/* raw instruction word */
+	const void *handler;	/* threaded-code label for op */
+} decoded_inst_t;
+
+/* one entry per loaded text word, indexed by (PC - MEM_TEXT_BEGIN) >> 2 */
+decoded_inst_t *DECODED;
+uint32_t DECODED_SIZE;
+
+/***************************************************************/
+/* Execution engines (selected at startup with -e)                                                    */
+/***************************************************************/
+enum {
+	ENGINE_SWITCH,		/* handle_instruction(), one instruction per cycle() */
+	ENGINE_THREADED,	/* run_threaded(), direct-threaded dispatch */
+	ENGINE_BLOCK		/* run_blocks(), cached and chained basic blocks */
+};
+
+int ENGINE;
+/* label addresses of run_threaded(), indexed by op; NULL until first use */
+const void **THREADED_HANDLERS;
+
+/* MIPS-I branch delay slots (-D 1): the instruction after a branch or jump always runs, */
+/* and JAL/JALR link past it. Every engine honours them.                                  */
+int DELAY_SLOTS;
+uint32_t DELAY_TARGET;	/* where a taken branch or jump goes once its slot has run; 0 if none */
+
+/***************************************************************/
+/* Basic-block translation cache                                                                               */
+/***************************************************************/
+#define BLOCK_MAX_LENGTH 64
+#define BLOCK_HASH_SIZE 1024
+#define BLOCK_HASH(pc) (((pc) >> 2) & (BLOCK_HASH_SIZE - 1))
+
+typedef struct Block_Struct {
+	uint32_t pc;						/* guest address of the first instruction */
+	uint32_t length;					/* instructions, including the terminating branch */
+	decoded_inst_t *ops;				/* compact copy of the decoded instructions */
+	struct Block_Struct *taken;			/* chained successor reached by the branch/jump */
+	struct Block_Struct *fallthrough;	/* chained successor at pc + 4 * length */
+	struct Block_Struct *hash_next;
+	struct Block_Struct *list_next;
+	uint32_t exec_count;
+	uint32_t (*jit)(CPU_State *state);	/* native translation, NULL until the block is hot */
+	int jit_failed;						/* translation disagreed with the interpreter */
+} block_t;
+
+block_t *BLOCK_HASH_TABLE[BLOCK_HASH_SIZE];
+block_t *BLOCK_LIST;
+int BLOCK_CACHE_STALE;		/* set by stores to cached code; blocks are freed at the next safe point */
+
+/* stores below MEM_TEXT_BEGIN + CODE_WATCH_BYTES may hit decoded or cached code */
+uint32_t CODE_WATCH_BYTES;
+
+/***************************************************************/
+/* x86-64 JIT for hot blocks (block engine only)                                                            */
+/***************************************************************/
+#define JIT_THRESHOLD 16				/* block executions before it is translated */
+#define JIT_CACHE_SIZE (4 << 20)		/* bytes of executable memory for translations */
+#define JIT_MAX_BLOCK_BYTES (BLOCK_MAX_LENGTH * 64)
+
+int JIT_ENABLED;
+int JIT_VERIFY;			/* run every translated block against the interpreter as well */
+uint8_t *JIT_CACHE;
+uint32_t JIT_CACHE_USED;
+uint32_t JIT_BLOCKS_COMPILED;
+uint32_t JIT_VERIFY_FAILURES;
+
+/* undo log of guest stores, used to replay a block on both engines */
+typedef struct {
+	uint32_t address;
+	uint32_t size;
+	uint32_t old;
+} mem_journal_t;
+
+int MEM_JOURNAL_ACTIVE;
+mem_journal_t *MEM_JOURNAL;
+uint32_t MEM_JOURNAL_COUNT;
+uint32_t MEM_JOURNAL_SIZE;
 
 /***************************************************************/
 /* CPU State info.                                                                                                               */
@@ -58,13 +214,85 @@ uint32_t PROGRAM_SIZE; /*in words*/
 
 char prog_file[32];
 
+/***************************************************************/
+/* Tracing                                                                                                                        */
+/***************************************************************/
+#define TRACE_OFF		0	/* command output only */
+#define TRACE_SUMMARY	1	/* one line per program load and per run/sim command */
+#define TRACE_INSTR		2	/* every executed instruction and every loaded word; there are no pipeline stages to trace */
+
+/* highest level compiled in; -DTRACE_MAX=TRACE_OFF removes every trace call from the build */
+#ifndef TRACE_MAX
+#define TRACE_MAX TRACE_INSTR
+#endif
+
+#define TRACE_BUFFER_SIZE (1 << 20)
+#define TRACE_ON(level) (TRACE_MAX >= (level) && TRACE_LEVEL >= (level))
+#define TRACE(level, ...) do { if (TRACE_ON(level)) fprintf(TRACE_SINK, __VA_ARGS__); } while (0)
+#define TRACE_INSTRUCTION(addr) do { if (TRACE_ON(TRACE_INSTR)) print_instruction(TRACE_SINK, addr); } while (0)
+
+int TRACE_LEVEL;	/* runtime level, set with the trace command; capped by TRACE_MAX */
+FILE *TRACE_SINK;	/* fully buffered: stdout or the file given with -t */
+
+/***************************************************************/
+/* Instruction trace recording (-r, threaded engine): the engine stores each */
+/* dispatched instruction into the slot at the ring head. Writer threads     */
+/* encode and compress full slots in parallel and append them to the file in */
+/* order, so the simulator only waits when every slot is full.               */
+/***************************************************************/
+#define ITRACE_RING_SLOTS 8
+#define ITRACE_SLOT_RECORDS (ITRACE_CHUNK_SIZE / ITRACE_RECORD_MAX)
+#define ITRACE_MAX_WRITERS 4	/* one per spare host CPU, up to this many */
+
+/* an instruction as dispatched; its outcome is known once the next one is */
+typedef struct {
+	uint32_t pc;
+	uint32_t instruction;
+	uint32_t address;	/* rs + immediate, kept for loads and stores */
+	uint8_t op;
+} itrace_held_t;
+
+typedef struct {
+	itrace_held_t *held;	/* ITRACE_SLOT_RECORDS entries */
+	uint32_t records;
+	uint32_t next_pc;		/* where the last one went */
+} itrace_slot_t;
+
+typedef struct {
+	FILE *file;
+	const char *path;
+	itrace_slot_t ring[ITRACE_RING_SLOTS];
+	uint32_t head;		/* slot being filled by the simulator */
+	uint32_t claimed;	/* slots [claimed, head) wait for a writer */
+	uint32_t tail;		/* next slot to append; [tail, claimed) are being encoded */
+	int closing;
+	int failed;			/* a write to the file failed */
+	pthread_mutex_t lock;
+	pthread_cond_t filled;		/* head moved or closing was set */
+	pthread_cond_t drained;		/* tail moved */
+	int num_threads;
+	pthread_t threads[ITRACE_MAX_WRITERS];
+	uint64_t total_records, raw_bytes, file_bytes;
+} itrace_writer_t;
+
+itrace_writer_t ITRACE_WRITER;	/* file is NULL unless recording */
+
 
 /***************************************************************/
 /* Function Declerations.                                                                                                */
 /***************************************************************/
 void help();
+void trace_open(const char *path);
+uint8_t mem_read_8(uint32_t address);
+uint16_t mem_read_16(uint32_t address);
 uint32_t mem_read_32(uint32_t address);
+void mem_write_8(uint32_t address, uint8_t value);
+void mem_write_16(uint32_t address, uint16_t value);
 void mem_write_32(uint32_t address, uint32_t value);
+void mem_tlb_flush();
+const uint8_t *mem_page_read(uint32_t address);
+uint8_t *mem_page_write(uint32_t address);
+void mem_clear();
 void cycle();
 void run(int num_cycles);
 void runAll();
@@ -74,8 +302,31 @@ void handle_command();
 void reset();
 void init_memory();
 void load_program();
+void mem_load(uint32_t address, const uint8_t *src, uint32_t size);
+uint32_t load_image(const uint8_t *file, size_t size);
+uint32_t load_hex(const char *text, size_t size);
 void handle_instruction(); /*IMPLEMENT THIS*/
 void initialize();
 void print_program(); /*IMPLEMENT THIS*/
-void print_instruction(uint32_t);
+void print_instruction(FILE *out, uint32_t addr);
+void decode_instruction(uint32_t addr, uint32_t instruction, decoded_inst_t *d);
+decoded_inst_t *decode_lookup(uint32_t addr);
+void decode_invalidate(uint32_t address, uint32_t size);
+void predecode_program();
+uint32_t run_threaded(uint32_t max_instructions);
+uint32_t execute_decoded(const decoded_inst_t *d, uint32_t pc);
+uint32_t delay_step(const decoded_inst_t *d, uint32_t pc);
+block_t *block_lookup(uint32_t pc);
+void block_cache_flush();
+void mem_journal_record(uint32_t address, uint32_t size);
+void mem_journal_rollback();
+void jit_compile(block_t *b);
+void jit_cache_flush();
+uint32_t jit_verify(block_t *b);
+uint32_t run_blocks(uint32_t max_instructions);
+uint32_t run_engine(uint32_t max_instructions);
+void itrace_open(const char *path);
+itrace_held_t *itrace_submit(uint32_t records, uint32_t next_pc);
+void *itrace_writer_main(void *arg);
+void itrace_close();
 
@@ -1,5 +1,9 @@
 #include "mips-assembler.h"
 
+uint32_t* program = NULL;	// machine code, written to output.txt once assembled
+int program_size = 0;
+int program_capacity = 0;
+
 
 /**************************************************************/
 // Load program into memory
@@ -105,7 +109,7 @@ void handle_instruction(char* instr) {
 	// I Type
 	else if(!strncmp(opcode,"beq",3)) {
 		dim = 3;
-		op = 0x08;
+		op = 0x04;
 		parse_params(params,dim);
 		i_type_data data = parse_registers_i_rs(params);
 		code = create_mach_code_i(data,op);
@@ -742,45 +746,305 @@ char* to_lower(char* str) {
 
 
 /********************************************/
-// 
+// Appends an instruction to the program
 /********************************************/
 void output_instr(uint32_t instr) {
+	if(program_size == program_capacity) {
+		program_capacity = program_capacity ? 2 * program_capacity : 64;
+		program = realloc(program, program_capacity * sizeof(uint32_t));
+		assert(program != NULL);
+	}
+	program[program_size++] = instr;
+}
+
+
+/********************************************/
+// Writes the program to output.txt
+/********************************************/
+void write_program() {
 	FILE * fp;
 	char* fn = "output.txt";
+	int i;
 
 	/* Open program file. */
-	fp = fopen(fn, "a");
+	fp = fopen(fn, "w");
 	if (fp == NULL) {
 		printf("Error: Can't open program file %s\n", fn);
 		exit(-1);
 	}
 
 	/* write to the program. */
-	char temp[10];
-	sprintf(temp, "%x\n", instr);
-	fputs(temp,fp);
+	for(i = 0; i < program_size; i++) {
+		fprintf(fp, "%x\n", program[i]);
+	}
+	fclose(fp);
+}
+
+
+/************************************************************/
+/* Write the program as a binary image (mu-image.h) to output.img: text     */
+/* only, as little-endian words, so mu-mips loads it without parsing hex.   */
+/************************************************************/
+void write_image() {
+	FILE * fp;
+	char* fn = "output.img";
+	image_header_t header;
+	uint8_t word[4];
+	int i;
+
+	memcpy(header.magic, IMAGE_MAGIC, 4);
+	header.version = IMAGE_VERSION;
+	header.text_base = MEM_TEXT_BEGIN;
+	header.text_size = program_size * 4;
+	header.data_base = MEM_DATA_BEGIN;
+	header.data_size = 0;
+
+	fp = fopen(fn, "wb");
+	if (fp == NULL) {
+		printf("Error: Can't open image file %s\n", fn);
+		exit(-1);
+	}
+	fwrite(&header, sizeof(header), 1, fp);
+	for(i = 0; i < program_size; i++) {
+		word[0] = program[i] & 0xFF;
+		word[1] = (program[i] >> 8) & 0xFF;
+		word[2] = (program[i] >> 16) & 0xFF;
+		word[3] = program[i] >> 24;
+		fwrite(word, 4, 1, fp);
+	}
+	if (ferror(fp)) {
+		printf("Error: Can't write image file %s\n", fn);
+		exit(-1);
+	}
 	fclose(fp);
 }
 
 
+/********************************************/
+// Is instr a branch or jump
+/********************************************/
+int is_control(uint32_t instr) {
+	uint32_t op = instr >> 26;
+	uint32_t funct = instr & 0x3F;
+
+	return (op >= 0x01 && op <= 0x07) || (op == 0x00 && (funct == 0x08 || funct == 0x09));
+}
+
+
+/********************************************/
+// Registers, HI/LO and memory instr reads and writes, one bit each; r0 is left out
+/********************************************/
+void get_registers(uint32_t instr, uint64_t* reads, uint64_t* writes) {
+	uint32_t op = instr >> 26;
+	uint32_t funct = instr & 0x3F;
+	uint64_t rs = 1ULL << ((instr >> 21) & 0x1F);
+	uint64_t rt = 1ULL << ((instr >> 16) & 0x1F);
+	uint64_t rd = 1ULL << ((instr >> 11) & 0x1F);
+
+	*reads = 0;
+	*writes = 0;
+	if(op == 0x00) {
+		switch(funct) {
+			case 0x00: case 0x02: case 0x03:	// SLL, SRL, SRA
+				*reads = rt; *writes = rd; break;
+			case 0x08:							// JR
+				*reads = rs; break;
+			case 0x09:							// JALR
+				*reads = rs; *writes = rd | (1ULL << 31); break;
+			case 0x0c:							// SYSCALL
+				*reads = (1ULL << 2) | (1ULL << 4); break;
+			case 0x10:							// MFHI
+				*reads = REG_HI; *writes = rd; break;
+			case 0x12:							// MFLO
+				*reads = REG_LO; *writes = rd; break;
+			case 0x11:							// MTHI
+				*reads = rs; *writes = REG_HI; break;
+			case 0x13:							// MTLO
+				*reads = rs; *writes = REG_LO; break;
+			case 0x18: case 0x19: case 0x1a: case 0x1b:	// MULT, MULTU, DIV, DIVU
+				*reads = rs | rt; *writes = REG_HI | REG_LO; break;
+			default:
+				*reads = rs | rt; *writes = rd; break;
+		}
+	} else if(op == 0x01 || op == 0x06 || op == 0x07) {	// BLTZ, BGEZ, BLEZ, BGTZ
+		*reads = rs;
+	} else if(op == 0x03) {								// JAL
+		*writes = 1ULL << 31;
+	} else if(op == 0x04 || op == 0x05) {				// BEQ, BNE
+		*reads = rs | rt;
+	} else if(op == 0x28 || op == 0x29 || op == 0x2b) {	// SB, SH, SW
+		*reads = rs | rt; *writes = REG_MEM;
+	} else if(op == 0x20 || op == 0x21 || op == 0x23) {	// LB, LH, LW
+		*reads = rs | REG_MEM; *writes = rt;
+	} else if(op == 0x0f) {								// LUI
+		*writes = rt;
+	} else if(op != 0x02) {								// immediate ALU ops
+		*reads = rs; *writes = rt;
+	}
+	*reads &= ~1ULL;
+	*writes &= ~1ULL;
+}
+
+
+/********************************************/
+// Index of the instruction a branch or J/JAL at index goes to; -1 for JR/JALR
+// Branch offsets count from the branch itself, as in the simulator
+/********************************************/
+int branch_target(uint32_t instr, int index) {
+	uint32_t op = instr >> 26;
+
+	if(op == 0x02 || op == 0x03) {
+		return (int)((instr & 0x03FFFFFF) - (MEM_TEXT_BEGIN >> 2));
+	}
+	if(op >= 0x01 && op <= 0x07) {
+		return index + (int16_t)(instr & 0xFFFF);
+	}
+	return -1;
+}
+
+
+/********************************************/
+// instr, moved to index, with its target changed to target
+/********************************************/
+uint32_t set_branch_target(uint32_t instr, int index, int target) {
+	if((instr >> 26) == 0x02 || (instr >> 26) == 0x03) {
+		return (instr & 0xFC000000) | ((MEM_TEXT_BEGIN >> 2) + target);
+	}
+	return (instr & 0xFFFF0000) | ((target - index) & 0xFFFF);
+}
+
+
+/********************************************/
+// Give every branch and jump a delay slot (-d). The latest instruction of
+// its basic block that the branch and everything after it in the block do
+// not depend on moves into the slot; if there is none the slot gets a NOP.
+// Branch and jump targets are relocated; JR/JALR addresses are not.
+/********************************************/
+void fill_delay_slots() {
+	uint32_t* out = malloc((2 * program_size + 1) * sizeof(uint32_t));
+	int* origin = malloc((2 * program_size + 1) * sizeof(int));	// index in program, -1 for a NOP
+	int* map = malloc((program_size + 1) * sizeof(int));		// new index of each old one
+	char* targeted = calloc(program_size + 1, 1);
+	uint64_t reads, writes, later_reads, later_writes;
+	uint32_t moved;
+	int i, j, m, k = 0, block = 0, target, filled = 0, nops = 0;
+
+	assert(out != NULL && origin != NULL && map != NULL && targeted != NULL);
+	for(i = 0; i < program_size; i++) {
+		target = branch_target(program[i], i);
+		if(target >= 0 && target < program_size) {
+			targeted[target] = 1;
+		}
+	}
+
+	for(i = 0; i < program_size; i++) {
+		map[i] = k;
+		origin[k] = i;
+		out[k++] = program[i];
+		if(!is_control(program[i])) {
+			continue;
+		}
+
+		// out[block .. k-2] are the instructions since the last slot, in program order;
+		// a jump to the branch or between it and the candidate would skip the candidate
+		get_registers(program[i], &later_reads, &later_writes);
+		j = targeted[i] ? block - 1 : k - 2;
+		for(; j >= block; j--) {
+			get_registers(out[j], &reads, &writes);
+			if(out[j] == 0x0c) {	// SYSCALL: nothing moves past it
+				j = block - 1;
+				break;
+			}
+			if(!(writes & (later_reads | later_writes)) && !(reads & later_writes)) {
+				break;
+			}
+			if(targeted[origin[j]]) {
+				j = block - 1;
+				break;
+			}
+			later_reads |= reads;
+			later_writes |= writes;
+		}
+
+		if(j >= block) {
+			// jumping to the moved instruction now runs the ones after it, then the branch, then it
+			moved = out[j];
+			m = origin[j];
+			map[m] = j;
+			for(; j < k - 1; j++) {
+				out[j] = out[j+1];
+				origin[j] = origin[j+1];
+				map[origin[j]] = j;
+			}
+			origin[k-1] = m;
+			out[k-1] = moved;
+			filled++;
+		} else {
+			origin[k] = -1;
+			out[k++] = NOP;
+			nops++;
+		}
+		block = k;
+	}
+	map[program_size] = k;
+
+	for(i = 0; i < k; i++) {
+		if(origin[i] >= 0 && is_control(out[i])) {
+			target = branch_target(out[i], origin[i]);
+			if(target >= 0 && target <= program_size) {
+				out[i] = set_branch_target(out[i], i, map[target]);
+			}
+		}
+	}
+	printf("Delay slots: %d filled, %d NOPs\n", filled, nops);
+
+	free(program);
+	free(origin);
+	free(map);
+	free(targeted);
+	program = out;
+	program_size = program_capacity = k;
+}
+
+
 /***************************************************************/
 /*main*/
 /***************************************************************/
 int main(int argc, char *argv[]) {                              
+	int fill = 0, image = 0, i;
+
 	printf("\n**************************\n");
 	printf("MIPS-Assembler\n");
 	printf("**************************\n\n");
 	
 	remove("output.txt");
 
-	if (argc < 2) {
-		printf("Error: You should provide input file.\nUsage: %s <input program> \n\n",  argv[0]);
+	for (i = 2; i < argc; i++) {
+		if (strcmp(argv[i], "-d") == 0) {
+			fill = 1;
+		} else if (strcmp(argv[i], "-b") == 0) {
+			image = 1;
+		} else {
+			break;
+		}
+	}
+	if (argc < 2 || i < argc) {
+		printf("Error: You should provide input file.\nUsage: %s <input program> [-d] [-b]\n", argv[0]);
+		printf("       -d: fill branch delay slots, for mu-mips -D 1\n");
+		printf("       -b: also write output.img, a binary image mu-mips loads directly\n\n");
 		exit(1);
 	}
 
 	char prog_file[32];
 	strcpy(prog_file, argv[1]);
 	load_program(prog_file);
+	if (fill) {
+		fill_delay_slots();
+	}
+	write_program();
+	if (image) {
+		write_image();
+	}
 	
 	return 0;
 }
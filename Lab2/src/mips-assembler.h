@@ -6,6 +6,17 @@
 #include <math.h>
 #include <ctype.h>
 
+#include "mu-image.h"
+
+#define MEM_TEXT_BEGIN 0x00400000
+#define MEM_DATA_BEGIN 0x10010000
+#define NOP 0x00000000	// sll r0, r0, 0
+
+// get_registers() bits past the 32 GPRs
+#define REG_HI	(1ULL << 32)
+#define REG_LO	(1ULL << 33)
+#define REG_MEM	(1ULL << 34)
+
 typedef struct R_Type_Instruction {
 	uint32_t rs;
 	uint32_t rt;
@@ -44,4 +55,11 @@ uint32_t create_mach_code_r(r_type_data data,uint32_t op);
 uint32_t create_mach_code_r_shamt(r_type_data data,uint32_t op);
 uint32_t create_mach_code_j(j_type_data data,uint32_t op);
 void output_instr(uint32_t instr);
+void write_program();
+void write_image();
+int is_control(uint32_t instr);
+void get_registers(uint32_t instr, uint64_t* reads, uint64_t* writes);
+int branch_target(uint32_t instr, int index);
+uint32_t set_branch_target(uint32_t instr, int index, int target);
+void fill_delay_slots();
 
@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "mu-mips.h"
+
+
+static inline int bpred_counter_taken(uint8_t counter)
+{
+	return counter >= 2;
+}
+
+
+static inline void bpred_counter_train(uint8_t *counter, int taken)
+{
+	if (taken && *counter < 3) {
+		(*counter)++;
+	} else if (!taken && *counter > 0) {
+		(*counter)--;
+	}
+}
+
+
+/***************************************************************/
+/* bimodal: one counter per branch, indexed by PC                           */
+/***************************************************************/
+static int bimodal_predict(const bpred_t *bp, uint32_t pc, uint32_t history)
+{
+	(void)history;	/* no global history: the PC alone picks the counter */
+	return bpred_counter_taken(bp->counters[0][(pc >> 2) & bp->index_mask]);
+}
+
+
+static void bimodal_update(bpred_t *bp, uint32_t pc, uint32_t history, int taken)
+{
+	(void)history;
+	bpred_counter_train(&bp->counters[0][(pc >> 2) & bp->index_mask], taken);
+}
+
+
+/***************************************************************/
+/* gshare: counters indexed by PC xor the global history                    */
+/***************************************************************/
+static inline uint32_t gshare_index(const bpred_t *bp, uint32_t pc, uint32_t history)
+{
+	return ((pc >> 2) ^ (history & bp->history_mask)) & bp->index_mask;
+}
+
+
+static int gshare_predict(const bpred_t *bp, uint32_t pc, uint32_t history)
+{
+	return bpred_counter_taken(bp->counters[0][gshare_index(bp, pc, history)]);
+}
+
+
+static void gshare_update(bpred_t *bp, uint32_t pc, uint32_t history, int taken)
+{
+	bpred_counter_train(&bp->counters[0][gshare_index(bp, pc, history)], taken);
+}
+
+
+/***************************************************************/
+/* local: each branch's own history picks the counter; PC bits fill the     */
+/* index above history_bits                                                 */
+/***************************************************************/
+static inline uint32_t local_index(const bpred_t *bp, uint32_t pc)
+{
+	uint32_t own = bp->local[(pc >> 2) & bp->index_mask] & bp->history_mask;
+
+	return (own | ((pc >> 2) << bp->config.history_bits)) & bp->index_mask;
+}
+
+
+static int local_predict(const bpred_t *bp, uint32_t pc, uint32_t history)
+{
+	(void)history;	/* the branch's own history is in bp->local */
+	return bpred_counter_taken(bp->counters[0][local_index(bp, pc)]);
+}
+
+
+static void local_update(bpred_t *bp, uint32_t pc, uint32_t history, int taken)
+{
+	uint32_t *own = &bp->local[(pc >> 2) & bp->index_mask];
+
+	(void)history;
+	bpred_counter_train(&bp->counters[0][local_index(bp, pc)], taken);
+	*own = (*own << 1) | (taken != 0);
+}
+
+
+/***************************************************************/
+/* tournament: a local and a gshare predictor, and per-branch counters      */
+/* choosing between them, trained only when the two disagree                */
+/***************************************************************/
+static int tournament_predict(const bpred_t *bp, uint32_t pc, uint32_t history)
+{
+	if (bpred_counter_taken(bp->chooser[(pc >> 2) & bp->index_mask])) {
+		return bpred_counter_taken(bp->counters[1][gshare_index(bp, pc, history)]);
+	}
+	return local_predict(bp, pc, history);
+}
+
+
+static void tournament_update(bpred_t *bp, uint32_t pc, uint32_t history, int taken)
+{
+	uint8_t *global = &bp->counters[1][gshare_index(bp, pc, history)];
+	int local_taken = local_predict(bp, pc, history);
+
+	if (local_taken != bpred_counter_taken(*global)) {
+		bpred_counter_train(&bp->chooser[(pc >> 2) & bp->index_mask], local_taken != taken);
+	}
+	bpred_counter_train(global, taken);
+	local_update(bp, pc, history, taken);
+}
+
+
+const bpred_kind_t BPRED_KINDS[NUM_BPRED_KINDS] = {
+	[BPRED_BIMODAL]    = { "bimodal", 1, FALSE, FALSE, bimodal_predict, bimodal_update },
+	[BPRED_GSHARE]     = { "gshare", 1, FALSE, FALSE, gshare_predict, gshare_update },
+	[BPRED_LOCAL]      = { "local", 1, TRUE, FALSE, local_predict, local_update },
+	[BPRED_TOURNAMENT] = { "tournament", 2, TRUE, TRUE, tournament_predict, tournament_update },
+};
+
+
+/***************************************************************/
+/* Parse a predictor "[<kind>:]<entries>[:<btb entries>[:<history bits>]]"  */
+/* with an optional ":ras<depth>" anywhere after the kind; returns 0 on     */
+/* success. The kind defaults to bimodal, the BTB to BPRED_DEFAULT_BTB      */
+/* entries, the history to log2(entries) bits and the stack to none.        */
+/***************************************************************/
+int bpred_parse_config(const char *spec, bpred_config_t *config)
+{
+	char buf[64], *token, *save, *end;
+	int field = 0, kind;
+	uint32_t index_bits = 0;
+	unsigned long value;
+
+	memset(config, 0, sizeof(bpred_config_t));
+	config->kind = BPRED_BIMODAL;
+	config->btb_entries = BPRED_DEFAULT_BTB;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	token = strtok_r(buf, ":", &save);
+	if (token != NULL && (token[0] < '0' || token[0] > '9')) {
+		for (kind = 0; kind < NUM_BPRED_KINDS && strcmp(token, BPRED_KINDS[kind].name) != 0; kind++);
+		if (kind == NUM_BPRED_KINDS) {
+			return -1;
+		}
+		config->kind = kind;
+		token = strtok_r(NULL, ":", &save);
+	}
+	for (; token != NULL; token = strtok_r(NULL, ":", &save)) {
+		if (strncmp(token, "ras", 3) == 0) {
+			value = strtoul(token + 3, &end, 0);
+			if (token[3] == '\0' || *end != '\0' || value == 0 || value > BPRED_MAX_RAS) {
+				return -1;
+			}
+			config->ras_depth = value;
+			continue;
+		}
+		value = strtoul(token, &end, 0);
+		if (field > 2 || *end != '\0' || value > BPRED_MAX_ENTRIES) {
+			return -1;
+		}
+		field++;
+		if (field == 1) config->entries = value;
+		else if (field == 2) config->btb_entries = value;
+		else config->history_bits = value;
+	}
+	if (field == 0 || config->entries == 0 || (config->entries & (config->entries - 1)) != 0
+		|| config->btb_entries == 0 || (config->btb_entries & (config->btb_entries - 1)) != 0) {
+		return -1;
+	}
+	while ((1u << index_bits) < config->entries) {
+		index_bits++;
+	}
+	if (config->kind == BPRED_BIMODAL) {
+		config->history_bits = 0;
+	} else if (field < 3) {
+		config->history_bits = index_bits;
+	} else if (config->history_bits == 0 || config->history_bits > index_bits) {
+		return -1;
+	}
+	return 0;
+}
+
+
+/***************************************************************/
+/* Short name of a predictor, e.g. "gshare 4096 h12 btb256 ras16"          */
+/***************************************************************/
+void bpred_describe(const bpred_config_t *config, char *buf, size_t size)
+{
+	int n;
+
+	if (config->history_bits == 0) {
+		n = snprintf(buf, size, "%s %u btb%u", BPRED_KINDS[config->kind].name, config->entries, config->btb_entries);
+	} else {
+		n = snprintf(buf, size, "%s %u h%u btb%u", BPRED_KINDS[config->kind].name, config->entries,
+			config->history_bits, config->btb_entries);
+	}
+	if (config->ras_depth > 0 && n >= 0 && (size_t)n < size) {
+		snprintf(buf + n, size - n, " ras%u", config->ras_depth);
+	}
+}
+
+
+/***************************************************************/
+/* Allocate a cold predictor of the given kind and size                     */
+/***************************************************************/
+void bpred_init(bpred_t *bp, const bpred_config_t *config)
+{
+	int i;
+
+	memset(bp, 0, sizeof(bpred_t));
+	bp->config = *config;
+	bp->kind = &BPRED_KINDS[config->kind];
+	bp->index_mask = config->entries - 1;
+	bp->history_mask = (1u << config->history_bits) - 1;
+	for (i = 0; i < bp->kind->tables; i++) {
+		bp->counters[i] = malloc(config->entries);
+		assert(bp->counters[i] != NULL);
+	}
+	if (bp->kind->local) {
+		bp->local = malloc(config->entries * sizeof(uint32_t));
+		assert(bp->local != NULL);
+	}
+	if (bp->kind->chooser) {
+		bp->chooser = malloc(config->entries);
+		assert(bp->chooser != NULL);
+	}
+	bp->btb = malloc(config->btb_entries * sizeof(bpred_btb_entry_t));
+	assert(bp->btb != NULL);
+	if (config->ras_depth > 0) {
+		bp->ras = malloc(config->ras_depth * sizeof(uint32_t));
+		assert(bp->ras != NULL);
+	}
+	bpred_reset(bp);
+}
+
+
+void bpred_free(bpred_t *bp)
+{
+	free(bp->counters[0]);
+	free(bp->counters[1]);
+	free(bp->local);
+	free(bp->chooser);
+	free(bp->btb);
+	free(bp->ras);
+}
+
+
+/***************************************************************/
+/* Forget all history and zero the statistics: every counter weakly not    */
+/* taken, the chooser weakly for the local side, every BTB entry and the   */
+/* return address stack empty                                              */
+/***************************************************************/
+void bpred_reset(bpred_t *bp)
+{
+	uint32_t i;
+
+	for (i = 0; i < (uint32_t)bp->kind->tables; i++) {
+		memset(bp->counters[i], 1, bp->config.entries);
+	}
+	if (bp->local != NULL) {
+		memset(bp->local, 0, bp->config.entries * sizeof(uint32_t));
+	}
+	if (bp->chooser != NULL) {
+		memset(bp->chooser, 1, bp->config.entries);
+	}
+	bp->history = 0;
+	for (i = 0; i < bp->config.btb_entries; i++) {
+		bp->btb[i].pc = BPRED_BTB_INVALID;
+		bp->btb[i].target = 0;
+		bp->btb[i].conditional = 0;
+	}
+	if (bp->ras != NULL) {
+		memset(bp->ras, 0, bp->config.ras_depth * sizeof(uint32_t));
+	}
+	bp->ras_top = 0;
+	bp->ras_count = 0;
+	memset(&bp->stats, 0, sizeof(bpred_stats_t));
+}
+
+
+/***************************************************************/
+/* Which kind of control transfer an instruction is. JAL and JALR are      */
+/* calls and JR $ra a return; other jumps, JR included, go by the BTB.     */
+/***************************************************************/
+int bpred_classify(uint32_t instruction)
+{
+	uint32_t opcode = instruction >> 26, funct = instruction & 0x3F, rs = (instruction >> 21) & 0x1F;
+
+	if (opcode == 0x00) {
+		if (funct == 0x09) return BPRED_CALL;
+		if (funct == 0x08) return rs == 31 ? BPRED_RETURN : BPRED_JUMP;
+		return BPRED_OTHER;
+	}
+	if (opcode == 0x03) return BPRED_CALL;
+	if (opcode == 0x02) return BPRED_JUMP;
+	if (opcode >= 0x01 && opcode <= 0x07) return BPRED_CONDITIONAL;
+	return BPRED_OTHER;
+}
+
+
+/***************************************************************/
+/* Next fetch PC after the instruction at pc, predicted with the current    */
+/* global history. A call pushes its return address and a return pops it;   */
+/* otherwise only a BTB hit can redirect the fetch, so a branch is          */
+/* predicted not taken until it has been taken once. snapshot receives the  */
+/* state bpred_update() needs to train on the outcome, or to repair the     */
+/* stack if this fetch turns out to be on a wrong path's heels.             */
+/***************************************************************/
+uint32_t bpred_predict(bpred_t *bp, uint32_t pc, uint32_t instruction, bpred_snapshot_t *snapshot)
+{
+	const bpred_btb_entry_t *entry = &bp->btb[(pc >> 2) & (bp->config.btb_entries - 1)];
+	int type = bpred_classify(instruction);
+	uint32_t next = pc + 4;
+
+	snapshot->history = bp->history;
+	snapshot->ras_event = 0;
+	if (entry->pc == pc && !(entry->conditional && !bp->kind->predict(bp, pc, bp->history))) {
+		next = entry->target;
+	}
+	if (bp->ras != NULL && type == BPRED_CALL) {
+		/* full: the oldest return address is overwritten */
+		if (bp->ras_count == bp->config.ras_depth) {
+			snapshot->ras_event = BPRED_RAS_OVERFLOW;
+		} else {
+			bp->ras_count++;
+		}
+		bp->ras_top = (bp->ras_top + 1) % bp->config.ras_depth;
+		bp->ras[bp->ras_top] = pc + 4;
+	} else if (bp->ras != NULL && type == BPRED_RETURN) {
+		if (bp->ras_count == 0) {
+			snapshot->ras_event = BPRED_RAS_UNDERFLOW;
+		} else {
+			next = bp->ras[bp->ras_top];
+			bp->ras_top = (bp->ras_top + bp->config.ras_depth - 1) % bp->config.ras_depth;
+			bp->ras_count--;
+		}
+	}
+	snapshot->ras_top = bp->ras_top;
+	snapshot->ras_count = bp->ras_count;
+	snapshot->ras_value = bp->ras != NULL ? bp->ras[bp->ras_top] : 0;
+	return next;
+}
+
+
+/***************************************************************/
+/* Train on the branch or jump at pc, resolved as taken to target or not    */
+/* taken. predicted is the PC fetched after it and snapshot what           */
+/* bpred_predict() saw then, so the counter that predicted it learns. On a  */
+/* misprediction the instructions fetched after it are squashed, so the     */
+/* return address stack goes back to how this fetch left it.                */
+/***************************************************************/
+void bpred_update(bpred_t *bp, uint32_t pc, uint32_t instruction, int taken, uint32_t target, uint32_t predicted,
+	const bpred_snapshot_t *snapshot)
+{
+	bpred_btb_entry_t *entry = &bp->btb[(pc >> 2) & (bp->config.btb_entries - 1)];
+	int type = bpred_classify(instruction), conditional = type == BPRED_CONDITIONAL;
+	int mispredicted = predicted != (taken ? target : pc + 4);
+
+	bp->stats.predictions++;
+	bp->stats.mispredictions += mispredicted;
+	if (type == BPRED_RETURN) {
+		bp->stats.returns++;
+		bp->stats.return_mispredictions += mispredicted;
+	}
+	bp->stats.ras_overflows += snapshot->ras_event == BPRED_RAS_OVERFLOW;
+	bp->stats.ras_underflows += snapshot->ras_event == BPRED_RAS_UNDERFLOW;
+	if (mispredicted && bp->ras != NULL) {
+		/* a checkpoint written with a deeper stack may point past this one */
+		bp->ras_top = snapshot->ras_top % bp->config.ras_depth;
+		bp->ras_count = snapshot->ras_count < bp->config.ras_depth ? snapshot->ras_count : bp->config.ras_depth;
+		bp->ras[bp->ras_top] = snapshot->ras_value;
+	}
+	if (conditional) {
+		bp->kind->update(bp, pc, snapshot->history, taken);
+		bp->history = (bp->history << 1) | (taken != 0);
+	}
+	/* not-taken branches are left out of the BTB: falling through needs no target */
+	if (taken) {
+		if (entry->pc != pc || entry->target != target) {
+			bp->stats.btb_misses++;
+			entry->pc = pc;
+			entry->target = target;
+		}
+		entry->conditional = conditional;
+	}
+}
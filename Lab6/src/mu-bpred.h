@@ -0,0 +1,96 @@
+/******************************************************************************/
+/* BRANCH PREDICTORS: consulted by IF() for every fetch, trained by EX()     */
+/* with each resolved branch and jump. A BTB supplies targets; a direction  */
+/* predictor, picked from BPRED_KINDS, decides whether a BTB hit on a       */
+/* conditional branch redirects the fetch. An optional return address       */
+/* stack predicts JR $ra from the calls fetched before it.                   */
+/******************************************************************************/
+#define BPRED_MAX_PREDICTORS 8
+#define BPRED_MAX_ENTRIES (1 << 20)
+#define BPRED_DEFAULT_BTB 256
+#define BPRED_MAX_RAS 1024
+#define BPRED_BTB_INVALID 1 //never equal to an instruction address
+
+/* what bpred_classify() makes of an instruction */
+enum { BPRED_OTHER, BPRED_CONDITIONAL, BPRED_JUMP, BPRED_CALL, BPRED_RETURN };
+
+/* bpred_snapshot_t.ras_event */
+#define BPRED_RAS_OVERFLOW  1 //a call pushed out the oldest return address
+#define BPRED_RAS_UNDERFLOW 2 //a return found the stack empty and fell back on the BTB
+
+enum { BPRED_BIMODAL, BPRED_GSHARE, BPRED_LOCAL, BPRED_TOURNAMENT, NUM_BPRED_KINDS };
+
+typedef struct {
+  int kind;               //BPRED_BIMODAL ... BPRED_TOURNAMENT
+  uint32_t entries;       //2-bit counters per table, power of two
+  uint32_t btb_entries;   //direct-mapped, power of two
+  uint32_t history_bits;  //global or local history length, at most log2(entries); 0 for bimodal
+  uint32_t ras_depth;     //return address stack entries, 0 for none
+} bpred_config_t;
+
+typedef struct {
+  uint64_t predictions;     //branches and jumps resolved
+  uint64_t mispredictions;  //of those, fetched past at the wrong PC
+  uint64_t btb_misses;      //taken ones whose target the BTB did not hold
+  uint64_t returns;         //JR $ra resolved
+  uint64_t return_mispredictions;
+  uint64_t ras_overflows;
+  uint64_t ras_underflows;
+} bpred_stats_t;
+
+/* taken at fetch and carried down the pipeline latches with the instruction */
+typedef struct {
+  uint32_t history;       //global history the fetch was predicted with
+  uint32_t ras_top;       //return address stack right after the fetch:
+  uint32_t ras_count;     //  top, depth in use and the top entry, which
+  uint32_t ras_value;     //  is all a wrong path can clobber before repair
+  uint32_t ras_event;     //BPRED_RAS_OVERFLOW, BPRED_RAS_UNDERFLOW or 0
+} bpred_snapshot_t;
+
+typedef struct {
+  uint32_t pc;            //tag, BPRED_BTB_INVALID when empty
+  uint32_t target;
+  uint32_t conditional;   //ask the direction predictor; jumps are always taken
+} bpred_btb_entry_t;
+
+typedef struct Branch_Predictor_Struct bpred_t;
+
+/* a direction predictor: history is the global history to predict or train with */
+typedef struct {
+  const char *name;
+  int tables;             //how many counter tables of config.entries it uses
+  int local;              //keeps a local history per branch
+  int chooser;            //picks one of two tables per branch
+  int (*predict)(const bpred_t *bp, uint32_t pc, uint32_t history);
+  void (*update)(bpred_t *bp, uint32_t pc, uint32_t history, int taken);
+} bpred_kind_t;
+
+struct Branch_Predictor_Struct {
+  bpred_config_t config;
+  const bpred_kind_t *kind;
+  uint32_t index_mask;    //entries - 1
+  uint32_t history_mask;  //(1 << history_bits) - 1
+  uint8_t *counters[2];   //0-1 predict not taken, 2-3 taken
+  uint32_t *local;        //local histories, entries of them
+  uint8_t *chooser;       //tournament: 0-1 trust the local side, 2-3 the global one
+  uint32_t history;       //outcomes of the last conditional branches resolved, newest in bit 0
+  bpred_btb_entry_t *btb;
+  uint32_t *ras;          //return addresses, a circular stack of ras_depth
+  uint32_t ras_top;       //index of the newest entry
+  uint32_t ras_count;     //entries in use, at most ras_depth
+  bpred_stats_t stats;
+};
+
+extern const bpred_kind_t BPRED_KINDS[NUM_BPRED_KINDS];
+
+
+/* mu-bpred.c */
+int bpred_parse_config(const char *spec, bpred_config_t *config);
+void bpred_describe(const bpred_config_t *config, char *buf, size_t size);
+void bpred_init(bpred_t *bp, const bpred_config_t *config);
+void bpred_free(bpred_t *bp);
+void bpred_reset(bpred_t *bp);
+int bpred_classify(uint32_t instruction);
+uint32_t bpred_predict(bpred_t *bp, uint32_t pc, uint32_t instruction, bpred_snapshot_t *snapshot);
+void bpred_update(bpred_t *bp, uint32_t pc, uint32_t instruction, int taken, uint32_t target, uint32_t predicted,
+  const bpred_snapshot_t *snapshot);
@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "mu-mips.h"
+
+/***************************************************************/
+/* Parse a cache model "<sets>:<ways>:<block bytes>[:lru|fifo|random][:wa|nwa][:<miss penalty>]"; */
+/* returns 0 on success. Defaults are LRU, write-allocate and the L1Cache miss stall.       */
+/***************************************************************/
+int cache_parse_config(const char *spec, cache_config_t *config)
+{
+	char buf[128], *token, *save, *end;
+	int field = 0;
+	unsigned long value;
+
+	memset(config, 0, sizeof(cache_config_t));
+	config->policy = CACHE_LRU;
+	config->write_allocate = TRUE;
+	config->miss_penalty = CACHE_DEFAULT_PENALTY;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	for (token = strtok_r(buf, ":", &save); token != NULL; token = strtok_r(NULL, ":", &save), field++) {
+		if (field < 3) {
+			value = strtoul(token, &end, 0);
+			if (*end != '\0' || value == 0 || value > (1 << 20)) {
+				return -1;
+			}
+			if (field == 0) config->sets = value;
+			else if (field == 1) config->ways = value;
+			else config->block_bytes = value;
+		} else if (strcmp(token, "lru") == 0) {
+			config->policy = CACHE_LRU;
+		} else if (strcmp(token, "fifo") == 0) {
+			config->policy = CACHE_FIFO;
+		} else if (strcmp(token, "random") == 0) {
+			config->policy = CACHE_RANDOM;
+		} else if (strcmp(token, "wa") == 0) {
+			config->write_allocate = TRUE;
+		} else if (strcmp(token, "nwa") == 0) {
+			config->write_allocate = FALSE;
+		} else {
+			config->miss_penalty = strtoul(token, &end, 0);
+			if (*end != '\0') {
+				return -1;
+			}
+		}
+	}
+	if (field < 3 || (config->sets & (config->sets - 1)) != 0 || config->block_bytes < 4
+		|| (config->block_bytes & (config->block_bytes - 1)) != 0 || config->ways > 256) {
+		return -1;
+	}
+	return 0;
+}
+
+
+/***************************************************************/
+/* Short name of a cache model, e.g. "16x2x16B lru wa p100"                 */
+/***************************************************************/
+void cache_model_describe(const cache_config_t *config, char *buf, size_t size)
+{
+	static const char *policies[] = { "lru", "fifo", "random" };
+
+	snprintf(buf, size, "%ux%ux%uB %s %s p%u", config->sets, config->ways, config->block_bytes,
+		policies[config->policy], config->write_allocate ? "wa" : "nwa", config->miss_penalty);
+}
+
+
+/***************************************************************/
+/* Allocate an empty model of the given geometry                            */
+/***************************************************************/
+void cache_model_init(cache_model_t *model, const cache_config_t *config)
+{
+	memset(model, 0, sizeof(cache_model_t));
+	model->config = *config;
+	while ((1u << model->offset_bits) < config->block_bytes) {
+		model->offset_bits++;
+	}
+	model->set_mask = config->sets - 1;
+	model->tags = calloc(config->sets * config->ways, sizeof(uint32_t));
+	model->stamps = calloc(config->sets * config->ways, sizeof(uint64_t));
+	assert(model->tags != NULL && model->stamps != NULL);
+	model->random = 2463534242u;
+}
+
+
+void cache_model_free(cache_model_t *model)
+{
+	free(model->tags);
+	free(model->stamps);
+}
+
+
+/***************************************************************/
+/* Empty the model and zero its counters                                    */
+/***************************************************************/
+void cache_model_reset(cache_model_t *model)
+{
+	memset(model->tags, 0, model->config.sets * model->config.ways * sizeof(uint32_t));
+	memset(model->stamps, 0, model->config.sets * model->config.ways * sizeof(uint64_t));
+	memset(&model->stats, 0, sizeof(cache_stats_t));
+	model->clock = 0;
+	model->random = 2463534242u;
+}
+
+
+/***************************************************************/
+/* One data reference. Models keep tags only: the data always comes from    */
+/* L1Cache and memory, so they never change results.                        */
+/***************************************************************/
+static inline void cache_model_reference(cache_model_t *model, uint32_t address, int store)
+{
+	uint32_t block, *tags, ways, w, victim;
+	uint64_t *stamps;
+
+	ways = model->config.ways;
+	block = address >> model->offset_bits;
+	tags = &model->tags[(block & model->set_mask) * ways];
+	stamps = &model->stamps[(block & model->set_mask) * ways];
+	block |= CACHE_TAG_VALID;
+	model->clock++;
+
+	for (w = 0; w < ways && tags[w] != block; w++);
+	if (w < ways) {
+		model->stats.hits++;
+		if (model->config.policy == CACHE_LRU) {
+			stamps[w] = model->clock;
+		}
+		return;
+	}
+
+	model->stats.misses++;
+	/* a store that does not allocate goes straight to the write buffer */
+	if (store && !model->config.write_allocate) {
+		return;
+	}
+	model->stats.stall_cycles += model->config.miss_penalty;
+
+	for (victim = 0; victim < ways && tags[victim] != 0; victim++);
+	if (victim == ways) {
+		if (model->config.policy == CACHE_RANDOM) {
+			model->random ^= model->random << 13;
+			model->random ^= model->random >> 17;
+			model->random ^= model->random << 5;
+			victim = model->random % ways;
+		} else {
+			/* oldest use (LRU) or oldest fill (FIFO) */
+			for (victim = 0, w = 1; w < ways; w++) {
+				if (stamps[w] < stamps[victim]) {
+					victim = w;
+				}
+			}
+		}
+	}
+	tags[victim] = block;
+	stamps[victim] = model->clock;
+}
+
+
+void cache_model_access(cache_model_t *model, uint32_t address, int store)
+{
+	cache_model_reference(model, address, store);
+}
+
+
+/***************************************************************/
+/* Replay count references in order; stores[i] is nonzero for stores        */
+/***************************************************************/
+void cache_model_replay(cache_model_t *model, const uint32_t *addresses, const uint8_t *stores, uint32_t count)
+{
+	uint32_t *tags = model->tags, block, set, i;
+	uint64_t *stamps = model->stamps, clock = model->clock, misses = 0, stalls = 0;
+
+	if (model->config.ways != 1) {
+		for (i = 0; i < count; i++) {
+			cache_model_reference(model, addresses[i], stores[i]);
+		}
+		return;
+	}
+
+	/* direct-mapped: the only way is the victim and the policies agree */
+	for (i = 0; i < count; i++) {
+		block = (addresses[i] >> model->offset_bits) | CACHE_TAG_VALID;
+		set = block & model->set_mask;
+		clock++;
+		if (tags[set] == block) {
+			if (model->config.policy == CACHE_LRU) {
+				stamps[set] = clock;
+			}
+			continue;
+		}
+		misses++;
+		if (stores[i] && !model->config.write_allocate) {
+			continue;
+		}
+		stalls++;
+		tags[set] = block;
+		stamps[set] = clock;
+	}
+	model->stats.hits += count - misses;
+	model->stats.misses += misses;
+	model->stats.stall_cycles += stalls * model->config.miss_penalty;
+	model->clock = clock;
+}
@@ -20,18 +20,51 @@ typedef struct Cache_Struct {
   
 } Cache;
 
-//Write buffer
-uint32_t WRITE_BUFFER[4];
+/* the cache itself, the write buffer and the hit/miss counters live in sim_t */
+
 
 /***************************************************************/
-/* CACHE STATS                                                 */
+/* CACHE MODELS: tag-only caches fed the same load/store stream as L1Cache, */
+/* so one run can evaluate many geometries and policies at once            */
 /***************************************************************/
-uint32_t cache_misses; //need to initialize to 0 at the beginning of simulation start
-uint32_t cache_hits;   //need to initialize to 0 at the beginning of simulation start
+#define CACHE_MAX_MODELS 32
+#define CACHE_TAG_VALID 0x80000000 //set in every valid tag; block numbers never reach it
+#define CACHE_DEFAULT_PENALTY 100  //same as the MEM_STALL of an L1Cache miss
 
+enum { CACHE_LRU, CACHE_FIFO, CACHE_RANDOM };
+
+typedef struct {
+  uint32_t sets;          //power of two
+  uint32_t ways;
+  uint32_t block_bytes;   //power of two, at least 4
+  int policy;             //CACHE_LRU, CACHE_FIFO or CACHE_RANDOM
+  int write_allocate;     //store misses fill a block; otherwise they go around the cache
+  uint32_t miss_penalty;  //stall cycles charged per load miss and per allocating store miss
+} cache_config_t;
+
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t stall_cycles;
+} cache_stats_t;
+
+typedef struct {
+  cache_config_t config;
+  uint32_t offset_bits;
+  uint32_t set_mask;
+  uint32_t *tags;         //sets * ways, CACHE_TAG_VALID | block number
+  uint64_t *stamps;       //last use (LRU) or fill time (FIFO) of each way
+  uint64_t clock;
+  uint32_t random;        //xorshift state for CACHE_RANDOM
+  cache_stats_t stats;
+} cache_model_t;
 
-/***************************************************************/
-/* CACHE OBJECT                                                */
-/***************************************************************/
-Cache L1Cache; //need to use this in the simulator
 
+/* mu-cache.c */
+int cache_parse_config(const char *spec, cache_config_t *config);
+void cache_model_describe(const cache_config_t *config, char *buf, size_t size);
+void cache_model_init(cache_model_t *model, const cache_config_t *config);
+void cache_model_free(cache_model_t *model);
+void cache_model_reset(cache_model_t *model);
+void cache_model_access(cache_model_t *model, uint32_t address, int store);
+void cache_model_replay(cache_model_t *model, const uint32_t *addresses, const uint8_t *stores, uint32_t count);
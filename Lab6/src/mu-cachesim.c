@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "mu-mips.h"
+
+/******************************************************************************/
+/* Trace-driven cache simulator: replays the loads and stores of an           */
+/* instruction trace (mu-mips -r) through the L1Cache geometry and any -c    */
+/* models, without executing a single instruction.                           */
+/* Chunks decode in parallel; the models see the references in trace order.   */
+/******************************************************************************/
+#define CACHESIM_SLOTS 8
+#define CACHESIM_MAX_THREADS 8
+#define CACHESIM_MAX_MODELS (CACHE_MAX_MODELS + 1)
+
+/* the L1Cache of MEM(): 16 direct-mapped blocks of 4 words, store misses allocate */
+#define CACHESIM_L1_CONFIG "16:1:16:lru:wa:100"
+
+typedef struct {
+	uint32_t *addresses;
+	uint8_t *stores;
+	uint32_t count;		/* references */
+	uint32_t records;	/* instructions */
+	int64_t chunk;		/* chunk held, -1 while free */
+	int failed;
+} cachesim_slot_t;
+
+typedef struct {
+	const uint8_t *data;
+	size_t size;
+	size_t *offsets;	/* of each itrace_chunk_t */
+	uint32_t num_chunks;
+	cachesim_slot_t slots[CACHESIM_SLOTS];
+	uint32_t claimed;	/* next chunk to decode */
+	uint32_t replayed;	/* chunks the models have seen */
+	pthread_mutex_t lock;
+	pthread_cond_t decoded, freed;
+} cachesim_t;
+
+
+/***************************************************************/
+/* Index the chunks of a mapped trace; returns -1 if it is not one          */
+/***************************************************************/
+int cachesim_index(cachesim_t *cs)
+{
+	itrace_header_t header;
+	itrace_chunk_t chunk;
+	size_t offset = sizeof(itrace_header_t);
+	uint32_t capacity = 0;
+
+	if (cs->size < sizeof(header)) {
+		return -1;
+	}
+	memcpy(&header, cs->data, sizeof(header));
+	if (memcmp(header.magic, ITRACE_MAGIC, 4) != 0 || header.version != ITRACE_VERSION) {
+		return -1;
+	}
+	while (offset < cs->size) {
+		memcpy(&chunk, cs->data + offset, cs->size - offset < sizeof(chunk) ? cs->size - offset : sizeof(chunk));
+		if (cs->size - offset < sizeof(chunk) || chunk.compressed_size > cs->size - offset - sizeof(chunk)) {
+			/* a recording that was killed leaves its last chunk short */
+			printf("Warning: trace ends inside chunk %u; replaying the ones before it\n", cs->num_chunks);
+			break;
+		}
+		if (chunk.raw_size > ITRACE_CHUNK_SIZE) {
+			return -1;
+		}
+		if (cs->num_chunks == capacity) {
+			capacity = capacity ? 2 * capacity : 64;
+			cs->offsets = realloc(cs->offsets, capacity * sizeof(size_t));
+			assert(cs->offsets != NULL);
+		}
+		cs->offsets[cs->num_chunks++] = offset;
+		offset += sizeof(chunk) + chunk.compressed_size;
+	}
+	return 0;
+}
+
+
+/***************************************************************/
+/* Expand and decode one chunk into a slot                                  */
+/***************************************************************/
+void cachesim_decode(cachesim_t *cs, uint32_t k, cachesim_slot_t *slot, itrace_codec_t *codec, uint8_t *raw)
+{
+	itrace_chunk_t chunk;
+	const uint8_t *data = cs->data + cs->offsets[k];
+
+	memcpy(&chunk, data, sizeof(chunk));
+	slot->count = 0;
+	slot->records = 0;
+	slot->failed = itrace_decompress(data + sizeof(chunk), chunk.compressed_size, raw, chunk.raw_size) != chunk.raw_size;
+	if (slot->failed) {
+		return;
+	}
+	memset(raw + chunk.raw_size, 0, ITRACE_RECORD_MAX);
+	itrace_codec_init(codec);
+	slot->records = itrace_decode_refs(codec, raw, raw + chunk.raw_size, slot->addresses, slot->stores, &slot->count);
+	slot->failed = slot->records != chunk.records;
+}
+
+
+/***************************************************************/
+/* Decoder thread: claims chunks in order, at most CACHESIM_SLOTS ahead of  */
+/* the replay                                                               */
+/***************************************************************/
+void *cachesim_decoder_main(void *arg)
+{
+	cachesim_t *cs = arg;
+	itrace_codec_t *codec = malloc(sizeof(itrace_codec_t));
+	uint8_t *raw = malloc(ITRACE_CHUNK_SIZE + ITRACE_RECORD_MAX);
+	cachesim_slot_t *slot;
+	uint32_t k;
+
+	assert(codec != NULL && raw != NULL);
+	for (;;) {
+		pthread_mutex_lock(&cs->lock);
+		if (cs->claimed == cs->num_chunks) {
+			pthread_mutex_unlock(&cs->lock);
+			break;
+		}
+		k = cs->claimed++;
+		while (k >= cs->replayed + CACHESIM_SLOTS) {
+			pthread_cond_wait(&cs->freed, &cs->lock);
+		}
+		pthread_mutex_unlock(&cs->lock);
+
+		slot = &cs->slots[k % CACHESIM_SLOTS];
+		cachesim_decode(cs, k, slot, codec, raw);
+
+		pthread_mutex_lock(&cs->lock);
+		slot->chunk = k;
+		pthread_cond_broadcast(&cs->decoded);
+		pthread_mutex_unlock(&cs->lock);
+	}
+	free(codec);
+	free(raw);
+	return NULL;
+}
+
+
+void print_usage(const char *name)
+{
+	printf("Usage: %s <trace file> [-c <cache model>]... [-j <threads>]\n", name);
+	printf("       cache model: <sets>:<ways>:<block bytes>[:lru|fifo|random][:wa|nwa][:<miss penalty>]\n");
+	printf("       the L1Cache geometry (%s) is always model 0\n", CACHESIM_L1_CONFIG);
+}
+
+
+/***************************************************************/
+/* Replay a trace and print each model's hits, misses and stall cycles      */
+/***************************************************************/
+int main(int argc, char *argv[])
+{
+	cachesim_t cs;
+	cache_model_t models[CACHESIM_MAX_MODELS];
+	cache_config_t config;
+	pthread_t threads[CACHESIM_MAX_THREADS];
+	struct timespec start, stop;
+	struct stat st;
+	uint64_t instructions = 0, references = 0, stores = 0;
+	cachesim_slot_t *slot;
+	uint32_t k, j;
+	double seconds;
+	char desc[64];
+	int fd, i, num_models = 0, num_threads = 0, failed = 0;
+
+	if (argc < 2) {
+		print_usage(argv[0]);
+		return 1;
+	}
+	cache_parse_config(CACHESIM_L1_CONFIG, &config);
+	cache_model_init(&models[num_models++], &config);
+	for (i = 2; i < argc; i += 2) {
+		if (strcmp(argv[i], "-c") == 0 && i + 1 < argc && num_models < CACHESIM_MAX_MODELS
+			&& cache_parse_config(argv[i+1], &config) == 0) {
+			cache_model_init(&models[num_models++], &config);
+		} else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			num_threads = atoi(argv[i+1]);
+		} else {
+			printf("Error: Bad option %s\n", argv[i]);
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (num_threads <= 0) {
+		num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (num_threads < 1) num_threads = 1;
+	if (num_threads > CACHESIM_MAX_THREADS) num_threads = CACHESIM_MAX_THREADS;
+
+	memset(&cs, 0, sizeof(cs));
+	fd = open(argv[1], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		printf("Error: Can't open trace file %s\n", argv[1]);
+		return 1;
+	}
+	cs.size = st.st_size;
+	cs.data = cs.size ? mmap(NULL, cs.size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (cs.data == MAP_FAILED || cachesim_index(&cs) != 0) {
+		printf("Error: %s is not an instruction trace\n", argv[1]);
+		return 1;
+	}
+	madvise((void *)cs.data, cs.size, MADV_SEQUENTIAL);
+
+	for (k = 0; k < CACHESIM_SLOTS; k++) {
+		cs.slots[k].addresses = malloc((ITRACE_CHUNK_SIZE + ITRACE_RECORD_MAX) * sizeof(uint32_t));
+		cs.slots[k].stores = malloc(ITRACE_CHUNK_SIZE + ITRACE_RECORD_MAX);
+		cs.slots[k].chunk = -1;
+		assert(cs.slots[k].addresses != NULL && cs.slots[k].stores != NULL);
+	}
+	pthread_mutex_init(&cs.lock, NULL);
+	pthread_cond_init(&cs.decoded, NULL);
+	pthread_cond_init(&cs.freed, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < num_threads; i++) {
+		pthread_create(&threads[i], NULL, cachesim_decoder_main, &cs);
+	}
+	for (k = 0; k < cs.num_chunks; k++) {
+		slot = &cs.slots[k % CACHESIM_SLOTS];
+		pthread_mutex_lock(&cs.lock);
+		while (slot->chunk != (int64_t)k) {
+			pthread_cond_wait(&cs.decoded, &cs.lock);
+		}
+		pthread_mutex_unlock(&cs.lock);
+
+		if (slot->failed) {
+			printf("Error: chunk %u of %s is corrupt; stopping there\n", k, argv[1]);
+			failed = 1;
+		} else {
+			instructions += slot->records;
+			for (j = 0; j < slot->count; j++) {
+				stores += slot->stores[j] != 0;
+			}
+			references += slot->count;
+			for (i = 0; i < num_models; i++) {
+				cache_model_replay(&models[i], slot->addresses, slot->stores, slot->count);
+			}
+		}
+
+		pthread_mutex_lock(&cs.lock);
+		slot->chunk = -1;
+		cs.replayed++;
+		if (failed) {
+			cs.claimed = cs.num_chunks;	/* decoders stop taking chunks */
+			cs.replayed += CACHESIM_SLOTS;	/* and none waits for a slot */
+		}
+		pthread_cond_broadcast(&cs.freed);
+		pthread_mutex_unlock(&cs.lock);
+		if (failed) {
+			break;
+		}
+	}
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Trace %s: %llu instructions, %llu loads, %llu stores\n", argv[1],
+		(unsigned long long)instructions, (unsigned long long)(references - stores), (unsigned long long)stores);
+	for (i = 0; i < num_models; i++) {
+		cache_model_describe(&models[i].config, desc, sizeof(desc));
+		printf("%s %-24s | Hits: %llu Misses: %llu Stall cycles: %llu\n", i == 0 ? "L1Cache:" : "Model:  ", desc,
+			(unsigned long long)models[i].stats.hits, (unsigned long long)models[i].stats.misses,
+			(unsigned long long)models[i].stats.stall_cycles);
+	}
+	printf("Replayed %llu references through %d models in %.3f s (%.1f M references/s, %d decoder threads)\n",
+		(unsigned long long)references, num_models, seconds,
+		seconds > 0 ? references / seconds / 1e6 : 0.0, num_threads);
+
+	for (i = 0; i < num_models; i++) {
+		cache_model_free(&models[i]);
+	}
+	for (k = 0; k < CACHESIM_SLOTS; k++) {
+		free(cs.slots[k].addresses);
+		free(cs.slots[k].stores);
+	}
+	free(cs.offsets);
+	munmap((void *)cs.data, cs.size);
+	return failed;
+}
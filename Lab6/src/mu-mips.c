@@ -3,9 +3,27 @@
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <math.h>
 
 #include "mu-mips.h"
-#include "mu-cache.h"
+
+const uint8_t MEM_ZERO_PAGE[MEM_PAGE_SIZE];
+
+/* copied into every simulator by sim_create() */
+static const mem_region_t DEFAULT_MEM_REGIONS[NUM_MEM_REGION] = {
+	{ MEM_TEXT_BEGIN, MEM_TEXT_END },
+	{ MEM_DATA_BEGIN, MEM_DATA_END },
+	{ MEM_KDATA_BEGIN, MEM_KDATA_END },
+	{ MEM_KTEXT_BEGIN, MEM_KTEXT_END }
+};
+
+/* an empty pipeline register, for clearing latches */
+static const CPU_Pipeline_Reg Empty;
 
 /***************************************************************/
 /* Print out a list of commands available                                                                  */
@@ -17,6 +35,8 @@ void help() {
 	printf("run <n>\t-- simulate program for <n> instructions\n");
 	printf("rdump\t-- dump register values\n");
 	printf("reset\t-- clears all registers/memory and re-loads the program\n");
+	printf("checkpoint <file>\t-- save the complete simulator state to <file>\n");
+	printf("restore <file>\t-- continue from the state saved in <file>\n");
 	printf("input <reg> <val>\t-- set GPR <reg> to <val>\n");
 	printf("mdump <start> <stop>\t-- dump memory from <start> to <stop> address\n");
 	printf("high <val>\t-- set the HI register to <val>\n");
@@ -24,104 +44,2001 @@ void help() {
 	printf("print\t-- print the program loaded into memory\n");
 	printf("show\t-- print the current content of the pipeline registers\n");
 	printf("?\t-- display help menu\n");
-	printf("f <0/1>\t-- enable forwarding\n\n");
+	printf("f <0/1>\t-- enable forwarding\n");
+	printf("e <0/1>\t-- resolve branches and jumps in ID instead of EX\n");
+	printf("d <0/1>\t-- run the instruction after each branch and jump (delay slots)\n");
+	printf("ff <n>\t-- execute <n> instructions functionally, then continue in the pipeline\n");
+	printf("trace <0-3>\t-- trace off, summary, instructions, stages\n\n");
 	printf("quit\t-- exit the simulator\n\n");
 	printf("------------------------------------------------------------------\n\n");
 }
 
 
 /***************************************************************/
-/* Read a 32-bit word from memory                                                                            */
+/* Send trace output to path (stdout when NULL) through a large buffer */
+/***************************************************************/
+void trace_open(sim_t *sim, const char *path)
+{
+	sim->TRACE_SINK = path == NULL ? stdout : fopen(path, "w");
+	if (sim->TRACE_SINK == NULL) {
+		printf("Error: Can't open trace file %s\n", path);
+		exit(1);
+	}
+	setvbuf(sim->TRACE_SINK, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+}
+
+
+/***************************************************************/
+/* Map a program file; the mapping is read-only and can back any number of simulators */
+/***************************************************************/
+program_t *program_open(const char *path)
+{
+	program_t *program;
+	struct stat st;
+	int fd;
+
+	program = calloc(1, sizeof(program_t));
+	assert(program != NULL);
+	strncpy(program->path, path, sizeof(program->path) - 1);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		printf("Error: Can't open program file %s\n", path);
+		exit(-1);
+	}
+	program->size = st.st_size;
+	if (program->size > 0) {
+		program->data = mmap(NULL, program->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (program->data == MAP_FAILED) {
+			printf("Error: Can't map program file %s\n", path);
+			exit(-1);
+		}
+	}
+	close(fd);
+	return program;
+}
+
+
+/***************************************************************/
+/* Unmap a program no simulator uses any more                                */
+/***************************************************************/
+void program_close(program_t *program)
+{
+	if (program->data != NULL) {
+		munmap((void *)program->data, program->size);
+	}
+	free(program);
+}
+
+
+/***************************************************************/
+/* Create a simulator for program; initialize() and load_program() it next   */
+/***************************************************************/
+sim_t *sim_create(const program_t *program)
+{
+	sim_t *sim = calloc(1, sizeof(sim_t));
+	assert(sim != NULL);
+	memcpy(sim->MEM_REGIONS, DEFAULT_MEM_REGIONS, sizeof(DEFAULT_MEM_REGIONS));
+	sim->program = program;
+	sim->TRACE_SINK = stdout;
+	sim->TRACE_LEVEL = TRACE_MAX;
+	return sim;
+}
+
+
+/***************************************************************/
+/* Free a simulator and all of its guest memory                              */
+/***************************************************************/
+void sim_destroy(sim_t *sim)
+{
+	uint32_t i;
+
+	mem_clear(sim);
+	for (i = 0; i < (1 << MEM_L1_BITS); i++) {
+		free(sim->MEM_PAGE_TABLE[i]);
+	}
+	free(sim->MEM_PAGE_LIST);
+	free(sim->DECODED);
+	for (i = 0; i < (uint32_t)sim->NUM_CACHE_MODELS; i++) {
+		cache_model_free(&sim->CACHE_MODELS[i]);
+	}
+	free(sim->CACHE_MODELS);
+	for (i = 0; i < (uint32_t)sim->NUM_BPRED; i++) {
+		bpred_free(&sim->BPRED[i]);
+	}
+	free(sim->BPRED);
+	if (sim->TRACE_SINK != stdout) {
+		fclose(sim->TRACE_SINK);
+	} else {
+		fflush(stdout);
+	}
+	free(sim);
+}
+
+
 /***************************************************************/
-uint32_t mem_read_32(uint32_t address)
+/* Return the host page backing address for reading (never NULL)             */
+/***************************************************************/
+const uint8_t *mem_page_read(sim_t *sim, uint32_t address)
+{
+	mem_page_table_t *table = sim->MEM_PAGE_TABLE[MEM_L1_INDEX(address)];
+	if (table == NULL || table->pages[MEM_L2_INDEX(address)] == NULL) {
+		return MEM_ZERO_PAGE;
+	}
+	return table->pages[MEM_L2_INDEX(address)];
+}
+
+
+/***************************************************************/
+/* Return the host page backing address for writing, allocating it on      */
+/* first touch. Returns NULL for addresses outside every memory region.     */
+/***************************************************************/
+uint8_t *mem_page_write(sim_t *sim, uint32_t address)
 {
 	int i;
+	mem_page_table_t *table = sim->MEM_PAGE_TABLE[MEM_L1_INDEX(address)];
+	uint8_t **page;
+
+	if (table != NULL && table->pages[MEM_L2_INDEX(address)] != NULL) {
+		return table->pages[MEM_L2_INDEX(address)];
+	}
 	for (i = 0; i < NUM_MEM_REGION; i++) {
-		if ( (address >= MEM_REGIONS[i].begin) &&  ( address <= MEM_REGIONS[i].end) ) {
-			uint32_t offset = address - MEM_REGIONS[i].begin;
-			return (MEM_REGIONS[i].mem[offset+3] << 24) |
-					(MEM_REGIONS[i].mem[offset+2] << 16) |
-					(MEM_REGIONS[i].mem[offset+1] <<  8) |
-					(MEM_REGIONS[i].mem[offset+0] <<  0);
+		if ( (address >= sim->MEM_REGIONS[i].begin) && (address <= sim->MEM_REGIONS[i].end) ) {
+			break;
 		}
 	}
-	return 0;
+	if (i == NUM_MEM_REGION) {
+		return NULL;
+	}
+	if (table == NULL) {
+		table = calloc(1, sizeof(mem_page_table_t));
+		assert(table != NULL);
+		sim->MEM_PAGE_TABLE[MEM_L1_INDEX(address)] = table;
+	}
+	page = &table->pages[MEM_L2_INDEX(address)];
+	*page = calloc(1, MEM_PAGE_SIZE);
+	assert(*page != NULL);
+	/* the read TLB may still map this page to the zero page */
+	sim->MEM_READ_TLB[MEM_TLB_INDEX(address)].tag = MEM_TLB_INVALID;
+	if (sim->MEM_PAGES_ALLOCATED == sim->MEM_PAGE_LIST_SIZE) {
+		sim->MEM_PAGE_LIST_SIZE = sim->MEM_PAGE_LIST_SIZE ? 2 * sim->MEM_PAGE_LIST_SIZE : 64;
+		sim->MEM_PAGE_LIST = realloc(sim->MEM_PAGE_LIST, sim->MEM_PAGE_LIST_SIZE * sizeof(uint32_t));
+		assert(sim->MEM_PAGE_LIST != NULL);
+	}
+	sim->MEM_PAGE_LIST[sim->MEM_PAGES_ALLOCATED++] = address & ~MEM_PAGE_MASK;
+	return *page;
 }
 
 
 /***************************************************************/
-/* Write a 32-bit word to memory                                                                                */
+/* Invalidate every software TLB entry                                       */
 /***************************************************************/
-void mem_write_32(uint32_t address, uint32_t value)
+void mem_tlb_flush(sim_t *sim)
 {
 	int i;
-	uint32_t offset;
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		if ( (address >= MEM_REGIONS[i].begin) && (address <= MEM_REGIONS[i].end) ) {
-			offset = address - MEM_REGIONS[i].begin;
+	for (i = 0; i < MEM_TLB_SIZE; i++) {
+		sim->MEM_READ_TLB[i].tag = MEM_TLB_INVALID;
+		sim->MEM_WRITE_TLB[i].tag = MEM_TLB_INVALID;
+	}
+}
+
+
+/***************************************************************/
+/* Translate address to a host page through the TLBs                         */
+/***************************************************************/
+static inline const uint8_t *mem_tlb_read(sim_t *sim, uint32_t address)
+{
+	mem_read_tlb_t *entry = &sim->MEM_READ_TLB[MEM_TLB_INDEX(address)];
+	if (entry->tag != (address & ~MEM_PAGE_MASK)) {
+		entry->tag = address & ~MEM_PAGE_MASK;
+		entry->page = mem_page_read(sim, address);
+	}
+	return entry->page;
+}
 
-			MEM_REGIONS[i].mem[offset+3] = (value >> 24) & 0xFF;
-			MEM_REGIONS[i].mem[offset+2] = (value >> 16) & 0xFF;
-			MEM_REGIONS[i].mem[offset+1] = (value >>  8) & 0xFF;
-			MEM_REGIONS[i].mem[offset+0] = (value >>  0) & 0xFF;
+
+static inline uint8_t *mem_tlb_write(sim_t *sim, uint32_t address)
+{
+	mem_write_tlb_t *entry = &sim->MEM_WRITE_TLB[MEM_TLB_INDEX(address)];
+	if (entry->tag != (address & ~MEM_PAGE_MASK)) {
+		uint8_t *page = mem_page_write(sim, address);
+		if (page == NULL) {
+			return NULL;
 		}
+		entry->tag = address & ~MEM_PAGE_MASK;
+		entry->page = page;
 	}
+	return entry->page;
 }
 
 
 /***************************************************************/
-/* Execute one cycle                                                                                                              */
+/* Read a byte from memory                                                   */
 /***************************************************************/
-void cycle() {                                                
-	handle_pipeline();
-	CURRENT_STATE = NEXT_STATE;
-	CYCLE_COUNT++;
+uint8_t mem_read_8(sim_t *sim, uint32_t address)
+{
+	return mem_tlb_read(sim, address)[address & MEM_PAGE_MASK];
 }
 
 
 /***************************************************************/
-/* Simulate MIPS for n cycles                                                                                       */
+/* Read a 16-bit halfword from memory                                        */
 /***************************************************************/
-void run(int num_cycles) {                                      
-	
-	if (RUN_FLAG == FALSE) {
-		printf("Simulation Stopped\n\n");
+uint16_t mem_read_16(sim_t *sim, uint32_t address)
+{
+	uint16_t value;
+	if ((address & MEM_PAGE_MASK) > MEM_PAGE_SIZE - 2) {
+		/* halfword straddles two pages */
+		return mem_read_8(sim, address) | (mem_read_8(sim, address + 1) << 8);
+	}
+	memcpy(&value, mem_tlb_read(sim, address) + (address & MEM_PAGE_MASK), 2);
+	return MEM_LE16(value);
+}
+
+
+/***************************************************************/
+/* Read a 32-bit word from memory                                                                            */
+/***************************************************************/
+uint32_t mem_read_32(sim_t *sim, uint32_t address)
+{
+	uint32_t value;
+	if ((address & MEM_PAGE_MASK) > MEM_PAGE_SIZE - 4) {
+		/* word straddles two pages */
+		return mem_read_16(sim, address) | (mem_read_16(sim, address + 2) << 16);
+	}
+	memcpy(&value, mem_tlb_read(sim, address) + (address & MEM_PAGE_MASK), 4);
+	return MEM_LE32(value);
+}
+
+
+/***************************************************************/
+/* Write a byte to memory                                                    */
+/***************************************************************/
+void mem_write_8(sim_t *sim, uint32_t address, uint8_t value)
+{
+	uint8_t *page = mem_tlb_write(sim, address);
+	if (page != NULL) {
+		page[address & MEM_PAGE_MASK] = value;
+	}
+	if (address - MEM_TEXT_BEGIN < sim->DECODED_SIZE << 2) {
+		decode_invalidate(sim, address, 1);
+	}
+}
+
+
+/***************************************************************/
+/* Write a 16-bit halfword to memory                                         */
+/***************************************************************/
+void mem_write_16(sim_t *sim, uint32_t address, uint16_t value)
+{
+	uint8_t *page;
+	if ((address & MEM_PAGE_MASK) > MEM_PAGE_SIZE - 2) {
+		/* halfword straddles two pages */
+		mem_write_8(sim, address, value & 0xFF);
+		mem_write_8(sim, address + 1, value >> 8);
 		return;
 	}
+	page = mem_tlb_write(sim, address);
+	if (page != NULL) {
+		value = MEM_LE16(value);
+		memcpy(page + (address & MEM_PAGE_MASK), &value, 2);
+	}
+	if (address - MEM_TEXT_BEGIN < sim->DECODED_SIZE << 2) {
+		decode_invalidate(sim, address, 2);
+	}
+}
 
-	printf("Running simulator for %d cycles...\n\n", num_cycles);
-	int i;
-	for (i = 0; i < num_cycles; i++) {
-		if (RUN_FLAG == FALSE) {
-			printf("Simulation Stopped.\n\n");
-			break;
+
+/***************************************************************/
+/* Write a 32-bit word to memory                                                                                */
+/***************************************************************/
+void mem_write_32(sim_t *sim, uint32_t address, uint32_t value)
+{
+	uint8_t *page;
+	if ((address & MEM_PAGE_MASK) > MEM_PAGE_SIZE - 4) {
+		/* word straddles two pages */
+		mem_write_16(sim, address, value & 0xFFFF);
+		mem_write_16(sim, address + 2, value >> 16);
+		return;
+	}
+	page = mem_tlb_write(sim, address);
+	if (page != NULL) {
+		value = MEM_LE32(value);
+		memcpy(page + (address & MEM_PAGE_MASK), &value, 4);
+	}
+	if (address - MEM_TEXT_BEGIN < sim->DECODED_SIZE << 2) {
+		decode_invalidate(sim, address, 4);
+	}
+}
+
+
+/***************************************************************/
+/* Release every allocated page; cost is proportional to the pages the      */
+/* program actually wrote, not to the size of the address space.            */
+/***************************************************************/
+void mem_clear(sim_t *sim)
+{
+	uint32_t i, address;
+	mem_page_table_t *table;
+	for (i = 0; i < sim->MEM_PAGES_ALLOCATED; i++) {
+		address = sim->MEM_PAGE_LIST[i];
+		table = sim->MEM_PAGE_TABLE[MEM_L1_INDEX(address)];
+		free(table->pages[MEM_L2_INDEX(address)]);
+		table->pages[MEM_L2_INDEX(address)] = NULL;
+	}
+	sim->MEM_PAGES_ALLOCATED = 0;
+	mem_tlb_flush(sim);
+}
+
+
+/***************************************************************/
+/* Execute one cycle                                                                                                              */
+/***************************************************************/
+void cycle(sim_t *sim) {                                                
+	handle_pipeline(sim);
+	sim->CURRENT_STATE = sim->NEXT_STATE;
+	sim->CYCLE_COUNT++;
+}
+
+
+/***************************************************************/
+/* ID_EX, EX_MEM and MEM_WB hold bubbles that one more cycle leaves as they */
+/* are: ID's bubble, EX's SLL of it, MEM's copy of that                     */
+/***************************************************************/
+static inline int pipeline_drained(const sim_t *sim)
+{
+	const CPU_Pipeline_Reg *id = &sim->ID_EX, *ex = &sim->EX_MEM, *mem = &sim->MEM_WB;
+
+	return id->IR == 0 && id->PC == 0 && id->A == 0 && id->B == 0 && id->D == 0
+		&& id->rs == 0 && id->rt == 0 && id->rd == 0 && id->imm == 0
+		&& ex->IR == 0 && ex->PC == 0 && ex->D == 0 && ex->rs == 0 && ex->rt == 0 && ex->rd == 0
+		&& ex->ALUOutput == 0 && ex->RegWrite == id->RegWrite
+		&& mem->IR == 0 && mem->PC == 0 && mem->D == 0 && mem->rs == 0 && mem->rt == 0 && mem->rd == 0
+		&& mem->ALUOutput == 0 && mem->RegWrite == ex->RegWrite && mem->A == ex->A && mem->B == ex->B;
+}
+
+
+/***************************************************************/
+/* Number of upcoming cycles in which nothing but a countdown changes, so   */
+/* they can be applied at once by pipeline_skip(). A unit that counts down  */
+/* a fixed latency adds its idle condition here and its countdown there.    */
+/***************************************************************/
+uint32_t pipeline_idle_cycles(sim_t *sim)
+{
+	/* memory stall after its first cycle: WB retires the empty latch, MEM counts down, */
+	/* EX/ID/IF wait. The cycle that reaches zero resumes the stages, so leave it to cycle(). */
+	if (sim->MEM_STALL > 1 && sim->MEM_FLAG == 1 && sim->WB_FLAG == 1
+		&& memcmp(&sim->MEM_WB, &Empty, sizeof(Empty)) == 0) {
+		return sim->MEM_STALL - 1;
+	}
+	/* ID waiting for a functional unit once its bubbles fill EX, MEM and WB: */
+	/* every stage redoes the same bubble and IF counts STALL_COUNT down      */
+	if (sim->STALL_COUNT > 1 && sim->MEM_STALL == 0 && sim->BRANCH_FLAG == 0
+		&& sim->ID_FLAG == 1 && sim->EX_FLAG == 1 && sim->MEM_FLAG == 1 && sim->WB_FLAG == 1
+		&& pipeline_drained(sim)) {
+		return sim->STALL_COUNT - 1;
+	}
+	return 0;
+}
+
+
+/***************************************************************/
+/* Apply n idle cycles (at most pipeline_idle_cycles()) exactly as cycle() would */
+/***************************************************************/
+void pipeline_skip(sim_t *sim, uint32_t n)
+{
+	uint32_t i;
+
+	if (sim->MEM_STALL > 0) {
+		if (TRACE_ON(TRACE_STAGE)) {
+			for (i = 1; i <= n; i++) {
+				fprintf(sim->TRACE_SINK, "\nMEM STALL: %d", sim->MEM_STALL - i);
+			}
+		}
+		sim->MEM_STALL -= n;
+	} else {
+		if (TRACE_ON(TRACE_STAGE)) {
+			for (i = 1; i <= n; i++) {
+				fprintf(sim->TRACE_SINK, "\nStalling!");
+			}
 		}
-		cycle();
+		sim->STALL_COUNT -= n;
 	}
+	/* what WB of the empty latch (an SLL to R0) leaves behind */
+	sim->NEXT_STATE.REGS[0] = 0;
+	sim->CURRENT_STATE = sim->NEXT_STATE;
+	sim->CYCLE_COUNT += n;
 }
 
 
 /***************************************************************/
-/* simulate to completion                                                                                               */
+/* Advance by one cycle, or by a run of idle cycles (at most limit, 0: no    */
+/* limit) in O(1). Returns the number of cycles advanced.                   */
 /***************************************************************/
-void runAll() {                                                     
-	if (RUN_FLAG == FALSE) {
-		printf("Simulation Stopped.\n\n");
-		return;
+uint32_t cycle_fast(sim_t *sim, uint32_t limit)
+{
+	uint32_t n = pipeline_idle_cycles(sim);
+
+	if (limit != 0 && n > limit) {
+		n = limit;
+	}
+	if (n == 0) {
+		cycle(sim);
+		return 1;
 	}
+	pipeline_skip(sim, n);
+	return n;
+}
 
-	printf("Simulation Started...\n\n");
-	while (RUN_FLAG){
-		cycle();
+
+/***************************************************************/
+/* Empty every pipeline latch and clear all hazard and stall state; the next */
+/* cycle fetches from CURRENT_STATE.PC                                       */
+/***************************************************************/
+void pipeline_flush(sim_t *sim)
+{
+	sim->IF_ID = sim->ID_EX_Prev = sim->ID_EX = sim->EX_MEM = sim->MEM_WB = Empty;
+	sim->ID_FLAG = sim->EX_FLAG = sim->MEM_FLAG = sim->WB_FLAG = 0;
+	sim->EX_HAZARD = sim->MEM_HAZARD = 0;
+	sim->STALL_COUNT = sim->MEM_STALL = sim->BRANCH_FLAG = 0;
+	sim->controlA = sim->controlB = 0;
+	sim->prev_op = 0;
+	memset(sim->FU_FREE, 0, sizeof(sim->FU_FREE));
+	sim->HILO_READY = 0;
+	sim->NEXT_STATE = sim->CURRENT_STATE;
+}
+
+
+/* which unit each op occupies, and the names -l accepts */
+static const uint8_t FU_UNIT[NUM_OPS] = {
+	[OP_MULT] = FU_MULT, [OP_MULTU] = FU_MULT, [OP_DIV] = FU_DIV, [OP_DIVU] = FU_DIV
+};
+
+static const struct {
+	const char *name;
+	uint8_t op;
+} FU_OPS[] = {
+	{ "mult", OP_MULT }, { "multu", OP_MULTU }, { "div", OP_DIV }, { "divu", OP_DIVU },
+	{ "mthi", OP_MTHI }, { "mtlo", OP_MTLO },
+	{ "lb", OP_LB }, { "lh", OP_LH }, { "lw", OP_LW }, { "sb", OP_SB }, { "sh", OP_SH }, { "sw", OP_SW }
+};
+
+
+/***************************************************************/
+/* Parse "<op>:<latency>[:<interval>]", e.g. "div:35:35" for an unpipelined  */
+/* divider; the interval defaults to 1 (fully pipelined). Returns 0 on success. */
+/***************************************************************/
+int fu_parse_timing(const char *spec, fu_timing_t *timing)
+{
+	char name[16];
+	unsigned latency, interval = 1;
+	size_t i;
+	int n;
+
+	n = sscanf(spec, "%15[a-z]:%u:%u", name, &latency, &interval);
+	if (n < 2 || latency < 1 || latency > 255 || interval < 1 || interval > 255) {
+		return -1;
+	}
+	for (i = 0; i < sizeof(FU_OPS) / sizeof(FU_OPS[0]); i++) {
+		if (strcmp(name, FU_OPS[i].name) == 0) {
+			timing->op = FU_OPS[i].op;
+			timing->latency = latency;
+			timing->interval = interval;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+
+void fu_set_timing(sim_t *sim, const fu_timing_t *timing)
+{
+	sim->FU_LATENCY[timing->op] = timing->latency;
+	sim->FU_INTERVAL[timing->op] = timing->interval;
+}
+
+
+static inline int fu_writes_hilo(int op)
+{
+	return FU_UNIT[op] != FU_NONE || op == OP_MTHI || op == OP_MTLO;
+}
+
+
+/***************************************************************/
+/* Cycles op has to wait in ID so that it enters EX (next cycle at the      */
+/* earliest) with its unit free and HI/LO ready. HI/LO writes also finish   */
+/* in program order, so a short op never overtakes a long one.              */
+/***************************************************************/
+uint32_t fu_stall_cycles(sim_t *sim, int op)
+{
+	uint32_t issue = sim->CYCLE_COUNT + 1, ready = issue;
+	uint32_t latency = sim->FU_LATENCY[op] > 1 ? sim->FU_LATENCY[op] : 1;
+
+	if (FU_UNIT[op] != FU_NONE && sim->FU_FREE[FU_UNIT[op]] > ready) {
+		ready = sim->FU_FREE[FU_UNIT[op]];
+	}
+	if ((op == OP_MFHI || op == OP_MFLO) && sim->HILO_READY > ready) {
+		ready = sim->HILO_READY;
+	}
+	if (fu_writes_hilo(op) && sim->HILO_READY > ready + latency) {
+		ready = sim->HILO_READY - latency;
+	}
+	return ready - issue;
+}
+
+
+/***************************************************************/
+/* op enters EX this cycle: occupy its unit and schedule its HI/LO result  */
+/***************************************************************/
+void fu_issue(sim_t *sim, int op)
+{
+	if (FU_UNIT[op] != FU_NONE) {
+		sim->FU_FREE[FU_UNIT[op]] = sim->CYCLE_COUNT + (sim->FU_INTERVAL[op] > 1 ? sim->FU_INTERVAL[op] : 1);
+	}
+	if (fu_writes_hilo(op)) {
+		sim->HILO_READY = sim->CYCLE_COUNT + (sim->FU_LATENCY[op] > 1 ? sim->FU_LATENCY[op] : 1);
+	}
+}
+
+
+/************************************************************/
+/* The L1Cache block holding address, filled from memory on a miss like MEM */
+/* does it. The functional engine keeps L1Cache's contents (not its hit and */
+/* miss counts): a store where no memory region is lands only there, and a  */
+/* load reads it back for as long as the block stays, as in the pipeline.   */
+/************************************************************/
+static inline CacheBlock *functional_cache_block(sim_t *sim, uint32_t address)
+{
+	CacheBlock *block = &sim->L1Cache.blocks[(address & 0x000000F0) >> 4];
+	uint32_t tag = (address & 0xFFFFFF00) >> 8, i;
+
+	if (!block->valid || block->tag != tag) {
+		for (i = 0; i < WORD_PER_BLOCK; i++) {
+			block->words[i] = mem_read_32(sim, (address & 0xFFFFFFF0) + 4 * i);
+		}
+		block->tag = tag;
+		block->valid = 1;
+	}
+	return block;
+}
+
+
+/************************************************************/
+/* Execute one decoded instruction in place on CURRENT_STATE, with the results */
+/* EX, MEM and WB give it; returns the next PC. Like the pipeline, immediates  */
+/* of ADDI and of loads/stores are zero-extended, MULT keeps only the low word, */
+/* loads mask the aligned word, stores write the whole register and both go    */
+/* through L1Cache. With delay slots the next PC of a taken branch is still    */
+/* its target; functional_step() runs the slot first.                          */
+/************************************************************/
+uint32_t execute_functional(sim_t *sim, const decoded_inst_t *d, uint32_t pc)
+{
+	uint32_t *R = sim->CURRENT_STATE.REGS;
+	uint32_t link = pc + (sim->DELAY_SLOTS ? 8 : 4);
+	uint32_t target, address;
+	uint64_t product;
+
+	switch(d->op){
+		case OP_SLL:	R[d->rd] = R[d->rt] << d->sa; break;
+		case OP_SRL:	R[d->rd] = R[d->rt] >> d->sa; break;
+		case OP_SRA:	R[d->rd] = ~(~R[d->rt] >> d->sa); break;
+		case OP_JR:		return R[d->rs];
+		case OP_JALR:
+			target = R[d->rs];
+			R[31] = link;
+			R[d->rd] = link;
+			return target;
+		case OP_SYSCALL:
+			if (R[2] == 0xA) {
+				sim->RUN_FLAG = FALSE;
+			}
+			break;
+		case OP_MFHI:	R[d->rd] = sim->CURRENT_STATE.HI; break;
+		case OP_MTHI:	sim->CURRENT_STATE.HI = R[d->rs]; break;
+		case OP_MFLO:	R[d->rd] = sim->CURRENT_STATE.LO; break;
+		case OP_MTLO:	sim->CURRENT_STATE.LO = R[d->rs]; break;
+		case OP_MULT:
+			sim->CURRENT_STATE.LO = R[d->rs] * R[d->rt];
+			sim->CURRENT_STATE.HI = 0;
+			break;
+		case OP_MULTU:
+			product = (uint64_t)R[d->rs] * (uint64_t)R[d->rt];
+			sim->CURRENT_STATE.LO = product & 0xFFFFFFFF;
+			sim->CURRENT_STATE.HI = product >> 32;
+			break;
+		case OP_DIV:
+			if (R[d->rt] != 0) {
+				sim->CURRENT_STATE.LO = (int32_t)R[d->rs] / (int32_t)R[d->rt];
+				sim->CURRENT_STATE.HI = (int32_t)R[d->rs] % (int32_t)R[d->rt];
+			}
+			break;
+		case OP_DIVU:
+			if (R[d->rt] != 0) {
+				sim->CURRENT_STATE.LO = R[d->rs] / R[d->rt];
+				sim->CURRENT_STATE.HI = R[d->rs] % R[d->rt];
+			}
+			break;
+		case OP_ADD:
+		case OP_ADDU:	R[d->rd] = R[d->rs] + R[d->rt]; break;
+		case OP_SUB:
+		case OP_SUBU:	R[d->rd] = R[d->rs] - R[d->rt]; break;
+		case OP_AND:	R[d->rd] = R[d->rs] & R[d->rt]; break;
+		case OP_OR:		R[d->rd] = R[d->rs] | R[d->rt]; break;
+		case OP_XOR:	R[d->rd] = R[d->rs] ^ R[d->rt]; break;
+		case OP_NOR:	R[d->rd] = ~(R[d->rs] | R[d->rt]); break;
+		case OP_SLT:	R[d->rd] = R[d->rs] < R[d->rt] ? 1 : 0; break;
+		case OP_BLTZ:	return (R[d->rs] & 0x80000000) > 0 ? d->target : pc + 4;
+		case OP_BGEZ:	return (R[d->rs] & 0x80000000) == 0 ? d->target : pc + 4;
+		case OP_J:		return d->target;
+		case OP_JAL:
+			R[31] = link;
+			return d->target;
+		case OP_BEQ:	return R[d->rs] == R[d->rt] ? d->target : pc + 4;
+		case OP_BNE:	return R[d->rs] != R[d->rt] ? d->target : pc + 4;
+		case OP_BLEZ:	return (R[d->rs] & 0x80000000) > 0 || R[d->rs] == 0 ? d->target : pc + 4;
+		case OP_BGTZ:	return (R[d->rs] & 0x80000000) == 0 || R[d->rs] != 0 ? d->target : pc + 4;
+		case OP_ADDI:	R[d->rt] = R[d->rs] + d->uimm; break;
+		case OP_ADDIU:	R[d->rt] = R[d->rs] + d->imm; break;
+		case OP_SLTI:	R[d->rt] = ((int32_t)R[d->rs] - (int32_t)d->imm) < 0 ? 1 : 0; break;
+		case OP_ANDI:	R[d->rt] = R[d->rs] & d->uimm; break;
+		case OP_ORI:	R[d->rt] = R[d->rs] | d->uimm; break;
+		case OP_XORI:	R[d->rt] = R[d->rs] ^ d->uimm; break;
+		case OP_LUI:	R[d->rt] = d->uimm << 16; break;
+		case OP_LB:
+		case OP_LH:
+		case OP_LW:
+			address = R[d->rs] + d->uimm;
+			R[d->rt] = functional_cache_block(sim, address)->words[(address & 0xC) >> 2]
+				& (d->op == OP_LB ? 0xFF : d->op == OP_LH ? 0xFFFF : 0xFFFFFFFF);
+			break;
+		case OP_SB:
+		case OP_SH:
+		case OP_SW:
+			address = R[d->rs] + d->uimm;
+			functional_cache_block(sim, address)->words[(address & 0xC) >> 2] = R[d->rt];
+			mem_write_32(sim, address & 0xFFFFFFFC, R[d->rt]);
+			break;
+		case OP_NOP:	break;
+		default:
+			printf("Instruction at 0x%x is not implemented!\n", pc);
+			break;
+	}
+	return pc + 4;
+}
+
+
+/***************************************************************/
+/* Decoded instruction at pc for the functional engine                      */
+/***************************************************************/
+static inline const decoded_inst_t *functional_fetch(sim_t *sim, uint32_t pc)
+{
+	uint32_t index = (pc - MEM_TEXT_BEGIN) >> 2;
+
+	if ((pc & 0x3) == 0 && index < sim->DECODED_SIZE && sim->DECODED[index].op != OP_INVALID) {
+		return &sim->DECODED[index];
+	}
+	return decode_lookup(sim, pc, mem_read_32(sim, pc));
+}
+
+
+/************************************************************/
+/* Does branch d go to its target, given operands a and b: the comparator  */
+/* in ID (-e 1), and how functional_step() tells a taken branch to the     */
+/* next instruction from one not taken. Same conditions as EX.             */
+/************************************************************/
+static inline int id_branch_taken(const decoded_inst_t *d, uint32_t a, uint32_t b)
+{
+	switch (d->op) {
+		case OP_BLTZ:	return (a & 0x80000000) > 0;
+		case OP_BGEZ:	return (a & 0x80000000) == 0;
+		case OP_BEQ:	return a == b;
+		case OP_BNE:	return a != b;
+		case OP_BLEZ:	return (a & 0x80000000) > 0 || a == 0;
+		case OP_BGTZ:	return (a & 0x80000000) == 0 || a != 0;
+		default:		return 1;	/* J, JAL, JR, JALR */
+	}
+}
+
+
+/***************************************************************/
+/* Execute d at pc functionally and return the PC to run next. With delay   */
+/* slots (-D 1) that is the slot of a taken branch or jump, whose target    */
+/* waits in *pending until the slot has run; *pending is 0 otherwise.       */
+/***************************************************************/
+static inline uint32_t functional_step(sim_t *sim, const decoded_inst_t *d, uint32_t pc, uint32_t *pending)
+{
+	const uint32_t *R = sim->CURRENT_STATE.REGS;
+	int taken = ((d->op >= OP_BLTZ && d->op <= OP_BGTZ) || d->op == OP_JR || d->op == OP_JALR)
+		&& id_branch_taken(d, R[d->rs], R[d->rt]);
+	uint32_t next = execute_functional(sim, d, pc), target = *pending;
+
+	if (!sim->DELAY_SLOTS) {
+		return next;
+	}
+	/* a branch to its own slot runs the slot twice */
+	*pending = taken ? next : 0;
+	return target ? target : pc + 4;
+}
+
+
+/***************************************************************/
+/* Execute up to max_instructions functionally from CURRENT_STATE.PC, then   */
+/* hand the architectural state (PC, registers, HI/LO, memory) to an empty   */
+/* pipeline. Cycles, INSTRUCTION_COUNT and cache statistics are not touched, */
+/* so the CPI covers the pipeline only. Returns the instructions run.       */
+/***************************************************************/
+uint32_t fast_forward(sim_t *sim, uint32_t max_instructions)
+{
+	uint32_t pc = sim->CURRENT_STATE.PC, pending = 0, count;
+
+	if (sim->ID_FLAG || sim->EX_FLAG || sim->MEM_FLAG || sim->WB_FLAG) {
+		printf("Error: fast-forward needs an empty pipeline (after load or reset)\n");
+		return 0;
+	}
+	/* the pipeline starts empty, so never stop between a branch and its delay slot */
+	for (count = 0; (count < max_instructions || pending) && sim->RUN_FLAG; count++) {
+		pc = functional_step(sim, functional_fetch(sim, pc), pc, &pending);
+		/* R0 writes never reach a later instruction: no hazard is detected on R0 */
+		/* and every pipeline bubble writes it back to zero */
+		sim->CURRENT_STATE.REGS[0] = 0;
+	}
+	sim->CURRENT_STATE.PC = pc;
+	pipeline_flush(sim);
+	TRACE(TRACE_SUMMARY, "%u instructions fast-forwarded, PC 0x%08x\n", count, pc);
+	return count;
+}
+
+
+/***************************************************************/
+/* Run functionally from CURRENT_STATE.PC until the program halts or       */
+/* max_instructions (0: no limit) have run, writing each one to an         */
+/* instruction trace for mu-cachesim. Loads and stores carry the address   */
+/* MEM hands L1Cache. Returns 0 on success.                                */
+/***************************************************************/
+int itrace_record(sim_t *sim, const char *path, uint32_t max_instructions)
+{
+	static const uint8_t kinds[NUM_OPS] = {
+		[OP_JR] = ITRACE_BRANCH, [OP_JALR] = ITRACE_BRANCH,
+		[OP_BLTZ] = ITRACE_BRANCH, [OP_BGEZ] = ITRACE_BRANCH, [OP_J] = ITRACE_BRANCH, [OP_JAL] = ITRACE_BRANCH,
+		[OP_BEQ] = ITRACE_BRANCH, [OP_BNE] = ITRACE_BRANCH, [OP_BLEZ] = ITRACE_BRANCH, [OP_BGTZ] = ITRACE_BRANCH,
+		[OP_LB] = ITRACE_LOAD, [OP_LH] = ITRACE_LOAD, [OP_LW] = ITRACE_LOAD,
+		[OP_SB] = ITRACE_STORE, [OP_SH] = ITRACE_STORE, [OP_SW] = ITRACE_STORE
+	};
+	itrace_header_t header;
+	itrace_chunk_t chunk;
+	itrace_record_t r;
+	const decoded_inst_t *d;
+	itrace_codec_t *codec = malloc(sizeof(itrace_codec_t));
+	uint8_t *raw = malloc(ITRACE_CHUNK_SIZE);
+	uint8_t *compressed = malloc(ITRACE_COMPRESS_BOUND(ITRACE_CHUNK_SIZE));
+	uint8_t *pos = raw;
+	uint32_t pc = sim->CURRENT_STATE.PC, pending = 0, next, count, records = 0;
+	uint64_t file_bytes = sizeof(header);
+	FILE *file = fopen(path, "wb");
+	int failed = FALSE;
+
+	assert(codec != NULL && raw != NULL && compressed != NULL);
+	if (file == NULL) {
+		printf("Error: Can't open trace file %s\n", path);
+		free(codec);
+		free(raw);
+		free(compressed);
+		return -1;
+	}
+	memcpy(header.magic, ITRACE_MAGIC, 4);
+	header.version = ITRACE_VERSION;
+	failed |= fwrite(&header, sizeof(header), 1, file) != 1;
+
+	itrace_codec_init(codec);
+	for (count = 0; (max_instructions == 0 || count < max_instructions || pending) && sim->RUN_FLAG; count++) {
+		d = functional_fetch(sim, pc);
+		r.pc = pc;
+		r.instruction = d->instruction;
+		r.flags = kinds[d->op];
+		/* read before the instruction runs: a load may overwrite its base */
+		r.address = r.flags & (ITRACE_LOAD | ITRACE_STORE) ? sim->CURRENT_STATE.REGS[d->rs] + d->uimm : 0;
+		next = functional_step(sim, d, pc, &pending);
+		sim->CURRENT_STATE.REGS[0] = 0;
+		/* the next record is not at pc + 4; with delay slots a taken branch is followed by its slot */
+		if ((r.flags & ITRACE_BRANCH) && next != pc + 4) {
+			r.flags |= ITRACE_TAKEN;
+		}
+		pos = itrace_encode(codec, &r, pos);
+		records++;
+		pc = next;
+
+		/* chunks are independent, so every one starts a fresh codec */
+		if (pos - raw > ITRACE_CHUNK_SIZE - ITRACE_RECORD_MAX || !sim->RUN_FLAG
+			|| (max_instructions != 0 && count + 1 >= max_instructions && !pending)) {
+			chunk.raw_size = pos - raw;
+			chunk.records = records;
+			chunk.compressed_size = itrace_compress(raw, chunk.raw_size, compressed);
+			failed |= fwrite(&chunk, sizeof(chunk), 1, file) != 1;
+			failed |= fwrite(compressed, 1, chunk.compressed_size, file) != chunk.compressed_size;
+			file_bytes += sizeof(chunk) + chunk.compressed_size;
+			itrace_codec_init(codec);
+			pos = raw;
+			records = 0;
+		}
+	}
+	sim->CURRENT_STATE.PC = pc;
+	sim->INSTRUCTION_COUNT += count;
+	failed |= fclose(file) != 0;
+	printf("Instruction trace %s: %u instructions, %llu bytes written%s\n", path, count,
+		(unsigned long long)file_bytes, failed ? " (write error)" : "");
+
+	free(codec);
+	free(raw);
+	free(compressed);
+	return failed ? -1 : 0;
+}
+
+
+/***************************************************************/
+/* Simulate MIPS for n cycles                                                                                       */
+/***************************************************************/
+void run(sim_t *sim, int num_cycles) {                                      
+	
+	if (sim->RUN_FLAG == FALSE) {
+		printf("Simulation Stopped\n\n");
+		return;
+	}
+
+	printf("Running simulator for %d cycles...\n\n", num_cycles);
+	uint32_t start = sim->CYCLE_COUNT;
+	int i;
+	for (i = 0; i < num_cycles; ) {
+		if (sim->RUN_FLAG == FALSE) {
+			printf("Simulation Stopped.\n\n");
+			break;
+		}
+		i += cycle_fast(sim, num_cycles - i);
+	}
+	TRACE(TRACE_SUMMARY, "\n%u cycles simulated, PC 0x%08x, %u cache hits, %u misses\n", sim->CYCLE_COUNT - start, sim->CURRENT_STATE.PC, sim->cache_hits, sim->cache_misses);
+}
+
+
+/***************************************************************/
+/* simulate to completion                                                                                               */
+/***************************************************************/
+void runAll(sim_t *sim) {                                                     
+	if (sim->RUN_FLAG == FALSE) {
+		printf("Simulation Stopped.\n\n");
+		return;
+	}
+
+	printf("Simulation Started...\n\n");
+	uint32_t start = sim->CYCLE_COUNT;
+	while (sim->RUN_FLAG){
+		cycle_fast(sim, 0);
+	}
+	printf("Simulation Finished.\n\n");
+	TRACE(TRACE_SUMMARY, "%u cycles simulated, PC 0x%08x, %u cache hits, %u misses\n", sim->CYCLE_COUNT - start, sim->CURRENT_STATE.PC, sim->cache_hits, sim->cache_misses);
+}
+
+
+/***************************************************************/
+/* Write the complete simulator state to path; returns 0 on success          */
+/***************************************************************/
+int checkpoint_save(sim_t *sim, const char *path)
+{
+	checkpoint_header_t header;
+	const uint8_t *page;
+	uint32_t i, address;
+	FILE *fp;
+
+	fp = fopen(path, "wb");
+	if (fp == NULL) {
+		printf("Error: Can't create checkpoint %s\n", path);
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CHECKPOINT_MAGIC, 4);
+	header.version = CHECKPOINT_VERSION;
+	header.header_size = sizeof(header);
+	header.program_size = sim->PROGRAM_SIZE;
+	header.current_state = sim->CURRENT_STATE;
+	header.next_state = sim->NEXT_STATE;
+	header.if_id = sim->IF_ID;
+	header.id_ex_prev = sim->ID_EX_Prev;
+	header.id_ex = sim->ID_EX;
+	header.ex_mem = sim->EX_MEM;
+	header.mem_wb = sim->MEM_WB;
+	header.run_flag = sim->RUN_FLAG;
+	header.id_flag = sim->ID_FLAG;
+	header.ex_flag = sim->EX_FLAG;
+	header.mem_flag = sim->MEM_FLAG;
+	header.wb_flag = sim->WB_FLAG;
+	header.ex_hazard = sim->EX_HAZARD;
+	header.mem_hazard = sim->MEM_HAZARD;
+	header.stall_count = sim->STALL_COUNT;
+	header.mem_stall = sim->MEM_STALL;
+	header.branch_flag = sim->BRANCH_FLAG;
+	header.control_a = sim->controlA;
+	header.control_b = sim->controlB;
+	header.prev_op = sim->prev_op;
+	header.instruction_count = sim->INSTRUCTION_COUNT;
+	header.cycle_count = sim->CYCLE_COUNT;
+	header.l1_cache = sim->L1Cache;
+	memcpy(header.write_buffer, sim->WRITE_BUFFER, sizeof(header.write_buffer));
+	header.cache_hits = sim->cache_hits;
+	header.cache_misses = sim->cache_misses;
+	memcpy(header.fu_free, sim->FU_FREE, sizeof(header.fu_free));
+	header.hilo_ready = sim->HILO_READY;
+	for (i = 0; i < sim->MEM_PAGES_ALLOCATED; i++) {
+		if (memcmp(mem_page_read(sim, sim->MEM_PAGE_LIST[i]), MEM_ZERO_PAGE, MEM_PAGE_SIZE) != 0) {
+			header.num_pages++;
+		}
+	}
+	fwrite(&header, sizeof(header), 1, fp);
+
+	for (i = 0; i < sim->MEM_PAGES_ALLOCATED; i++) {
+		address = sim->MEM_PAGE_LIST[i];
+		page = mem_page_read(sim, address);
+		if (memcmp(page, MEM_ZERO_PAGE, MEM_PAGE_SIZE) != 0) {
+			fwrite(&address, sizeof(address), 1, fp);
+			fwrite(page, MEM_PAGE_SIZE, 1, fp);
+		}
+	}
+	if (ferror(fp) | fclose(fp)) {
+		printf("Error: Can't write checkpoint %s\n", path);
+		return -1;
+	}
+	TRACE(TRACE_SUMMARY, "Checkpoint %s: cycle %u, PC 0x%08x, %u pages\n", path, sim->CYCLE_COUNT, sim->CURRENT_STATE.PC, header.num_pages);
+	return 0;
+}
+
+
+/***************************************************************/
+/* Replace the simulator state with a checkpoint mapped from path; returns 0 */
+/* on success and leaves the simulator untouched on failure. Cache models    */
+/* start empty.                                                              */
+/***************************************************************/
+int checkpoint_restore(sim_t *sim, const char *path)
+{
+	const checkpoint_header_t *header;
+	const checkpoint_page_t *pages;
+	const uint8_t *data;
+	struct stat st;
+	uint32_t i;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		printf("Error: Can't open checkpoint %s\n", path);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	data = st.st_size >= (off_t)sizeof(checkpoint_header_t) ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	header = (const checkpoint_header_t *)data;
+	if (data == MAP_FAILED || memcmp(header->magic, CHECKPOINT_MAGIC, 4) != 0
+		|| header->version != CHECKPOINT_VERSION || header->header_size != sizeof(checkpoint_header_t)
+		|| (uint64_t)st.st_size != sizeof(checkpoint_header_t) + (uint64_t)header->num_pages * sizeof(checkpoint_page_t)) {
+		printf("Error: %s is not a version %d checkpoint\n", path, CHECKPOINT_VERSION);
+		if (data != MAP_FAILED) {
+			munmap((void *)data, st.st_size);
+		}
+		return -1;
+	}
+
+	sim->CURRENT_STATE = header->current_state;
+	sim->NEXT_STATE = header->next_state;
+	sim->IF_ID = header->if_id;
+	sim->ID_EX_Prev = header->id_ex_prev;
+	sim->ID_EX = header->id_ex;
+	sim->EX_MEM = header->ex_mem;
+	sim->MEM_WB = header->mem_wb;
+	sim->RUN_FLAG = header->run_flag;
+	sim->ID_FLAG = header->id_flag;
+	sim->EX_FLAG = header->ex_flag;
+	sim->MEM_FLAG = header->mem_flag;
+	sim->WB_FLAG = header->wb_flag;
+	sim->EX_HAZARD = header->ex_hazard;
+	sim->MEM_HAZARD = header->mem_hazard;
+	sim->STALL_COUNT = header->stall_count;
+	sim->MEM_STALL = header->mem_stall;
+	sim->BRANCH_FLAG = header->branch_flag;
+	sim->controlA = header->control_a;
+	sim->controlB = header->control_b;
+	sim->prev_op = header->prev_op;
+	sim->INSTRUCTION_COUNT = header->instruction_count;
+	sim->CYCLE_COUNT = header->cycle_count;
+	sim->L1Cache = header->l1_cache;
+	memcpy(sim->WRITE_BUFFER, header->write_buffer, sizeof(sim->WRITE_BUFFER));
+	sim->cache_hits = header->cache_hits;
+	sim->cache_misses = header->cache_misses;
+	memcpy(sim->FU_FREE, header->fu_free, sizeof(sim->FU_FREE));
+	sim->HILO_READY = header->hilo_ready;
+	cache_models_reset(sim);
+
+	mem_clear(sim);
+	pages = (const checkpoint_page_t *)(header + 1);
+	for (i = 0; i < header->num_pages; i++) {
+		mem_load(sim, pages[i].address, pages[i].data, MEM_PAGE_SIZE);
+	}
+	sim->PROGRAM_SIZE = header->program_size;
+	predecode_program(sim);
+
+	TRACE(TRACE_SUMMARY, "Restored %s: cycle %u, PC 0x%08x, %u pages\n", path, sim->CYCLE_COUNT, sim->CURRENT_STATE.PC, header->num_pages);
+	munmap((void *)data, st.st_size);
+	return 0;
+}
+
+
+/***************************************************************/
+/* Words in a -d range. Loops count these rather than compare addresses,    */
+/* which would wrap at the top of the address space.                        */
+/***************************************************************/
+static inline uint32_t dump_words(const mem_region_t *dump)
+{
+	return ((dump->end - dump->begin) >> 2) + 1;
+}
+
+
+/***************************************************************/
+/* Parse the batch option at argv[i]; returns the number of arguments used, 0 if not one */
+/***************************************************************/
+int batch_parse_option(batch_config_t *config, int argc, char *argv[], int i)
+{
+	mem_region_t *dump;
+
+	if (i + 1 >= argc) {
+		return 0;
+	}
+	if (strcmp(argv[i], "-n") == 0) {
+		config->cycles = strtoul(argv[i+1], NULL, 0);
+	} else if (strcmp(argv[i], "-f") == 0) {
+		config->forwarding = atoi(argv[i+1]) != 0;
+	} else if (strcmp(argv[i], "-e") == 0) {
+		config->early_branch = atoi(argv[i+1]) != 0;
+	} else if (strcmp(argv[i], "-D") == 0) {
+		config->delay_slots = atoi(argv[i+1]) != 0;
+	} else if (strcmp(argv[i], "-F") == 0) {
+		config->fast_forward = strtoul(argv[i+1], NULL, 0);
+	} else if (strcmp(argv[i], "-o") == 0) {
+		config->binary = strcmp(argv[i+1], "bin") == 0;
+	} else if (strcmp(argv[i], "-d") == 0 && config->num_dumps < BATCH_MAX_DUMPS) {
+		dump = &config->dumps[config->num_dumps];
+		if (sscanf(argv[i+1], "%x:%x", &dump->begin, &dump->end) != 2 || dump->end < dump->begin) {
+			return 0;
+		}
+		if (dump_words(dump) > BATCH_MAX_DUMP_WORDS) {
+			printf("Error: -d %s is over %u words\n", argv[i+1], BATCH_MAX_DUMP_WORDS);
+			return 0;
+		}
+		config->num_dumps++;
+	} else if (strcmp(argv[i], "-R") == 0) {
+		snprintf(config->restore, sizeof(config->restore), "%s", argv[i+1]);
+	} else if (strcmp(argv[i], "-C") == 0) {
+		snprintf(config->checkpoint, sizeof(config->checkpoint), "%s", argv[i+1]);
+	} else if (strcmp(argv[i], "-c") == 0 && config->num_cache_models < CACHE_MAX_MODELS) {
+		if (cache_parse_config(argv[i+1], &config->cache_models[config->num_cache_models]) != 0) {
+			return 0;
+		}
+		config->num_cache_models++;
+	} else if (strcmp(argv[i], "-l") == 0 && config->num_timings < FU_MAX_TIMINGS) {
+		if (fu_parse_timing(argv[i+1], &config->timings[config->num_timings]) != 0) {
+			return 0;
+		}
+		config->num_timings++;
+	} else if (strcmp(argv[i], "-B") == 0 && config->num_predictors < BPRED_MAX_PREDICTORS) {
+		if (bpred_parse_config(argv[i+1], &config->predictors[config->num_predictors]) != 0) {
+			return 0;
+		}
+		config->num_predictors++;
+	} else {
+		return 0;
+	}
+	return 2;
+}
+
+
+/***************************************************************/
+/* Run a loaded simulator as configured and fill in its result record        */
+/***************************************************************/
+void batch_execute(sim_t *sim, const batch_config_t *config, batch_record_t *record)
+{
+	uint32_t n;
+
+	if (config->restore[0] != '\0' && checkpoint_restore(sim, config->restore) != 0) {
+		exit(1);
+	}
+	if (config->fast_forward > 0) {
+		fast_forward(sim, config->fast_forward);
+	}
+	for (n = 0; sim->RUN_FLAG && (config->cycles == 0 || n < config->cycles); ) {
+		n += cycle_fast(sim, config->cycles == 0 ? 0 : config->cycles - n);
+	}
+	if (config->checkpoint[0] != '\0' && checkpoint_save(sim, config->checkpoint) != 0) {
+		exit(1);
+	}
+
+	memset(record, 0, sizeof(batch_record_t));
+	memcpy(record->magic, BATCH_MAGIC, 4);
+	record->version = BATCH_VERSION;
+	record->pc = sim->CURRENT_STATE.PC;
+	record->halted = !sim->RUN_FLAG;
+	record->cycles = sim->CYCLE_COUNT;
+	record->instructions = sim->INSTRUCTION_COUNT;
+	memcpy(record->regs, sim->CURRENT_STATE.REGS, sizeof(record->regs));
+	record->hi = sim->CURRENT_STATE.HI;
+	record->lo = sim->CURRENT_STATE.LO;
+	record->cache_hits = sim->cache_hits;
+	record->cache_misses = sim->cache_misses;
+	record->forwarding = sim->ENABLE_FORWARDING;
+	record->num_dumps = config->num_dumps;
+	record->num_cache_models = sim->NUM_CACHE_MODELS;
+	record->num_predictors = sim->NUM_BPRED;
+	record->early_branch = sim->EARLY_BRANCH && !sim->DELAY_SLOTS;	/* ID ignores -e with delay slots */
+	record->delay_slots = sim->DELAY_SLOTS;
+}
+
+
+/***************************************************************/
+/* Batch mode: run the loaded program, then write one result record to stdout */
+/***************************************************************/
+void batch_run(sim_t *sim, const batch_config_t *config)
+{
+	batch_record_t record;
+	uint32_t address, word, n;
+	const char *c;
+	int i;
+
+	batch_execute(sim, config, &record);
+
+	if (config->binary) {
+		fwrite(&record, sizeof(record), 1, stdout);
+		for (i = 0; i < config->num_dumps; i++) {
+			fwrite(&config->dumps[i], sizeof(mem_region_t), 1, stdout);
+			for (n = 0, address = config->dumps[i].begin; n < dump_words(&config->dumps[i]); n++, address += 4) {
+				word = mem_read_32(sim, address);
+				fwrite(&word, 4, 1, stdout);
+			}
+		}
+		for (i = 0; i < sim->NUM_CACHE_MODELS; i++) {
+			batch_cache_record_t model = { sim->CACHE_MODELS[i].config, sim->CACHE_MODELS[i].stats };
+			fwrite(&model, sizeof(model), 1, stdout);
+		}
+		for (i = 0; i < sim->NUM_BPRED; i++) {
+			batch_bpred_record_t predictor = { sim->BPRED[i].config, sim->BPRED[i].stats };
+			fwrite(&predictor, sizeof(predictor), 1, stdout);
+		}
+		fflush(stdout);
+		return;
+	}
+
+	printf("{\"program\":\"");
+	for (c = sim->program->path; *c != '\0'; c++) {
+		if (*c == '"' || *c == '\\') {
+			putchar('\\');
+		}
+		putchar(*c);
+	}
+	printf("\",\"halted\":%s,\"pc\":%u,\"cycles\":%u,\"instructions\":%u,\"cpi\":%.4f,\"forwarding\":%u,"
+		"\"early_branch\":%u,\"delay_slots\":%u,\"regs\":[", record.halted ? "true" : "false", record.pc, record.cycles,
+		record.instructions, record.instructions ? (double)record.cycles / record.instructions : 0.0, record.forwarding,
+		record.early_branch, record.delay_slots);
+	for (i = 0; i < MIPS_REGS; i++) {
+		printf(i ? ",%u" : "%u", record.regs[i]);
+	}
+	printf("],\"hi\":%u,\"lo\":%u,\"cache\":{\"hits\":%u,\"misses\":%u},\"memory\":[",
+		record.hi, record.lo, record.cache_hits, record.cache_misses);
+	for (i = 0; i < config->num_dumps; i++) {
+		printf("%s{\"begin\":%u,\"end\":%u,\"words\":[", i ? "," : "", config->dumps[i].begin, config->dumps[i].end);
+		for (n = 0, address = config->dumps[i].begin; n < dump_words(&config->dumps[i]); n++, address += 4) {
+			printf(n ? ",%u" : "%u", mem_read_32(sim, address));
+		}
+		printf("]}");
+	}
+	printf("],\"cache_models\":[");
+	for (i = 0; i < sim->NUM_CACHE_MODELS; i++) {
+		const cache_model_t *model = &sim->CACHE_MODELS[i];
+		printf("%s{\"sets\":%u,\"ways\":%u,\"block_bytes\":%u,\"policy\":\"%s\",\"write_allocate\":%s,\"miss_penalty\":%u,"
+			"\"hits\":%llu,\"misses\":%llu,\"stall_cycles\":%llu}", i ? "," : "", model->config.sets, model->config.ways,
+			model->config.block_bytes, model->config.policy == CACHE_LRU ? "lru" : model->config.policy == CACHE_FIFO ? "fifo" : "random",
+			model->config.write_allocate ? "true" : "false", model->config.miss_penalty, (unsigned long long)model->stats.hits,
+			(unsigned long long)model->stats.misses, (unsigned long long)model->stats.stall_cycles);
+	}
+	printf("],\"predictors\":[");
+	for (i = 0; i < sim->NUM_BPRED; i++) {
+		const bpred_t *bp = &sim->BPRED[i];
+		printf("%s{\"kind\":\"%s\",\"entries\":%u,\"btb_entries\":%u,\"history_bits\":%u,\"branches\":%llu,\"mispredictions\":%llu,"
+			"\"btb_misses\":%llu,\"ras_depth\":%u,\"returns\":%llu,\"return_mispredictions\":%llu,\"ras_overflows\":%llu,"
+			"\"ras_underflows\":%llu,\"cpi\":%.4f,\"cpi_change\":%.4f}", i ? "," : "", bp->kind->name, bp->config.entries,
+			bp->config.btb_entries, bp->config.history_bits, (unsigned long long)bp->stats.predictions,
+			(unsigned long long)bp->stats.mispredictions, (unsigned long long)bp->stats.btb_misses, bp->config.ras_depth,
+			(unsigned long long)bp->stats.returns, (unsigned long long)bp->stats.return_mispredictions,
+			(unsigned long long)bp->stats.ras_overflows, (unsigned long long)bp->stats.ras_underflows,
+			bpred_cpi(sim, i), bpred_cpi(sim, i) - bpred_cpi(sim, -1));
+	}
+	printf("]}\n");
+	fflush(stdout);
+}
+
+
+/***************************************************************/
+/* Take the next job for worker id: from the tail of its own queue, otherwise steal from    */
+/* the head of another. Jobs are never added once the pool runs, so empty everywhere means done. */
+/***************************************************************/
+static int runner_next_job(runner_t *runner, int id, uint32_t *job)
+{
+	runner_queue_t *queue;
+	int i, found = FALSE;
+
+	for (i = 0; i < runner->num_threads && !found; i++) {
+		queue = &runner->queues[(id + i) % runner->num_threads];
+		pthread_mutex_lock(&queue->lock);
+		if (queue->head < queue->tail) {
+			*job = i == 0 ? queue->jobs[--queue->tail] : queue->jobs[queue->head++];
+			found = TRUE;
+		}
+		pthread_mutex_unlock(&queue->lock);
+	}
+	return found;
+}
+
+
+/***************************************************************/
+/* Worker thread: run jobs, each on its own simulator, until none are left  */
+/***************************************************************/
+static void *runner_worker(void *arg)
+{
+	runner_worker_t *worker = arg;
+	runner_t *runner = worker->runner;
+	runner_job_t *job;
+	sim_t *sim;
+	uint32_t index, address, n, w;
+	int i;
+
+	while (runner_next_job(runner, worker->id, &index)) {
+		job = &runner->jobs[index];
+		sim = sim_create(job->program);
+		sim->ENABLE_FORWARDING = job->config.forwarding;
+		sim->EARLY_BRANCH = job->config.early_branch;
+		sim->DELAY_SLOTS = job->config.delay_slots;
+		sim->TRACE_LEVEL = TRACE_OFF;
+		for (i = 0; i < job->config.num_cache_models; i++) {
+			cache_model_add(sim, &job->config.cache_models[i]);
+		}
+		for (i = 0; i < job->config.num_timings; i++) {
+			fu_set_timing(sim, &job->config.timings[i]);
+		}
+		for (i = 0; i < job->config.num_predictors; i++) {
+			bpred_add(sim, &job->config.predictors[i]);
+		}
+		initialize(sim);
+		load_program(sim);
+		batch_execute(sim, &job->config, &job->record);
+		for (i = 0; i < sim->NUM_CACHE_MODELS; i++) {
+			job->cache_stats[i] = sim->CACHE_MODELS[i].stats;
+		}
+		for (i = 0; i < sim->NUM_BPRED; i++) {
+			job->bpred_stats[i] = sim->BPRED[i].stats;
+		}
+		for (i = 0, n = 0; i < job->config.num_dumps; i++) {
+			for (w = 0, address = job->config.dumps[i].begin; w < dump_words(&job->config.dumps[i]); w++, address += 4) {
+				job->memory[n++] = mem_read_32(sim, address);
+			}
+		}
+		sim_destroy(sim);
+	}
+	return NULL;
+}
+
+
+/***************************************************************/
+/* Read a manifest of jobs, one "<program> [-R <checkpoint>] [-F <instructions>] [-n <cycles>] [-f 0|1] [-e 0|1] [-D 0|1] [-d <start>:<stop>]... [-c <cache model>]... [-l <unit timing>]... [-B <predictor>]..." */
+/* per line ('#' starts a comment), run them on num_threads threads (0: one per online   */
+/* core) and print one results table. Each program file is mapped once for all its jobs. */
+/* A job without -n stops after RUNNER_DEFAULT_CYCLES; one that stops before halting is  */
+/* listed as a timeout.                                                                   */
+/***************************************************************/
+void runner_main(const char *manifest, int num_threads)
+{
+	runner_t runner;
+	runner_worker_t *workers;
+	runner_job_t *job;
+	char *line = NULL, *args[RUNNER_MAX_ARGS], *save;
+	size_t line_size = 0;
+	uint32_t line_no = 0, words, timeouts = 0, i, j;
+	uint64_t total_cycles = 0;
+	struct timespec start, stop;
+	double seconds;
+	FILE *fp;
+	int argc, n;
+
+	memset(&runner, 0, sizeof(runner));
+	fp = fopen(manifest, "r");
+	if (fp == NULL) {
+		printf("Error: Can't open manifest %s\n", manifest);
+		exit(1);
+	}
+	while (getline(&line, &line_size, fp) != -1) {
+		line_no++;
+		line[strcspn(line, "#")] = '\0';
+		for (argc = 0, args[0] = strtok_r(line, " \t\r\n", &save); args[argc] != NULL && argc < RUNNER_MAX_ARGS - 1; ) {
+			args[++argc] = strtok_r(NULL, " \t\r\n", &save);
+		}
+		if (argc == 0) {
+			continue;
+		}
+
+		runner.jobs = realloc(runner.jobs, (runner.num_jobs + 1) * sizeof(runner_job_t));
+		assert(runner.jobs != NULL);
+		job = &runner.jobs[runner.num_jobs++];
+		memset(job, 0, sizeof(runner_job_t));
+		job->line = line_no;
+		for (i = 1; i < argc; i += n) {
+			n = batch_parse_option(&job->config, argc, args, i);
+			if (n == 0) {
+				printf("Error: %s:%u: bad option %s\n", manifest, line_no, args[i]);
+				exit(1);
+			}
+		}
+		if (job->config.cycles == 0) {
+			job->config.cycles = RUNNER_DEFAULT_CYCLES;
+		}
+		for (j = 0, words = 0; j < job->config.num_dumps; j++) {
+			words += dump_words(&job->config.dumps[j]);
+		}
+		job->memory = malloc(words * sizeof(uint32_t) + 1);
+		job->cache_stats = calloc(job->config.num_cache_models + 1, sizeof(cache_stats_t));
+		assert(job->memory != NULL && job->cache_stats != NULL);
+
+		for (j = 0; j < runner.num_programs; j++) {
+			if (strcmp(runner.programs[j]->path, args[0]) == 0) {
+				break;
+			}
+		}
+		if (j == runner.num_programs) {
+			runner.programs = realloc(runner.programs, (runner.num_programs + 1) * sizeof(program_t *));
+			assert(runner.programs != NULL);
+			runner.programs[runner.num_programs++] = program_open(args[0]);
+		}
+		job->program = runner.programs[j];
+	}
+	free(line);
+	fclose(fp);
+
+	if (num_threads <= 0) {
+		num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (num_threads > (int)runner.num_jobs) {
+		num_threads = runner.num_jobs;
+	}
+	if (num_threads < 1) {
+		num_threads = 1;
+	}
+
+	/* deal the jobs round-robin; stealing evens out the uneven ones */
+	runner.num_threads = num_threads;
+	runner.queues = calloc(num_threads, sizeof(runner_queue_t));
+	workers = calloc(num_threads, sizeof(runner_worker_t));
+	assert(runner.queues != NULL && workers != NULL);
+	for (i = 0; i < num_threads; i++) {
+		pthread_mutex_init(&runner.queues[i].lock, NULL);
+		runner.queues[i].jobs = malloc((runner.num_jobs / num_threads + 1) * sizeof(uint32_t));
+		assert(runner.queues[i].jobs != NULL);
+	}
+	for (i = 0; i < runner.num_jobs; i++) {
+		runner.queues[i % num_threads].jobs[runner.queues[i % num_threads].tail++] = i;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < num_threads; i++) {
+		workers[i].runner = &runner;
+		workers[i].id = i;
+		if (pthread_create(&workers[i].thread, NULL, runner_worker, &workers[i]) != 0) {
+			printf("Error: Can't start worker thread\n");
+			exit(1);
+		}
+	}
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("# job\tline\tprogram\tforwarding\tearly_branch\tdelay_slots\tstatus\tcycles\tcpi\tpc\tcache_hits\tcache_misses\tmispredictions\tcache_models\tmemory\n");
+	for (i = 0; i < runner.num_jobs; i++) {
+		job = &runner.jobs[i];
+		printf("%u\t%u\t%s\t%u\t%u\t%u\t%s\t%u\t%.4f\t0x%08x\t%u\t%u\t", i, job->line, job->program->path, job->record.forwarding,
+			job->record.early_branch, job->record.delay_slots, job->record.halted ? "halted" : "timeout", job->record.cycles,
+			job->record.instructions ? (double)job->record.cycles / job->record.instructions : 0.0, job->record.pc,
+			job->record.cache_hits, job->record.cache_misses);
+		/* mispredictions/branches and jumps of each -B predictor */
+		for (j = 0; j < job->config.num_predictors; j++) {
+			printf(j ? ",%llu/%llu" : "%llu/%llu", (unsigned long long)job->bpred_stats[j].mispredictions,
+				(unsigned long long)job->bpred_stats[j].predictions);
+		}
+		printf(job->config.num_predictors ? "\t" : "-\t");
+		/* hits/misses/stall cycles of each -c model */
+		for (j = 0; j < job->config.num_cache_models; j++) {
+			printf(j ? ",%llu/%llu/%llu" : "%llu/%llu/%llu", (unsigned long long)job->cache_stats[j].hits,
+				(unsigned long long)job->cache_stats[j].misses, (unsigned long long)job->cache_stats[j].stall_cycles);
+		}
+		printf(job->config.num_cache_models ? "\t" : "-\t");
+		for (j = 0, words = 0; j < job->config.num_dumps; j++) {
+			words += dump_words(&job->config.dumps[j]);
+		}
+		for (j = 0; j < words; j++) {
+			printf(j ? ",%08x" : "%08x", job->memory[j]);
+		}
+		printf(words ? "\n" : "-\n");
+		total_cycles += job->record.cycles;
+		timeouts += !job->record.halted;
+	}
+	printf("# %u jobs (%u timed out), %u programs, %d threads: %llu cycles in %.3f s (%.1f Mcycles/s)\n", runner.num_jobs,
+		timeouts, runner.num_programs, num_threads, (unsigned long long)total_cycles, seconds,
+		seconds > 0 ? total_cycles / seconds / 1e6 : 0.0);
+	fflush(stdout);
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_mutex_destroy(&runner.queues[i].lock);
+		free(runner.queues[i].jobs);
+	}
+	for (i = 0; i < runner.num_jobs; i++) {
+		free(runner.jobs[i].memory);
+		free(runner.jobs[i].cache_stats);
+	}
+	for (i = 0; i < runner.num_programs; i++) {
+		program_close(runner.programs[i]);
+	}
+	free(runner.queues);
+	free(runner.jobs);
+	free(runner.programs);
+	free(workers);
+}
+
+
+/***************************************************************/
+/* Id (from 1, in order of first use) of the basic block starting at pc    */
+/***************************************************************/
+static uint32_t bbv_map_id(bbv_map_t *map, uint32_t pc)
+{
+	uint32_t i, slot, *pcs, *ids, size;
+
+	slot = (pc >> 2) * 2654435761u & (map->size - 1);
+	while (map->pcs[slot] != 0 && map->pcs[slot] != pc) {
+		slot = (slot + 1) & (map->size - 1);
+	}
+	if (map->pcs[slot] == pc) {
+		return map->ids[slot];
+	}
+	map->pcs[slot] = pc;
+	map->ids[slot] = ++map->used;
+	if (map->used * 2 > map->size) {
+		pcs = map->pcs;
+		ids = map->ids;
+		size = map->size;
+		map->size *= 2;
+		map->pcs = calloc(map->size, sizeof(uint32_t));
+		map->ids = calloc(map->size, sizeof(uint32_t));
+		assert(map->pcs != NULL && map->ids != NULL);
+		for (i = 0; i < size; i++) {
+			if (pcs[i] != 0) {
+				slot = (pcs[i] >> 2) * 2654435761u & (map->size - 1);
+				while (map->pcs[slot] != 0) {
+					slot = (slot + 1) & (map->size - 1);
+				}
+				map->pcs[slot] = pcs[i];
+				map->ids[slot] = ids[i];
+			}
+		}
+		free(pcs);
+		free(ids);
+	}
+	return map->used;
+}
+
+
+/***************************************************************/
+/* Run the program functionally to the end (or for max_instructions, if not */
+/* 0), writing one basic-block vector per interval instructions in          */
+/* SimPoint's "T:<id>:<count> ..." format, after a "# interval <n>" line.   */
+/* Returns the number of vectors written.                                   */
+/***************************************************************/
+uint32_t bbv_profile(sim_t *sim, uint32_t interval, uint32_t max_instructions, FILE *out)
+{
+	const decoded_inst_t *d;
+	bbv_map_t map;
+	uint32_t *counts = NULL, *touched = NULL, counts_size = 0, num_touched = 0;
+	uint32_t pc = sim->CURRENT_STATE.PC, pending = 0, next, id, n = 0, vectors = 0, i;
+
+	map.size = 1024;
+	map.used = 0;
+	map.pcs = calloc(map.size, sizeof(uint32_t));
+	map.ids = calloc(map.size, sizeof(uint32_t));
+	assert(map.pcs != NULL && map.ids != NULL);
+
+	fprintf(out, "# interval %u\n", interval);
+	id = bbv_map_id(&map, pc);
+	while (sim->RUN_FLAG) {
+		if (id >= counts_size) {
+			i = counts_size;
+			counts_size = id * 2;
+			counts = realloc(counts, counts_size * sizeof(uint32_t));
+			touched = realloc(touched, counts_size * sizeof(uint32_t));
+			assert(counts != NULL && touched != NULL);
+			memset(counts + i, 0, (counts_size - i) * sizeof(uint32_t));
+		}
+		if (counts[id]++ == 0) {
+			touched[num_touched++] = id;
+		}
+
+		d = functional_fetch(sim, pc);
+		next = functional_step(sim, d, pc, &pending);
+		sim->CURRENT_STATE.REGS[0] = 0;
+		sim->INSTRUCTION_COUNT++;
+		/* a block ends at every branch, jump or syscall, taken or not */
+		if (next != pc + 4 || (d->op >= OP_BLTZ && d->op <= OP_BGTZ) || d->op == OP_JR || d->op == OP_JALR || d->op == OP_SYSCALL) {
+			id = bbv_map_id(&map, next);
+		}
+		pc = next;
+
+		/* the last, partial interval gets a vector too */
+		if (max_instructions != 0 && sim->INSTRUCTION_COUNT >= max_instructions && !pending) {
+			sim->RUN_FLAG = FALSE;
+		}
+		if (++n == interval || !sim->RUN_FLAG) {
+			fputc('T', out);
+			for (i = 0; i < num_touched; i++) {
+				fprintf(out, ":%u:%u ", touched[i], counts[touched[i]]);
+				counts[touched[i]] = 0;
+			}
+			fputc('\n', out);
+			num_touched = 0;
+			n = 0;
+			vectors++;
+		}
+	}
+	sim->CURRENT_STATE.PC = pc;
+	pipeline_flush(sim);
+	fflush(out);
+
+	free(map.pcs);
+	free(map.ids);
+	free(counts);
+	free(touched);
+	return vectors;
+}
+
+
+/***************************************************************/
+/* Fixed pseudo-random projection of basic block id onto dimension j, in [-1, 1) */
+/***************************************************************/
+static double simpoint_projection(uint32_t id, int j)
+{
+	uint64_t x = ((uint64_t)id << 8 | j) * 0x9E3779B97F4A7C15ull;
+
+	x ^= x >> 31;
+	x *= 0xBF58476D1CE4E5B9ull;
+	x ^= x >> 29;
+	return (double)(x >> 11) / (double)(1ull << 52) - 1.0;
+}
+
+
+static uint64_t simpoint_random(uint64_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+
+static double simpoint_distance(const double *a, const double *b)
+{
+	double sum = 0, diff;
+	int j;
+
+	for (j = 0; j < SIMPOINT_DIMS; j++) {
+		diff = a[j] - b[j];
+		sum += diff * diff;
+	}
+	return sum;
+}
+
+
+/***************************************************************/
+/* k-means of n points with k-means++ seeding; returns the distortion (sum of */
+/* squared distances to the assigned centers)                                */
+/***************************************************************/
+static double simpoint_kmeans(const double (*x)[SIMPOINT_DIMS], uint32_t n, int k, uint64_t seed,
+	uint32_t *assign, double (*centers)[SIMPOINT_DIMS])
+{
+	double *nearest, total, pick, distortion, d;
+	uint32_t i, *sizes;
+	int c, j, iteration, changed;
+
+	nearest = malloc(n * sizeof(double));
+	sizes = malloc(k * sizeof(uint32_t));
+	assert(nearest != NULL && sizes != NULL);
+
+	memcpy(centers[0], x[simpoint_random(&seed) % n], sizeof(centers[0]));
+	for (i = 0; i < n; i++) {
+		nearest[i] = simpoint_distance(x[i], centers[0]);
+	}
+	for (c = 1; c < k; c++) {
+		for (i = 0, total = 0; i < n; i++) {
+			total += nearest[i];
+		}
+		pick = (double)(simpoint_random(&seed) >> 11) / (double)(1ull << 53) * total;
+		for (i = 0; i + 1 < n && pick >= nearest[i]; i++) {
+			pick -= nearest[i];
+		}
+		memcpy(centers[c], x[i], sizeof(centers[c]));
+		for (i = 0; i < n; i++) {
+			d = simpoint_distance(x[i], centers[c]);
+			if (d < nearest[i]) {
+				nearest[i] = d;
+			}
+		}
+	}
+
+	memset(assign, 0xFF, n * sizeof(uint32_t));
+	for (iteration = 0, changed = 1; changed && iteration < SIMPOINT_ITERATIONS; iteration++) {
+		changed = 0;
+		for (i = 0; i < n; i++) {
+			uint32_t best = 0;
+			for (c = 1; c < k; c++) {
+				if (simpoint_distance(x[i], centers[c]) < simpoint_distance(x[i], centers[best])) {
+					best = c;
+				}
+			}
+			if (assign[i] != best) {
+				assign[i] = best;
+				changed = 1;
+			}
+		}
+		memset(centers, 0, k * sizeof(centers[0]));
+		memset(sizes, 0, k * sizeof(uint32_t));
+		for (i = 0; i < n; i++) {
+			sizes[assign[i]]++;
+			for (j = 0; j < SIMPOINT_DIMS; j++) {
+				centers[assign[i]][j] += x[i][j];
+			}
+		}
+		for (c = 0; c < k; c++) {
+			for (j = 0; j < SIMPOINT_DIMS && sizes[c] > 0; j++) {
+				centers[c][j] /= sizes[c];
+			}
+		}
+	}
+
+	for (i = 0, distortion = 0; i < n; i++) {
+		distortion += simpoint_distance(x[i], centers[assign[i]]);
+	}
+	free(nearest);
+	free(sizes);
+	return distortion;
+}
+
+
+/***************************************************************/
+/* Bayesian information criterion of a clustering, as used by SimPoint      */
+/***************************************************************/
+static double simpoint_bic(uint32_t n, int k, const uint32_t *assign, double distortion)
+{
+	double variance, likelihood = 0, size;
+	uint32_t i, *sizes;
+	int c;
+
+	if (n <= (uint32_t)k) {
+		return -INFINITY;
+	}
+	sizes = calloc(k, sizeof(uint32_t));
+	assert(sizes != NULL);
+	for (i = 0; i < n; i++) {
+		sizes[assign[i]]++;
+	}
+	variance = distortion / (double)(n - k) / SIMPOINT_DIMS;
+	if (variance < 1e-12) {
+		variance = 1e-12;
+	}
+	for (c = 0; c < k; c++) {
+		size = sizes[c];
+		if (size > 0) {
+			likelihood += size * log(size) - size * log((double)n) - size * 0.5 * log(2 * M_PI)
+				- size * SIMPOINT_DIMS * 0.5 * log(variance) - (size - k) * 0.5;
+		}
+	}
+	free(sizes);
+	return likelihood - (double)k * (SIMPOINT_DIMS + 1) * 0.5 * log((double)n);
+}
+
+
+/***************************************************************/
+/* Cluster the basic-block vectors of a -p profile and print the chosen      */
+/* intervals as "<interval> <cluster> <weight>" lines: the interval closest  */
+/* to each cluster center, then samples-1 more members drawn from it, so     */
+/* the -S driver can estimate its error.                                     */
+/***************************************************************/
+void simpoint_cluster(const char *path, int max_k, int samples)
+{
+	double (*x)[SIMPOINT_DIMS] = NULL, (*centers)[SIMPOINT_DIMS], (*best_centers)[SIMPOINT_DIMS];
+	double distortion, best_distortion, *bic, low, high, d, closest;
+	uint32_t n = 0, x_size = 0, interval = 0, i, *assign, *best_assign, *chosen_assign, *sizes, pick, tokens;
+	uint32_t id, count, total;
+	uint64_t seed;
+	char *line = NULL, *p;
+	size_t line_size = 0;
+	int k, chosen, c, s, run, offset;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		printf("Error: Can't open profile %s\n", path);
+		exit(1);
+	}
+	while (getline(&line, &line_size, fp) != -1) {
+		if (line[0] == '#') {
+			sscanf(line, "# interval %u", &interval);
+			continue;
+		}
+		if (line[0] != 'T') {
+			continue;
+		}
+		if (n == x_size) {
+			x_size = x_size ? x_size * 2 : 1024;
+			x = realloc(x, x_size * sizeof(x[0]));
+			assert(x != NULL);
+		}
+		/* normalize to the instructions in the interval, then project */
+		for (p = line + 1, total = 0; sscanf(p, ":%u:%u %n", &id, &count, &offset) == 2; p += offset) {
+			total += count;
+		}
+		memset(x[n], 0, sizeof(x[n]));
+		for (p = line + 1, tokens = 0; sscanf(p, ":%u:%u %n", &id, &count, &offset) == 2; p += offset, tokens++) {
+			for (s = 0; s < SIMPOINT_DIMS; s++) {
+				x[n][s] += (double)count / total * simpoint_projection(id, s);
+			}
+		}
+		if (tokens > 0) {
+			n++;
+		}
+	}
+	free(line);
+	fclose(fp);
+	if (n == 0 || interval == 0) {
+		printf("Error: %s is not a -p profile\n", path);
+		exit(1);
+	}
+
+	if (max_k > (int)n) {
+		max_k = n;
+	}
+	assign = malloc(n * sizeof(uint32_t));
+	best_assign = malloc((size_t)n * max_k * sizeof(uint32_t));
+	centers = malloc(max_k * sizeof(centers[0]));
+	best_centers = malloc((size_t)max_k * max_k * sizeof(centers[0]));
+	bic = malloc(max_k * sizeof(double));
+	sizes = malloc(max_k * sizeof(uint32_t));
+	assert(assign != NULL && best_assign != NULL && centers != NULL && best_centers != NULL && bic != NULL && sizes != NULL);
+
+	for (k = 1; k <= max_k; k++) {
+		best_distortion = INFINITY;
+		for (run = 0; run < SIMPOINT_SEEDS; run++) {
+			seed = 0x853C49E6748FEA9Bull + k * 7919 + run;
+			distortion = simpoint_kmeans((const double (*)[SIMPOINT_DIMS])x, n, k, seed, assign, centers);
+			if (distortion < best_distortion) {
+				best_distortion = distortion;
+				memcpy(&best_assign[(size_t)n * (k - 1)], assign, n * sizeof(uint32_t));
+				memcpy(&best_centers[max_k * (k - 1)], centers, k * sizeof(centers[0]));
+			}
+		}
+		bic[k - 1] = k == 1 && n == 1 ? 0 : simpoint_bic(n, k, &best_assign[(size_t)n * (k - 1)], best_distortion);
+	}
+	for (k = 1, low = INFINITY, high = -INFINITY; k <= max_k; k++) {
+		if (isfinite(bic[k - 1])) {
+			low = bic[k - 1] < low ? bic[k - 1] : low;
+			high = bic[k - 1] > high ? bic[k - 1] : high;
+		}
+	}
+	for (chosen = 1; chosen < max_k && !(isfinite(bic[chosen - 1]) && bic[chosen - 1] >= low + SIMPOINT_BIC_THRESHOLD * (high - low)); chosen++);
+
+	chosen_assign = &best_assign[(size_t)n * (chosen - 1)];
+	memset(sizes, 0, max_k * sizeof(uint32_t));
+	for (i = 0; i < n; i++) {
+		sizes[chosen_assign[i]]++;
+	}
+	printf("# interval %u\n", interval);
+	printf("# %u intervals, %d clusters (BIC %.1f, range %.1f to %.1f)\n", n, chosen, bic[chosen - 1], low, high);
+	printf("# interval\tcluster\tweight\n");
+	seed = 0x2545F4914F6CDD1Dull;
+	for (c = 0; c < chosen; c++) {
+		if (sizes[c] == 0) {
+			continue;
+		}
+		for (i = 0, pick = 0, closest = INFINITY; i < n; i++) {
+			d = chosen_assign[i] == (uint32_t)c ? simpoint_distance(x[i], best_centers[max_k * (chosen - 1) + c]) : INFINITY;
+			if (d < closest) {
+				closest = d;
+				pick = i;
+			}
+		}
+		printf("%u\t%d\t%.6f\n", pick, c, (double)sizes[c] / n);
+		/* further samples: members drawn at random, without repeats */
+		for (s = 1; s < samples && (uint32_t)s < sizes[c]; s++) {
+			count = simpoint_random(&seed) % (sizes[c] - s);
+			for (i = 0; i < n; i++) {
+				if (chosen_assign[i] == (uint32_t)c && i != pick && count-- == 0) {
+					break;
+				}
+			}
+			chosen_assign[i] = max_k;	/* drawn */
+			printf("%u\t%d\t%.6f\n", i, c, (double)sizes[c] / n);
+		}
+	}
+	fflush(stdout);
+
+	free(x);
+	free(assign);
+	free(best_assign);
+	free(centers);
+	free(best_centers);
+	free(bic);
+	free(sizes);
+}
+
+
+/***************************************************************/
+/* Simulate the intervals chosen by -s in the pipeline and extrapolate       */
+/* whole-program CPI and L1Cache misses per 1000 instructions. Each interval */
+/* starts from a functional fast-forward, then runs warmup instructions in   */
+/* the pipeline to fill the cache before it is measured. Clusters are strata */
+/* of a stratified sample: the error is its 95% interval, known once every   */
+/* cluster is sampled twice or completely.                                   */
+/***************************************************************/
+void simpoint_run(const program_t *program, const batch_config_t *config, const char *path, uint32_t warmup)
+{
+	static const char *names[SIMPOINT_METRICS] = { "CPI", "L1Cache MPKI", "L1Cache APKI" };
+	simpoint_stratum_t *strata = NULL, *h;
+	uint32_t interval = 0, intervals = 0, index, cluster, num_strata = 0, start, warm, retired, cycles, hits, misses;
+	uint64_t begin, limit;
+	double weight, value[SIMPOINT_METRICS], estimate[SIMPOINT_METRICS] = { 0 }, variance[SIMPOINT_METRICS] = { 0 };
+	double mean, s2, size;
+	char *line = NULL;
+	size_t line_size = 0;
+	int i, m, known = TRUE;
+	sim_t *sim;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		printf("Error: Can't open simpoints %s\n", path);
+		exit(1);
+	}
+	printf("# interval\tcluster\tweight\tinstructions\tcycles\tcpi\tcache_hits\tcache_misses\n");
+	while (getline(&line, &line_size, fp) != -1) {
+		if (line[0] == '#') {
+			if (sscanf(line, "# interval %u", &interval) != 1) {
+				sscanf(line, "# %u intervals", &intervals);
+			}
+			continue;
+		}
+		if (sscanf(line, "%u %u %lf", &index, &cluster, &weight) != 3) {
+			continue;
+		}
+		if (interval == 0) {
+			printf("Error: %s does not give the interval length\n", path);
+			exit(1);
+		}
+		/* the instruction counters are 32-bit */
+		begin = (uint64_t)index * interval;
+		if (begin + interval > 0xFFFFFFFFu) {
+			printf("Error: interval %u of %s ends past instruction %u\n", index, path, 0xFFFFFFFFu);
+			exit(1);
+		}
+
+		sim = sim_create(program);
+		sim->ENABLE_FORWARDING = config->forwarding;
+		sim->EARLY_BRANCH = config->early_branch;
+		sim->DELAY_SLOTS = config->delay_slots;
+		sim->TRACE_LEVEL = TRACE_OFF;
+		for (i = 0; i < config->num_timings; i++) {
+			fu_set_timing(sim, &config->timings[i]);
+		}
+		for (i = 0; i < config->num_predictors; i++) {
+			bpred_add(sim, &config->predictors[i]);
+		}
+		initialize(sim);
+		load_program(sim);
+		start = begin > warmup ? begin - warmup : 0;
+		warm = begin - start;
+		fast_forward(sim, start);
+		/* warm up, then measure; a pipeline that stops retiring gives up after 1000 cycles per instruction, */
+		/* or when the 32-bit cycle counter runs out */
+		limit = sim->CYCLE_COUNT + ((uint64_t)warm + interval) * 1000;
+		if (limit > 0xFFFFFFFFu) {
+			limit = 0xFFFFFFFFu;
+		}
+		while (sim->RUN_FLAG && sim->INSTRUCTION_COUNT < warm && sim->CYCLE_COUNT < limit) {
+			cycle_fast(sim, 0);
+		}
+		retired = sim->INSTRUCTION_COUNT;
+		cycles = sim->CYCLE_COUNT;
+		hits = sim->cache_hits;
+		misses = sim->cache_misses;
+		while (sim->RUN_FLAG && sim->INSTRUCTION_COUNT - retired < interval && sim->CYCLE_COUNT < limit) {
+			cycle_fast(sim, 0);
+		}
+		retired = sim->INSTRUCTION_COUNT - retired;
+		cycles = sim->CYCLE_COUNT - cycles;
+		hits = sim->cache_hits - hits;
+		misses = sim->cache_misses - misses;
+		if (sim->RUN_FLAG && retired < interval) {
+			printf("# interval %u cut short: %u of %u instructions in %u cycles\n", index, retired, interval, cycles);
+		}
+		sim_destroy(sim);
+
+		value[0] = retired ? (double)cycles / retired : 0;
+		value[1] = retired ? 1000.0 * misses / retired : 0;
+		value[2] = retired ? 1000.0 * (hits + misses) / retired : 0;
+		printf("%u\t%u\t%.6f\t%u\t%u\t%.4f\t%u\t%u\n", index, cluster, weight, retired, cycles, value[0], hits, misses);
+
+		if (cluster >= num_strata) {
+			strata = realloc(strata, (cluster + 1) * sizeof(simpoint_stratum_t));
+			assert(strata != NULL);
+			memset(&strata[num_strata], 0, (cluster + 1 - num_strata) * sizeof(simpoint_stratum_t));
+			num_strata = cluster + 1;
+		}
+		h = &strata[cluster];
+		h->weight = weight;
+		h->samples++;
+		for (m = 0; m < SIMPOINT_METRICS; m++) {
+			h->sum[m] += value[m];
+			h->sum_sq[m] += value[m] * value[m];
+		}
+	}
+	free(line);
+	fclose(fp);
+
+	for (i = 0; i < (int)num_strata; i++) {
+		h = &strata[i];
+		if (h->samples == 0) {
+			continue;
+		}
+		size = h->weight * intervals;
+		if (h->samples < 2 && !(intervals > 0 && h->samples >= size - 0.5)) {
+			known = FALSE;
+		}
+		for (m = 0; m < SIMPOINT_METRICS; m++) {
+			mean = h->sum[m] / h->samples;
+			estimate[m] += h->weight * mean;
+			if (h->samples > 1) {
+				s2 = (h->sum_sq[m] - h->samples * mean * mean) / (h->samples - 1);
+				/* with the finite population correction when the cluster size is known */
+				variance[m] += h->weight * h->weight * (s2 > 0 ? s2 : 0) / h->samples
+					* (intervals > 0 && size > h->samples ? 1 - h->samples / size : intervals > 0 ? 0 : 1);
+			}
+		}
+	}
+	printf("# estimated");
+	for (m = 0; m < SIMPOINT_METRICS; m++) {
+		if (known) {
+			printf("%s %s %.4f +/- %.4f", m ? "," : "", names[m], estimate[m], 1.96 * sqrt(variance[m]));
+		} else {
+			printf("%s %s %.4f", m ? "," : "", names[m], estimate[m]);
+		}
+	}
+	printf(", L1Cache miss rate %.4f\n", estimate[2] > 0 ? estimate[1] / estimate[2] : 0);
+	if (!known) {
+		printf("# error unknown: sample each cluster at least twice (-s -N 2)\n");
 	}
-	printf("Simulation Finished.\n\n");
+	fflush(stdout);
+	free(strata);
 }
 
 
 /***************************************************************/ 
 /* Dump a word-aligned region of memory to the terminal                              */
 /***************************************************************/
-void mdump(uint32_t start, uint32_t stop) {          
+void mdump(sim_t *sim, uint32_t start, uint32_t stop) {          
 	uint32_t address;
 
 	printf("-------------------------------------------------------------\n");
@@ -129,7 +2046,7 @@ void mdump(uint32_t start, uint32_t stop) {
 	printf("-------------------------------------------------------------\n");
 	printf("\t[Address in Hex (Dec) ]\t[Value]\n");
 	for (address = start; address <= stop; address += 4){
-		printf("\t0x%08x (%d) :\t0x%08x\n", address, address, mem_read_32(address));
+		printf("\t0x%08x (%d) :\t0x%08x\n", address, address, mem_read_32(sim, address));
 	}
 	printf("\n");
 }
@@ -138,23 +2055,40 @@ void mdump(uint32_t start, uint32_t stop) {
 /***************************************************************/
 /* Dump current values of registers to the teminal                                              */   
 /***************************************************************/
-void rdump() {                               
+void rdump(sim_t *sim) {                               
 	int i; 
 	printf("-------------------------------------\n");
 	printf("Dumping Register Content\n");
 	printf("-------------------------------------\n");
-	printf("# Instructions Executed\t: %u\n", INSTRUCTION_COUNT);
-	printf("# Cycles Executed\t: %u\n", CYCLE_COUNT);
-	printf("PC\t: 0x%08x\n", CURRENT_STATE.PC);
+	printf("# Instructions Executed\t: %u\n", sim->INSTRUCTION_COUNT);
+	printf("# Cycles Executed\t: %u\n", sim->CYCLE_COUNT);
+	printf("# CPI\t\t\t: %.4f (branches resolved in %s%s)\n", sim->INSTRUCTION_COUNT ? (double)sim->CYCLE_COUNT / sim->INSTRUCTION_COUNT : 0.0,
+		sim->EARLY_BRANCH && !sim->DELAY_SLOTS ? "ID" : "EX", sim->DELAY_SLOTS ? ", delay slots" : "");
+	printf("PC\t: 0x%08x\n", sim->CURRENT_STATE.PC);
+	for (i = 0; i < sim->NUM_BPRED; i++) {
+		const bpred_t *bp = &sim->BPRED[i];
+		char desc[64];
+		bpred_describe(&bp->config, desc, sizeof(desc));
+		printf("# Branches (%s)\t: %llu, %llu mispredicted (%.2f%% correct), %llu BTB misses, CPI %.4f (%+.4f)%s\n", desc,
+			(unsigned long long)bp->stats.predictions, (unsigned long long)bp->stats.mispredictions,
+			bp->stats.predictions ? 100.0 * (bp->stats.predictions - bp->stats.mispredictions) / bp->stats.predictions : 100.0,
+			(unsigned long long)bp->stats.btb_misses, bpred_cpi(sim, i), bpred_cpi(sim, i) - bpred_cpi(sim, -1),
+			i ? " estimated" : "");
+		if (bp->config.ras_depth > 0) {
+			printf("# Returns (ras%u)\t: %llu, %llu mispredicted, %llu overflows, %llu underflows\n", bp->config.ras_depth,
+				(unsigned long long)bp->stats.returns, (unsigned long long)bp->stats.return_mispredictions,
+				(unsigned long long)bp->stats.ras_overflows, (unsigned long long)bp->stats.ras_underflows);
+		}
+	}
 	printf("-------------------------------------\n");
 	printf("[Register]\t[Value]\n");
 	printf("-------------------------------------\n");
 	for (i = 0; i < MIPS_REGS; i++){
-		printf("[R%d]\t: 0x%08x\n", i, CURRENT_STATE.REGS[i]);
+		printf("[R%d]\t: 0x%08x\n", i, sim->CURRENT_STATE.REGS[i]);
 	}
 	printf("-------------------------------------\n");
-	printf("[HI]\t: 0x%08x\n", CURRENT_STATE.HI);
-	printf("[LO]\t: 0x%08x\n", CURRENT_STATE.LO);
+	printf("[HI]\t: 0x%08x\n", sim->CURRENT_STATE.HI);
+	printf("[LO]\t: 0x%08x\n", sim->CURRENT_STATE.LO);
 	printf("-------------------------------------\n");
 }
 
@@ -162,14 +2096,17 @@ void rdump() {
 /***************************************************************/
 /* Read a command from standard input.                                                               */  
 /***************************************************************/
-void handle_command() {                         
+void handle_command(sim_t *sim) {                         
 	char buffer[20];
 	uint32_t start, stop, cycles;
 	uint32_t register_no;
 	int register_value;
 	int hi_reg_value, lo_reg_value;
+	int trace_level;
+	char path[256];
 
 	printf("\nMU-MIPS SIM:> ");
+	fflush(stdout);
 
 	if (scanf("%s", buffer) == EOF){
 		exit(0);
@@ -179,9 +2116,9 @@ void handle_command() {
 		case 'S':
 		case 's':
 			if (buffer[1] == 'h' || buffer[1] == 'H'){
-				show_pipeline();
+				show_pipeline(sim);
 			}else {
-				runAll(); 
+				runAll(sim); 
 			}
 			break;
 		case 'M':
@@ -189,7 +2126,7 @@ void handle_command() {
 			if (scanf("%x %x", &start, &stop) != 2){
 				break;
 			}
-			mdump(start, stop);
+			mdump(sim, start, stop);
 			break;
 		case '?':
 			help();
@@ -203,15 +2140,19 @@ void handle_command() {
 		case 'R':
 		case 'r':
 			if (buffer[1] == 'd' || buffer[1] == 'D'){
-				rdump();
+				rdump(sim);
+			}else if((buffer[1] == 'e' || buffer[1] == 'E') && (buffer[3] == 't' || buffer[3] == 'T')){
+				if (scanf("%255s", path) == 1) {
+					checkpoint_restore(sim, path);
+				}
 			}else if(buffer[1] == 'e' || buffer[1] == 'E'){
-				reset();
+				reset(sim);
 			}
 			else {
 				if (scanf("%d", &cycles) != 1) {
 					break;
 				}
-				run(cycles);
+				run(sim, cycles);
 			}
 			break;
 		case 'I':
@@ -219,37 +2160,70 @@ void handle_command() {
 			if (scanf("%u %i", &register_no, &register_value) != 2){
 				break;
 			}
-			CURRENT_STATE.REGS[register_no] = register_value;
-			NEXT_STATE.REGS[register_no] = register_value;
+			sim->CURRENT_STATE.REGS[register_no] = register_value;
+			sim->NEXT_STATE.REGS[register_no] = register_value;
 			break;
 		case 'H':
 		case 'h':
 			if (scanf("%i", &hi_reg_value) != 1){
 				break;
 			}
-			CURRENT_STATE.HI = hi_reg_value; 
-			NEXT_STATE.HI = hi_reg_value; 
+			sim->CURRENT_STATE.HI = hi_reg_value; 
+			sim->NEXT_STATE.HI = hi_reg_value; 
 			break;
 		case 'L':
 		case 'l':
 			if (scanf("%i", &lo_reg_value) != 1){
 				break;
 			}
-			CURRENT_STATE.LO = lo_reg_value;
-			NEXT_STATE.LO = lo_reg_value;
+			sim->CURRENT_STATE.LO = lo_reg_value;
+			sim->NEXT_STATE.LO = lo_reg_value;
 			break;
 		case 'P':
 		case 'p':
-			print_program(); 
+			print_program(sim); 
 			break;
 		case 'f':
-			if (scanf("%d", &ENABLE_FORWARDING) != 1) {
+			if (buffer[1] == 'f' || buffer[1] == 'F') {
+				if (scanf("%u", &cycles) == 1) {
+					fast_forward(sim, cycles);
+				}
+				break;
+			}
+			if (scanf("%d", &sim->ENABLE_FORWARDING) != 1) {
+				break;
+			}
+			sim->ENABLE_FORWARDING == 0 ? printf("Forwarding OFF\n") : printf("Forwarding ON\n");
+			break;
+		case 'E':
+		case 'e':
+			if (scanf("%u", &sim->EARLY_BRANCH) != 1) {
+				break;
+			}
+			printf("Branches resolve in %s\n", sim->EARLY_BRANCH && !sim->DELAY_SLOTS ? "ID" : "EX");
+			break;
+		case 'D':
+		case 'd':
+			if (scanf("%u", &sim->DELAY_SLOTS) != 1) {
+				break;
+			}
+			sim->DELAY_SLOTS == 0 ? printf("Delay slots OFF\n") : printf("Delay slots ON\n");
+			break;
+		case 't':
+			if (scanf("%d", &trace_level) != 1){
 				break;
 			}
-			ENABLE_FORWARDING == 0 ? printf("Forwarding OFF\n") : printf("Forwarding ON\n");
+			sim->TRACE_LEVEL = trace_level > TRACE_MAX ? TRACE_MAX : trace_level;
+			printf("Trace level %d\n", sim->TRACE_LEVEL);
 			break;
 		case 'c':
-			view_cache();
+			if (buffer[1] == 'h' || buffer[1] == 'H') {
+				if (scanf("%255s", path) == 1) {
+					checkpoint_save(sim, path);
+				}
+				break;
+			}
+			view_cache(sim);
 			break;
 		default:
 			printf("Invalid Command.\n");
@@ -261,125 +2235,432 @@ void handle_command() {
 /***************************************************************/
 /* reset registers/memory and reload program                                                    */
 /***************************************************************/
-void reset() {   
-	int i;
+void reset(sim_t *sim) {   
 	/*reset registers*/
-	for (i = 0; i < MIPS_REGS; i++){
-		CURRENT_STATE.REGS[i] = 0;
-	}
-	CURRENT_STATE.HI = 0;
-	CURRENT_STATE.LO = 0;
+	memset(&sim->CURRENT_STATE, 0, sizeof(sim->CURRENT_STATE));
 	
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-		memset(MEM_REGIONS[i].mem, 0, region_size);
-	}
+	/*drop only the pages the previous run dirtied*/
+	mem_clear(sim);
+	
+	/*clear pipeline latches, hazard state and cache*/
+	pipeline_flush(sim);
+	memset(&sim->L1Cache, 0, sizeof(sim->L1Cache));
+	memset(sim->WRITE_BUFFER, 0, sizeof(sim->WRITE_BUFFER));
 	
 	/*load program*/
-	load_program();
+	load_program(sim);
 	
-	/*reset PC*/
-	INSTRUCTION_COUNT = 0;
-	CURRENT_STATE.PC =  MEM_TEXT_BEGIN;
-	NEXT_STATE = CURRENT_STATE;
-	RUN_FLAG = TRUE;
+	/*reset PC and counters*/
+	sim->INSTRUCTION_COUNT = 0;
+	sim->CYCLE_COUNT = 0;
+	sim->cache_hits = 0;
+	sim->cache_misses = 0;
+	cache_models_reset(sim);
+	for (int i = 0; i < sim->NUM_BPRED; i++) {
+		bpred_reset(&sim->BPRED[i]);
+	}
+	sim->CURRENT_STATE.PC =  MEM_TEXT_BEGIN;
+	sim->NEXT_STATE = sim->CURRENT_STATE;
+	sim->RUN_FLAG = TRUE;
 }
 
 
 /***************************************************************/
-/* Allocate and set memory to zero                                                                            */
+/* Start with an empty page table; pages are allocated on first write        */
 /***************************************************************/
-void init_memory() {                                           
-	int i;
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-		MEM_REGIONS[i].mem = malloc(region_size);
-		memset(MEM_REGIONS[i].mem, 0, region_size);
+void init_memory(sim_t *sim) {                                           
+	memset(sim->MEM_PAGE_TABLE, 0, sizeof(sim->MEM_PAGE_TABLE));
+	sim->MEM_PAGES_ALLOCATED = 0;
+	mem_tlb_flush(sim);
+}
+
+
+/**************************************************************/
+/* Copy size bytes into guest memory at address, a page at a time                          */
+/**************************************************************/
+void mem_load(sim_t *sim, uint32_t address, const uint8_t *src, uint32_t size)
+{
+	uint32_t chunk;
+	uint8_t *page;
+	while (size > 0) {
+		chunk = MEM_PAGE_SIZE - (address & MEM_PAGE_MASK);
+		if (chunk > size) {
+			chunk = size;
+		}
+		page = mem_page_write(sim, address);
+		if (page != NULL) {
+			memcpy(page + (address & MEM_PAGE_MASK), src, chunk);
+		}
+		address += chunk;
+		src += chunk;
+		size -= chunk;
 	}
 }
 
 
 /**************************************************************/
-/* load program into memory                                                                                      */
+/* Load a binary program image; returns the number of text words                          */
 /**************************************************************/
-void load_program() {                   
-	FILE * fp;
-	int i, word;
-	uint32_t address;
+uint32_t load_image(sim_t *sim, const uint8_t *file, size_t size)
+{
+	image_header_t header;
 
-	/* Open program file. */
-	fp = fopen(prog_file, "r");
-	if (fp == NULL) {
-		printf("Error: Can't open program file %s\n", prog_file);
+	memcpy(&header, file, sizeof(header));
+	if (header.version != IMAGE_VERSION || header.text_base != MEM_TEXT_BEGIN || (header.text_size & 0x3) != 0
+			|| (uint64_t)header.text_size + header.data_size > size - sizeof(header)) {
+		printf("Error: Bad program image %s\n", sim->program->path);
 		exit(-1);
 	}
+	mem_load(sim, header.text_base, file + sizeof(header), header.text_size);
+	mem_load(sim, header.data_base, file + sizeof(header) + header.text_size, header.data_size);
+	return header.text_size >> 2;
+}
+
+
+/**************************************************************/
+/* Load hex text, one word per whitespace-separated token with an optional 0x prefix.       */
+/* Stops at the first token that is not a hex number. Returns the number of words.         */
+/**************************************************************/
+uint32_t load_hex(sim_t *sim, const char *text, size_t size)
+{
+	const char *p = text, *end = text + size;
+	uint32_t address = MEM_TEXT_BEGIN;
+	uint32_t word;
+	int digits, value;
+
+	for (;;) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+			p++;
+		}
+		if (end - p > 1 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+			p += 2;
+		}
+		word = 0;
+		for (digits = 0; p < end; digits++, p++) {
+			if (*p >= '0' && *p <= '9') {
+				value = *p - '0';
+			} else if ((*p | 0x20) >= 'a' && (*p | 0x20) <= 'f') {
+				value = (*p | 0x20) - 'a' + 10;
+			} else {
+				break;
+			}
+			word = (word << 4) | value;
+		}
+		if (digits == 0) {
+			break;
+		}
+		mem_write_32(sim, address, word);
+		TRACE(TRACE_INSTR, "writing 0x%08x into address 0x%08x (%d)\n", word, address, address);
+		address += 4;
+	}
+	return (address - MEM_TEXT_BEGIN) >> 2;
+}
+
+
+/**************************************************************/
+/* load program into memory                                                                                      */
+/**************************************************************/
+void load_program(sim_t *sim) {                   
+	const program_t *program = sim->program;
 
 	/* Read in the program. */
+	if (program->size >= sizeof(image_header_t) && memcmp(program->data, IMAGE_MAGIC, 4) == 0) {
+		sim->PROGRAM_SIZE = load_image(sim, program->data, program->size);
+	} else {
+		sim->PROGRAM_SIZE = load_hex(sim, (const char *)program->data, program->size);
+	}
+	TRACE(TRACE_SUMMARY, "Program loaded into memory.\n%d words written into memory.\n\n", sim->PROGRAM_SIZE);
+	predecode_program(sim);
+}
 
-	i = 0;
-	while( fscanf(fp, "%x\n", &word) != EOF ) {
-		address = MEM_TEXT_BEGIN + i;
-		mem_write_32(address, word);
-		printf("writing 0x%08x into address 0x%08x (%d)\n", word, address, address);
-		i += 4;
+
+/**************************************************************/
+/* Decode an instruction word fetched from addr                                                             */
+/**************************************************************/
+void decode_instruction(uint32_t addr, uint32_t instruction, decoded_inst_t *d) {
+	uint32_t opcode, function;
+
+	opcode = (instruction & 0xFC000000) >> 26;
+	function = instruction & 0x0000003F;
+	d->instruction = instruction;
+	d->rs = (instruction & 0x03E00000) >> 21;
+	d->rt = (instruction & 0x001F0000) >> 16;
+	d->rd = (instruction & 0x0000F800) >> 11;
+	d->sa = (instruction & 0x000007C0) >> 6;
+	d->uimm = instruction & 0x0000FFFF;
+	d->imm = (d->uimm & 0x8000) > 0 ? (d->uimm | 0xFFFF0000) : d->uimm;
+	d->target = addr + (d->imm << 2);
+
+	if(opcode == 0x00){
+		switch(function){
+			case 0x00: d->op = OP_SLL; break;
+			case 0x02: d->op = OP_SRL; break;
+			case 0x03: d->op = OP_SRA; break;
+			case 0x08: d->op = OP_JR; break;
+			case 0x09: d->op = OP_JALR; break;
+			case 0x0C: d->op = OP_SYSCALL; break;
+			case 0x10: d->op = OP_MFHI; break;
+			case 0x11: d->op = OP_MTHI; break;
+			case 0x12: d->op = OP_MFLO; break;
+			case 0x13: d->op = OP_MTLO; break;
+			case 0x18: d->op = OP_MULT; break;
+			case 0x19: d->op = OP_MULTU; break;
+			case 0x1A: d->op = OP_DIV; break;
+			case 0x1B: d->op = OP_DIVU; break;
+			case 0x20: d->op = OP_ADD; break;
+			case 0x21: d->op = OP_ADDU; break;
+			case 0x22: d->op = OP_SUB; break;
+			case 0x23: d->op = OP_SUBU; break;
+			case 0x24: d->op = OP_AND; break;
+			case 0x25: d->op = OP_OR; break;
+			case 0x26: d->op = OP_XOR; break;
+			case 0x27: d->op = OP_NOR; break;
+			case 0x2A: d->op = OP_SLT; break;
+			default: d->op = OP_UNKNOWN; break;
+		}
 	}
-	PROGRAM_SIZE = i/4;
-	printf("Program loaded into memory.\n%d words written into memory.\n\n", PROGRAM_SIZE);
-	fclose(fp);
+	else{
+		switch(opcode){
+			case 0x01:
+				if(d->rt == 0){
+					d->op = OP_BLTZ;
+				}
+				else if(d->rt == 1){
+					d->op = OP_BGEZ;
+				}
+				else{
+					d->op = OP_NOP;
+				}
+				break;
+			case 0x02:
+				d->op = OP_J;
+				d->target = (addr & 0xF0000000) | ((instruction & 0x03FFFFFF) << 2);
+				break;
+			case 0x03:
+				d->op = OP_JAL;
+				d->target = (addr & 0xF0000000) | ((instruction & 0x03FFFFFF) << 2);
+				break;
+			case 0x04: d->op = OP_BEQ; break;
+			case 0x05: d->op = OP_BNE; break;
+			case 0x06: d->op = OP_BLEZ; break;
+			case 0x07: d->op = OP_BGTZ; break;
+			case 0x08: d->op = OP_ADDI; break;
+			case 0x09: d->op = OP_ADDIU; break;
+			case 0x0A: d->op = OP_SLTI; break;
+			case 0x0C: d->op = OP_ANDI; break;
+			case 0x0D: d->op = OP_ORI; break;
+			case 0x0E: d->op = OP_XORI; break;
+			case 0x0F: d->op = OP_LUI; break;
+			case 0x20: d->op = OP_LB; break;
+			case 0x21: d->op = OP_LH; break;
+			case 0x23: d->op = OP_LW; break;
+			case 0x28: d->op = OP_SB; break;
+			case 0x29: d->op = OP_SH; break;
+			case 0x2B: d->op = OP_SW; break;
+			default: d->op = OP_UNKNOWN; break;
+		}
+	}
+}
+
+
+/**************************************************************/
+/* Return the decoded form of instruction fetched from addr. The word is     */
+/* checked too: the latched one can predate a store that rewrote it.       */
+/**************************************************************/
+decoded_inst_t *decode_lookup(sim_t *sim, uint32_t addr, uint32_t instruction) {
+	uint32_t index = (addr - MEM_TEXT_BEGIN) >> 2;
+	decoded_inst_t *d;
+
+	if ((addr & 0x3) == 0 && index < sim->DECODED_SIZE) {
+		d = &sim->DECODED[index];
+		if (d->op == OP_INVALID) {
+			decode_instruction(addr, mem_read_32(sim, addr), d);
+		}
+		if (d->instruction == instruction) {
+			return d;
+		}
+	}
+	decode_instruction(addr, instruction, &sim->DECODE_SCRATCH);
+	return &sim->DECODE_SCRATCH;
+}
+
+
+/**************************************************************/
+/* Drop decoded entries overlapping a store of size bytes at address                                  */
+/**************************************************************/
+void decode_invalidate(sim_t *sim, uint32_t address, uint32_t size) {
+	uint32_t first = (address - MEM_TEXT_BEGIN) >> 2;
+	uint32_t last = (address + size - 1 - MEM_TEXT_BEGIN) >> 2;
+	uint32_t i;
+
+	for (i = first; i <= last && i < sim->DECODED_SIZE; i++) {
+		sim->DECODED[i].op = OP_INVALID;
+	}
+}
+
+
+/**************************************************************/
+/* Decode the whole text segment once, right after loading                                               */
+/**************************************************************/
+void predecode_program(sim_t *sim) {
+	uint32_t i;
+
+	free(sim->DECODED);
+	sim->DECODED = malloc((sim->PROGRAM_SIZE + 1) * sizeof(decoded_inst_t));
+	assert(sim->DECODED != NULL);
+	sim->DECODED_SIZE = sim->PROGRAM_SIZE;
+	for (i = 0; i < sim->DECODED_SIZE; i++) {
+		decode_instruction(MEM_TEXT_BEGIN + (i << 2), mem_read_32(sim, MEM_TEXT_BEGIN + (i << 2)), &sim->DECODED[i]);
+	}
+	/* entry past the end is never valid */
+	sim->DECODED[sim->DECODED_SIZE].op = OP_INVALID;
 }
 
 
-void view_cache() {
+void view_cache(sim_t *sim) {
 	printf("\n");
-	printf("Hits: %d Misses: %d",cache_hits, cache_misses);
+	printf("Hits: %d Misses: %d",sim->cache_hits, sim->cache_misses);
 	for(int i=0; i<16; i++) {	
-		printf("\nBlock: %2d | Tag: %8x | %8x  %8x  %8x  %8x", i, L1Cache.blocks[i].tag, L1Cache.blocks[i].words[0], L1Cache.blocks[i].words[1], L1Cache.blocks[i].words[2], L1Cache.blocks[i].words[3]);
+		printf("\nBlock: %2d | Tag: %8x | %8x  %8x  %8x  %8x", i, sim->L1Cache.blocks[i].tag, sim->L1Cache.blocks[i].words[0], sim->L1Cache.blocks[i].words[1], sim->L1Cache.blocks[i].words[2], sim->L1Cache.blocks[i].words[3]);
+	}
+	for (int i = 0; i < sim->NUM_CACHE_MODELS; i++) {
+		char desc[64];
+		cache_model_describe(&sim->CACHE_MODELS[i].config, desc, sizeof(desc));
+		printf("\nModel %d: %-24s | Hits: %llu Misses: %llu Stall cycles: %llu", i, desc,
+			(unsigned long long)sim->CACHE_MODELS[i].stats.hits, (unsigned long long)sim->CACHE_MODELS[i].stats.misses,
+			(unsigned long long)sim->CACHE_MODELS[i].stats.stall_cycles);
+	}
+}
+
+
+/***************************************************************/
+/* Attach another cache model; it sees every load and store from here on    */
+/***************************************************************/
+void cache_model_add(sim_t *sim, const cache_config_t *config)
+{
+	sim->CACHE_MODELS = realloc(sim->CACHE_MODELS, (sim->NUM_CACHE_MODELS + 1) * sizeof(cache_model_t));
+	assert(sim->CACHE_MODELS != NULL);
+	cache_model_init(&sim->CACHE_MODELS[sim->NUM_CACHE_MODELS++], config);
+}
+
+
+/***************************************************************/
+/* Empty every cache model and zero its counters                            */
+/***************************************************************/
+void cache_models_reset(sim_t *sim)
+{
+	int i;
+
+	for (i = 0; i < sim->NUM_CACHE_MODELS; i++) {
+		cache_model_reset(&sim->CACHE_MODELS[i]);
+	}
+}
+
+
+/***************************************************************/
+/* Feed one data reference to every cache model                             */
+/***************************************************************/
+void cache_models_access(sim_t *sim, uint32_t address, int store)
+{
+	int i;
+
+	for (i = 0; i < sim->NUM_CACHE_MODELS; i++) {
+		cache_model_access(&sim->CACHE_MODELS[i], address, store);
+	}
+}
+
+
+/***************************************************************/
+/* Add a branch predictor. The first one steers IF from here on; the others */
+/* are trained on the same branches, predicting each as EX resolves it.     */
+/***************************************************************/
+void bpred_add(sim_t *sim, const bpred_config_t *config)
+{
+	sim->BPRED = realloc(sim->BPRED, (sim->NUM_BPRED + 1) * sizeof(bpred_t));
+	assert(sim->BPRED != NULL);
+	bpred_init(&sim->BPRED[sim->NUM_BPRED++], config);
+}
+
+
+/***************************************************************/
+/* CPI had predictor i (-1: none) steered IF. A branch or jump costs one    */
+/* cycle when mispredicted and one cycle always without a predictor, so     */
+/* the cycles are BPRED[0]'s, moved by the difference in those costs.       */
+/***************************************************************/
+double bpred_cpi(const sim_t *sim, int i)
+{
+	const bpred_stats_t *used = &sim->BPRED[0].stats;
+	double cycles = sim->CYCLE_COUNT;
+
+	if (sim->INSTRUCTION_COUNT == 0) {
+		return 0;
+	}
+	if (i < 0) {
+		cycles += (double)used->predictions - used->mispredictions;
+	} else {
+		cycles += (double)sim->BPRED[i].stats.mispredictions - used->mispredictions;
 	}
+	return cycles / sim->INSTRUCTION_COUNT;
 }
 
 
 /************************************************************/
 /* maintain the pipeline            */ 
 /************************************************************/
-void handle_pipeline()
+void handle_pipeline(sim_t *sim)
 {
 	/*INSTRUCTION_COUNT should be incremented when instruction is done*/
 	/*Since we do not have branch/jump instructions, INSTRUCTION_COUNT should be incremented in WB stage */
 	
-	WB();
-	MEM();
-	EX();
-	ID();
-	IF();
+	WB(sim);
+	MEM(sim);
+	EX(sim);
+	ID(sim);
+	IF(sim);
 }
 
 
 /************************************************************/
 /* writeback (WB) pipeline stage:            */ 
 /************************************************************/
-void WB()
+void WB(sim_t *sim)
 {
-	if(WB_FLAG == 1) {
-		uint32_t instruction = MEM_WB.IR;
+	if(sim->WB_FLAG == 1) {
+		uint32_t instruction = sim->MEM_WB.IR;
 		uint32_t opcode = (instruction & 0xFC000000) >> 24;
+		/* bubbles carry PC 0 */
+		if (sim->MEM_WB.PC != 0) {
+			sim->INSTRUCTION_COUNT++;
+		}
 		uint32_t function = instruction & 0x0000003F;
 
 		switch(opcode) {
 			case 0x00: //R type
-				if(function == 0xc && MEM_WB.ALUOutput == 0xA) {
-					RUN_FLAG = 0;
+				if(function == 0xc && sim->MEM_WB.ALUOutput == 0xA) {
+					sim->RUN_FLAG = 0;
+				} else if(function == 0x08) {
+					//JR writes nothing; its D and ALUOutput are left over from the instruction before
 				} else {
-					NEXT_STATE.REGS[MEM_WB.D] = MEM_WB.ALUOutput;
+					sim->NEXT_STATE.REGS[sim->MEM_WB.D] = sim->MEM_WB.ALUOutput;
 				}
 				break;
 			case 0x80: //LB
-				NEXT_STATE.REGS[MEM_WB.D] = MEM_WB.LMD;
+				sim->NEXT_STATE.REGS[sim->MEM_WB.D] = sim->MEM_WB.LMD;
 				break;
 			case 0x84: //LH
-				NEXT_STATE.REGS[MEM_WB.D] = MEM_WB.LMD;
+				sim->NEXT_STATE.REGS[sim->MEM_WB.D] = sim->MEM_WB.LMD;
 				break;
 			case 0x8C: //LW
-				NEXT_STATE.REGS[MEM_WB.D] = MEM_WB.LMD;
+				sim->NEXT_STATE.REGS[sim->MEM_WB.D] = sim->MEM_WB.LMD;
+				break;
+			case 0x04: //BLTZ, BGEZ
+			case 0x08: //J
+			case 0x0C: //JAL: EX wrote $31
+			case 0x10: //BEQ
+			case 0x14: //BNE
+			case 0x18: //BLEZ
+			case 0x1C: //BGTZ
+				//nothing to write; D and ALUOutput are left over, e.g. a load's address
 				break;
 			case 0xA0: //SB
 
@@ -391,10 +2672,22 @@ void WB()
 
 				break;
 			default: //I Type
-				NEXT_STATE.REGS[MEM_WB.D] = MEM_WB.ALUOutput;
+				sim->NEXT_STATE.REGS[sim->MEM_WB.D] = sim->MEM_WB.ALUOutput;
 				break;
 		}
-		CURRENT_STATE = NEXT_STATE;
+		sim->CURRENT_STATE = sim->NEXT_STATE;
+	}
+}
+
+
+/************************************************************/
+/* A hit that takes more than one cycle holds MEM like a short miss */
+/************************************************************/
+static inline void mem_hit_latency(sim_t *sim, int op)
+{
+	if (sim->FU_LATENCY[op] > 1) {
+		sim->MEM_STALL = sim->FU_LATENCY[op] - 1;
+		sim->EX_MEM = Empty;
 	}
 }
 
@@ -402,29 +2695,33 @@ void WB()
 /************************************************************/
 /* memory access (MEM) pipeline stage:           */ 
 /************************************************************/
-void MEM()
+void MEM(sim_t *sim)
 {
 
-	if(MEM_FLAG == 1) {
-		if(MEM_STALL == 0) {
-			uint32_t instruction = EX_MEM.IR;
+	if(sim->MEM_FLAG == 1) {
+		if(sim->MEM_STALL == 0) {
+			uint32_t instruction = sim->EX_MEM.IR;
 			uint32_t opcode = (instruction & 0xFC000000) >> 24;
 			uint32_t function = instruction & 0x0000003F;
 
 			//Forward Pipeline
-			MEM_WB.IR = EX_MEM.IR;
-			MEM_WB.D  = EX_MEM.D;
-			MEM_WB.B  = EX_MEM.B;
-			MEM_WB.A  = EX_MEM.A;
-			MEM_WB.ALUOutput = EX_MEM.ALUOutput;
-			MEM_WB.rs = EX_MEM.rs;
-			MEM_WB.rd = EX_MEM.rd;
-			MEM_WB.rt = EX_MEM.rt;
-			MEM_WB.RegWrite = EX_MEM.RegWrite;
+			sim->MEM_WB.IR = sim->EX_MEM.IR;
+			sim->MEM_WB.PC = sim->EX_MEM.PC;
+			sim->MEM_WB.D  = sim->EX_MEM.D;
+			sim->MEM_WB.B  = sim->EX_MEM.B;
+			sim->MEM_WB.A  = sim->EX_MEM.A;
+			sim->MEM_WB.ALUOutput = sim->EX_MEM.ALUOutput;
+			sim->MEM_WB.rs = sim->EX_MEM.rs;
+			sim->MEM_WB.rd = sim->EX_MEM.rd;
+			sim->MEM_WB.rt = sim->EX_MEM.rt;
+			sim->MEM_WB.RegWrite = sim->EX_MEM.RegWrite;
 
 			//If load instr
 			if(opcode == 0x80 || opcode == 0x84 || opcode == 0x8C) {
-				
+				if (sim->NUM_CACHE_MODELS > 0) {
+					cache_models_access(sim, sim->EX_MEM.ALUOutput, FALSE);
+				}
+
 				//create mask 
 				uint32_t mask = 0;
 				if(opcode == 0x80) {
@@ -436,391 +2733,512 @@ void MEM()
 				}
 
 				//break up addr
-				uint32_t index = (EX_MEM.ALUOutput & 0x000000F0) >> 4;
-				uint32_t tag   = (EX_MEM.ALUOutput & 0xFFFFFF00) >> 8;
-				uint32_t woff  = (EX_MEM.ALUOutput & 0x0000000C) >> 2;
-				uint32_t boff  = (EX_MEM.ALUOutput & 0x00000003);
+				uint32_t index = (sim->EX_MEM.ALUOutput & 0x000000F0) >> 4;
+				uint32_t tag   = (sim->EX_MEM.ALUOutput & 0xFFFFFF00) >> 8;
+				uint32_t woff  = (sim->EX_MEM.ALUOutput & 0x0000000C) >> 2;
+				uint32_t boff  = (sim->EX_MEM.ALUOutput & 0x00000003);
 
 				//if L1Cache hit
-				if(L1Cache.blocks[index].valid == 1 && L1Cache.blocks[index].tag == tag) {
-					MEM_WB.LMD = L1Cache.blocks[index].words[woff] & mask;
-					cache_hits += 1;
+				if(sim->L1Cache.blocks[index].valid == 1 && sim->L1Cache.blocks[index].tag == tag) {
+					sim->MEM_WB.LMD = sim->L1Cache.blocks[index].words[woff] & mask;
+					sim->cache_hits += 1;
+					mem_hit_latency(sim, opcode == 0x80 ? OP_LB : opcode == 0x84 ? OP_LH : OP_LW);
 				} else {
 					//if L1Cache miss
 					//Get from mem
-					uint32_t start_addr = EX_MEM.ALUOutput & 0xFFFFFFFC;
+					uint32_t start_addr = sim->EX_MEM.ALUOutput & 0xFFFFFFFC;
 
-					L1Cache.blocks[index].words[0] = mem_read_32((start_addr & 0xFFFFFFF0));
-					L1Cache.blocks[index].words[1] = mem_read_32((start_addr & 0xFFFFFFF0) + 4);
-					L1Cache.blocks[index].words[2] = mem_read_32((start_addr & 0xFFFFFFF0) + 8);
-					L1Cache.blocks[index].words[3] = mem_read_32((start_addr & 0xFFFFFFF0) + 12);
+					sim->L1Cache.blocks[index].words[0] = mem_read_32(sim, (start_addr & 0xFFFFFFF0));
+					sim->L1Cache.blocks[index].words[1] = mem_read_32(sim, (start_addr & 0xFFFFFFF0) + 4);
+					sim->L1Cache.blocks[index].words[2] = mem_read_32(sim, (start_addr & 0xFFFFFFF0) + 8);
+					sim->L1Cache.blocks[index].words[3] = mem_read_32(sim, (start_addr & 0xFFFFFFF0) + 12);
 
 					//update tag
-					L1Cache.blocks[index].tag = tag;
+					sim->L1Cache.blocks[index].tag = tag;
 
 					//update valid
-					L1Cache.blocks[index].valid = 1;
+					sim->L1Cache.blocks[index].valid = 1;
 
 					//Get LMD
-					MEM_WB.LMD = L1Cache.blocks[index].words[woff] & mask;
+					sim->MEM_WB.LMD = sim->L1Cache.blocks[index].words[woff] & mask;
 
-					MEM_STALL = 100;
-					EX_MEM  = Empty;
-					cache_misses += 1;
+					sim->MEM_STALL = 100;
+					sim->EX_MEM  = Empty;
+					sim->cache_misses += 1;
 				}
 			} 
 			//if store instr
 			else if(opcode == 0xA0 || opcode == 0xA4 || opcode == 0xAC) {
+				if (sim->NUM_CACHE_MODELS > 0) {
+					cache_models_access(sim, sim->EX_MEM.ALUOutput, TRUE);
+				}
 
 				//break up addr
-				uint32_t index = (EX_MEM.ALUOutput & 0x000000F0) >> 4;
-				uint32_t tag   = (EX_MEM.ALUOutput & 0xFFFFFF00) >> 8;
-				uint32_t woff  = (EX_MEM.ALUOutput & 0x0000000C) >> 2;
-				uint32_t boff  = (EX_MEM.ALUOutput & 0x00000003);
+				uint32_t index = (sim->EX_MEM.ALUOutput & 0x000000F0) >> 4;
+				uint32_t tag   = (sim->EX_MEM.ALUOutput & 0xFFFFFF00) >> 8;
+				uint32_t woff  = (sim->EX_MEM.ALUOutput & 0x0000000C) >> 2;
+				uint32_t boff  = (sim->EX_MEM.ALUOutput & 0x00000003);
 
 				//if L1Cache hit
-				if(L1Cache.blocks[index].valid == 1 && L1Cache.blocks[index].tag == tag) {
-					L1Cache.blocks[index].words[woff] =  EX_MEM.D;
+				if(sim->L1Cache.blocks[index].valid == 1 && sim->L1Cache.blocks[index].tag == tag) {
+					sim->L1Cache.blocks[index].words[woff] =  sim->EX_MEM.D;
 					//Place in write buffer
-					WRITE_BUFFER[0] = L1Cache.blocks[index].words[0];
-					WRITE_BUFFER[1] = L1Cache.blocks[index].words[1];
-					WRITE_BUFFER[2] = L1Cache.blocks[index].words[2];
-					WRITE_BUFFER[3] = L1Cache.blocks[index].words[3];
+					sim->WRITE_BUFFER[0] = sim->L1Cache.blocks[index].words[0];
+					sim->WRITE_BUFFER[1] = sim->L1Cache.blocks[index].words[1];
+					sim->WRITE_BUFFER[2] = sim->L1Cache.blocks[index].words[2];
+					sim->WRITE_BUFFER[3] = sim->L1Cache.blocks[index].words[3];
 
 					//update memory
-					mem_write_32((EX_MEM.ALUOutput & 0xFFFFFFF0),WRITE_BUFFER[0]);
-					mem_write_32((EX_MEM.ALUOutput & 0xFFFFFFF0) + 4,WRITE_BUFFER[1]);
-					mem_write_32((EX_MEM.ALUOutput & 0xFFFFFFF0) + 8,WRITE_BUFFER[2]);
-					mem_write_32((EX_MEM.ALUOutput & 0xFFFFFFF0) + 12,WRITE_BUFFER[3]);
+					mem_write_32(sim, (sim->EX_MEM.ALUOutput & 0xFFFFFFF0),sim->WRITE_BUFFER[0]);
+					mem_write_32(sim, (sim->EX_MEM.ALUOutput & 0xFFFFFFF0) + 4,sim->WRITE_BUFFER[1]);
+					mem_write_32(sim, (sim->EX_MEM.ALUOutput & 0xFFFFFFF0) + 8,sim->WRITE_BUFFER[2]);
+					mem_write_32(sim, (sim->EX_MEM.ALUOutput & 0xFFFFFFF0) + 12,sim->WRITE_BUFFER[3]);
 
 					//Clear Write Buffer
-					WRITE_BUFFER[0] = 0x0;
-					WRITE_BUFFER[1] = 0x0;
-					WRITE_BUFFER[2] = 0x0;
-					WRITE_BUFFER[3] = 0x0;
+					sim->WRITE_BUFFER[0] = 0x0;
+					sim->WRITE_BUFFER[1] = 0x0;
+					sim->WRITE_BUFFER[2] = 0x0;
+					sim->WRITE_BUFFER[3] = 0x0;
 
-					cache_hits += 1;
+					sim->cache_hits += 1;
+					mem_hit_latency(sim, opcode == 0xA0 ? OP_SB : opcode == 0xA4 ? OP_SH : OP_SW);
 				} else {
 					//if L1Cache miss
 					//Get from mem
-					uint32_t start_addr = EX_MEM.ALUOutput & 0xFFFFFFFC;
+					uint32_t start_addr = sim->EX_MEM.ALUOutput & 0xFFFFFFFC;
 
-					L1Cache.blocks[index].words[0] = mem_read_32((start_addr & 0xFFFFFFF0));
-					L1Cache.blocks[index].words[1] = mem_read_32((start_addr & 0xFFFFFFF0) + 4);
-					L1Cache.blocks[index].words[2] = mem_read_32((start_addr & 0xFFFFFFF0) + 8);
-					L1Cache.blocks[index].words[3] = mem_read_32((start_addr & 0xFFFFFFF0) + 12);
+					sim->L1Cache.blocks[index].words[0] = mem_read_32(sim, (start_addr & 0xFFFFFFF0));
+					sim->L1Cache.blocks[index].words[1] = mem_read_32(sim, (start_addr & 0xFFFFFFF0) + 4);
+					sim->L1Cache.blocks[index].words[2] = mem_read_32(sim, (start_addr & 0xFFFFFFF0) + 8);
+					sim->L1Cache.blocks[index].words[3] = mem_read_32(sim, (start_addr & 0xFFFFFFF0) + 12);
 
 					//update tag
-					L1Cache.blocks[index].tag = tag;
+					sim->L1Cache.blocks[index].tag = tag;
 
 					//update valid
-					L1Cache.blocks[index].valid = 1;
+					sim->L1Cache.blocks[index].valid = 1;
 
 					//Update L1Cache
-					L1Cache.blocks[index].words[woff] =  EX_MEM.D;
+					sim->L1Cache.blocks[index].words[woff] =  sim->EX_MEM.D;
 
 					//Place in write buffer
-					WRITE_BUFFER[0] = L1Cache.blocks[index].words[0];
-					WRITE_BUFFER[1] = L1Cache.blocks[index].words[1];
-					WRITE_BUFFER[2] = L1Cache.blocks[index].words[2];
-					WRITE_BUFFER[3] = L1Cache.blocks[index].words[3];
+					sim->WRITE_BUFFER[0] = sim->L1Cache.blocks[index].words[0];
+					sim->WRITE_BUFFER[1] = sim->L1Cache.blocks[index].words[1];
+					sim->WRITE_BUFFER[2] = sim->L1Cache.blocks[index].words[2];
+					sim->WRITE_BUFFER[3] = sim->L1Cache.blocks[index].words[3];
 
 					//update memory
-					mem_write_32((EX_MEM.ALUOutput & 0xFFFFFFF0),WRITE_BUFFER[0]);
-					mem_write_32((EX_MEM.ALUOutput & 0xFFFFFFF0) + 4,WRITE_BUFFER[1]);
-					mem_write_32((EX_MEM.ALUOutput & 0xFFFFFFF0) + 8,WRITE_BUFFER[2]);
-					mem_write_32((EX_MEM.ALUOutput & 0xFFFFFFF0) + 12,WRITE_BUFFER[3]);
+					mem_write_32(sim, (sim->EX_MEM.ALUOutput & 0xFFFFFFF0),sim->WRITE_BUFFER[0]);
+					mem_write_32(sim, (sim->EX_MEM.ALUOutput & 0xFFFFFFF0) + 4,sim->WRITE_BUFFER[1]);
+					mem_write_32(sim, (sim->EX_MEM.ALUOutput & 0xFFFFFFF0) + 8,sim->WRITE_BUFFER[2]);
+					mem_write_32(sim, (sim->EX_MEM.ALUOutput & 0xFFFFFFF0) + 12,sim->WRITE_BUFFER[3]);
 
 					//Clear Write Buffer
-					WRITE_BUFFER[0] = 0x0;
-					WRITE_BUFFER[1] = 0x0;
-					WRITE_BUFFER[2] = 0x0;
-					WRITE_BUFFER[3] = 0x0;
-
-					MEM_STALL = 100;
-					EX_MEM  = Empty;
-					cache_misses += 1;
+					sim->WRITE_BUFFER[0] = 0x0;
+					sim->WRITE_BUFFER[1] = 0x0;
+					sim->WRITE_BUFFER[2] = 0x0;
+					sim->WRITE_BUFFER[3] = 0x0;
+
+					sim->MEM_STALL = 100;
+					sim->EX_MEM  = Empty;
+					sim->cache_misses += 1;
 				}
 			}
 		} else {
-			if(MEM_STALL > 0) {
-				MEM_STALL -= 1;
-				MEM_WB = Empty;
+			if(sim->MEM_STALL > 0) {
+				sim->MEM_STALL -= 1;
+				sim->MEM_WB = Empty;
 			}
 		}
-		WB_FLAG = 1;
+		sim->WB_FLAG = 1;
+	}
+}
+
+/************************************************************/
+/* Train the predictors on the branch or jump in ID_EX, resolved to next    */
+/************************************************************/
+static inline void bpred_train(sim_t *sim, int taken, uint32_t next)
+{
+	int i;
+
+	/* BPRED[0] predicted at fetch; the others predict now, with their own history and stack */
+	for (i = 0; i < sim->NUM_BPRED; i++) {
+		bpred_t *bp = &sim->BPRED[i];
+		if (i == 0) {
+			bpred_update(bp, sim->ID_EX.PC, sim->ID_EX.IR, taken, next, sim->ID_EX.NPC, &sim->ID_EX.bpred);
+		} else {
+			bpred_snapshot_t snapshot;
+			uint32_t predicted = bpred_predict(bp, sim->ID_EX.PC, sim->ID_EX.IR, &snapshot);
+			bpred_update(bp, sim->ID_EX.PC, sim->ID_EX.IR, taken, next, predicted, &snapshot);
+		}
+	}
+}
+
+
+/************************************************************/
+/* The branch or jump in ID_EX has been resolved: BRANCH_FLAG and          */
+/* NEXT_STATE.PC say where it went. Train the predictor, and squash the    */
+/* instruction IF fetched after it only if that came from the wrong PC.    */
+/************************************************************/
+static inline void branch_resolve(sim_t *sim, uint32_t fetch_pc, int stall_count)
+{
+	uint32_t next = sim->BRANCH_FLAG ? sim->NEXT_STATE.PC : sim->ID_EX.PC + 4;
+
+	bpred_train(sim, sim->BRANCH_FLAG, next);
+	if (next == sim->ID_EX.NPC) {
+		/* already fetching the right path: no flush, and no stall cycle */
+		sim->BRANCH_FLAG = 0;
+		sim->NEXT_STATE.PC = fetch_pc;
+		sim->STALL_COUNT = stall_count;
+	} else {
+		sim->NEXT_STATE.PC = next;
+		sim->BRANCH_FLAG = 1;
+		sim->STALL_COUNT = 0;
 	}
 }
 
+
 /************************************************************/
 /* execution (EX) pipeline stage:     */ 
 /************************************************************/
-void EX()
+void EX(sim_t *sim)
 {
-	if(EX_FLAG == 1 && MEM_STALL == 0) {
-		uint32_t instruction = ID_EX.IR;
+	if(sim->EX_FLAG == 1 && sim->MEM_STALL == 0) {
+		uint32_t instruction = sim->ID_EX.IR;
 		uint32_t opcode = (instruction & 0xFC000000) >> 26;
 		uint32_t function = instruction & 0x0000003F;
+		uint32_t fetch_pc = sim->NEXT_STATE.PC;
+		uint32_t link = sim->ID_EX.PC + (sim->DELAY_SLOTS ? 8 : 4);	/* past the delay slot with -D 1 */
+		int stall_count = sim->STALL_COUNT;
 		uint64_t product;
 
-		EX_MEM.D = ID_EX.D;
-		EX_MEM.PC = ID_EX.PC;
-		EX_MEM.IR = ID_EX.IR;
-		EX_MEM.rs = ID_EX.rs;
-		EX_MEM.rd = ID_EX.rd;
-		EX_MEM.rt = ID_EX.rt;
-		EX_MEM.RegWrite = ID_EX.RegWrite;
+		sim->EX_MEM.D = sim->ID_EX.D;
+		sim->EX_MEM.PC = sim->ID_EX.PC;
+		sim->EX_MEM.IR = sim->ID_EX.IR;
+		sim->EX_MEM.rs = sim->ID_EX.rs;
+		sim->EX_MEM.rd = sim->ID_EX.rd;
+		sim->EX_MEM.rt = sim->ID_EX.rt;
+		sim->EX_MEM.RegWrite = sim->ID_EX.RegWrite;
 
 		if(opcode == 0x00){
 			switch(function){
 				case 0x00: //SLL
-					EX_MEM.ALUOutput = ID_EX.B << ID_EX.sa;
+					sim->EX_MEM.ALUOutput = sim->ID_EX.B << sim->ID_EX.sa;
 					break;
 				case 0x02: //SRL
-					EX_MEM.ALUOutput = ID_EX.B >> ID_EX.sa;
+					sim->EX_MEM.ALUOutput = sim->ID_EX.B >> sim->ID_EX.sa;
 					break;
 				case 0x03: //SRA 
-					if ((ID_EX.B & 0x80000000) == 1)
+					if ((sim->ID_EX.B & 0x80000000) == 1)
 					{
-						EX_MEM.ALUOutput =  ~(~ID_EX.B >> ID_EX.sa );
+						sim->EX_MEM.ALUOutput =  ~(~sim->ID_EX.B >> sim->ID_EX.sa );
 					}
 					else {
-						EX_MEM.ALUOutput =  ~(~ID_EX.B >> ID_EX.sa );
+						sim->EX_MEM.ALUOutput =  ~(~sim->ID_EX.B >> sim->ID_EX.sa );
 					}
 					break;
 				case 0x08: //JR
-					NEXT_STATE.PC = ID_EX.A;
-					BRANCH_FLAG = 1;
+					sim->NEXT_STATE.PC = sim->ID_EX.A;
+					sim->BRANCH_FLAG = 1;
 					//printf("jr pc: %x", NEXT_STATE.PC); 
 					break;
 				case 0x09: //JALR
-					EX_MEM.ALUOutput 	= ID_EX.PC + 4;
-					NEXT_STATE.REGS[31] = ID_EX.PC + 4;
-					NEXT_STATE.PC    	= ID_EX.A;
-					BRANCH_FLAG = 1;
+					sim->EX_MEM.ALUOutput 	= link;
+					sim->NEXT_STATE.REGS[31] = link;
+					sim->NEXT_STATE.PC    	= sim->ID_EX.A;
+					sim->BRANCH_FLAG = 1;
 					//printf("jalr pc: %x", NEXT_STATE.PC);					 
 					break;
 				case 0x0C: //SYSCALL
-					EX_MEM.ALUOutput = CURRENT_STATE.REGS[2];
+					sim->EX_MEM.ALUOutput = sim->CURRENT_STATE.REGS[2];
 					break;
 				case 0x10: //MFHI
-					EX_MEM.ALUOutput = CURRENT_STATE.HI;
+					sim->EX_MEM.ALUOutput = sim->CURRENT_STATE.HI;
 					break;
 				case 0x11: //MTHI
-					NEXT_STATE.HI = ID_EX.A;
+					sim->NEXT_STATE.HI = sim->ID_EX.A;
+					fu_issue(sim, OP_MTHI);
 					break;
 				case 0x12: //MFLO
-					EX_MEM.ALUOutput = CURRENT_STATE.LO;
+					sim->EX_MEM.ALUOutput = sim->CURRENT_STATE.LO;
 					break;
 				case 0x13: //MTLO
-					NEXT_STATE.LO = ID_EX.A;
+					sim->NEXT_STATE.LO = sim->ID_EX.A;
+					fu_issue(sim, OP_MTLO);
 					break;
 				case 0x18: //MULT
 					; uint32_t p1,p2;
-					if ((ID_EX.A & 0x80000000) == 0x80000000){
-						p1 = 0xFFFFFFFF00000000 | ID_EX.A;
+					if ((sim->ID_EX.A & 0x80000000) == 0x80000000){
+						p1 = 0xFFFFFFFF00000000 | sim->ID_EX.A;
 					}else{
-						p1 = 0x00000000FFFFFFFF & ID_EX.A;
+						p1 = 0x00000000FFFFFFFF & sim->ID_EX.A;
 					}
-					if ((ID_EX.B & 0x80000000) == 0x80000000){
-						p2 = 0xFFFFFFFF00000000 | ID_EX.B;
+					if ((sim->ID_EX.B & 0x80000000) == 0x80000000){
+						p2 = 0xFFFFFFFF00000000 | sim->ID_EX.B;
 					}else{
-						p2 = 0x00000000FFFFFFFF & ID_EX.B;
+						p2 = 0x00000000FFFFFFFF & sim->ID_EX.B;
 					}
 					product = p1 * p2;
-					NEXT_STATE.LO = (product & 0X00000000FFFFFFFF);
-					NEXT_STATE.HI = (product & 0XFFFFFFFF00000000)>>32;
+					sim->NEXT_STATE.LO = (product & 0X00000000FFFFFFFF);
+					sim->NEXT_STATE.HI = (product & 0XFFFFFFFF00000000)>>32;
+					fu_issue(sim, OP_MULT);
 					break;
 				case 0x19: //MULTU
-					product = (uint64_t)ID_EX.A * (uint64_t)ID_EX.B;
-					NEXT_STATE.LO = (product & 0X00000000FFFFFFFF);
-					NEXT_STATE.HI = (product & 0XFFFFFFFF00000000)>>32;
+					product = (uint64_t)sim->ID_EX.A * (uint64_t)sim->ID_EX.B;
+					sim->NEXT_STATE.LO = (product & 0X00000000FFFFFFFF);
+					sim->NEXT_STATE.HI = (product & 0XFFFFFFFF00000000)>>32;
+					fu_issue(sim, OP_MULTU);
 					break;
 				case 0x1A: //DIV 
-					if(ID_EX.B != 0)
+					if(sim->ID_EX.B != 0)
 					{
-						NEXT_STATE.LO = (int32_t)ID_EX.A / (int32_t)ID_EX.B;
-						NEXT_STATE.HI = (int32_t)ID_EX.A % (int32_t)ID_EX.B;
+						sim->NEXT_STATE.LO = (int32_t)sim->ID_EX.A / (int32_t)sim->ID_EX.B;
+						sim->NEXT_STATE.HI = (int32_t)sim->ID_EX.A % (int32_t)sim->ID_EX.B;
 					}
+					fu_issue(sim, OP_DIV);
 					 
 					break;
 				case 0x1B: //DIVU
-					if(ID_EX.B != 0)
+					if(sim->ID_EX.B != 0)
 					{
-						NEXT_STATE.LO = ID_EX.A / ID_EX.B;
-						NEXT_STATE.HI = ID_EX.A % ID_EX.B;
+						sim->NEXT_STATE.LO = sim->ID_EX.A / sim->ID_EX.B;
+						sim->NEXT_STATE.HI = sim->ID_EX.A % sim->ID_EX.B;
 					}
+					fu_issue(sim, OP_DIVU);
 					 
 					break;
 				case 0x20: //ADD
-					EX_MEM.ALUOutput = ID_EX.A + ID_EX.B;
+					sim->EX_MEM.ALUOutput = sim->ID_EX.A + sim->ID_EX.B;
 					 
 					break;
 				case 0x21: //ADDU 
-					EX_MEM.ALUOutput = ID_EX.B + ID_EX.A;
+					sim->EX_MEM.ALUOutput = sim->ID_EX.B + sim->ID_EX.A;
 					 
 					break;
 				case 0x22: //SUB
-					EX_MEM.ALUOutput = ID_EX.A - ID_EX.B;
+					sim->EX_MEM.ALUOutput = sim->ID_EX.A - sim->ID_EX.B;
 					 
 					break;
 				case 0x23: //SUBU
-					EX_MEM.ALUOutput = ID_EX.A - ID_EX.B;
+					sim->EX_MEM.ALUOutput = sim->ID_EX.A - sim->ID_EX.B;
 					 
 					break;
 				case 0x24: //AND
-					EX_MEM.ALUOutput = ID_EX.A & ID_EX.B;
+					sim->EX_MEM.ALUOutput = sim->ID_EX.A & sim->ID_EX.B;
 					 
 					break;
 				case 0x25: //OR
-					EX_MEM.ALUOutput = ID_EX.A | ID_EX.B;
+					sim->EX_MEM.ALUOutput = sim->ID_EX.A | sim->ID_EX.B;
 					 
 					break;
 				case 0x26: //XOR
-					EX_MEM.ALUOutput = ID_EX.A ^ ID_EX.B;
+					sim->EX_MEM.ALUOutput = sim->ID_EX.A ^ sim->ID_EX.B;
 					 
 					break;
 				case 0x27: //NOR
-					EX_MEM.ALUOutput = ~(ID_EX.A | ID_EX.B);
+					sim->EX_MEM.ALUOutput = ~(sim->ID_EX.A | sim->ID_EX.B);
 					 
 					break;
 				case 0x2A: //SLT
-					if(ID_EX.A < ID_EX.B){
-						EX_MEM.ALUOutput = 0x1;
+					if(sim->ID_EX.A < sim->ID_EX.B){
+						sim->EX_MEM.ALUOutput = 0x1;
 					}
 					else{
-						EX_MEM.ALUOutput = 0x0;
+						sim->EX_MEM.ALUOutput = 0x0;
 					}
 					 
 					break;
 				default:
-					printf("Instruction at 0x%x is not implemented!\n", CURRENT_STATE.PC);
+					printf("Instruction at 0x%x is not implemented!\n", sim->CURRENT_STATE.PC);
 					break;
 			}
 		}
 		else{
 			switch(opcode){
 				case 0x01:
-					if(EX_MEM.rt == 0x00000){ //BLTZ
-						if((ID_EX.A & 0x80000000) > 0){
-							NEXT_STATE.PC = ID_EX.PC + ( (ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000)<<2 : (ID_EX.imm & 0x0000FFFF)<<2);
-							BRANCH_FLAG = 1;
+					if(sim->EX_MEM.rt == 0x00000){ //BLTZ
+						if((sim->ID_EX.A & 0x80000000) > 0){
+							sim->NEXT_STATE.PC = sim->ID_EX.PC + ( (sim->ID_EX.imm & 0x8000) > 0 ? (sim->ID_EX.imm | 0xFFFF0000)<<2 : (sim->ID_EX.imm & 0x0000FFFF)<<2);
+							sim->BRANCH_FLAG = 1;
 						}
-						STALL_COUNT = 1;
+						sim->STALL_COUNT = 1;
 						 
 					}
-					else if(EX_MEM.rt == 0x00001){ //BGEZ
-						if((ID_EX.A & 0x80000000) == 0x0){
-							NEXT_STATE.PC = ID_EX.PC + ( (ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000)<<2 : (ID_EX.imm & 0x0000FFFF)<<2);
-							BRANCH_FLAG = 1;
+					else if(sim->EX_MEM.rt == 0x00001){ //BGEZ
+						if((sim->ID_EX.A & 0x80000000) == 0x0){
+							sim->NEXT_STATE.PC = sim->ID_EX.PC + ( (sim->ID_EX.imm & 0x8000) > 0 ? (sim->ID_EX.imm | 0xFFFF0000)<<2 : (sim->ID_EX.imm & 0x0000FFFF)<<2);
+							sim->BRANCH_FLAG = 1;
 						}
-						STALL_COUNT = 1;
+						sim->STALL_COUNT = 1;
 					}
 					break;
 				case 0x02: //J
-					NEXT_STATE.PC = (ID_EX.PC & 0xF0000000) | (ID_EX.target << 2);
+					sim->NEXT_STATE.PC = (sim->ID_EX.PC & 0xF0000000) | (sim->ID_EX.target << 2);
 					//printf("j pc: %x", NEXT_STATE.PC);
-					BRANCH_FLAG = 1;
-					STALL_COUNT = 1;
+					sim->BRANCH_FLAG = 1;
+					sim->STALL_COUNT = 1;
 					break;
 				case 0x03: //JAL
-					NEXT_STATE.PC = (ID_EX.PC & 0xF0000000) | (ID_EX.target << 2);
-					NEXT_STATE.REGS[31] = ID_EX.PC + 4;
-					BRANCH_FLAG = 1;
-					STALL_COUNT = 1;
+					sim->NEXT_STATE.PC = (sim->ID_EX.PC & 0xF0000000) | (sim->ID_EX.target << 2);
+					sim->NEXT_STATE.REGS[31] = link;
+					sim->BRANCH_FLAG = 1;
+					sim->STALL_COUNT = 1;
 					//printf("jal pc: %x", NEXT_STATE.PC);
 					break;
 				case 0x04: //BEQ
-					if(ID_EX.A == ID_EX.B){
-						NEXT_STATE.PC = ID_EX.PC + ( (ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000)<<2 : (ID_EX.imm & 0x0000FFFF)<<2);
-						BRANCH_FLAG = 1;
+					if(sim->ID_EX.A == sim->ID_EX.B){
+						sim->NEXT_STATE.PC = sim->ID_EX.PC + ( (sim->ID_EX.imm & 0x8000) > 0 ? (sim->ID_EX.imm | 0xFFFF0000)<<2 : (sim->ID_EX.imm & 0x0000FFFF)<<2);
+						sim->BRANCH_FLAG = 1;
 					}
-					STALL_COUNT = 1;
+					sim->STALL_COUNT = 1;
 					break;
 				case 0x05: //BNE
-					if(ID_EX.A != ID_EX.B){
-						NEXT_STATE.PC = ID_EX.PC + ( (ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000)<<2 : (ID_EX.imm & 0x0000FFFF)<<2);
-						BRANCH_FLAG = 1;
+					if(sim->ID_EX.A != sim->ID_EX.B){
+						sim->NEXT_STATE.PC = sim->ID_EX.PC + ( (sim->ID_EX.imm & 0x8000) > 0 ? (sim->ID_EX.imm | 0xFFFF0000)<<2 : (sim->ID_EX.imm & 0x0000FFFF)<<2);
+						sim->BRANCH_FLAG = 1;
 					}
-					STALL_COUNT = 1;
+					sim->STALL_COUNT = 1;
 					 
 					break;
 				case 0x06: //BLEZ
-					if((ID_EX.A & 0x80000000) > 0 || ID_EX.A == 0){
-						NEXT_STATE.PC = ID_EX.PC +  ( (ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000)<<2 : (ID_EX.imm & 0x0000FFFF)<<2);
-						BRANCH_FLAG = 1;
+					if((sim->ID_EX.A & 0x80000000) > 0 || sim->ID_EX.A == 0){
+						sim->NEXT_STATE.PC = sim->ID_EX.PC +  ( (sim->ID_EX.imm & 0x8000) > 0 ? (sim->ID_EX.imm | 0xFFFF0000)<<2 : (sim->ID_EX.imm & 0x0000FFFF)<<2);
+						sim->BRANCH_FLAG = 1;
 					}
-					STALL_COUNT = 1;
+					sim->STALL_COUNT = 1;
 					break;
 				case 0x07: //BGTZ
-					if((ID_EX.A & 0x80000000) == 0x0 || ID_EX.A != 0){
-						NEXT_STATE.PC = ID_EX.PC +  ( (ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000)<<2 : (ID_EX.imm & 0x0000FFFF)<<2);
-						BRANCH_FLAG = 1;
+					if((sim->ID_EX.A & 0x80000000) == 0x0 || sim->ID_EX.A != 0){
+						sim->NEXT_STATE.PC = sim->ID_EX.PC +  ( (sim->ID_EX.imm & 0x8000) > 0 ? (sim->ID_EX.imm | 0xFFFF0000)<<2 : (sim->ID_EX.imm & 0x0000FFFF)<<2);
+						sim->BRANCH_FLAG = 1;
 					}
-					STALL_COUNT = 1;
+					sim->STALL_COUNT = 1;
 					break;
 				case 0x08: //ADDI
-					EX_MEM.ALUOutput = ID_EX.A + ID_EX.imm;
+					sim->EX_MEM.ALUOutput = sim->ID_EX.A + sim->ID_EX.imm;
 					break;
 				case 0x09: //ADDIU
-					EX_MEM.ALUOutput = ID_EX.A + ( (ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF));
+					sim->EX_MEM.ALUOutput = sim->ID_EX.A + ( (sim->ID_EX.imm & 0x8000) > 0 ? (sim->ID_EX.imm | 0xFFFF0000) : (sim->ID_EX.imm & 0x0000FFFF));
 					 
 					break;
 				case 0x0A: //SLTI
-					if ( (  (int32_t)ID_EX.A - (int32_t)( (ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF))) < 0){
-						EX_MEM.ALUOutput = 0x1;
+					if ( (  (int32_t)sim->ID_EX.A - (int32_t)( (sim->ID_EX.imm & 0x8000) > 0 ? (sim->ID_EX.imm | 0xFFFF0000) : (sim->ID_EX.imm & 0x0000FFFF))) < 0){
+						sim->EX_MEM.ALUOutput = 0x1;
 					}else{
-						EX_MEM.ALUOutput = 0x0;
+						sim->EX_MEM.ALUOutput = 0x0;
 					}
 					break;
 				case 0x0C: //ANDI
-					EX_MEM.ALUOutput = ID_EX.A & (ID_EX.imm & 0x0000FFFF);
+					sim->EX_MEM.ALUOutput = sim->ID_EX.A & (sim->ID_EX.imm & 0x0000FFFF);
 					 
 					break;
 				case 0x0D: //ORI
-					EX_MEM.ALUOutput = ID_EX.A | ID_EX.imm;
-					EX_MEM.D 		 = ID_EX.D;
+					sim->EX_MEM.ALUOutput = sim->ID_EX.A | sim->ID_EX.imm;
+					sim->EX_MEM.D 		 = sim->ID_EX.D;
 					break;
 				case 0x0E: //XORI
-					EX_MEM.ALUOutput = ID_EX.A ^ (ID_EX.imm & 0x0000FFFF);
+					sim->EX_MEM.ALUOutput = sim->ID_EX.A ^ (sim->ID_EX.imm & 0x0000FFFF);
 					 
 					break;
 				case 0x0F: //LUI
-					EX_MEM.ALUOutput = ID_EX.imm << 16;
+					sim->EX_MEM.ALUOutput = sim->ID_EX.imm << 16;
 					 
 					break;
 				case 0x20: //LB
-					EX_MEM.ALUOutput = ID_EX.A + ID_EX.imm;
-					EX_MEM.D = ID_EX.D;					 
+					sim->EX_MEM.ALUOutput = sim->ID_EX.A + sim->ID_EX.imm;
+					sim->EX_MEM.D = sim->ID_EX.D;					 
 					break;
 				case 0x21: //LH
-					EX_MEM.ALUOutput = ID_EX.A + ID_EX.imm;
-					EX_MEM.D = ID_EX.D;
+					sim->EX_MEM.ALUOutput = sim->ID_EX.A + sim->ID_EX.imm;
+					sim->EX_MEM.D = sim->ID_EX.D;
 					break;
 				case 0x23: //LW
-					EX_MEM.ALUOutput = ID_EX.A + ID_EX.imm;
-					EX_MEM.D = ID_EX.D;
+					sim->EX_MEM.ALUOutput = sim->ID_EX.A + sim->ID_EX.imm;
+					sim->EX_MEM.D = sim->ID_EX.D;
 					break;
 				case 0x28: //SB
-					EX_MEM.ALUOutput = ID_EX.A + ID_EX.imm;
-					EX_MEM.D = ID_EX.D;
+					sim->EX_MEM.ALUOutput = sim->ID_EX.A + sim->ID_EX.imm;
+					sim->EX_MEM.D = sim->ID_EX.D;
 					break;
 				case 0x29: //SH
-					EX_MEM.ALUOutput = ID_EX.A + ID_EX.imm;
-					EX_MEM.D = ID_EX.D;
+					sim->EX_MEM.ALUOutput = sim->ID_EX.A + sim->ID_EX.imm;
+					sim->EX_MEM.D = sim->ID_EX.D;
 					break;
 				case 0x2B: //SW
-					EX_MEM.ALUOutput = ID_EX.A + ID_EX.imm;
-					EX_MEM.D = ID_EX.D;
+					sim->EX_MEM.ALUOutput = sim->ID_EX.A + sim->ID_EX.imm;
+					sim->EX_MEM.D = sim->ID_EX.D;
 					break;
 				default:
 					// put more things here
-					printf("Instruction at 0x%x is not implemented!\n", CURRENT_STATE.PC);
+					printf("Instruction at 0x%x is not implemented!\n", sim->CURRENT_STATE.PC);
 					break;
 			}
 		}
-		MEM_FLAG = 1;
 
+		// IF went on at ID_EX.NPC; without a predictor that is PC + 4, except in a checkpoint written with one
+		if((opcode >= 0x01 && opcode <= 0x07) || (opcode == 0x00 && (function == 0x08 || function == 0x09))) {
+			if(sim->DELAY_SLOTS) {
+				// the delay slot IF fetched behind it goes on through ID; IF turns to the target after it
+				sim->STALL_COUNT = stall_count;
+			} else if(sim->ID_EX.resolved) {
+				// ID's comparator already steered IF (-e 1); all that is left to EX is the link of JAL/JALR
+				sim->BRANCH_FLAG = 0;
+				sim->NEXT_STATE.PC = fetch_pc;
+				sim->STALL_COUNT = stall_count;
+			} else if(sim->NUM_BPRED > 0 || sim->ID_EX.NPC != sim->ID_EX.PC + 4) {
+				branch_resolve(sim, fetch_pc, stall_count);
+			}
+		}
+		sim->MEM_FLAG = 1;
+
+	}
+}
+
+
+/************************************************************/
+/* Operand r of a branch for the comparator in ID, with forwarding (-e 1    */
+/* -f 1): from MEM_WB's ALU result or the register file. Returns the cycles */
+/* ID has to wait for it instead: one behind an ALU op in EX or a load in   */
+/* MEM, two behind a load in EX.                                            */
+/************************************************************/
+static inline int id_branch_operand(sim_t *sim, uint32_t r, uint32_t *value)
+{
+	const CPU_Pipeline_Reg *ex = &sim->EX_MEM, *mem = &sim->MEM_WB;
+	uint32_t ex_op = ex->IR >> 26, mem_op = mem->IR >> 26;
+
+	*value = sim->CURRENT_STATE.REGS[r];
+	if (r == 0) {
+		return 0;
+	}
+	if (ex->RegWrite && ex->D == r) {
+		return ex_op == 0x20 || ex_op == 0x21 || ex_op == 0x23 ? 2 : 1;
+	}
+	if (mem->RegWrite && mem->D == r) {
+		if (mem_op == 0x20 || mem_op == 0x21 || mem_op == 0x23) {
+			return 1;
+		}
+		*value = mem->ALUOutput;
+	}
+	return 0;
+}
+
+
+/************************************************************/
+/* Resolve the branch or jump just decoded into ID_EX (-e 1). If IF is     */
+/* fetching from the right PC this cycle nothing is lost; otherwise that   */
+/* fetch is dropped and the next cycle fetches from the right one.        */
+/************************************************************/
+static inline void id_branch_resolve(sim_t *sim, const decoded_inst_t *d)
+{
+	int taken = id_branch_taken(d, sim->ID_EX.A, sim->ID_EX.B);
+	uint32_t next = !taken ? sim->ID_EX.PC + 4 : (d->op == OP_JR || d->op == OP_JALR) ? sim->ID_EX.A : d->target;
+
+	bpred_train(sim, taken, next);
+	sim->ID_EX.resolved = 1;
+	if (next != sim->ID_EX.NPC) {
+		sim->NEXT_STATE.PC = next;
+		sim->STALL_COUNT = 1;
+		sim->IF_ID = Empty;	/* decodes as a NOP next cycle */
 	}
 }
 
@@ -828,422 +3246,276 @@ void EX()
 /************************************************************/
 /* instruction decode (ID) pipeline stage:                                                         */ 
 /************************************************************/
-void ID()
+void ID(sim_t *sim)
 {
-	if(ID_FLAG == 1 && MEM_STALL == 0) {
-		if(BRANCH_FLAG == 1) {
+	if(sim->ID_FLAG == 1 && sim->MEM_STALL == 0) {
+		if(sim->BRANCH_FLAG == 1 && !sim->DELAY_SLOTS) {
 			
-			ID_EX.IR = 0;
-			ID_EX.A  = 0;
-			ID_EX.B  = 0;
-			ID_EX.D  = 0;
-			ID_EX.rs = 0;
-			ID_EX.rt = 0;
-			ID_EX.rd = 0;
-			ID_EX.imm= 0;
-		} else if(STALL_COUNT > 0) {
-			ID_EX.IR = 0;
-			ID_EX.A  = 0;
-			ID_EX.B  = 0;
-			ID_EX.D  = 0;
-			ID_EX.rs = 0;
-			ID_EX.rt = 0;
-			ID_EX.rd = 0;
-			ID_EX.imm= 0;
+			sim->ID_EX.IR = 0;
+			sim->ID_EX.PC = 0;
+			sim->ID_EX.A  = 0;
+			sim->ID_EX.B  = 0;
+			sim->ID_EX.D  = 0;
+			sim->ID_EX.rs = 0;
+			sim->ID_EX.rt = 0;
+			sim->ID_EX.rd = 0;
+			sim->ID_EX.imm= 0;
+		} else if(sim->STALL_COUNT > 0) {
+			sim->ID_EX.IR = 0;
+			sim->ID_EX.PC = 0;
+			sim->ID_EX.A  = 0;
+			sim->ID_EX.B  = 0;
+			sim->ID_EX.D  = 0;
+			sim->ID_EX.rs = 0;
+			sim->ID_EX.rt = 0;
+			sim->ID_EX.rd = 0;
+			sim->ID_EX.imm= 0;
 		} else {
-			uint32_t instruction, opcode, function, rs, rt, rd, sa, immediate, target;
-			uint64_t product, p1, p2;
+			uint32_t instruction, opcode, function;
+			decoded_inst_t *d;
+			int early;
 			
-			uint32_t addr, data;
-			
-			//int branch_jump = FALSE;
-			
-			instruction = IF_ID.IR;
-			printf("\n\n[0x%x]\t", instruction);
+			instruction = sim->IF_ID.IR;
+			TRACE(TRACE_INSTR, "\n\n[0x%x]\t", instruction);
 			
+			d = decode_lookup(sim, sim->IF_ID.PC, instruction);
 			opcode = (instruction & 0xFC000000) >> 26;
 			function = instruction & 0x0000003F;
-			rs = (instruction & 0x03E00000) >> 21;
-			rt = (instruction & 0x001F0000) >> 16;
-			rd = (instruction & 0x0000F800) >> 11;
-			sa = (instruction & 0x000007C0) >> 6;
-			immediate = instruction & 0x0000FFFF;
-			target = instruction & 0x03FFFFFF;
-
-			ID_EX.IR = IF_ID.IR;
-			ID_EX.PC = IF_ID.PC;
-			ID_EX.rs = rs;
-			ID_EX.rd = rd;
-			ID_EX.rt = rt;
-			ID_EX.RegWrite = 0;
-
-			ID_EX_Prev = ID_EX;
+			early = sim->EARLY_BRANCH && !sim->DELAY_SLOTS && ((d->op >= OP_BLTZ && d->op <= OP_BGTZ) || d->op == OP_JR || d->op == OP_JALR);
+
+			sim->ID_EX.IR = sim->IF_ID.IR;
+			sim->ID_EX.PC = sim->IF_ID.PC;
+			sim->ID_EX.NPC = sim->IF_ID.NPC;
+			sim->ID_EX.bpred = sim->IF_ID.bpred;
+			sim->ID_EX.resolved = 0;
+			sim->ID_EX.rs = d->rs;
+			sim->ID_EX.rd = d->rd;
+			sim->ID_EX.rt = d->rt;
+			sim->ID_EX.RegWrite = 0;
+
+			sim->ID_EX_Prev = sim->ID_EX;
 			
-			if(opcode == 0x00){
-				switch(function){
-					case 0x00: //SLL
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.B 	= CURRENT_STATE.REGS[rt];
-						ID_EX.D 	= rd;
-						ID_EX.sa 	= sa;
-						ID_EX.RegWrite = 1;
-						break;
-					case 0x02: //SRL
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.B 	= CURRENT_STATE.REGS[rt];
-						ID_EX.D 	= rd;
-						ID_EX.sa 	= sa;
-						ID_EX.RegWrite = 1;
-						break;
-					case 0x03: //SRA
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.B 	= CURRENT_STATE.REGS[rt];
-						ID_EX.D 	= rd;
-						ID_EX.sa 	= sa;
-						ID_EX.RegWrite = 1;
-						break;
-					case 0x08: //JR
-						ID_EX.A     = CURRENT_STATE.REGS[rs];
-						break;
-					case 0x09: //JALR
-						ID_EX.A     = CURRENT_STATE.REGS[rs];
-						ID_EX.D   	= rd;
-						ID_EX.RegWrite = 1;
-						break;
-					case 0x0C: //SYSCALL
-						;
-						break;
-					case 0x10: //MFHI
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.B 	= CURRENT_STATE.REGS[rt];
-						ID_EX.D 	= rd;
-						break;
-					case 0x11: //MTHI
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.B 	= CURRENT_STATE.REGS[rt];
-						ID_EX.D 	= rd;
-						break;
-					case 0x12: //MFLO
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.B 	= CURRENT_STATE.REGS[rt];
-						ID_EX.D 	= rd;
-						break;
-					case 0x13: //MTLO
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.B 	= CURRENT_STATE.REGS[rt];
-						ID_EX.D 	= rd;
-						break;
-					case 0x18: //MULT
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.B 	= CURRENT_STATE.REGS[rt];
-						ID_EX.D 	= rd;
-						ID_EX.RegWrite = 1;
-						break;
-					case 0x19: //MULTU
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.B 	= CURRENT_STATE.REGS[rt];
-						ID_EX.D 	= rd;
-						ID_EX.RegWrite = 1;
-						break;
-					case 0x1A: //DIV 
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.B 	= CURRENT_STATE.REGS[rt];
-						ID_EX.D 	= rd;
-						ID_EX.RegWrite = 1;
-						break;
-					case 0x1B: //DIVU
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.B 	= CURRENT_STATE.REGS[rt];
-						ID_EX.D 	= rd;
-						ID_EX.RegWrite = 1;
-
-						break;
-					case 0x20: //ADD
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.B 	= CURRENT_STATE.REGS[rt];
-						ID_EX.D 	= rd;
-						ID_EX.RegWrite = 1;
-						break;
-					case 0x21: //ADDU 
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.B 	= CURRENT_STATE.REGS[rt];
-						ID_EX.D 	= rd;
-						ID_EX.RegWrite = 1;
-						break;
-					case 0x22: //SUB
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.B 	= CURRENT_STATE.REGS[rt];
-						ID_EX.D 	= rd;
-						ID_EX.RegWrite = 1;
-						break;
-					case 0x23: //SUBU
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.B 	= CURRENT_STATE.REGS[rt];
-						ID_EX.D 	= rd;
-						ID_EX.RegWrite = 1;
-						break;
-					case 0x24: //AND
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.B 	= CURRENT_STATE.REGS[rt];
-						ID_EX.D 	= rd;
-						ID_EX.RegWrite = 1;
-						break;
-					case 0x25: //OR
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.B 	= CURRENT_STATE.REGS[rt];
-						ID_EX.D 	= rd;
-						ID_EX.RegWrite = 1;
-						break;
-					case 0x26: //XOR
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.B 	= CURRENT_STATE.REGS[rt];
-						ID_EX.D 	= rd;
-						ID_EX.RegWrite = 1;
-						break;
-					case 0x27: //NOR
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.B 	= CURRENT_STATE.REGS[rt];
-						ID_EX.D 	= rd;
-						ID_EX.RegWrite = 1;
-						break;
-					case 0x2A: //SLT
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.B 	= CURRENT_STATE.REGS[rt];
-						ID_EX.D 	= rd;
-						ID_EX.RegWrite = 1;
-						break;
-					default:
-						printf("Instruction at 0x%x is not implemented!\n", CURRENT_STATE.PC);
-						break;
-				}
-			}
-			else{
-				switch(opcode){
-					case 0x01:
-						if(rt == 0x00000){ //BLTZ
-							ID_EX.A     = CURRENT_STATE.REGS[rs];
-							ID_EX.B     = CURRENT_STATE.REGS[rt];
-							ID_EX.imm   = immediate;
-						}
-						else if(rt == 0x00001){ //BGEZ
-							ID_EX.A     = CURRENT_STATE.REGS[rs];
-							ID_EX.B     = CURRENT_STATE.REGS[rt];
-							ID_EX.imm   = immediate;
-						}
-						break;
-					case 0x02: //J
-						ID_EX.target = target;
-						break;
-					case 0x03: //JAL
-						ID_EX.target = target;
-						break;
-					case 0x04: //BEQ
-						ID_EX.A     = CURRENT_STATE.REGS[rs];
-						ID_EX.B     = CURRENT_STATE.REGS[rt];
-						ID_EX.imm   = immediate;
-						break;
-					case 0x05: //BNE
-						ID_EX.A     = CURRENT_STATE.REGS[rs];
-						ID_EX.B     = CURRENT_STATE.REGS[rt];
-						ID_EX.imm   = immediate;
-						break;
-					case 0x06: //BLEZ
-						ID_EX.A     = CURRENT_STATE.REGS[rs];
-						ID_EX.B     = CURRENT_STATE.REGS[rt];
-						ID_EX.imm   = immediate;
-						break;
-					case 0x07: //BGTZ
-						ID_EX.A     = CURRENT_STATE.REGS[rs];
-						ID_EX.B     = CURRENT_STATE.REGS[rt];
-						ID_EX.imm   = immediate;
-						break;
-					case 0x08: //ADDI
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.D 	= rt;
-						ID_EX.rd    = rt;
-						ID_EX.imm 	= immediate;
-						ID_EX.RegWrite = 1;
-						break;
-					case 0x09: //ADDIU
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.D 	= rt;
-						ID_EX.rd    = rt;
-						ID_EX.imm 	= immediate;
-						ID_EX.RegWrite = 1;
-						break;
-					case 0x0A: //SLTI
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.D 	= rt;
-						ID_EX.rd    = rt;
-						ID_EX.imm 	= immediate;
-						ID_EX.RegWrite = 1;
-						break;
-					case 0x0C: //ANDI
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.D 	= rt;
-						ID_EX.rd    = rt;
-						ID_EX.imm 	= immediate;
-						ID_EX.RegWrite = 1;
-						break;
-					case 0x0D: //ORI
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.D 	= rt;
-						ID_EX.rd    = rt;
-						ID_EX.imm 	= immediate;
-						ID_EX.RegWrite = 1;
-						break;
-					case 0x0E: //XORI
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.D 	= rt;
-						ID_EX.rd    = rt;
-						ID_EX.imm 	= immediate;
-						ID_EX.RegWrite = 1;
-						break;
-					case 0x0F: //LUI
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.D 	= rt;
-						ID_EX.rd    = rt;
-						ID_EX.imm 	= immediate;
-						ID_EX.RegWrite = 1;
-						break;
-					case 0x20: //LB
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.D 	= rt;
-						ID_EX.rd    = rt;
-						ID_EX.imm 	= immediate;
-						ID_EX.RegWrite = 1;
-						break;
-					case 0x21: //LH
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.D 	= rt;
-						ID_EX.rd    = rt;
-						ID_EX.imm 	= immediate;
-						ID_EX.RegWrite = 1;
-						break;
-					case 0x23: //LW
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.D 	= rt;
-						ID_EX.rd    = rt;
-						ID_EX.imm 	= immediate;
-						ID_EX.RegWrite = 1;
-						break;
-					case 0x28: //SB
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.D 	= CURRENT_STATE.REGS[rt];
-						ID_EX.imm 	= immediate;	
-						break;
-					case 0x29: //SH
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.D 	= CURRENT_STATE.REGS[rt];
-						ID_EX.imm 	= immediate;
-						break;
-					case 0x2B: //SW
-						ID_EX.A 	= CURRENT_STATE.REGS[rs];
-						ID_EX.D 	= CURRENT_STATE.REGS[rt];
-						ID_EX.imm 	= immediate;
-						break;
-					default:
-						// put more things here
-						printf("Instruction at 0x%x is not implemented!\n", CURRENT_STATE.PC);
-						break;
-				}
+			switch(d->op){
+				case OP_SLL:
+				case OP_SRL:
+				case OP_SRA:
+					sim->ID_EX.A 	= sim->CURRENT_STATE.REGS[d->rs];
+					sim->ID_EX.B 	= sim->CURRENT_STATE.REGS[d->rt];
+					sim->ID_EX.D 	= d->rd;
+					sim->ID_EX.sa 	= d->sa;
+					sim->ID_EX.RegWrite = 1;
+					break;
+				case OP_JR:
+					sim->ID_EX.A     = sim->CURRENT_STATE.REGS[d->rs];
+					break;
+				case OP_JALR:
+					sim->ID_EX.A     = sim->CURRENT_STATE.REGS[d->rs];
+					sim->ID_EX.D   	= d->rd;
+					sim->ID_EX.RegWrite = 1;
+					break;
+				case OP_SYSCALL:
+				case OP_NOP:
+					break;
+				case OP_MFHI:
+				case OP_MFLO:
+					/* writes rd, so later readers stall or forward like after ADDU */
+					sim->ID_EX.A 	= sim->CURRENT_STATE.REGS[d->rs];
+					sim->ID_EX.B 	= sim->CURRENT_STATE.REGS[d->rt];
+					sim->ID_EX.D 	= d->rd;
+					sim->ID_EX.RegWrite = 1;
+					break;
+				case OP_MTHI:
+				case OP_MTLO:
+					sim->ID_EX.A 	= sim->CURRENT_STATE.REGS[d->rs];
+					sim->ID_EX.B 	= sim->CURRENT_STATE.REGS[d->rt];
+					sim->ID_EX.D 	= d->rd;
+					break;
+				case OP_MULT:
+				case OP_MULTU:
+				case OP_DIV:
+				case OP_DIVU:
+				case OP_ADD:
+				case OP_ADDU:
+				case OP_SUB:
+				case OP_SUBU:
+				case OP_AND:
+				case OP_OR:
+				case OP_XOR:
+				case OP_NOR:
+				case OP_SLT:
+					sim->ID_EX.A 	= sim->CURRENT_STATE.REGS[d->rs];
+					sim->ID_EX.B 	= sim->CURRENT_STATE.REGS[d->rt];
+					sim->ID_EX.D 	= d->rd;
+					sim->ID_EX.RegWrite = 1;
+					break;
+				case OP_BLTZ:
+				case OP_BGEZ:
+				case OP_BEQ:
+				case OP_BNE:
+				case OP_BLEZ:
+				case OP_BGTZ:
+					sim->ID_EX.A     = sim->CURRENT_STATE.REGS[d->rs];
+					sim->ID_EX.B     = sim->CURRENT_STATE.REGS[d->rt];
+					sim->ID_EX.imm   = d->uimm;
+					break;
+				case OP_J:
+				case OP_JAL:
+					sim->ID_EX.target = instruction & 0x03FFFFFF;
+					break;
+				case OP_ADDI:
+				case OP_ADDIU:
+				case OP_SLTI:
+				case OP_ANDI:
+				case OP_ORI:
+				case OP_XORI:
+				case OP_LUI:
+				case OP_LB:
+				case OP_LH:
+				case OP_LW:
+					sim->ID_EX.A 	= sim->CURRENT_STATE.REGS[d->rs];
+					sim->ID_EX.D 	= d->rt;
+					sim->ID_EX.rd    = d->rt;
+					sim->ID_EX.imm 	= d->uimm;
+					sim->ID_EX.RegWrite = 1;
+					break;
+				case OP_SB:
+				case OP_SH:
+				case OP_SW:
+					sim->ID_EX.A 	= sim->CURRENT_STATE.REGS[d->rs];
+					sim->ID_EX.D 	= sim->CURRENT_STATE.REGS[d->rt];
+					sim->ID_EX.imm 	= d->uimm;
+					break;
+				default:
+					printf("Instruction at 0x%x is not implemented!\n", sim->CURRENT_STATE.PC);
+					break;
 			}
-			EX_FLAG = 1;
+			sim->EX_FLAG = 1;
 
 
-			if(ENABLE_FORWARDING == 1) {
+			if(early && sim->ENABLE_FORWARDING == 1) {
+				// the comparator has its own paths from EX_MEM and MEM_WB into ID
+				int wait_a = 0, wait_b = 0;
+				if(d->op != OP_J && d->op != OP_JAL) {
+					wait_a = id_branch_operand(sim, d->rs, &sim->ID_EX.A);
+				}
+				if(d->op == OP_BEQ || d->op == OP_BNE) {
+					wait_b = id_branch_operand(sim, d->rt, &sim->ID_EX.B);
+				}
+				if(wait_a > 0 || wait_b > 0) {
+					sim->STALL_COUNT = wait_a > wait_b ? wait_a : wait_b;
+					sim->ID_EX = Empty;
+				}
+			} else if(sim->ENABLE_FORWARDING == 1) {
 				//uint32_t prev_op = (EX_MEM.IR & 0xFC000000) >> 26;
-				if (EX_MEM.RegWrite && (EX_MEM.D != 0) && (EX_MEM.D == ID_EX.rs)) {
-					controlA = 2;
-					if(prev_op == 0x20 || prev_op == 0x21 || prev_op == 0x23) {	
-						STALL_COUNT = 1;
+				if (sim->EX_MEM.RegWrite && (sim->EX_MEM.D != 0) && (sim->EX_MEM.D == sim->ID_EX.rs)) {
+					sim->controlA = 2;
+					if(sim->prev_op == 0x20 || sim->prev_op == 0x21 || sim->prev_op == 0x23) {	
+						sim->STALL_COUNT = 1;
 					}
 				}
-				else if (EX_MEM.RegWrite && (EX_MEM.D != 0) && (EX_MEM.D == ID_EX.rt)) {
-					controlB = 2;
-					if(prev_op == 0x20 || prev_op == 0x21 || prev_op == 0x23) {	
-						STALL_COUNT = 1;
+				else if (sim->EX_MEM.RegWrite && (sim->EX_MEM.D != 0) && (sim->EX_MEM.D == sim->ID_EX.rt)) {
+					sim->controlB = 2;
+					if(sim->prev_op == 0x20 || sim->prev_op == 0x21 || sim->prev_op == 0x23) {	
+						sim->STALL_COUNT = 1;
 					}
 				}
-				else if (MEM_WB.RegWrite && (MEM_WB.D != 0) && !(EX_MEM.RegWrite && (EX_MEM.D != 0) && (EX_MEM.D == ID_EX.rs)) && (MEM_WB.D == ID_EX.rs)) {
-					controlA = 1;
+				else if (sim->MEM_WB.RegWrite && (sim->MEM_WB.D != 0) && !(sim->EX_MEM.RegWrite && (sim->EX_MEM.D != 0) && (sim->EX_MEM.D == sim->ID_EX.rs)) && (sim->MEM_WB.D == sim->ID_EX.rs)) {
+					sim->controlA = 1;
 				}
-				else if (MEM_WB.RegWrite && (MEM_WB.D != 0) && !(EX_MEM.RegWrite && (EX_MEM.D != 0) && (EX_MEM.D == ID_EX.rt)) && (MEM_WB.D == ID_EX.rt)) {
-					controlB = 1;
+				else if (sim->MEM_WB.RegWrite && (sim->MEM_WB.D != 0) && !(sim->EX_MEM.RegWrite && (sim->EX_MEM.D != 0) && (sim->EX_MEM.D == sim->ID_EX.rt)) && (sim->MEM_WB.D == sim->ID_EX.rt)) {
+					sim->controlB = 1;
 				}
 
-				if(controlA == 2 && STALL_COUNT == 0) {
-					if(prev_op == 0x20 || prev_op == 0x21 || prev_op == 0x23) {	
-						ID_EX.A = MEM_WB.LMD;
+				if(sim->controlA == 2 && sim->STALL_COUNT == 0) {
+					if(sim->prev_op == 0x20 || sim->prev_op == 0x21 || sim->prev_op == 0x23) {	
+						sim->ID_EX.A = sim->MEM_WB.LMD;
 					} else {
-						ID_EX.A = EX_MEM.ALUOutput;
+						sim->ID_EX.A = sim->EX_MEM.ALUOutput;
 					}
-					controlA = 0;
+					sim->controlA = 0;
 				}
-				if(controlB == 2 && STALL_COUNT == 0) {
-					if(prev_op == 0x20 || prev_op == 0x21 || prev_op == 0x23) {	
-						ID_EX.B = MEM_WB.LMD;
+				if(sim->controlB == 2 && sim->STALL_COUNT == 0) {
+					if(sim->prev_op == 0x20 || sim->prev_op == 0x21 || sim->prev_op == 0x23) {	
+						sim->ID_EX.B = sim->MEM_WB.LMD;
 					} else {
 						switch(opcode) {
 							case 0x28:
-								ID_EX.D = EX_MEM.ALUOutput;
+								sim->ID_EX.D = sim->EX_MEM.ALUOutput;
 								break;
 							case 0x29:
-								ID_EX.D = EX_MEM.ALUOutput;
+								sim->ID_EX.D = sim->EX_MEM.ALUOutput;
 								break;
 							case 0x2B:
-								ID_EX.D = EX_MEM.ALUOutput;
+								sim->ID_EX.D = sim->EX_MEM.ALUOutput;
 								break;
 							default:
-								ID_EX.B = EX_MEM.ALUOutput;
+								sim->ID_EX.B = sim->EX_MEM.ALUOutput;
 								break;
 						}
 					}
-					controlB = 0;
+					sim->controlB = 0;
 				}
-				if(controlA == 1 && STALL_COUNT == 0) {
-					if(prev_op == 0x20 || prev_op == 0x21 || prev_op == 0x23) {	
-						ID_EX.A = MEM_WB.LMD;
+				if(sim->controlA == 1 && sim->STALL_COUNT == 0) {
+					if(sim->prev_op == 0x20 || sim->prev_op == 0x21 || sim->prev_op == 0x23) {	
+						sim->ID_EX.A = sim->MEM_WB.LMD;
 					} else {
-						ID_EX.A = EX_MEM.ALUOutput;
+						sim->ID_EX.A = sim->EX_MEM.ALUOutput;
 					}
-					controlA = 0;
+					sim->controlA = 0;
 				}
-				if(controlB == 1 && STALL_COUNT == 0) {
-					ID_EX.B = EX_MEM.ALUOutput;
-					controlB = 0;
+				if(sim->controlB == 1 && sim->STALL_COUNT == 0) {
+					sim->ID_EX.B = sim->EX_MEM.ALUOutput;
+					sim->controlB = 0;
 				}
 
 			} else {
 				// If load-use hazard exists, set flag and clear out pipeline
-				if ( (EX_MEM.RegWrite && (EX_MEM.rd != 0) && (EX_MEM.rd == ID_EX.rs)) ||
-				 	 (EX_MEM.RegWrite && (EX_MEM.rd != 0) && (EX_MEM.rd == ID_EX.rt)) ) {
-					STALL_COUNT = 2;
-					EX_HAZARD = 1;
-					ID_EX = Empty;
+				if ( (sim->EX_MEM.RegWrite && (sim->EX_MEM.rd != 0) && (sim->EX_MEM.rd == sim->ID_EX.rs)) ||
+				 	 (sim->EX_MEM.RegWrite && (sim->EX_MEM.rd != 0) && (sim->EX_MEM.rd == sim->ID_EX.rt)) ) {
+					sim->STALL_COUNT = 2;
+					sim->EX_HAZARD = 1;
+					sim->ID_EX = Empty;
 				} else {
-					EX_HAZARD = 0;
+					sim->EX_HAZARD = 0;
 				}
 
 				// If prod-con hazard exists, set flag and clear out pipeline
-				if ( (MEM_WB.RegWrite && (MEM_WB.rd != 0) && (MEM_WB.rd == ID_EX.rs)) ||
-					 (MEM_WB.RegWrite && (MEM_WB.rd != 0) && (MEM_WB.rd == ID_EX.rt)) ) {
-					STALL_COUNT = 1;
-					MEM_HAZARD = 1;
-					ID_EX = Empty;
+				if ( (sim->MEM_WB.RegWrite && (sim->MEM_WB.rd != 0) && (sim->MEM_WB.rd == sim->ID_EX.rs)) ||
+					 (sim->MEM_WB.RegWrite && (sim->MEM_WB.rd != 0) && (sim->MEM_WB.rd == sim->ID_EX.rt)) ) {
+					sim->STALL_COUNT = 1;
+					sim->MEM_HAZARD = 1;
+					sim->ID_EX = Empty;
 				} else {
-					MEM_HAZARD = 0;
+					sim->MEM_HAZARD = 0;
+				}
+
+				if(opcode == 0x00 && function == 0x0c && sim->EX_MEM.rd == 2) {
+					sim->STALL_COUNT = 2;
+					sim->EX_HAZARD = 1;
+					sim->ID_EX = Empty;
 				}
+			}
 
-				if(opcode == 0x00 && function == 0x0c && EX_MEM.rd == 2) {
-					STALL_COUNT = 2;
-					EX_HAZARD = 1;
-					ID_EX = Empty;
+			// JAL writes $31 in EX, too late for a target fetched right behind it
+			if(sim->STALL_COUNT == 0 && (sim->EX_MEM.IR >> 26) == 0x03 && (d->rs == 31 || d->rt == 31)) {
+				sim->STALL_COUNT = 1;
+				sim->ID_EX = Empty;
+			}
+
+			// Wait for a busy multiplier/divider or for HI/LO, then decode again
+			if(sim->STALL_COUNT == 0) {
+				uint32_t stall = fu_stall_cycles(sim, d->op);
+				if(stall > 0) {
+					sim->STALL_COUNT = stall;
+					sim->ID_EX = Empty;
 				}
 			}
 
-			if(STALL_COUNT == 0) {
-				prev_op = opcode;
+			if(sim->STALL_COUNT == 0) {
+				sim->prev_op = opcode;
+				if(early) {
+					id_branch_resolve(sim, d);
+				}
 			}
 		}
 	}
@@ -1252,30 +3524,40 @@ void ID()
 /************************************************************/
 /* instruction fetch (IF) pipeline stage:                                                              */ 
 /************************************************************/
-void IF()
-{
-	if(MEM_STALL == 0) {
-		if(BRANCH_FLAG == 1) {
-			BRANCH_FLAG = 0;
-			CURRENT_STATE.PC = NEXT_STATE.PC;
-			IF_ID.IR = mem_read_32(CURRENT_STATE.PC);
-			NEXT_STATE.PC = CURRENT_STATE.PC + 4;
-			printf("\nBranch taken");
-		}
-		if(STALL_COUNT == 0) {
-			IF_ID.IR = mem_read_32(CURRENT_STATE.PC);
-			IF_ID.PC = CURRENT_STATE.PC;
-			NEXT_STATE.PC = IF_ID.PC + 4;
+void IF(sim_t *sim)
+{
+	if(sim->MEM_STALL == 0) {
+		int fetch = sim->STALL_COUNT == 0;
+
+		if(sim->BRANCH_FLAG == 1) {
+			sim->BRANCH_FLAG = 0;
+			sim->CURRENT_STATE.PC = sim->NEXT_STATE.PC;
+			// the target is fetched right away, with its own PC, like after a misprediction;
+			// with delay slots IF_ID holds the slot and the target is fetched once ID has taken it
+			if(!sim->DELAY_SLOTS) {
+				fetch = TRUE;
+			}
+			TRACE(TRACE_STAGE, "\nBranch taken");
+		}
+		if(fetch) {
+			sim->IF_ID.IR = mem_read_32(sim, sim->CURRENT_STATE.PC);
+			sim->IF_ID.PC = sim->CURRENT_STATE.PC;
+			if(sim->NUM_BPRED > 0 && !sim->DELAY_SLOTS) {
+				sim->NEXT_STATE.PC = bpred_predict(sim->BPRED, sim->IF_ID.PC, sim->IF_ID.IR, &sim->IF_ID.bpred);
+			} else {
+				sim->NEXT_STATE.PC = sim->IF_ID.PC + 4;
+			}
+			sim->IF_ID.NPC = sim->NEXT_STATE.PC;
 		} else {
-			printf("\nStalling!");
+			TRACE(TRACE_STAGE, "\nStalling!");
 		}
-		ID_FLAG = 1;
-		STALL_COUNT--;
-		if(STALL_COUNT < 0) {
-			STALL_COUNT = 0;
+		sim->ID_FLAG = 1;
+		sim->STALL_COUNT--;
+		if(sim->STALL_COUNT < 0) {
+			sim->STALL_COUNT = 0;
 		}
 	} else {
-		printf("\nMEM STALL: %d",MEM_STALL);
+		TRACE(TRACE_STAGE, "\nMEM STALL: %d",sim->MEM_STALL);
 	}
 }
 
@@ -1283,63 +3565,27 @@ void IF()
 /************************************************************/
 /* Initialize Memory                                                                                                    */ 
 /************************************************************/
-void initialize() { 
-	init_memory();
-	CURRENT_STATE.PC = MEM_TEXT_BEGIN;
-	NEXT_STATE = CURRENT_STATE;
-	RUN_FLAG = TRUE;
-	cache_misses = 0;
-	cache_hits = 0;
-}
-
-
-/************************************************************/
-/* Parses instruction into data struct for R-type instr                                                                                                  */ 
-/************************************************************/
-r_type_data parse_r_type(uint32_t instr) {
-	r_type_data data;
-	data.rs 	= (instr & 0x03E00000) / 0x200000;
-	data.rt 	= (instr & 0x001F0000) / 0x10000;
-	data.rd 	= (instr & 0x0000F800) / 0x800;
-	data.shamt 	= (instr & 0x000007E0) / 0x40;
-	return data;
-}
-
-
-/************************************************************/
-/* Parses instruction into data struct for I-type instr                                                                                                  */ 
-/************************************************************/
-i_type_data parse_i_type(uint32_t instr) {
-	i_type_data data;
-	data.rs 		= (instr & 0x03E00000) / 0x200000;
-	data.rt 		= (instr & 0x001F0000) / 0x10000;
-	data.immediate 	= (instr & 0x0000FFFF);
-	//printf("\n\n%x %x %x %x",instr,data.rs,data.rt,data.immediate);
-	return data;
-}
-
-
-/************************************************************/
-/* Parses instruction into data struct for J-type instr                                                                                                  */ 
-/************************************************************/
-j_type_data parse_j_type(uint32_t instr) {
-	j_type_data data;
-	data.target	= (instr & 0x03FFFFFF);
-	return data;
+void initialize(sim_t *sim) { 
+	init_memory(sim);
+	sim->CURRENT_STATE.PC = MEM_TEXT_BEGIN;
+	sim->NEXT_STATE = sim->CURRENT_STATE;
+	sim->RUN_FLAG = TRUE;
+	sim->cache_misses = 0;
+	sim->cache_hits = 0;
 }
 
 
 /************************************************************/
 /* Print the program loaded into memory (in MIPS assembly format)    */ 
 /************************************************************/
-void print_program(){
+void print_program(sim_t *sim){
 	int i;
 	uint32_t addr;
 	
-	for(i=0; i<PROGRAM_SIZE; i++){
+	for(i=0; i<sim->PROGRAM_SIZE; i++){
 		addr = MEM_TEXT_BEGIN + (i*4);
 		printf("[0x%x]\t", addr);
-		print_instruction(addr);
+		print_instruction(sim, addr);
 	}
 }
 
@@ -1347,11 +3593,9 @@ void print_program(){
 /************************************************************/
 /* Print the program loaded into memory (in MIPS assembly format)    */ 
 /************************************************************/
-void print_instruction(uint32_t addr) {
-	uint32_t instruction = mem_read_32(addr);
-	r_type_data	data_r = parse_r_type(instruction);
-	i_type_data data_i = parse_i_type(instruction);
-	j_type_data data_j = parse_j_type(instruction);
+void print_instruction(sim_t *sim, uint32_t addr) {
+	uint32_t instruction = mem_read_32(sim, addr);
+	decoded_inst_t *d = decode_lookup(sim, addr, instruction);
 
 	uint32_t opcode;
 	opcode = instruction & 0xFC000000;
@@ -1365,73 +3609,73 @@ void print_instruction(uint32_t addr) {
 
 			switch(func) {
 				case 0x00000010: // MFHI
-					printf("MFHI R%d\n",data_r.rd);
+					printf("MFHI R%d\n",d->rd);
 					break;
 				case 0x00000012: //MFLO
-					printf("MFLO R%d\n",data_r.rd);
+					printf("MFLO R%d\n",d->rd);
 					break;
 				case 0x00000011: //MTHI
-					printf("MTHI R%d\n",data_r.rs);
+					printf("MTHI R%d\n",d->rs);
 					break;
 				case 0x00000013: //MTLO
-					printf("MTLO R%d\n",data_r.rs);
+					printf("MTLO R%d\n",d->rs);
 					break;
 				case 0x00000018: //MULT
-					printf("MULT R%d R%d\n",data_r.rs,data_r.rt);
+					printf("MULT R%d R%d\n",d->rs,d->rt);
 					break;
 				case 0x00000019: //MULTU
-					printf("MULTU R%d R%d\n",data_r.rs,data_r.rt);
+					printf("MULTU R%d R%d\n",d->rs,d->rt);
 					break;
 				case 0x00000027: //NOR
-					printf("NOR R%d R%d R%d\n",data_r.rd,data_r.rs,data_r.rt);
+					printf("NOR R%d R%d R%d\n",d->rd,d->rs,d->rt);
 					break;
 				case 0x00000025: //OR
-					printf("OR R%d R%d R%d\n",data_r.rd,data_r.rs,data_r.rt);
+					printf("OR R%d R%d R%d\n",d->rd,d->rs,d->rt);
 					break;
 				case 0x00000000: // SLL
-					printf("SLL R%d R%d %d\n",data_r.rd,data_r.rt,data_r.shamt);
+					printf("SLL R%d R%d %d\n",d->rd,d->rt,d->sa);
 					break;
 				case 0x0000002A: // SLT
-					printf("SLT R%d R%d R%d\n",data_r.rd,data_r.rs,data_r.rt);
+					printf("SLT R%d R%d R%d\n",d->rd,d->rs,d->rt);
 					break;
 				case 0x00000003: // SRA  - Sign extending????
-					printf("SRA R%d R%d %d\n",data_r.rd,data_r.rt,data_r.shamt);
+					printf("SRA R%d R%d %d\n",d->rd,d->rt,d->sa);
 					break;
 				case 0x00000002: // SRL
-					printf("SRL R%d R%d %d\n",data_r.rd,data_r.rt,data_r.shamt);
+					printf("SRL R%d R%d %d\n",d->rd,d->rt,d->sa);
 					break;
 				case 0x00000022: // SUB
-					printf("SUB R%d R%d R%d\n",data_r.rd,data_r.rs,data_r.rt);
+					printf("SUB R%d R%d R%d\n",d->rd,d->rs,d->rt);
 					break;
 				case 0x00000023: // SUBU
-					printf("SUBU R%d R%d R%d\n",data_r.rd,data_r.rs,data_r.rt);
+					printf("SUBU R%d R%d R%d\n",d->rd,d->rs,d->rt);
 					break;
 				case 0x0000000C: //SYSCALL
 					printf("SYSCALL\n");
 					break;
 				case 0x00000026: // XOR
-					printf("XOR R%d R%d R%d\n",data_r.rd,data_r.rs,data_r.rt);
+					printf("XOR R%d R%d R%d\n",d->rd,d->rs,d->rt);
 					break;
 				case 0x00000020: // ADD
-					printf("ADD R%d R%d R%d\n",data_r.rd,data_r.rs,data_r.rt);
+					printf("ADD R%d R%d R%d\n",d->rd,d->rs,d->rt);
 					break;
 				case 0x00000021: // ADDU
-					printf("ADDU R%d R%d R%d\n",data_r.rd,data_r.rs,data_r.rt);
+					printf("ADDU R%d R%d R%d\n",d->rd,d->rs,d->rt);
 					break;
 				case 0x00000024: // AND
-					printf("AND R%d R%d R%d\n",data_r.rd,data_r.rs,data_r.rt);
+					printf("AND R%d R%d R%d\n",d->rd,d->rs,d->rt);
 					break;
 				case 0x0000001A: // DIV
-					printf("DIV R%d R%d\n",data_r.rs,data_r.rt);
+					printf("DIV R%d R%d\n",d->rs,d->rt);
 					break;
 				case 0x0000001B: // DIVU
-					printf("DIVU R%d R%d\n",data_r.rs,data_r.rt);
+					printf("DIVU R%d R%d\n",d->rs,d->rt);
 					break;
 				case 0x00000009: // JALR
-					printf("JALR R%d R%d\n",data_r.rd,data_r.rs);
+					printf("JALR R%d R%d\n",d->rd,d->rs);
 					break;
 				case 0x00000008: // JR
-					printf("JR R%d\n",data_r.rs);
+					printf("JR R%d\n",d->rs);
 					break;
 				default:
 					printf("\n\nUnknown instruction in R type.\n\n");
@@ -1446,10 +3690,10 @@ void print_instruction(uint32_t addr) {
 
 			switch(rt) {
 				case 0x00010000: // BGEZ
-					printf("BGEZ R%d %d\n",data_i.rs,data_i.immediate);
+					printf("BGEZ R%d %d\n",d->rs,d->uimm);
 					break;
 				case 0x00000000: // BLTZ
-					printf("BLTZ R%d %d\n",data_i.rs,data_i.immediate);
+					printf("BLTZ R%d %d\n",d->rs,d->uimm);
 					break;
 				default:
 					printf("\n\nUnknown instruction in B case.\n\n");
@@ -1458,61 +3702,61 @@ void print_instruction(uint32_t addr) {
 			break;
 
 		case 0x3C000000: // LUI
-			printf("LUI R%d %d\n",data_i.rt,data_i.immediate);
+			printf("LUI R%d %d\n",d->rt,d->uimm);
 			break;
 		case 0x84000000: // LH
-			printf("LH R%d %d(R%d)\n",data_i.rt,data_i.immediate,data_i.rs);
+			printf("LH R%d %d(R%d)\n",d->rt,d->uimm,d->rs);
 			break;
 		case 0x8C000000: // LW
-			printf("LW R%d %d(R%d)\n",data_i.rt,data_i.immediate,data_i.rs);
+			printf("LW R%d %d(R%d)\n",d->rt,d->uimm,d->rs);
 			break;
 		case 0x34000000: // ORI
-			printf("ORI R%d R%d %d\n",data_i.rt,data_i.rs,data_i.immediate);
+			printf("ORI R%d R%d %d\n",d->rt,d->rs,d->uimm);
 			break;
 		case 0xA0000000: // SB
-			printf("SB R%d %d(R%d)\n",data_i.rt,data_i.immediate,data_i.rs);
+			printf("SB R%d %d(R%d)\n",d->rt,d->uimm,d->rs);
 			break;
 		case 0xA4000000: // SH
-			printf("SH R%d %d(R%d)\n",data_i.rt,data_i.immediate,data_i.rs);
+			printf("SH R%d %d(R%d)\n",d->rt,d->uimm,d->rs);
 			break;
 		case 0x28000000: // SLTI
-			printf("SLTI R%d R%d %d\n",data_i.rt,data_i.rs,data_i.immediate);
+			printf("SLTI R%d R%d %d\n",d->rt,d->rs,d->uimm);
 			break;
 		case 0xAC000000: // SW
-			printf("SW R%d %d(R%d)\n",data_i.rt,data_i.immediate,data_i.rs);
+			printf("SW R%d %d(R%d)\n",d->rt,d->uimm,d->rs);
 			break;
 		case 0x38000000: // XORI
-			printf("XORI R%d R%d %d\n",data_i.rt,data_i.rs,data_i.immediate);
+			printf("XORI R%d R%d %d\n",d->rt,d->rs,d->uimm);
 			break;
 		case 0x20000000: // ADDI
-			printf("ADDI R%d R%d %d\n",data_i.rt,data_i.rs,data_i.immediate);			
+			printf("ADDI R%d R%d %d\n",d->rt,d->rs,d->uimm);			
 			break;
 		case 0x24000000: // ADDIU
-			printf("ADDIU R%d R%d %d\n",data_i.rt,data_i.rs,data_i.immediate);
+			printf("ADDIU R%d R%d %d\n",d->rt,d->rs,d->uimm);
 			break;
 		case 0x30000000: // ANDI
-			printf("ANDI R%d R%d %d\n",data_i.rt,data_i.rs,data_i.immediate);
+			printf("ANDI R%d R%d %d\n",d->rt,d->rs,d->uimm);
 			break;
 		case 0x10000000: // BEQ
-			printf("BEQ R%d R%d %d\n",data_i.rs,data_i.rt,data_i.immediate);
+			printf("BEQ R%d R%d %d\n",d->rs,d->rt,d->uimm);
 			break;
 		case 0x1C000000: // BGTZ
-			printf("BGTZ R%d %d\n",data_i.rs,data_i.immediate);
+			printf("BGTZ R%d %d\n",d->rs,d->uimm);
 			break;
 		case 0x18000000: // BLEZ
-			printf("BLEZ R%d %d\n",data_i.rs,data_i.immediate);
+			printf("BLEZ R%d %d\n",d->rs,d->uimm);
 			break;
 		case 0x14000000: // BNE
-			printf("BNE R%d R%d %d\n",data_i.rs,data_i.rt,data_i.immediate);
+			printf("BNE R%d R%d %d\n",d->rs,d->rt,d->uimm);
 			break;
 		case 0x08000000: // J
-			printf("J %d\n",data_j.target);
+			printf("J %d\n",(instruction & 0x03FFFFFF));
 			break;
 		case 0x0C000000: // JAL
-			printf("JAL %d\n",data_j.target);
+			printf("JAL %d\n",(instruction & 0x03FFFFFF));
 			break;
 		case 0x80000000: // LB
-			printf("LB R%d %d(R%d)\n",data_i.rt,data_i.immediate,data_i.rs);
+			printf("LB R%d %d(R%d)\n",d->rt,d->uimm,d->rs);
 			break;
 		default:
 			printf("\n\nUnknown instruction in other case.\n\n");
@@ -1523,26 +3767,26 @@ void print_instruction(uint32_t addr) {
 /************************************************************/
 /* Print the current pipeline                                                                                    */ 
 /************************************************************/
-void show_pipeline(){
-	printf("\n\nCurrent PC: %x",CURRENT_STATE.PC);
-	printf("\nIF_ID.IR: %x",IF_ID.IR);
-	printf("\nIF_ID.PC: %x",IF_ID.PC);
-
-	printf("\n\nID_EX.IR: %x",ID_EX.IR);
-	printf("\nID_EX.A: %x",ID_EX.A);
-	printf("\nID_EX.B: %x",ID_EX.B);
-	printf("\nID_EX.D: %x",ID_EX.D);
-	printf("\nID_EX.imm: %x",ID_EX.imm);
-
-	printf("\n\nEX_MEM.IR: %x",EX_MEM.IR);
-	printf("\nEX_MEM.A: %x",EX_MEM.A);
-	printf("\nEX_MEM.B: %x",EX_MEM.B);
-	printf("\nEX_MEM.D: %x",EX_MEM.D);
-	printf("\nEX_MEM.ALUOutput: %x",EX_MEM.ALUOutput);
-
-	printf("\n\nMEM_WB.IR: %x",MEM_WB.IR);
-	printf("\nMEM_WB.ALUOutput: %x",MEM_WB.ALUOutput);
-	printf("\nMEM_WB.LMD: %x",MEM_WB.LMD);
+void show_pipeline(sim_t *sim){
+	printf("\n\nCurrent PC: %x",sim->CURRENT_STATE.PC);
+	printf("\nIF_ID.IR: %x",sim->IF_ID.IR);
+	printf("\nIF_ID.PC: %x",sim->IF_ID.PC);
+
+	printf("\n\nID_EX.IR: %x",sim->ID_EX.IR);
+	printf("\nID_EX.A: %x",sim->ID_EX.A);
+	printf("\nID_EX.B: %x",sim->ID_EX.B);
+	printf("\nID_EX.D: %x",sim->ID_EX.D);
+	printf("\nID_EX.imm: %x",sim->ID_EX.imm);
+
+	printf("\n\nEX_MEM.IR: %x",sim->EX_MEM.IR);
+	printf("\nEX_MEM.A: %x",sim->EX_MEM.A);
+	printf("\nEX_MEM.B: %x",sim->EX_MEM.B);
+	printf("\nEX_MEM.D: %x",sim->EX_MEM.D);
+	printf("\nEX_MEM.ALUOutput: %x",sim->EX_MEM.ALUOutput);
+
+	printf("\n\nMEM_WB.IR: %x",sim->MEM_WB.IR);
+	printf("\nMEM_WB.ALUOutput: %x",sim->MEM_WB.ALUOutput);
+	printf("\nMEM_WB.LMD: %x",sim->MEM_WB.LMD);
 	printf("\n\n");
 }
 
@@ -1550,21 +3794,133 @@ void show_pipeline(){
 /* main                                                                                                                                   */
 /***************************************************************/
 int main(int argc, char *argv[]) {                              
-	printf("\n**************************\n");
-	printf("Welcome to MU-MIPS SIM...\n");
-	printf("**************************\n\n");
-	
+	const char *trace_file = NULL, *simpoints = NULL, *record_file = NULL;
+	uint32_t profile = 0, warmup = 0;
+	batch_config_t config;
+	program_t *program;
+	sim_t *sim;
+	int batch = FALSE;
+	int i, n;
+
+	if (argc > 2 && strcmp(argv[1], "-m") == 0) {
+		runner_main(argv[2], argc > 4 && strcmp(argv[3], "-j") == 0 ? atoi(argv[4]) : 0);
+		return 0;
+	}
+	if (argc > 2 && strcmp(argv[1], "-s") == 0) {
+		int max_k = SIMPOINT_MAX_K, samples = 1;
+		for (i = 3; i + 1 < argc; i += 2) {
+			if (strcmp(argv[i], "-k") == 0) {
+				max_k = atoi(argv[i+1]);
+			} else if (strcmp(argv[i], "-N") == 0) {
+				samples = atoi(argv[i+1]);
+			}
+		}
+		simpoint_cluster(argv[2], max_k > 0 ? max_k : 1, samples > 0 ? samples : 1);
+		return 0;
+	}
+
+	memset(&config, 0, sizeof(config));
+	for (i = 2; i < argc; i += n) {
+		n = 1;
+		if (strcmp(argv[i], "-b") == 0) {
+			batch = TRUE;
+		} else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			trace_file = argv[i+1];
+			n = 2;
+		} else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc && (profile = strtoul(argv[i+1], NULL, 0)) > 0) {
+			n = 2;
+		} else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+			simpoints = argv[i+1];
+			n = 2;
+		} else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			record_file = argv[i+1];
+			n = 2;
+		} else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+			warmup = strtoul(argv[i+1], NULL, 0);
+			n = 2;
+		} else if ((n = batch_parse_option(&config, argc, argv, i)) == 0) {
+			break;
+		}
+	}
+	if (i < argc) {
+		printf("Error: Bad option %s\n", argv[i]);
+		argc = 1;
+	}
 	if (argc < 2) {
-		printf("Error: You should provide input file.\nUsage: %s <input program> \n\n",  argv[0]);
+		printf("Error: You should provide input file.\nUsage: %s <input program> [-t <trace file>] [-c <cache model>]... [-l <unit timing>]... [-B <predictor>]...\n", argv[0]);
+		printf("       %s <input program> -b [-n <cycles>] [-R <checkpoint>] [-F <instructions>] [-f 0|1] [-e 0|1] [-D 0|1]\n", argv[0]);
+		printf("           [-d <start>:<stop>]... [-c <cache model>]... [-l <unit timing>]... [-B <predictor>]... [-C <checkpoint>] [-o json|bin]\n");
+		printf("       %s -m <manifest> [-j <threads>]\n", argv[0]);
+		printf("       %s <input program> -p <interval> [-F <instructions>] [-D 0|1]\t(basic-block vectors)\n", argv[0]);
+		printf("       %s -s <profile> [-k <max clusters>] [-N <samples per cluster>]\t(pick simpoints)\n", argv[0]);
+		printf("       %s <input program> -S <simpoints> [-w <warmup>] [-f 0|1] [-e 0|1] [-D 0|1]\t(sampled simulation)\n", argv[0]);
+		printf("       %s <input program> -r <trace file> [-F <instructions>] [-D 0|1]\t(instruction trace for mu-cachesim)\n", argv[0]);
+		printf("       cache model: <sets>:<ways>:<block bytes>[:lru|fifo|random][:wa|nwa][:<miss penalty>]\n");
+		printf("       unit timing: mult|multu|div|divu|mthi|mtlo|lb|lh|lw|sb|sh|sw:<latency>[:<issue interval>]\n");
+		printf("       predictor: [bimodal|gshare|local|tournament:]<entries>[:<btb entries>[:<history bits>]][:ras<depth>]\n\n");
 		exit(1);
 	}
 
-	strcpy(prog_file, argv[1]);
-	initialize();
-	load_program();
+	program = program_open(argv[1]);
+	sim = sim_create(program);
+	sim->ENABLE_FORWARDING = config.forwarding;
+	sim->EARLY_BRANCH = config.early_branch;
+	sim->DELAY_SLOTS = config.delay_slots;
+	for (i = 0; i < config.num_cache_models; i++) {
+		cache_model_add(sim, &config.cache_models[i]);
+	}
+	for (i = 0; i < config.num_timings; i++) {
+		fu_set_timing(sim, &config.timings[i]);
+	}
+	for (i = 0; i < config.num_predictors; i++) {
+		bpred_add(sim, &config.predictors[i]);
+	}
+	/* before any output, so stdout gets the large buffer too */
+	trace_open(sim, trace_file);
+
+	if (profile > 0) {
+		sim->TRACE_LEVEL = TRACE_OFF;
+		initialize(sim);
+		load_program(sim);
+		bbv_profile(sim, profile, config.fast_forward, stdout);
+		sim_destroy(sim);
+		program_close(program);
+		return 0;
+	}
+	if (record_file != NULL) {
+		sim->TRACE_LEVEL = TRACE_OFF;
+		initialize(sim);
+		load_program(sim);
+		i = itrace_record(sim, record_file, config.fast_forward);
+		sim_destroy(sim);
+		program_close(program);
+		return i != 0;
+	}
+	if (simpoints != NULL) {
+		simpoint_run(program, &config, simpoints, warmup);
+		sim_destroy(sim);
+		program_close(program);
+		return 0;
+	}
+	if (batch) {
+		sim->TRACE_LEVEL = TRACE_OFF;
+		initialize(sim);
+		load_program(sim);
+		batch_run(sim, &config);
+		sim_destroy(sim);
+		program_close(program);
+		return 0;
+	}
+
+	printf("\n**************************\n");
+	printf("Welcome to MU-MIPS SIM...\n");
+	printf("**************************\n\n");
+
+	initialize(sim);
+	load_program(sim);
 	help();
 	while (1){
-		handle_command();
+		handle_command(sim);
 	}
 	return 0;
 }
@@ -1,4 +1,9 @@
+#include <stdio.h>
 #include <stdint.h>
+#include <pthread.h>
+#include "mu-itrace.h"
+#include "mu-image.h"
+#include "mu-bpred.h"
 
 #define FALSE 0
 #define TRUE  1
@@ -24,18 +29,53 @@
 
 typedef struct {
 	uint32_t begin, end;
-	uint8_t *mem;
 } mem_region_t;
 
-/* memory will be dynamically allocated at initialization */
-mem_region_t MEM_REGIONS[] = {
-	{ MEM_TEXT_BEGIN, MEM_TEXT_END, NULL },
-	{ MEM_DATA_BEGIN, MEM_DATA_END, NULL },
-	{ MEM_KDATA_BEGIN, MEM_KDATA_END, NULL },
-	{ MEM_KTEXT_BEGIN, MEM_KTEXT_END, NULL }
-};
-
 #define NUM_MEM_REGION 4
+
+/******************************************************************************/
+/* Sparse guest memory: two-level page table, pages allocated on first write  */
+/******************************************************************************/
+#define MEM_PAGE_BITS   12
+#define MEM_PAGE_SIZE   (1 << MEM_PAGE_BITS)
+#define MEM_PAGE_MASK   (MEM_PAGE_SIZE - 1)
+#define MEM_L2_BITS     10
+#define MEM_L1_BITS     (32 - MEM_PAGE_BITS - MEM_L2_BITS)
+
+#define MEM_L1_INDEX(addr) ((addr) >> (MEM_PAGE_BITS + MEM_L2_BITS))
+#define MEM_L2_INDEX(addr) (((addr) >> MEM_PAGE_BITS) & ((1 << MEM_L2_BITS) - 1))
+
+typedef struct {
+	uint8_t *pages[1 << MEM_L2_BITS];
+} mem_page_table_t;
+
+/* untouched pages read as zero; shared by every simulator */
+extern const uint8_t MEM_ZERO_PAGE[MEM_PAGE_SIZE];
+
+/* direct-mapped software TLBs caching guest page -> host page translations */
+#define MEM_TLB_BITS    8
+#define MEM_TLB_SIZE    (1 << MEM_TLB_BITS)
+#define MEM_TLB_INDEX(addr) (((addr) >> MEM_PAGE_BITS) & (MEM_TLB_SIZE - 1))
+#define MEM_TLB_INVALID 1 /* never equal to a page-aligned tag */
+
+typedef struct {
+	uint32_t tag;
+	const uint8_t *page;
+} mem_read_tlb_t;
+
+typedef struct {
+	uint32_t tag;
+	uint8_t *page;
+} mem_write_tlb_t;
+
+/* guest memory is little-endian; swap only on big-endian hosts */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define MEM_LE16(x) __builtin_bswap16(x)
+#define MEM_LE32(x) __builtin_bswap32(x)
+#else
+#define MEM_LE16(x) (x)
+#define MEM_LE32(x) (x)
+#endif
 #define MIPS_REGS 32
 
 typedef struct CPU_State_Struct {
@@ -60,89 +100,382 @@ typedef struct CPU_Pipeline_Reg_Struct{
 	uint32_t rs;
 	uint32_t rd;
 	uint32_t rt;
+	uint32_t NPC;	/* PC that IF fetched next, predicted past a branch or jump */
+	bpred_snapshot_t bpred;	/* BPRED[0] state NPC was predicted with */
+	uint32_t resolved;	/* branch or jump already resolved by ID (-e 1); EX only links */
 	
 } CPU_Pipeline_Reg;
 
 /***************************************************************/
-/* CPU State info.                                                                                                               */
+/* Tracing                                                                                                                        */
 /***************************************************************/
+#define TRACE_OFF		0	/* command output only */
+#define TRACE_SUMMARY	1	/* one line per program load and per run/sim command */
+#define TRACE_INSTR		2	/* every decoded instruction and every loaded word */
+#define TRACE_STAGE		3	/* pipeline stage events: stalls, taken branches, memory stalls */
 
-CPU_State CURRENT_STATE, NEXT_STATE;
-int RUN_FLAG;	/* run flag*/
-int ID_FLAG = 0;
-int EX_FLAG = 0;
-int MEM_FLAG = 0;
-int WB_FLAG = 0;
-uint32_t INSTRUCTION_COUNT;
-uint32_t CYCLE_COUNT;
-uint32_t PROGRAM_SIZE; /*in words*/
-uint32_t ENABLE_FORWARDING = 0;
-int EX_HAZARD = 0;
-int MEM_HAZARD = 0;
-int STALL_COUNT = 0;
-int MEM_STALL = 0;
-int BRANCH_FLAG = 0;
-int controlA = 0;
-int controlB = 0;
-uint32_t prev_op;
+/* highest level compiled in; -DTRACE_MAX=TRACE_OFF removes every trace call from the build */
+#ifndef TRACE_MAX
+#define TRACE_MAX TRACE_STAGE
+#endif
 
+#define TRACE_BUFFER_SIZE (1 << 20)
+/* both expect the simulator context as sim */
+#define TRACE_ON(level) (TRACE_MAX >= (level) && sim->TRACE_LEVEL >= (level))
+#define TRACE(level, ...) do { if (TRACE_ON(level)) fprintf(sim->TRACE_SINK, __VA_ARGS__); } while (0)
+
+#include "mu-cache.h"
 
 /***************************************************************/
-/* Pipeline Registers.                                                                                                        */
+/* Functional units: per-op latency and issue interval, given with -l.      */
+/* MULT/MULTU share the multiplier and DIV/DIVU the divider; an op enters   */
+/* EX once its unit is free, and HI/LO are ready latency cycles later.      */
+/* A load or store that hits L1Cache holds MEM for its latency. Ops not     */
+/* configured take one cycle, as does every other op.                       */
 /***************************************************************/
-CPU_Pipeline_Reg IF_ID;
-CPU_Pipeline_Reg ID_EX_Prev;
-CPU_Pipeline_Reg ID_EX;
-CPU_Pipeline_Reg EX_MEM;
-CPU_Pipeline_Reg MEM_WB;
-CPU_Pipeline_Reg Empty;
+#define FU_MAX_TIMINGS 16
 
-char prog_file[32];
+enum { FU_NONE, FU_MULT, FU_DIV, NUM_FU };
 
+typedef struct {
+	uint8_t op;			/* OP_MULT ... OP_SW */
+	uint8_t latency;	/* cycles until the result can be used */
+	uint8_t interval;	/* cycles until the unit takes another op */
+} fu_timing_t;
 
-typedef struct R_Type_Instruction {
-	uint32_t rs;
-	uint32_t rt;
-	uint32_t rd;
-	uint32_t shamt;
-} r_type_data;
+/***************************************************************/
+/* Headless batch mode (-b): run from argv, write one result record, no other output */
+/***************************************************************/
+#define BATCH_MAX_DUMPS 16
+#define BATCH_MAX_DUMP_WORDS 65536	/* per -d range; 0xffffffff would otherwise ask for 4 GB */
+#define BATCH_MAGIC "MUMR"
+#define BATCH_VERSION 8
 
-typedef struct I_Type_Instruction {
-	uint32_t rs;
-	uint32_t rt;
-	uint32_t immediate;
-} i_type_data;
+typedef struct {
+	uint32_t fast_forward;		/* instructions to execute functionally before the pipeline starts */
+	uint32_t cycles;			/* cycle limit of the detailed window; 0 runs until the program halts */
+	int forwarding;
+	int early_branch;			/* resolve branches and jumps in ID */
+	int delay_slots;			/* MIPS-I branch delay slots */
+	int binary;					/* write a batch_record_t instead of JSON */
+	int num_dumps;
+	mem_region_t dumps[BATCH_MAX_DUMPS];	/* word ranges to report, inclusive as in mdump */
+	int num_cache_models;
+	cache_config_t cache_models[CACHE_MAX_MODELS];	/* extra cache models fed from the same run */
+	int num_timings;
+	fu_timing_t timings[FU_MAX_TIMINGS];	/* functional-unit latencies other than one cycle */
+	int num_predictors;
+	bpred_config_t predictors[BPRED_MAX_PREDICTORS];	/* the first steers IF, the others only learn */
+	char restore[256];			/* checkpoint to start from instead of the program entry */
+	char checkpoint[256];		/* checkpoint to write when the run ends */
+} batch_config_t;
 
-typedef struct J_Type_Instruction {
-	uint32_t target;
-} j_type_data;
+/* binary result: this header, then per dump its begin and end addresses and the words in between */
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t pc;
+	uint32_t halted;
+	uint32_t cycles;
+	uint32_t instructions;
+	uint32_t regs[32];
+	uint32_t hi, lo;
+	uint32_t cache_hits, cache_misses;
+	uint32_t forwarding;
+	uint32_t num_dumps;
+	uint32_t num_cache_models;
+	uint32_t num_predictors;
+	uint32_t early_branch;
+	uint32_t delay_slots;
+} batch_record_t;
+
+/* binary result, after the dumps: one per cache model */
+typedef struct {
+	cache_config_t config;
+	cache_stats_t stats;
+} batch_cache_record_t;
+
+/* binary result, after the cache models: one per branch predictor */
+typedef struct {
+	bpred_config_t config;
+	bpred_stats_t stats;
+} batch_bpred_record_t;
+
+/***************************************************************/
+/* Checkpoints: this header, then num_pages page records, one per guest page  */
+/* that is not all zero. Configuration (forwarding, early branches, delay   */
+/* slots, cache models, unit timings, branch predictors) is not saved;      */
+/* predictors restart cold.                                                  */
+/***************************************************************/
+#define CHECKPOINT_MAGIC "MUCK"
+#define CHECKPOINT_VERSION 8
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t header_size;		/* sizeof(checkpoint_header_t) of the writer */
+	uint32_t num_pages;
+	uint32_t program_size;		/* text words, for the predecode table */
+	CPU_State current_state, next_state;
+	CPU_Pipeline_Reg if_id, id_ex_prev, id_ex, ex_mem, mem_wb;
+	int32_t run_flag, id_flag, ex_flag, mem_flag, wb_flag;
+	int32_t ex_hazard, mem_hazard, stall_count, mem_stall, branch_flag, control_a, control_b;
+	uint32_t prev_op;
+	uint32_t instruction_count, cycle_count;
+	Cache l1_cache;
+	uint32_t write_buffer[4];
+	uint32_t cache_hits, cache_misses;
+	uint32_t fu_free[NUM_FU], hilo_ready;
+} checkpoint_header_t;
+
+typedef struct {
+	uint32_t address;
+	uint8_t data[MEM_PAGE_SIZE];
+} checkpoint_page_t;
+
+
+/***************************************************************/
+/* Predecoded instructions                                                                                       */
+/***************************************************************/
+enum {
+	OP_INVALID = 0,	/* not decoded yet, or invalidated by a store to text */
+	OP_SLL, OP_SRL, OP_SRA, OP_JR, OP_JALR, OP_SYSCALL,
+	OP_MFHI, OP_MTHI, OP_MFLO, OP_MTLO, OP_MULT, OP_MULTU, OP_DIV, OP_DIVU,
+	OP_ADD, OP_ADDU, OP_SUB, OP_SUBU, OP_AND, OP_OR, OP_XOR, OP_NOR, OP_SLT,
+	OP_BLTZ, OP_BGEZ, OP_J, OP_JAL, OP_BEQ, OP_BNE, OP_BLEZ, OP_BGTZ,
+	OP_ADDI, OP_ADDIU, OP_SLTI, OP_ANDI, OP_ORI, OP_XORI, OP_LUI,
+	OP_LB, OP_LH, OP_LW, OP_SB, OP_SH, OP_SW,
+	OP_NOP,		/* REGIMM encoding other than BLTZ/BGEZ */
+	OP_UNKNOWN,	/* not implemented */
+	NUM_OPS
+};
+
+typedef struct Decoded_Inst_Struct {
+	uint8_t op;				/* handler id */
+	uint8_t rs, rt, rd, sa;
+	uint32_t imm;			/* sign-extended immediate */
+	uint32_t uimm;			/* zero-extended immediate */
+	uint32_t target;		/* absolute branch/jump target */
+	uint32_t instruction;	/* raw instruction word */
+} decoded_inst_t;
+
+/***************************************************************/
+/* Program file, mapped once and shared read-only by any number of simulators                */
+/***************************************************************/
+typedef struct {
+	const uint8_t *data;
+	size_t size;
+	char path[256];
+} program_t;
+
+/***************************************************************/
+/* Simulator context: all state of one simulation. Every function that touches it takes it  */
+/* as its first argument, so independent simulators can run on separate host threads.      */
+/***************************************************************/
+typedef struct Simulator_Struct {
+	/* guest memory: second-level tables are allocated on demand */
+	mem_region_t MEM_REGIONS[NUM_MEM_REGION];	/* only these addresses are backed by memory */
+	mem_page_table_t *MEM_PAGE_TABLE[1 << MEM_L1_BITS];
+	/* guest address of every allocated page, so reset only touches dirtied memory */
+	uint32_t *MEM_PAGE_LIST;
+	uint32_t MEM_PAGES_ALLOCATED;
+	uint32_t MEM_PAGE_LIST_SIZE;
+	mem_read_tlb_t MEM_READ_TLB[MEM_TLB_SIZE];
+	mem_write_tlb_t MEM_WRITE_TLB[MEM_TLB_SIZE];
+
+	/* CPU state info */
+	CPU_State CURRENT_STATE, NEXT_STATE;
+	int RUN_FLAG;	/* run flag*/
+	int ID_FLAG;
+	int EX_FLAG;
+	int MEM_FLAG;
+	int WB_FLAG;
+	uint32_t INSTRUCTION_COUNT;	/* instructions (not bubbles) through WB; fast-forwarded ones are not counted */
+	uint32_t CYCLE_COUNT;
+	uint32_t PROGRAM_SIZE; /*in words*/
+	uint32_t ENABLE_FORWARDING;
+	uint32_t EARLY_BRANCH;	/* branches and jumps resolve in ID, with their own forwarding */
+	uint32_t DELAY_SLOTS;	/* the instruction after a branch or jump always runs (MIPS-I) */
+	int EX_HAZARD;
+	int MEM_HAZARD;
+	int STALL_COUNT;
+	int MEM_STALL;
+	int BRANCH_FLAG;
+	int controlA;
+	int controlB;
+	uint32_t prev_op;
+
+	/* functional units: 0 in FU_LATENCY/FU_INTERVAL means one cycle */
+	uint8_t FU_LATENCY[NUM_OPS];
+	uint8_t FU_INTERVAL[NUM_OPS];
+	uint32_t FU_FREE[NUM_FU];	/* first cycle each unit accepts an op in EX */
+	uint32_t HILO_READY;		/* first cycle MFHI/MFLO may read HI/LO in EX */
+
+	/* pipeline registers */
+	CPU_Pipeline_Reg IF_ID;
+	CPU_Pipeline_Reg ID_EX_Prev;
+	CPU_Pipeline_Reg ID_EX;
+	CPU_Pipeline_Reg EX_MEM;
+	CPU_Pipeline_Reg MEM_WB;
+
+	/* one entry per loaded text word, indexed by (PC - MEM_TEXT_BEGIN) >> 2 */
+	decoded_inst_t *DECODED;
+	uint32_t DECODED_SIZE;
+	decoded_inst_t DECODE_SCRATCH;	/* returned by decode_lookup() for words not in DECODED */
+
+	/* cache */
+	Cache L1Cache;
+	uint32_t WRITE_BUFFER[4];
+	uint32_t cache_misses;
+	uint32_t cache_hits;
+	cache_model_t *CACHE_MODELS;	/* models given with -c, fed every load and store MEM performs */
+	int NUM_CACHE_MODELS;
+
+	/* branch predictors given with -B: BPRED[0] steers IF, the rest learn from the same branches */
+	/* to be compared with it. Without one IF fetches PC + 4 and every branch stalls a cycle.    */
+	bpred_t *BPRED;
+	int NUM_BPRED;
+
+	const program_t *program;
+	int TRACE_LEVEL;	/* runtime level, set with the trace command; capped by TRACE_MAX */
+	FILE *TRACE_SINK;	/* fully buffered: stdout or the file given with -t */
+} sim_t;
+
+/***************************************************************/
+/* Multi-threaded batch runner (-m <manifest>): one job per manifest line, run on a        */
+/* work-stealing pool, results printed as one table in manifest order                      */
+/***************************************************************/
+#define RUNNER_MAX_ARGS 64
+#define RUNNER_DEFAULT_CYCLES 10000000	/* cycle limit of a job without -n, so one that never halts cannot hang the run */
+
+typedef struct {
+	const program_t *program;	/* shared with every other job naming the same file */
+	batch_config_t config;
+	batch_record_t record;
+	uint32_t *memory;			/* words of config.dumps, in order */
+	cache_stats_t *cache_stats;	/* one per config.cache_models */
+	bpred_stats_t bpred_stats[BPRED_MAX_PREDICTORS];	/* one per config.predictors */
+	uint32_t line;				/* manifest line, for the table */
+} runner_job_t;
+
+/* per-thread deque of job indexes: the owner takes from the tail, thieves from the head */
+typedef struct {
+	pthread_mutex_t lock;
+	uint32_t *jobs;
+	uint32_t head, tail;
+} runner_queue_t;
+
+typedef struct Runner_Struct {
+	runner_job_t *jobs;
+	uint32_t num_jobs;
+	runner_queue_t *queues;
+	int num_threads;
+	program_t **programs;
+	uint32_t num_programs;
+} runner_t;
+
+typedef struct {
+	runner_t *runner;
+	int id;
+	pthread_t thread;
+} runner_worker_t;
+
+/***************************************************************/
+/* SimPoint phase analysis: -p writes one basic-block vector per interval of the functional */
+/* run, -s clusters them into representative intervals and weights, -S simulates only those */
+/* intervals in the pipeline and extrapolates CPI and miss rate                              */
+/***************************************************************/
+#define SIMPOINT_DIMS 15			/* basic-block vectors are randomly projected to this many dimensions */
+#define SIMPOINT_MAX_K 10			/* default cluster limit */
+#define SIMPOINT_SEEDS 5			/* k-means runs per k; the lowest distortion is kept */
+#define SIMPOINT_ITERATIONS 100
+#define SIMPOINT_BIC_THRESHOLD 0.9	/* pick the smallest k scoring this fraction of the BIC range */
+
+/* basic block leader PC -> block id, open addressing */
+typedef struct {
+	uint32_t *pcs;				/* 0: free slot; text never starts at 0 */
+	uint32_t *ids;
+	uint32_t size, used;
+} bbv_map_t;
+
+/* per-cluster sums for the stratified estimate of CPI, L1Cache misses and L1Cache accesses */
+/* per 1000 instructions                                                                    */
+#define SIMPOINT_METRICS 3
+
+typedef struct {
+	double weight;
+	uint32_t samples;
+	double sum[SIMPOINT_METRICS], sum_sq[SIMPOINT_METRICS];
+} simpoint_stratum_t;
 
 /***************************************************************/
 /* Function Declerations.                                                                                                */
 /***************************************************************/
 void help();
-uint32_t mem_read_32(uint32_t address);
-void mem_write_32(uint32_t address, uint32_t value);
-void cycle();
-void run(int num_cycles);
-void runAll();
-void mdump(uint32_t start, uint32_t stop) ;
-void rdump();
-void handle_command();
-void reset();
-void init_memory();
-void load_program();
-void handle_pipeline(); /*IMPLEMENT THIS*/
-void WB();/*IMPLEMENT THIS*/
-void MEM();/*IMPLEMENT THIS*/
-void EX();/*IMPLEMENT THIS*/
-void ID();/*IMPLEMENT THIS*/
-void IF();/*IMPLEMENT THIS*/
-void show_pipeline();/*IMPLEMENT THIS*/
-void initialize();
-void print_program(); /*IMPLEMENT THIS*/
-r_type_data parse_r_type(uint32_t);
-i_type_data parse_i_type(uint32_t);
-j_type_data parse_j_type(uint32_t);
-void print_instruction(uint32_t addr);
-void view_cache();
\ No newline at end of file
+program_t *program_open(const char *path);
+void program_close(program_t *program);
+sim_t *sim_create(const program_t *program);
+void sim_destroy(sim_t *sim);
+void trace_open(sim_t *sim, const char *path);
+int batch_parse_option(batch_config_t *config, int argc, char *argv[], int i);
+void batch_execute(sim_t *sim, const batch_config_t *config, batch_record_t *record);
+void batch_run(sim_t *sim, const batch_config_t *config);
+void runner_main(const char *manifest, int num_threads);
+int checkpoint_save(sim_t *sim, const char *path);
+int checkpoint_restore(sim_t *sim, const char *path);
+uint8_t mem_read_8(sim_t *sim, uint32_t address);
+uint16_t mem_read_16(sim_t *sim, uint32_t address);
+uint32_t mem_read_32(sim_t *sim, uint32_t address);
+void mem_write_8(sim_t *sim, uint32_t address, uint8_t value);
+void mem_write_16(sim_t *sim, uint32_t address, uint16_t value);
+void mem_write_32(sim_t *sim, uint32_t address, uint32_t value);
+void mem_tlb_flush(sim_t *sim);
+const uint8_t *mem_page_read(sim_t *sim, uint32_t address);
+uint8_t *mem_page_write(sim_t *sim, uint32_t address);
+void mem_clear(sim_t *sim);
+void cycle(sim_t *sim);
+uint32_t pipeline_idle_cycles(sim_t *sim);
+void pipeline_skip(sim_t *sim, uint32_t n);
+uint32_t cycle_fast(sim_t *sim, uint32_t limit);
+void pipeline_flush(sim_t *sim);
+uint32_t execute_functional(sim_t *sim, const decoded_inst_t *d, uint32_t pc);
+uint32_t fast_forward(sim_t *sim, uint32_t max_instructions);
+int fu_parse_timing(const char *spec, fu_timing_t *timing);
+void fu_set_timing(sim_t *sim, const fu_timing_t *timing);
+uint32_t fu_stall_cycles(sim_t *sim, int op);
+void fu_issue(sim_t *sim, int op);
+int itrace_record(sim_t *sim, const char *path, uint32_t max_instructions);
+uint32_t bbv_profile(sim_t *sim, uint32_t interval, uint32_t max_instructions, FILE *out);
+void simpoint_cluster(const char *path, int max_k, int samples);
+void simpoint_run(const program_t *program, const batch_config_t *config, const char *path, uint32_t warmup);
+void run(sim_t *sim, int num_cycles);
+void runAll(sim_t *sim);
+void mdump(sim_t *sim, uint32_t start, uint32_t stop) ;
+void rdump(sim_t *sim);
+void handle_command(sim_t *sim);
+void reset(sim_t *sim);
+void init_memory(sim_t *sim);
+void load_program(sim_t *sim);
+void mem_load(sim_t *sim, uint32_t address, const uint8_t *src, uint32_t size);
+uint32_t load_image(sim_t *sim, const uint8_t *file, size_t size);
+uint32_t load_hex(sim_t *sim, const char *text, size_t size);
+void handle_pipeline(sim_t *sim); /*IMPLEMENT THIS*/
+void WB(sim_t *sim);/*IMPLEMENT THIS*/
+void MEM(sim_t *sim);/*IMPLEMENT THIS*/
+void EX(sim_t *sim);/*IMPLEMENT THIS*/
+void ID(sim_t *sim);/*IMPLEMENT THIS*/
+void IF(sim_t *sim);/*IMPLEMENT THIS*/
+void show_pipeline(sim_t *sim);/*IMPLEMENT THIS*/
+void initialize(sim_t *sim);
+void print_program(sim_t *sim); /*IMPLEMENT THIS*/
+void print_instruction(sim_t *sim, uint32_t addr);
+void decode_instruction(uint32_t addr, uint32_t instruction, decoded_inst_t *d);
+decoded_inst_t *decode_lookup(sim_t *sim, uint32_t addr, uint32_t instruction);
+void decode_invalidate(sim_t *sim, uint32_t address, uint32_t size);
+void predecode_program(sim_t *sim);
+void view_cache(sim_t *sim);
+void cache_model_add(sim_t *sim, const cache_config_t *config);
+void cache_models_reset(sim_t *sim);
+void cache_models_access(sim_t *sim, uint32_t address, int store);
+void bpred_add(sim_t *sim, const bpred_config_t *config);
+double bpred_cpi(const sim_t *sim, int i);
\ No newline at end of file
@@ -0,0 +1,17 @@
+#include <stdint.h>
+
+/******************************************************************************/
+/* Binary program image: this header, then text_size bytes of text and        */
+/* data_size bytes of data, each exactly as laid out in guest memory          */
+/* (little-endian words). Files without the magic are read as hex text.       */
+/* mu-mips (Lab1Solution, Lab6) reads it and mips-assembler -b writes it.     */
+/******************************************************************************/
+#define IMAGE_MAGIC "MUIM"
+#define IMAGE_VERSION 1
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t text_base, text_size;	/* text_base must be MEM_TEXT_BEGIN */
+	uint32_t data_base, data_size;
+} image_header_t;
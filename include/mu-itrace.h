@@ -0,0 +1,429 @@
+#include <stdint.h>
+#include <string.h>
+
+/******************************************************************************/
+/* Instruction trace file: an itrace_header_t, then chunks. Each chunk is an  */
+/* itrace_chunk_t followed by compressed_size bytes that expand to raw_size   */
+/* bytes of encoded records. Chunks are independent (each starts a fresh      */
+/* codec), so they can be written and read in parallel.                       */
+/*                                                                            */
+/* A record is one flag byte followed by the fields its flags announce:       */
+/*   ITRACE_PC      zigzag varint of pc minus its prediction: previous pc + 4 */
+/*                  or, after a taken branch, that branch's last target       */
+/*   ITRACE_INST    instruction word, 4 bytes little-endian                   */
+/*   loads/stores   zigzag varint of the distance from the last address used  */
+/*                  at this PC, left out when ITRACE_STRIDE is set            */
+/* The predictions come from a direct-mapped table indexed by PC that the     */
+/* writer and the reader update identically, so a loop that repeats its      */
+/* strides costs one byte per instruction before the chunk compression.      */
+/*                                                                            */
+/* The writers (mu-mips in Lab1Solution and Lab6) and the reader              */
+/* (mu-cachesim) must agree on all of this: they share this one copy,         */
+/* through -I../../include in their Makefiles.                                */
+/******************************************************************************/
+#define ITRACE_MAGIC "MUTR"
+#define ITRACE_VERSION 1
+
+/* record flags visible to readers */
+#define ITRACE_LOAD		0x01
+#define ITRACE_STORE	0x02
+#define ITRACE_BRANCH	0x04	/* branch or jump */
+#define ITRACE_TAKEN	0x08	/* control left the fall-through path */
+#define ITRACE_OUTCOME	0x0F
+/* encoding flags */
+#define ITRACE_PC		0x10
+#define ITRACE_INST		0x20
+#define ITRACE_STRIDE	0x40
+
+#define ITRACE_RECORD_MAX	15			/* flags + PC varint + word + address varint */
+#define ITRACE_CHUNK_SIZE	(1 << 20)	/* raw bytes per chunk */
+#define ITRACE_COMPRESS_BOUND(n) ((n) + (n) / 255 + 16)
+
+#define ITRACE_TABLE_BITS	12
+#define ITRACE_TABLE_INDEX(pc) (((pc) >> 2) & ((1 << ITRACE_TABLE_BITS) - 1))
+
+#define ITRACE_LZ_HASH_BITS	14
+#define ITRACE_LZ_MAX_OFFSET 65535
+
+#define ITRACE_ZIGZAG(v)	(((uint32_t)(v) << 1) ^ (uint32_t)((int32_t)(v) >> 31))
+#define ITRACE_UNZIGZAG(v)	(((v) >> 1) ^ (0 - ((v) & 1)))
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+} itrace_header_t;
+
+typedef struct {
+	uint32_t raw_size;
+	uint32_t compressed_size;
+	uint32_t records;
+} itrace_chunk_t;
+
+typedef struct {
+	uint32_t pc;
+	uint32_t instruction;
+	uint32_t address;	/* effective address of loads and stores, 0 otherwise */
+	uint8_t flags;		/* ITRACE_OUTCOME bits */
+} itrace_record_t;
+
+typedef struct {
+	uint32_t pc;		/* tag; never matches before the first use */
+	uint32_t instruction;
+	uint32_t address;	/* last effective address at pc */
+	uint32_t stride;	/* distance between its last two addresses */
+	uint32_t target;	/* where pc last branched to */
+} itrace_entry_t;
+
+typedef struct {
+	uint32_t pc;		/* pc of the previous record */
+	uint32_t next;		/* predicted pc of the next record */
+	uint8_t taken;		/* the previous record was a taken branch */
+	itrace_entry_t table[1 << ITRACE_TABLE_BITS];
+} itrace_codec_t;
+
+
+/***************************************************************/
+/* Start a chunk; writer and reader each keep one codec         */
+/***************************************************************/
+static inline void itrace_codec_init(itrace_codec_t *c)
+{
+	memset(c->table, 0xFF, sizeof(c->table));	/* unaligned tags */
+	c->pc = (uint32_t)-4;
+	c->next = 0;
+	c->taken = 0;
+}
+
+
+static inline uint8_t *itrace_put_varint(uint8_t *out, uint32_t value)
+{
+	while (value >= 0x80) {
+		*out++ = value | 0x80;
+		value >>= 7;
+	}
+	*out++ = value;
+	return out;
+}
+
+
+static inline const uint8_t *itrace_get_varint(const uint8_t *in, uint32_t *value)
+{
+	uint32_t shift = 0;
+
+	*value = 0;
+	do {
+		*value |= (uint32_t)(*in & 0x7F) << shift;
+		shift += 7;
+	} while (*in++ & 0x80);
+	return in;
+}
+
+
+/***************************************************************/
+/* Append r to out (at least ITRACE_RECORD_MAX bytes); returns the new end.  */
+/* Works on locals: stores through out may alias the codec.                  */
+/***************************************************************/
+static inline uint8_t *itrace_encode(itrace_codec_t *c, const itrace_record_t *r, uint8_t *out)
+{
+	const uint32_t pc = r->pc, instruction = r->instruction, address = r->address, next = c->next;
+	itrace_entry_t *e = &c->table[ITRACE_TABLE_INDEX(pc)];
+	uint32_t last = e->address, stride = e->stride, target = e->target;
+	uint8_t *start = out++;
+	uint8_t flags = r->flags;
+
+	if (pc != next) {
+		flags |= ITRACE_PC;
+		if (c->taken) {
+			c->table[ITRACE_TABLE_INDEX(c->pc)].target = pc;
+			if (ITRACE_TABLE_INDEX(c->pc) == ITRACE_TABLE_INDEX(pc)) {
+				target = pc;
+			}
+		}
+		out = itrace_put_varint(out, ITRACE_ZIGZAG(pc - next));
+	}
+	if (e->pc != pc || e->instruction != instruction) {
+		flags |= ITRACE_INST;
+		e->pc = pc;
+		e->instruction = instruction;
+		out[0] = instruction;
+		out[1] = instruction >> 8;
+		out[2] = instruction >> 16;
+		out[3] = instruction >> 24;
+		out += 4;
+	}
+	if (flags & (ITRACE_LOAD | ITRACE_STORE)) {
+		if (address == last + stride) {
+			flags |= ITRACE_STRIDE;
+		} else {
+			out = itrace_put_varint(out, ITRACE_ZIGZAG(address - last));
+		}
+		e->stride = address - last;
+		e->address = address;
+	}
+	c->pc = pc;
+	c->taken = flags & ITRACE_TAKEN;
+	c->next = c->taken ? target : pc + 4;
+	*start = flags;
+	return out;
+}
+
+
+/***************************************************************/
+/* Read one record from in; returns the start of the next one  */
+/***************************************************************/
+static inline const uint8_t *itrace_decode(itrace_codec_t *c, const uint8_t *in, itrace_record_t *r)
+{
+	uint8_t flags = *in++;
+	uint32_t value;
+	itrace_entry_t *e;
+
+	r->pc = c->next;
+	if (flags & ITRACE_PC) {
+		in = itrace_get_varint(in, &value);
+		r->pc += ITRACE_UNZIGZAG(value);
+		if (c->taken) {
+			c->table[ITRACE_TABLE_INDEX(c->pc)].target = r->pc;
+		}
+	}
+	e = &c->table[ITRACE_TABLE_INDEX(r->pc)];
+	if (flags & ITRACE_INST) {
+		e->pc = r->pc;
+		e->instruction = in[0] | in[1] << 8 | in[2] << 16 | (uint32_t)in[3] << 24;
+		in += 4;
+	}
+	r->instruction = e->instruction;
+	r->address = 0;
+	if (flags & (ITRACE_LOAD | ITRACE_STORE)) {
+		if (flags & ITRACE_STRIDE) {
+			r->address = e->address + e->stride;
+		} else {
+			in = itrace_get_varint(in, &value);
+			r->address = e->address + ITRACE_UNZIGZAG(value);
+		}
+		e->stride = r->address - e->address;
+		e->address = r->address;
+	}
+	c->pc = r->pc;
+	c->taken = flags & ITRACE_TAKEN;
+	c->next = c->taken ? e->target : r->pc + 4;
+	r->flags = flags & ITRACE_OUTCOME;
+	return in;
+}
+
+
+static inline uint32_t itrace_read32(const uint8_t *p)
+{
+	uint32_t value;
+
+	memcpy(&value, p, 4);
+	return value;
+}
+
+
+static inline uint8_t *itrace_put_length(uint8_t *out, uint32_t length)
+{
+	while (length >= 255) {
+		*out++ = 255;
+		length -= 255;
+	}
+	*out++ = length;
+	return out;
+}
+
+
+/***************************************************************/
+/* Byte-oriented LZ77 in the LZ4 block layout: each sequence is a token      */
+/* (literal count << 4 | match length - 4, 15 meaning more length bytes      */
+/* follow), the literals, then a 16-bit match offset. The last sequence has  */
+/* literals only. out must hold ITRACE_COMPRESS_BOUND(size) bytes.           */
+/***************************************************************/
+static inline uint32_t itrace_compress(const uint8_t *in, uint32_t size, uint8_t *out)
+{
+	static __thread uint32_t table[1 << ITRACE_LZ_HASH_BITS];
+	const uint8_t *ip = in, *anchor = in, *end = in + size;
+	const uint8_t *limit = size > 8 ? end - 8 : in;
+	const uint8_t *match;
+	uint8_t *op = out, *token;
+	uint32_t h, literals, length;
+
+	memset(table, 0, sizeof(table));
+	while (ip < limit) {
+		h = (itrace_read32(ip) * 2654435761u) >> (32 - ITRACE_LZ_HASH_BITS);
+		match = in + table[h];
+		table[h] = ip - in;
+		if (match >= ip || ip - match > ITRACE_LZ_MAX_OFFSET || itrace_read32(match) != itrace_read32(ip)) {
+			ip++;
+			continue;
+		}
+		length = 4;
+		while (ip + length < end && match[length] == ip[length]) {
+			length++;
+		}
+
+		literals = ip - anchor;
+		token = op++;
+		*token = (literals < 15 ? literals : 15) << 4;
+		if (literals >= 15) {
+			op = itrace_put_length(op, literals - 15);
+		}
+		memcpy(op, anchor, literals);
+		op += literals;
+		*op++ = (ip - match) & 0xFF;
+		*op++ = (ip - match) >> 8;
+		*token |= length - 4 < 15 ? length - 4 : 15;
+		if (length - 4 >= 15) {
+			op = itrace_put_length(op, length - 4 - 15);
+		}
+		ip += length;
+		anchor = ip;
+	}
+
+	literals = end - anchor;
+	token = op++;
+	*token = (literals < 15 ? literals : 15) << 4;
+	if (literals >= 15) {
+		op = itrace_put_length(op, literals - 15);
+	}
+	memcpy(op, anchor, literals);
+	op += literals;
+	return op - out;
+}
+
+
+/***************************************************************/
+/* Expand a compressed chunk into out; returns its size, or -1 if corrupt */
+/***************************************************************/
+static inline int64_t itrace_decompress(const uint8_t *in, uint32_t size, uint8_t *out, uint32_t capacity)
+{
+	const uint8_t *ip = in, *in_end = in + size;
+	uint8_t *op = out, *out_end = out + capacity;
+	const uint8_t *match;
+	uint32_t length, offset;
+	uint8_t token, byte;
+
+	while (ip < in_end) {
+		token = *ip++;
+		length = token >> 4;
+		if (length == 15) {
+			do {
+				if (ip >= in_end) {
+					return -1;
+				}
+				byte = *ip++;
+				length += byte;
+			} while (byte == 255);
+		}
+		if (length > (uint32_t)(in_end - ip) || length > (uint32_t)(out_end - op)) {
+			return -1;
+		}
+		memcpy(op, ip, length);
+		op += length;
+		ip += length;
+		if (ip == in_end) {
+			break;	/* the last sequence has no match */
+		}
+
+		if (in_end - ip < 2) {
+			return -1;
+		}
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		length = (token & 15) + 4;
+		if ((token & 15) == 15) {
+			do {
+				if (ip >= in_end) {
+					return -1;
+				}
+				byte = *ip++;
+				length += byte;
+			} while (byte == 255);
+		}
+		if (offset == 0 || offset > (uint32_t)(op - out) || length > (uint32_t)(out_end - op)) {
+			return -1;
+		}
+		match = op - offset;
+		while (length > 0) {
+			/* an overlapping match repeats the last offset bytes: copy them in */
+			/* runs that double as the output grows past match */
+			offset = op - match < length ? op - match : length;
+			memcpy(op, match, offset);
+			op += offset;
+			length -= offset;
+		}
+	}
+	return op - out;
+}
+
+
+/***************************************************************/
+/* Decode a whole chunk keeping only its loads and stores, for readers that */
+/* need the reference stream alone; returns the number of records read.     */
+/* Same steps as itrace_decode with the codec state held in locals. A zero  */
+/* flag byte is an ALU instruction at its predicted PC, so runs of them     */
+/* just advance the prediction. in must be followed by ITRACE_RECORD_MAX    */
+/* readable bytes in case the chunk is corrupt.                             */
+/***************************************************************/
+static inline uint32_t itrace_decode_refs(itrace_codec_t *c, const uint8_t *in, const uint8_t *end,
+	uint32_t *addresses, uint8_t *stores, uint32_t *count)
+{
+	itrace_entry_t *table = c->table, *e;
+	const uint8_t *run;
+	uint32_t pc = c->pc, next = c->next, taken = c->taken;
+	uint32_t records = 0, n = 0, value, address;
+	uint64_t word;
+	uint8_t flags;
+
+	while (in < end) {
+		flags = *in;
+		if (flags == 0) {
+			run = in;
+			while (end - in >= 8 && (memcpy(&word, in, 8), word == 0)) {
+				in += 8;
+			}
+			while (in < end && *in == 0) {
+				in++;
+			}
+			pc = next + 4 * (uint32_t)(in - run - 1);
+			next += 4 * (uint32_t)(in - run);
+			taken = 0;
+			records += in - run;
+			continue;
+		}
+		in++;
+		records++;
+
+		if (flags & ITRACE_PC) {
+			in = itrace_get_varint(in, &value);
+			if (taken) {
+				table[ITRACE_TABLE_INDEX(pc)].target = next + ITRACE_UNZIGZAG(value);
+			}
+			next += ITRACE_UNZIGZAG(value);
+		}
+		pc = next;
+		e = &table[ITRACE_TABLE_INDEX(pc)];
+		if (flags & ITRACE_INST) {
+			e->pc = pc;
+			e->instruction = in[0] | in[1] << 8 | in[2] << 16 | (uint32_t)in[3] << 24;
+			in += 4;
+		}
+		if (flags & (ITRACE_LOAD | ITRACE_STORE)) {
+			if (flags & ITRACE_STRIDE) {
+				address = e->address + e->stride;
+			} else {
+				in = itrace_get_varint(in, &value);
+				address = e->address + ITRACE_UNZIGZAG(value);
+			}
+			e->stride = address - e->address;
+			e->address = address;
+			addresses[n] = address;
+			stores[n] = flags & ITRACE_STORE;
+			n++;
+		}
+		taken = flags & ITRACE_TAKEN;
+		next = taken ? e->target : pc + 4;
+	}
+	c->pc = pc;
+	c->next = next;
+	c->taken = taken;
+	*count = n;
+	return records;
+}